@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bulkcert - issue lots of certificates from the intermediate CA, fast.
+ *
+ * makecert.sh runs openssl(1) three times per certificate, and spends
+ * most of its time generating an RSA key. For test fixtures with
+ * thousands of identities (SNI with many names, mTLS with many
+ * clients) we instead do it all in one process per cpu: each worker
+ * takes a contiguous slice of the list of common names, makes a key,
+ * builds and signs the certificate itself, and writes both out.
+ *
+ * Everything but the common name comes from a template certificate -
+ * say server.crt or client.crt - so the new ones get the same subject,
+ * extensions and lifetime. Each gets a subjectAltName for its common
+ * name, and fresh key identifiers.
+ *
+ * Serial numbers are consecutive from a random starting point, so the
+ * parent knows them all in advance and writes the index once every
+ * worker is done. The index is in the format of intermediate/index.txt,
+ * so it can be appended to that to let the ocsp responder and CRL
+ * generation know about the new certificates.
+ *
+ * Run it in the CA directory, after "make", like makecert.sh.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#define SIGNER_CERT	"intermediate/certs/intermediate.cert.pem"
+#define SIGNER_KEY	"intermediate/private/intermediate.key.pem"
+#define CHAIN_FILE	"chain.pem"
+#define MAXWORKERS	256
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-d days] [-j jobs] [-k ec|rsa] "
+	    "[-o outdir] -t template cnlist\n", __progname);
+	exit(1);
+}
+
+struct bulk {
+	char		**cns;		/* common names to issue for */
+	char		**files;	/* and the file names to use */
+	size_t		  ncns;
+	X509		 *signer;
+	EVP_PKEY	 *signkey;
+	X509_NAME	 *subject;	/* template subject, without the CN */
+	STACK_OF(X509_EXTENSION) *exts;	/* template extensions to copy */
+	long		  days;
+	time_t		  now;
+	BIGNUM		 *serial;	/* serial of cns[0] */
+	int		  rsa;
+	const char	 *outdir;
+	char		 *chain;	/* chain.pem, appended to each cert */
+	size_t		  chainlen;
+};
+
+static void
+cryptoerr(const char *what)
+{
+	ERR_print_errors_fp(stderr);
+	errx(1, "%s failed", what);
+}
+
+/*
+ * Read the list of common names, one per line, and make a file name
+ * for each that is safe to use in outdir.
+ */
+static void
+load_cns(struct bulk *b, const char *file)
+{
+	char *line = NULL, *p;
+	size_t linesize = 0, maxcns = 0;
+	ssize_t len;
+	FILE *fp;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdin;
+	else if ((fp = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (strlen(line) > 64)
+			errx(1, "%s: common name too long", line);
+		if (b->ncns == maxcns) {
+			maxcns = maxcns ? maxcns * 2 : 1024;
+			if ((b->cns = reallocarray(b->cns, maxcns,
+			    sizeof(char *))) == NULL ||
+			    (b->files = reallocarray(b->files, maxcns,
+			    sizeof(char *))) == NULL)
+				err(1, "reallocarray");
+		}
+		if ((b->cns[b->ncns] = strdup(line)) == NULL ||
+		    (b->files[b->ncns] = strdup(line)) == NULL)
+			err(1, "strdup");
+		for (p = b->files[b->ncns]; *p != '\0'; p++)
+			if (!((*p >= 'a' && *p <= 'z') ||
+			    (*p >= 'A' && *p <= 'Z') ||
+			    (*p >= '0' && *p <= '9') || *p == '.' ||
+			    *p == '-'))
+				*p = '_';
+		if (b->files[b->ncns][0] == '.')
+			b->files[b->ncns][0] = '_';
+		b->ncns++;
+	}
+	if (ferror(fp))
+		err(1, "%s", file);
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	if (b->ncns == 0)
+		errx(1, "%s: no common names", file);
+}
+
+/*
+ * Take what we can from the template: the subject less its CN, the
+ * lifetime, and the extensions, less the ones that are particular to
+ * the template certificate itself.
+ */
+static void
+load_template(struct bulk *b, const char *file)
+{
+	X509_EXTENSION *ext;
+	X509 *tmpl;
+	FILE *fp;
+	int i, nid, days, secs;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if ((tmpl = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(file);
+	fclose(fp);
+
+	if ((b->subject = X509_NAME_dup(X509_get_subject_name(tmpl))) == NULL)
+		cryptoerr("X509_NAME_dup");
+	while ((i = X509_NAME_get_index_by_NID(b->subject, NID_commonName,
+	    -1)) != -1)
+		X509_NAME_ENTRY_free(X509_NAME_delete_entry(b->subject, i));
+
+	if (b->days == 0) {
+		if (!ASN1_TIME_diff(&days, &secs, X509_get0_notBefore(tmpl),
+		    X509_get0_notAfter(tmpl)))
+			cryptoerr("ASN1_TIME_diff");
+		b->days = days;
+	}
+
+	if ((b->exts = sk_X509_EXTENSION_new_null()) == NULL)
+		cryptoerr("sk_X509_EXTENSION_new_null");
+	for (i = 0; i < X509_get_ext_count(tmpl); i++) {
+		ext = X509_get_ext(tmpl, i);
+		nid = OBJ_obj2nid(X509_EXTENSION_get_object(ext));
+		if (nid == NID_subject_key_identifier ||
+		    nid == NID_authority_key_identifier ||
+		    nid == NID_subject_alt_name)
+			continue;
+		if ((ext = X509_EXTENSION_dup(ext)) == NULL ||
+		    !sk_X509_EXTENSION_push(b->exts, ext))
+			cryptoerr("copying template extensions");
+	}
+	X509_free(tmpl);
+}
+
+static void
+load_signer(struct bulk *b)
+{
+	struct stat sb;
+	FILE *fp;
+	int fd;
+
+	if ((fp = fopen(SIGNER_CERT, "r")) == NULL)
+		err(1, "%s", SIGNER_CERT);
+	if ((b->signer = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(SIGNER_CERT);
+	fclose(fp);
+	if ((fp = fopen(SIGNER_KEY, "r")) == NULL)
+		err(1, "%s", SIGNER_KEY);
+	if ((b->signkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(SIGNER_KEY);
+	fclose(fp);
+
+	if ((fd = open(CHAIN_FILE, O_RDONLY)) == -1 || fstat(fd, &sb) == -1)
+		err(1, "%s", CHAIN_FILE);
+	b->chainlen = sb.st_size;
+	if ((b->chain = malloc(b->chainlen)) == NULL)
+		err(1, "malloc");
+	if (read(fd, b->chain, b->chainlen) != (ssize_t)b->chainlen)
+		err(1, "%s", CHAIN_FILE);
+	close(fd);
+}
+
+static EVP_PKEY *
+newkey(int rsa)
+{
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *key = NULL;
+
+	if ((ctx = EVP_PKEY_CTX_new_id(rsa ? EVP_PKEY_RSA : EVP_PKEY_EC,
+	    NULL)) == NULL || EVP_PKEY_keygen_init(ctx) <= 0)
+		cryptoerr("key generation setup");
+	if (rsa) {
+		if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0)
+			cryptoerr("EVP_PKEY_CTX_set_rsa_keygen_bits");
+	} else if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+	    NID_X9_62_prime256v1) <= 0)
+		cryptoerr("EVP_PKEY_CTX_set_ec_paramgen_curve_nid");
+	if (EVP_PKEY_keygen(ctx, &key) <= 0)
+		cryptoerr("EVP_PKEY_keygen");
+	EVP_PKEY_CTX_free(ctx);
+	return (key);
+}
+
+/* The subject for "cn" - the template's, with "cn" on the end. */
+static X509_NAME *
+subject(struct bulk *b, const char *cn)
+{
+	X509_NAME *name;
+
+	if ((name = X509_NAME_dup(b->subject)) == NULL ||
+	    !X509_NAME_add_entry_by_NID(name, NID_commonName, MBSTRING_UTF8,
+	    (const unsigned char *)cn, -1, -1, 0))
+		cryptoerr("building subject");
+	return (name);
+}
+
+static void
+addext(X509 *x, X509V3_CTX *ctx, int nid, const char *value)
+{
+	X509_EXTENSION *ext;
+
+	if ((ext = X509V3_EXT_conf_nid(NULL, ctx, nid, (char *)value)) == NULL)
+		cryptoerr(OBJ_nid2sn(nid));
+	if (!X509_add_ext(x, ext, -1))
+		cryptoerr("X509_add_ext");
+	X509_EXTENSION_free(ext);
+}
+
+/* Write what is in "mem", then "extralen" bytes of "extra", to "path" */
+static void
+writefile(const char *path, int mode, BIO *mem, const char *extra,
+    size_t extralen)
+{
+	char *data;
+	long len;
+	int fd;
+
+	len = BIO_get_mem_data(mem, &data);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode)) == -1)
+		err(1, "%s", path);
+	if (write(fd, data, len) != len ||
+	    (extralen > 0 && write(fd, extra, extralen) != (ssize_t)extralen))
+		err(1, "%s", path);
+	close(fd);
+}
+
+/* Make the key and certificate for cns[i]. */
+static void
+issue(struct bulk *b, size_t i)
+{
+	char path[PATH_MAX], san[128];
+	X509V3_CTX ctx;
+	EVP_PKEY *key;
+	X509_NAME *name;
+	BIGNUM *bn;
+	BIO *mem;
+	X509 *x;
+	int j;
+
+	key = newkey(b->rsa);
+	if ((x = X509_new()) == NULL || !X509_set_version(x, 2))
+		cryptoerr("X509_new");
+	if ((bn = BN_dup(b->serial)) == NULL || !BN_add_word(bn, i) ||
+	    BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(x)) == NULL)
+		cryptoerr("setting serial");
+	BN_free(bn);
+	name = subject(b, b->cns[i]);
+	if (!X509_set_subject_name(x, name) ||
+	    !X509_set_issuer_name(x, X509_get_subject_name(b->signer)))
+		cryptoerr("setting names");
+	X509_NAME_free(name);
+	if (ASN1_TIME_set(X509_getm_notBefore(x), b->now) == NULL ||
+	    ASN1_TIME_adj(X509_getm_notAfter(x), b->now, b->days, 0) == NULL)
+		cryptoerr("setting validity");
+	if (!X509_set_pubkey(x, key))
+		cryptoerr("X509_set_pubkey");
+
+	for (j = 0; j < sk_X509_EXTENSION_num(b->exts); j++)
+		if (!X509_add_ext(x, sk_X509_EXTENSION_value(b->exts, j), -1))
+			cryptoerr("X509_add_ext");
+	X509V3_set_ctx(&ctx, b->signer, x, NULL, NULL, 0);
+	addext(x, &ctx, NID_subject_key_identifier, "hash");
+	addext(x, &ctx, NID_authority_key_identifier, "keyid,issuer");
+	snprintf(san, sizeof(san), "DNS:%s", b->cns[i]);
+	addext(x, &ctx, NID_subject_alt_name, san);
+
+	if (!X509_sign(x, b->signkey, EVP_sha256()))
+		cryptoerr("X509_sign");
+
+	if ((mem = BIO_new(BIO_s_mem())) == NULL)
+		cryptoerr("BIO_new");
+	if (!PEM_write_bio_PrivateKey(mem, key, NULL, NULL, 0, NULL, NULL))
+		cryptoerr("PEM_write_bio_PrivateKey");
+	snprintf(path, sizeof(path), "%s/%s.key", b->outdir, b->files[i]);
+	writefile(path, 0600, mem, NULL, 0);
+	(void)BIO_reset(mem);
+	if (!PEM_write_bio_X509(mem, x))
+		cryptoerr("PEM_write_bio_X509");
+	snprintf(path, sizeof(path), "%s/%s.crt", b->outdir, b->files[i]);
+	writefile(path, 0644, mem, b->chain, b->chainlen);
+
+	BIO_free(mem);
+	X509_free(x);
+	EVP_PKEY_free(key);
+}
+
+/*
+ * The index, in the format openssl ca keeps intermediate/index.txt in:
+ * status, expiry, revocation time, serial, file name and subject.
+ */
+static void
+write_index(struct bulk *b)
+{
+	char path[PATH_MAX], expiry[32], sub[1024], *hex;
+	X509_NAME *name;
+	struct tm tm;
+	time_t t;
+	BIGNUM *bn;
+	FILE *fp;
+	size_t i;
+
+	t = b->now + b->days * 24 * 60 * 60;
+	gmtime_r(&t, &tm);
+	strftime(expiry, sizeof(expiry), "%y%m%d%H%M%SZ", &tm);
+
+	snprintf(path, sizeof(path), "%s/index.txt", b->outdir);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	if ((bn = BN_dup(b->serial)) == NULL)
+		cryptoerr("BN_dup");
+	for (i = 0; i < b->ncns; i++) {
+		name = subject(b, b->cns[i]);
+		X509_NAME_oneline(name, sub, sizeof(sub));
+		X509_NAME_free(name);
+		if ((hex = BN_bn2hex(bn)) == NULL)
+			cryptoerr("BN_bn2hex");
+		fprintf(fp, "V\t%s\t\t%s\t%s\t%s\n", expiry, hex,
+		    b->files[i], sub);
+		OPENSSL_free(hex);
+		if (!BN_add_word(bn, 1))
+			cryptoerr("BN_add_word");
+	}
+	BN_free(bn);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bulk b;
+	struct timespec t0, t1;
+	const char *tmpl = NULL;
+	unsigned char rnd[8];
+	pid_t pids[MAXWORKERS];
+	size_t i, start, end;
+	long jobs, l;
+	char *ep;
+	int ch, status, failed = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.outdir = "bulk";
+	if ((jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jobs = 1;
+	while ((ch = getopt(argc, argv, "d:j:k:o:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+		case 'j':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || (ch == 'j' && l > MAXWORKERS) ||
+			    (ch == 'd' && l > 36500)) {
+				fprintf(stderr, "%s - bad number\n", optarg);
+				usage();
+			}
+			if (ch == 'd')
+				b.days = l;
+			else
+				jobs = l;
+			break;
+		case 'k':
+			if (strcmp(optarg, "rsa") == 0)
+				b.rsa = 1;
+			else if (strcmp(optarg, "ec") != 0)
+				usage();
+			break;
+		case 'o':
+			b.outdir = optarg;
+			break;
+		case 't':
+			tmpl = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || tmpl == NULL)
+		usage();
+
+	load_cns(&b, argv[0]);
+	load_template(&b, tmpl);
+	load_signer(&b);
+	if (mkdir(b.outdir, 0755) == -1 && errno != EEXIST)
+		err(1, "%s", b.outdir);
+
+	/* a random 64 bit start, well clear of intermediate/serial */
+	if (RAND_bytes(rnd, sizeof(rnd)) != 1)
+		cryptoerr("RAND_bytes");
+	rnd[0] |= 0x40;
+	rnd[0] &= 0x7f;
+	if ((b.serial = BN_bin2bn(rnd, sizeof(rnd), NULL)) == NULL)
+		cryptoerr("BN_bin2bn");
+	b.now = time(NULL);
+
+	if ((size_t)jobs > b.ncns)
+		jobs = b.ncns;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (l = 0; l < jobs; l++) {
+		start = b.ncns * l / jobs;
+		end = b.ncns * (l + 1) / jobs;
+		if ((pids[l] = fork()) == -1)
+			err(1, "fork failed");
+		if (pids[l] == 0) {
+			for (i = start; i < end; i++)
+				issue(&b, i);
+			exit(0);
+		}
+	}
+	for (l = 0; l < jobs; l++) {
+		if (waitpid(pids[l], &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	if (failed)
+		errx(1, "a worker failed, %s is incomplete", b.outdir);
+	write_index(&b);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	fprintf(stderr, "issued %zu certificates in %.2fs with %ld workers\n",
+	    b.ncns, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+	    jobs);
+	return (0);
+}
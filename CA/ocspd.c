@@ -0,0 +1,970 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ocspd - an OCSP responder for testing, that answers from responses
+ * it signed ahead of time.
+ *
+ * ocspserver.sh runs "openssl ocsp -port", which handles one request
+ * at a time and signs each answer as it goes, with a 4096 bit RSA key.
+ * That makes it the bottleneck as soon as anything fetches staples for
+ * more than a handful of certificates.
+ *
+ * Instead we read intermediate/index.txt, and sign a response for
+ * every certificate in it before anyone asks, using one process per
+ * cpu. The responses are kept in a table keyed by the DER of the OCSP
+ * CertID they answer for - which is exactly what a client puts in its
+ * request - so answering is a hash lookup and a write. Requests come
+ * in over HTTP, by POST or GET, on any number of connections at once,
+ * from a single poll(2) loop like the one in ../ex2/echo.c.
+ *
+ * When index.txt changes, or the responses we have are halfway to
+ * their nextUpdate, we sign a new set in the background, and switch to
+ * it when it's done. The signing processes send us their responses
+ * over pipes, so we keep answering from the old set in the meantime.
+ *
+ * Precomputed responses can't carry a nonce, so we don't send one,
+ * same as any responder handing out cached answers. A request we have
+ * no ready answer for - asking about something signed by us but not in
+ * the index, or using a hash other than SHA1 in its CertID - gets
+ * signed on the spot.
+ *
+ * Like ocspserver.sh, run it in the CA directory, and keep it off the
+ * internet: it only listens on 127.0.0.1.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#define INDEX_FILE	"intermediate/index.txt"
+#define ISSUER_CERT	"intermediate/certs/intermediate.cert.pem"
+#define RESP_CERT	"intermediate/certs/ocsp-localhost.pem"
+#define RESP_KEY	"intermediate/private/ocsp-localhost.key.pem"
+
+#define VALIDITY	(24 * 60 * 60)	/* nextUpdate, from when we sign */
+#define MAXWORKERS	64
+#define MAX_CONNECTIONS	1024
+#define REQ_MAX		8192		/* biggest HTTP request we take */
+#define FIRST_CONN	(1 + MAXWORKERS)	/* pollfds: listen, workers */
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-j jobs] [-p port]\n", __progname);
+	exit(1);
+}
+
+/* One line of index.txt */
+struct record {
+	int		 status;	/* V_OCSP_CERTSTATUS_* */
+	int		 reason;	/* OCSP_REVOKED_STATUS_*, if revoked */
+	char		*serial;	/* hex */
+	char		*revoked;	/* revocation time, if revoked */
+};
+
+/* A signed response, and the CertID it answers for */
+struct entry {
+	unsigned char	*id;
+	size_t		 idlen;
+	unsigned char	*resp;
+	size_t		 resplen;
+	size_t		 rec;		/* which record it is for */
+};
+
+/* open addressed, hashed on the CertID */
+struct table {
+	struct entry	*entries;
+	size_t		 size;
+	size_t		 count;
+	struct record	*records;
+	size_t		 nrecords;
+	time_t		 signed_at;
+};
+
+/* A process signing part of the next table, and what it sent so far */
+struct worker {
+	pid_t		 pid;
+	unsigned char	*buf;
+	size_t		 len, cap;
+};
+
+struct conn {
+	unsigned char	 in[REQ_MAX];
+	size_t		 inlen;
+	unsigned char	*out;
+	size_t		 outlen, outoff;
+	int		 keepalive;
+};
+
+static X509 *issuer, *rcert;
+static EVP_PKEY *rkey;
+static struct table table;		/* what we answer from */
+static struct table next;		/* what the workers are signing */
+static struct worker workers[MAXWORKERS];
+static int nworkers, running, jobs;
+static struct stat indexsb;
+static struct timespec signstart;
+
+static struct pollfd pollfds[MAX_CONNECTIONS];
+static struct conn *conns[MAX_CONNECTIONS];
+
+/* canned responses that need no signature */
+static unsigned char *malformed, *unauthorized, *trylater;
+static size_t malformedlen, unauthorizedlen, trylaterlen;
+
+static void
+cryptoerr(const char *what)
+{
+	ERR_print_errors_fp(stderr);
+	errx(1, "%s failed", what);
+}
+
+/* FNV-1a */
+static uint64_t
+hash(const unsigned char *p, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static struct entry *
+table_find(struct table *t, const unsigned char *id, size_t idlen)
+{
+	struct entry *e;
+	size_t i;
+
+	for (i = hash(id, idlen) & (t->size - 1); ;
+	    i = (i + 1) & (t->size - 1)) {
+		e = &t->entries[i];
+		if (e->id == NULL ||
+		    (e->idlen == idlen && memcmp(e->id, id, idlen) == 0))
+			return (e);
+	}
+}
+
+static void
+table_free(struct table *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->size; i++) {
+		free(t->entries[i].id);
+		free(t->entries[i].resp);
+	}
+	for (i = 0; i < t->nrecords; i++) {
+		free(t->records[i].serial);
+		free(t->records[i].revoked);
+	}
+	free(t->entries);
+	free(t->records);
+	memset(t, 0, sizeof(*t));
+}
+
+static int
+revocation_reason(const char *s)
+{
+	static const char *reasons[] = {
+		"unspecified", "keyCompromise", "CACompromise",
+		"affiliationChanged", "superseded", "cessationOfOperation",
+		"certificateHold", NULL, "removeFromCRL"
+	};
+	int i;
+
+	for (i = 0; i < (int)(sizeof(reasons) / sizeof(reasons[0])); i++)
+		if (reasons[i] != NULL && strcasecmp(s, reasons[i]) == 0)
+			return (i);
+	return (OCSP_REVOKED_STATUS_NOSTATUS);
+}
+
+/*
+ * Read index.txt into "t". Each line is tab separated: status (V, R or
+ * E), expiry, revocation time and reason, serial, file and subject.
+ */
+static int
+read_index(struct table *t)
+{
+	char *line = NULL, *p, *field[6], *comma;
+	size_t linesize = 0, max = 0;
+	struct record *r;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(INDEX_FILE, "r")) == NULL) {
+		warn("%s", INDEX_FILE);
+		return (-1);
+	}
+	if (fstat(fileno(fp), &indexsb) == -1)
+		err(1, "%s", INDEX_FILE);
+	while (getline(&line, &linesize, fp) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		p = line;
+		for (i = 0; i < 6; i++)
+			field[i] = strsep(&p, "\t");
+		if (field[5] == NULL || field[3][0] == '\0')
+			continue;
+		if (t->nrecords == max) {
+			max = max ? max * 2 : 1024;
+			if ((t->records = reallocarray(t->records, max,
+			    sizeof(*t->records))) == NULL)
+				err(1, "reallocarray");
+		}
+		r = &t->records[t->nrecords];
+		memset(r, 0, sizeof(*r));
+		switch (field[0][0]) {
+		case 'R':
+			r->status = V_OCSP_CERTSTATUS_REVOKED;
+			r->reason = OCSP_REVOKED_STATUS_NOSTATUS;
+			if ((comma = strchr(field[2], ',')) != NULL) {
+				*comma++ = '\0';
+				r->reason = revocation_reason(comma);
+			}
+			if ((r->revoked = strdup(field[2])) == NULL)
+				err(1, "strdup");
+			break;
+		case 'V':
+		case 'E':
+			r->status = V_OCSP_CERTSTATUS_GOOD;
+			break;
+		default:
+			continue;
+		}
+		if ((r->serial = strdup(field[3])) == NULL)
+			err(1, "strdup");
+		t->nrecords++;
+	}
+	free(line);
+	fclose(fp);
+	return (0);
+}
+
+/* The CertID for "serial" from our issuer, hashed with "md" */
+static OCSP_CERTID *
+certid(const EVP_MD *md, const char *serial)
+{
+	ASN1_INTEGER *ai;
+	OCSP_CERTID *id;
+	BIGNUM *bn = NULL;
+
+	if (BN_hex2bn(&bn, serial) == 0 ||
+	    (ai = BN_to_ASN1_INTEGER(bn, NULL)) == NULL)
+		return (NULL);
+	id = OCSP_cert_id_new(md, X509_get_subject_name(issuer),
+	    X509_get0_pubkey_bitstr(issuer), ai);
+	ASN1_INTEGER_free(ai);
+	BN_free(bn);
+	return (id);
+}
+
+/* Sign a response saying what "r" (or nothing, if NULL) says about "id" */
+static unsigned char *
+sign_response(OCSP_CERTID *id, const struct record *r, time_t now,
+    size_t *len)
+{
+	ASN1_TIME *thisupd, *nextupd, *revtime = NULL;
+	OCSP_BASICRESP *bs;
+	OCSP_RESPONSE *resp;
+	unsigned char *der = NULL;
+	int n, status = V_OCSP_CERTSTATUS_UNKNOWN, reason = 0;
+
+	if ((bs = OCSP_BASICRESP_new()) == NULL ||
+	    (thisupd = ASN1_TIME_set(NULL, now)) == NULL ||
+	    (nextupd = ASN1_TIME_set(NULL, now + VALIDITY)) == NULL)
+		cryptoerr("response setup");
+	if (r != NULL) {
+		status = r->status;
+		reason = r->reason;
+		if (r->revoked != NULL &&
+		    ((revtime = ASN1_TIME_new()) == NULL ||
+		    !ASN1_TIME_set_string(revtime, r->revoked))) {
+			warnx("serial %s: bad revocation time %s", r->serial,
+			    r->revoked);
+			ASN1_TIME_free(revtime);
+			revtime = ASN1_TIME_set(NULL, now);
+		}
+	}
+	if (OCSP_basic_add1_status(bs, id, status, reason, revtime, thisupd,
+	    nextupd) == NULL)
+		cryptoerr("OCSP_basic_add1_status");
+	if (!OCSP_basic_sign(bs, rcert, rkey, EVP_sha256(), NULL, 0))
+		cryptoerr("OCSP_basic_sign");
+	if ((resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL,
+	    bs)) == NULL || (n = i2d_OCSP_RESPONSE(resp, &der)) <= 0)
+		cryptoerr("OCSP_response_create");
+	*len = n;
+
+	OCSP_RESPONSE_free(resp);
+	OCSP_BASICRESP_free(bs);
+	ASN1_TIME_free(thisupd);
+	ASN1_TIME_free(nextupd);
+	ASN1_TIME_free(revtime);
+	return (der);
+}
+
+static unsigned char *
+canned(int status, size_t *len)
+{
+	OCSP_RESPONSE *resp;
+	unsigned char *der = NULL;
+	int n;
+
+	if ((resp = OCSP_response_create(status, NULL)) == NULL ||
+	    (n = i2d_OCSP_RESPONSE(resp, &der)) <= 0)
+		cryptoerr("OCSP_response_create");
+	OCSP_RESPONSE_free(resp);
+	*len = n;
+	return (der);
+}
+
+static void
+writeall(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "write to parent");
+		}
+		p += w;
+		len -= w;
+	}
+}
+
+/*
+ * In a worker: sign responses for records "start" to "end" of "t", and
+ * send them to our parent on "fd", each as the lengths and bytes of
+ * the CertID and the response, and the record number.
+ */
+static void
+sign_records(struct table *t, size_t start, size_t end, int fd)
+{
+	unsigned char *id, *resp;
+	OCSP_CERTID *cid;
+	uint32_t hdr[3];
+	time_t now = time(NULL);
+	size_t i, resplen;
+	int idlen;
+
+	for (i = start; i < end; i++) {
+		if ((cid = certid(EVP_sha1(), t->records[i].serial)) == NULL) {
+			warnx("serial %s: can't make a CertID",
+			    t->records[i].serial);
+			continue;
+		}
+		id = NULL;
+		if ((idlen = i2d_OCSP_CERTID(cid, &id)) <= 0)
+			cryptoerr("i2d_OCSP_CERTID");
+		resp = sign_response(cid, &t->records[i], now, &resplen);
+		hdr[0] = idlen;
+		hdr[1] = resplen;
+		hdr[2] = i;
+		writeall(fd, hdr, sizeof(hdr));
+		writeall(fd, id, idlen);
+		writeall(fd, resp, resplen);
+		OPENSSL_free(id);
+		OPENSSL_free(resp);
+		OCSP_CERTID_free(cid);
+	}
+}
+
+/*
+ * Start signing a new table in the background, from a fresh read of
+ * the index. The workers' pipes go in pollfds[1..jobs].
+ */
+static void
+start_signing(void)
+{
+	size_t start, end;
+	int i, p[2];
+
+	table_free(&next);
+	if (read_index(&next) == -1)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &signstart);
+	next.signed_at = time(NULL);
+	nworkers = jobs;
+	if ((size_t)nworkers > next.nrecords)
+		nworkers = next.nrecords > 0 ? next.nrecords : 1;
+	for (i = 0; i < nworkers; i++) {
+		start = next.nrecords * i / nworkers;
+		end = next.nrecords * (i + 1) / nworkers;
+		if (pipe(p) == -1)
+			err(1, "pipe");
+		if ((workers[i].pid = fork()) == -1)
+			err(1, "fork failed");
+		if (workers[i].pid == 0) {
+			close(p[0]);
+			sign_records(&next, start, end, p[1]);
+			_exit(0);
+		}
+		close(p[1]);
+		if (fcntl(p[0], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl failed");
+		workers[i].len = 0;
+		pollfds[1 + i].fd = p[0];
+		pollfds[1 + i].events = POLLIN;
+	}
+	running = nworkers;
+}
+
+/* Turn what the workers sent us into the table, and start using it */
+static void
+finish_signing(void)
+{
+	struct timespec now;
+	struct entry *e;
+	uint32_t hdr[3];
+	size_t off;
+	int i, status, failed = 0;
+
+	for (i = 0; i < nworkers; i++) {
+		if (waitpid(workers[i].pid, &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	if (failed) {
+		warnx("a signer failed, still using the old responses");
+		goto done;
+	}
+
+	next.size = 64;
+	while (next.size < next.nrecords * 2)
+		next.size *= 2;
+	if ((next.entries = calloc(next.size, sizeof(*next.entries))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nworkers; i++) {
+		for (off = 0; off + sizeof(hdr) <= workers[i].len; ) {
+			memcpy(hdr, workers[i].buf + off, sizeof(hdr));
+			off += sizeof(hdr);
+			if (off + hdr[0] + hdr[1] > workers[i].len)
+				break;
+			e = table_find(&next, workers[i].buf + off, hdr[0]);
+			if (e->id == NULL) {
+				if ((e->id = malloc(hdr[0])) == NULL ||
+				    (e->resp = malloc(hdr[1])) == NULL)
+					err(1, "malloc");
+				memcpy(e->id, workers[i].buf + off, hdr[0]);
+				memcpy(e->resp, workers[i].buf + off + hdr[0],
+				    hdr[1]);
+				e->idlen = hdr[0];
+				e->resplen = hdr[1];
+				e->rec = hdr[2];
+				next.count++;
+			}
+			off += hdr[0] + hdr[1];
+		}
+	}
+	table_free(&table);
+	table = next;
+	memset(&next, 0, sizeof(next));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "signed %zu responses in %.2fs with %d workers\n",
+	    table.count, (now.tv_sec - signstart.tv_sec) +
+	    (now.tv_nsec - signstart.tv_nsec) / 1e9, nworkers);
+ done:
+	for (i = 0; i < nworkers; i++) {
+		free(workers[i].buf);
+		workers[i].buf = NULL;
+		workers[i].len = workers[i].cap = 0;
+	}
+	nworkers = 0;
+}
+
+static void
+handle_worker(struct pollfd *pfd, struct worker *w)
+{
+	ssize_t r;
+
+	if (w->cap - w->len < 65536) {
+		w->cap = w->cap ? w->cap * 2 : 1024 * 1024;
+		if ((w->buf = realloc(w->buf, w->cap)) == NULL)
+			err(1, "realloc");
+	}
+	r = read(pfd->fd, w->buf + w->len, w->cap - w->len);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r > 0) {
+		w->len += r;
+		return;
+	}
+	if (r == -1)
+		warn("read from signer");
+	close(pfd->fd);
+	pfd->fd = -1;
+	if (--running == 0)
+		finish_signing();
+}
+
+/* Has index.txt changed, or are our responses getting old? */
+static int
+need_signing(void)
+{
+	struct stat sb;
+
+	if (running)
+		return (0);
+	if (table.entries == NULL)
+		return (1);
+	if (stat(INDEX_FILE, &sb) == 0 &&
+	    (sb.st_mtime != indexsb.st_mtime || sb.st_size != indexsb.st_size ||
+	    sb.st_ino != indexsb.st_ino))
+		return (1);
+	return (time(NULL) - table.signed_at > VALIDITY / 2);
+}
+
+/*
+ * The answer to the DER encoded OCSP request in "req". Returns a
+ * pointer we must free in "*tofree", or NULL if the answer is static.
+ */
+static const unsigned char *
+answer(const unsigned char *req, size_t reqlen, size_t *len,
+    unsigned char **tofree)
+{
+	const unsigned char *p = req;
+	OCSP_REQUEST *oreq;
+	OCSP_CERTID *id, *sha1id = NULL, *ours = NULL;
+	ASN1_OBJECT *mdobj;
+	ASN1_INTEGER *serial;
+	const EVP_MD *md;
+	unsigned char *der = NULL, *resp = NULL;
+	const unsigned char *ret;
+	struct entry *e;
+	BIGNUM *bn = NULL;
+	char *hex = NULL;
+	int n;
+
+	*tofree = NULL;
+	if (table.entries == NULL) {
+		*len = trylaterlen;
+		return (trylater);
+	}
+	if ((oreq = d2i_OCSP_REQUEST(NULL, &p, reqlen)) == NULL ||
+	    OCSP_request_onereq_count(oreq) != 1) {
+		OCSP_REQUEST_free(oreq);
+		*len = malformedlen;
+		return (malformed);
+	}
+	id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(oreq, 0));
+
+	/* the fast path - a CertID we signed an answer for already */
+	if ((n = i2d_OCSP_CERTID(id, &der)) > 0) {
+		e = table_find(&table, der, n);
+		OPENSSL_free(der);
+		if (e->id != NULL) {
+			OCSP_REQUEST_free(oreq);
+			*len = e->resplen;
+			return (e->resp);
+		}
+	}
+
+	/*
+	 * Otherwise make sure it's about a certificate from our issuer,
+	 * find it by serial, and sign an answer now.
+	 */
+	ret = unauthorized;
+	*len = unauthorizedlen;
+	OCSP_id_get0_info(NULL, &mdobj, NULL, &serial, id);
+	if ((md = EVP_get_digestbyobj(mdobj)) == NULL ||
+	    (ours = OCSP_cert_id_new(md, X509_get_subject_name(issuer),
+	    X509_get0_pubkey_bitstr(issuer), serial)) == NULL ||
+	    OCSP_id_issuer_cmp(ours, id) != 0)
+		goto done;
+	if ((bn = ASN1_INTEGER_to_BN(serial, NULL)) == NULL ||
+	    (hex = BN_bn2hex(bn)) == NULL ||
+	    (sha1id = certid(EVP_sha1(), hex)) == NULL)
+		goto done;
+	der = NULL;
+	e = NULL;
+	if ((n = i2d_OCSP_CERTID(sha1id, &der)) > 0) {
+		e = table_find(&table, der, n);
+		OPENSSL_free(der);
+	}
+	resp = sign_response(id, e != NULL && e->id != NULL ?
+	    &table.records[e->rec] : NULL, time(NULL), len);
+	*tofree = resp;
+	ret = resp;
+ done:
+	OCSP_CERTID_free(ours);
+	OCSP_CERTID_free(sha1id);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	OCSP_REQUEST_free(oreq);
+	return (ret);
+}
+
+/* Undo the URL and base64 encoding of a GET request, in place */
+static ssize_t
+decode_get(char *path)
+{
+	char *in, *out, hex[3];
+	int n;
+
+	for (in = out = path; *in != '\0'; in++, out++) {
+		if (*in == '%' && in[1] != '\0' && in[2] != '\0') {
+			hex[0] = in[1];
+			hex[1] = in[2];
+			hex[2] = '\0';
+			*out = strtol(hex, NULL, 16);
+			in += 2;
+		} else
+			*out = *in;
+	}
+	*out = '\0';
+	if ((n = EVP_DecodeBlock((unsigned char *)path,
+	    (unsigned char *)path, out - path)) < 0)
+		return (-1);
+	return (n);
+}
+
+/* Find header "name" in the header lines at "hdrs", NULL if it isn't there */
+static const char *
+header(const char *hdrs, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = hdrs; p != NULL && *p != '\0'; p = strstr(p, "\r\n")) {
+		if (p[0] == '\r')
+			p += 2;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+static void
+closeconn(struct pollfd *pfd, int i)
+{
+	close(pfd->fd);
+	pfd->fd = -1;
+	free(conns[i]->out);
+	free(conns[i]);
+	conns[i] = NULL;
+}
+
+static void
+respond(struct conn *c, int code, const unsigned char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	if (code != 200)
+		c->keepalive = 0;
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n"
+	    "Content-Type: application/ocsp-response\r\n"
+	    "Content-Length: %zu\r\n%s\r\n",
+	    code == 200 ? "200 OK" : "400 Bad Request", len,
+	    c->keepalive ? "" : "Connection: close\r\n");
+	if ((c->out = malloc(n + len)) == NULL)
+		err(1, "malloc");
+	memcpy(c->out, hdr, n);
+	if (len > 0)
+		memcpy(c->out + n, body, len);
+	c->outlen = n + len;
+	c->outoff = 0;
+}
+
+/*
+ * See if we have a whole request yet, and if so, set up the answer.
+ * Returns 1 if we do, 0 if we need more, and -1 if it's hopeless.
+ */
+static int
+parse_request(struct conn *c)
+{
+	char head[REQ_MAX], *end, *path, *version, *sp, *hdrs, *ep;
+	const unsigned char *resp;
+	unsigned char *tofree;
+	const char *h;
+	size_t hdrlen, bodylen = 0, len;
+	ssize_t n;
+	int post;
+
+	memcpy(head, c->in, c->inlen);
+	head[c->inlen] = '\0';
+	if ((end = strstr(head, "\r\n\r\n")) == NULL)
+		return (c->inlen >= REQ_MAX - 1 ? -1 : 0);
+	hdrlen = end + 4 - head;
+	end[2] = '\0';		/* keep the last header's \r\n */
+
+	/* "METHOD path HTTP/1.x" */
+	if ((hdrs = strstr(head, "\r\n")) == NULL)
+		return (-1);
+	*hdrs = '\0';
+	hdrs += 2;
+	if ((sp = strchr(head, ' ')) == NULL)
+		return (-1);
+	*sp = '\0';
+	path = sp + 1;
+	if ((sp = strchr(path, ' ')) == NULL)
+		return (-1);
+	*sp = '\0';
+	version = sp + 1;
+	if (strcmp(head, "POST") == 0)
+		post = 1;
+	else if (strcmp(head, "GET") == 0)
+		post = 0;
+	else
+		return (-1);
+
+	c->keepalive = strcmp(version, "HTTP/1.1") == 0;
+	if ((h = header(hdrs, "Connection")) != NULL) {
+		if (strncasecmp(h, "close", 5) == 0)
+			c->keepalive = 0;
+		else if (strncasecmp(h, "keep-alive", 10) == 0)
+			c->keepalive = 1;
+	}
+
+	if (post) {
+		if ((h = header(hdrs, "Content-Length")) == NULL)
+			return (-1);
+		/* nothing but a number, and not one that wraps our sums */
+		errno = 0;
+		bodylen = strtoul(h, &ep, 10);
+		while (*ep == ' ' || *ep == '\t')
+			ep++;
+		if (!isdigit((unsigned char)*h) || errno == ERANGE ||
+		    strncmp(ep, "\r\n", 2) != 0)
+			return (-1);
+		if (bodylen > REQ_MAX - 1 - hdrlen)
+			return (-1);
+		if (c->inlen < hdrlen + bodylen)
+			return (0);
+		resp = answer(c->in + hdrlen, bodylen, &len, &tofree);
+	} else {
+		while (*path == '/')
+			path++;
+		if ((n = decode_get(path)) <= 0)
+			return (-1);
+		resp = answer((unsigned char *)path, n, &len, &tofree);
+	}
+
+	respond(c, 200, resp, len);
+	free(tofree);
+	/* keep anything pipelined after this request */
+	memmove(c->in, c->in + hdrlen + bodylen, c->inlen - hdrlen - bodylen);
+	c->inlen -= hdrlen + bodylen;
+	return (1);
+}
+
+static void
+handle_conn(struct pollfd *pfd, int i)
+{
+	struct conn *c = conns[i];
+	ssize_t n;
+	int ret;
+
+	if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		closeconn(pfd, i);
+		return;
+	}
+	if (c->out == NULL) {
+		n = read(pfd->fd, c->in + c->inlen, REQ_MAX - 1 - c->inlen);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n <= 0) {
+			closeconn(pfd, i);
+			return;
+		}
+		c->inlen += n;
+		if ((ret = parse_request(c)) == 0)
+			return;
+		if (ret == -1)
+			respond(c, 400, NULL, 0);
+		pfd->events = POLLOUT;
+	}
+
+	n = write(pfd->fd, c->out + c->outoff, c->outlen - c->outoff);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n == -1) {
+		closeconn(pfd, i);
+		return;
+	}
+	c->outoff += n;
+	if (c->outoff < c->outlen)
+		return;
+	free(c->out);
+	c->out = NULL;
+	if (!c->keepalive) {
+		closeconn(pfd, i);
+		return;
+	}
+	pfd->events = POLLIN;
+	/* a pipelined request may already be here in full */
+	if (c->inlen > 0 && parse_request(c) == 1)
+		pfd->events = POLLOUT;
+}
+
+static void
+load(void)
+{
+	FILE *fp;
+
+	if ((fp = fopen(ISSUER_CERT, "r")) == NULL)
+		err(1, "%s", ISSUER_CERT);
+	if ((issuer = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(ISSUER_CERT);
+	fclose(fp);
+	if ((fp = fopen(RESP_CERT, "r")) == NULL)
+		err(1, "%s", RESP_CERT);
+	if ((rcert = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(RESP_CERT);
+	fclose(fp);
+	if ((fp = fopen(RESP_KEY, "r")) == NULL)
+		err(1, "%s", RESP_KEY);
+	if ((rkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) == NULL)
+		cryptoerr(RESP_KEY);
+	fclose(fp);
+
+	malformed = canned(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST,
+	    &malformedlen);
+	unauthorized = canned(OCSP_RESPONSE_STATUS_UNAUTHORIZED,
+	    &unauthorizedlen);
+	trylater = canned(OCSP_RESPONSE_STATUS_TRYLATER, &trylaterlen);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in sa;
+	u_short port = 2560;
+	long l;
+	char *ep;
+	int ch, i, fd, sd, one = 1;
+
+	if ((jobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jobs = 1;
+	while ((ch = getopt(argc, argv, "j:p:")) != -1) {
+		switch (ch) {
+		case 'j':
+		case 'p':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || (ch == 'j' && l > MAXWORKERS) ||
+			    l > USHRT_MAX) {
+				fprintf(stderr, "%s - bad number\n", optarg);
+				usage();
+			}
+			if (ch == 'j')
+				jobs = l;
+			else
+				port = l;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc != 0)
+		usage();
+
+	load();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket failed");
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		err(1, "setsockopt SO_REUSEADDR");
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		err(1, "bind failed");
+	if (listen(sd, SOMAXCONN) == -1)
+		err(1, "listen failed");
+	if (fcntl(sd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl failed");
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		pollfds[i].fd = -1;
+		pollfds[i].events = POLLIN;
+	}
+	pollfds[0].fd = sd;
+	fprintf(stderr, "OCSP responder listening on 127.0.0.1:%u\n", port);
+
+	for (;;) {
+		if (need_signing())
+			start_signing();
+		/* wake up now and then to see if index.txt changed */
+		if (poll(pollfds, MAX_CONNECTIONS, 1000) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+		if ((pollfds[0].revents & POLLIN) &&
+		    (fd = accept(sd, NULL, NULL)) != -1) {
+			for (i = FIRST_CONN; i < MAX_CONNECTIONS; i++)
+				if (pollfds[i].fd == -1)
+					break;
+			/* if we're full, they can try again */
+			if (i == MAX_CONNECTIONS ||
+			    fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+			    (conns[i] = calloc(1, sizeof(struct conn))) == NULL)
+				close(fd);
+			else {
+				pollfds[i].fd = fd;
+				pollfds[i].events = POLLIN;
+			}
+		}
+		for (i = 1; i < 1 + MAXWORKERS; i++)
+			if (pollfds[i].fd != -1 && pollfds[i].revents)
+				handle_worker(&pollfds[i], &workers[i - 1]);
+		for (i = FIRST_CONN; i < MAX_CONNECTIONS; i++)
+			if (pollfds[i].fd != -1 && pollfds[i].revents)
+				handle_conn(&pollfds[i], i);
+	}
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+
+# print a pin for each certificate given, in the form tls_peer_cert_hash(3)
+# uses, suitable for the pin file of the ex1 client's -P option.
+for cert in "$@"; do
+    hash=`openssl x509 -in ${cert} -outform der | openssl dgst -sha256 -r | sed 's/ .*//'`
+    if [ -z "${hash}" ]; then
+	echo "can't hash ${cert}" >&2
+	exit 1
+    fi
+    echo "# ${cert}"
+    echo "SHA256:${hash}"
+done
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Count heap allocations, so the benchmarks can report allocations
+ * per operation. We interpose on malloc and friends and hand the calls
+ * on to the real ones found with dlsym(RTLD_NEXT). dlsym itself may
+ * want memory before we know where the real calloc lives, so those
+ * early requests come out of a small static arena that is never freed.
+ */
+
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+unsigned long alloc_count = 0;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static unsigned char arena[4096];
+static size_t arena_used = 0;
+static int resolving = 0;
+
+static void *
+arena_alloc(size_t len)
+{
+	void *p;
+
+	len = (len + 15) & ~(size_t)15;
+	if (len > sizeof(arena) - arena_used)
+		return (NULL);
+	p = arena + arena_used;
+	arena_used += len;
+	return (p);
+}
+
+static int
+in_arena(void *p)
+{
+	return ((unsigned char *)p >= arena &&
+	    (unsigned char *)p < arena + sizeof(arena));
+}
+
+static void
+resolve(void)
+{
+	if (real_free != NULL || resolving)
+		return;
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+	if (real_malloc == NULL || real_calloc == NULL ||
+	    real_realloc == NULL || real_free == NULL)
+		abort();
+}
+
+void *
+malloc(size_t len)
+{
+	resolve();
+	if (resolving)
+		return (arena_alloc(len));
+	alloc_count++;
+	return (real_malloc(len));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	resolve();
+	if (resolving) {
+		/* the arena is static, so already zeroed */
+		if (size != 0 && nmemb > SIZE_MAX / size)
+			return (NULL);
+		return (arena_alloc(nmemb * size));
+	}
+	alloc_count++;
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void *p, size_t len)
+{
+	size_t max;
+	void *np;
+
+	resolve();
+	if (p != NULL && in_arena(p)) {
+		/* we don't know the old size, but it ends with the arena */
+		max = arena + sizeof(arena) - (unsigned char *)p;
+		if ((np = malloc(len)) == NULL)
+			return (NULL);
+		memcpy(np, p, len < max ? len : max);
+		return (np);
+	}
+	alloc_count++;
+	return (real_realloc(p, len));
+}
+
+void
+free(void *p)
+{
+	if (p == NULL || in_arena(p))
+		return;
+	resolve();
+	real_free(p);
+}
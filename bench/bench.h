@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Entry points into the exercise code for the micro benchmarks.
+ *
+ * The ring buffer routines and newconn() are static in the exercises,
+ * so echo_ring.c and client_ring.c include the exercise sources whole
+ * and export these thin wrappers around them.
+ */
+
+struct pollfd;
+struct tls;
+
+/* ex2/echo.c - the client_* ring buffer, and newconn() */
+void	*echo_ring_new(void);
+size_t	 echo_ring_room(void);
+void	 echo_ring_reset(void *);
+void	 echo_ring_mark(void *, size_t);
+ssize_t	 echo_ring_put(void *, const unsigned char *, size_t);
+ssize_t	 echo_ring_get(void *, unsigned char *, size_t);
+ssize_t	 echo_ring_consume(void *, size_t);
+void	 echo_newconn(struct pollfd *, int);
+
+/* ex2/client.c - the server_* ring buffer */
+void	*client_ring_new(void);
+size_t	 client_ring_room(void);
+void	 client_ring_reset(void *);
+void	 client_ring_mark(void *, size_t);
+ssize_t	 client_ring_put(void *, const unsigned char *, size_t);
+ssize_t	 client_ring_get(void *, unsigned char *, size_t);
+ssize_t	 client_ring_consume(void *, size_t);
+
+/* ex0/strlcpy.c */
+size_t	 bench_strlcpy(char *, const char *, size_t);
+
+/* ex1/report_tls.c */
+void	 report_tls(struct tls *, char *);
+
+/* alloc.c */
+extern unsigned long alloc_count;
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pull in the echo client whole so the benchmarks can get at its
+ * static ring buffer routines. Its main() is renamed out of the way.
+ */
+
+#define main client_main
+#include "../ex2/client.c"
+#undef main
+
+#include "bench.h"
+
+void *
+client_ring_new(void)
+{
+	struct server *c;
+
+	if ((c = malloc(sizeof(*c))) == NULL)
+		err(1, "malloc");
+	server_init(c);
+	return (c);
+}
+
+size_t
+client_ring_room(void)
+{
+	/* one slot is always kept empty to tell full from empty */
+	return (BUFLEN - 1);
+}
+
+void
+client_ring_reset(void *c)
+{
+	server_init(c);
+}
+
+void
+client_ring_mark(void *arg, size_t len)
+{
+	struct server *c = arg;
+
+	c->readptr = c->buf;
+	c->nextptr = c->buf + len;
+}
+
+ssize_t
+client_ring_put(void *c, const unsigned char *in, size_t len)
+{
+	return (server_put(c, in, len));
+}
+
+ssize_t
+client_ring_get(void *c, unsigned char *out, size_t len)
+{
+	return (server_get(c, out, len));
+}
+
+ssize_t
+client_ring_consume(void *c, size_t len)
+{
+	return (server_consume(c, len));
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * fiberbench - what it costs to have lots of fibers (../common/fiber.c)
+ * at once, the way the ex2 echo server does with -F.
+ *
+ * For each number of fibers, in a process of its own, we start them
+ * all, then let each one yield a number of times, round robin, so
+ * every switch is to a different stack than the last. Then we do it
+ * again, with the stacks the first lot left in the pool. We report
+ *
+ * - new ns: starting a fiber that needs a fresh stack
+ * - pooled ns: starting one with a stack from the pool
+ * - switch ns: going from one fiber to the next
+ * - KB/fiber: resident memory each fiber cost
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-s stackKB] [-y yields] [count ...]\n",
+	    __progname);
+	exit(1);
+}
+
+static int yields = 20;
+static volatile unsigned long sink;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static long
+maxrss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return (ru.ru_maxrss / 1024);
+#else
+	return (ru.ru_maxrss);
+#endif
+}
+
+static void
+yielder(void *arg)
+{
+	int i;
+
+	for (i = 0; i < yields; i++) {
+		sink++;
+		fiber_yield();
+	}
+}
+
+static double
+spawn(size_t count)
+{
+	double t0 = now_ns();
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (fiber_new(yielder, NULL) == NULL) {
+			if (errno == ENOMEM)
+				warnx("out of mappings at %zu fibers, "
+				    "raise vm.max_map_count", i);
+			err(1, "fiber_new");
+		}
+	}
+	return ((now_ns() - t0) / count);
+}
+
+static void
+run(size_t count, size_t stack)
+{
+	double fresh, pooled, t0, sw;
+	long rss0;
+
+	if (fiber_init(stack, count) == -1)
+		err(1, "fiber_init");
+	rss0 = maxrss_kb();
+	fresh = spawn(count);
+	t0 = now_ns();
+	fiber_loop();
+	sw = (now_ns() - t0) / ((double)count * yields);
+	pooled = spawn(count);
+	fiber_loop();
+	printf("  %9zu %9.0f %9.0f %9.1f %9.1f\n", count, fresh, pooled, sw,
+	    (double)(maxrss_kb() - rss0) / count);
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t counts[16], ncounts = 0, stack = FIBER_STACK, i;
+	int ch, status;
+	long l;
+	char *ep;
+	pid_t pid;
+
+	while ((ch = getopt(argc, argv, "s:y:")) != -1) {
+		switch (ch) {
+		case 's':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 4 || l > 65536)
+				usage();
+			stack = l * 1024;
+			break;
+		case 'y':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || l > 1000000)
+				usage();
+			yields = l;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	for (i = 0; i < (size_t)argc && ncounts < 16; i++) {
+		l = strtol(argv[i], &ep, 10);
+		if (*argv[i] == '\0' || *ep != '\0' || l < 1 || l > INT_MAX)
+			usage();
+		counts[ncounts++] = l;
+	}
+	if (ncounts == 0) {
+		counts[0] = 100;
+		counts[1] = 10000;
+		counts[2] = 100000;
+		ncounts = 3;
+	}
+
+	printf("# %9s %9s %9s %9s %9s\n", "fibers", "new ns", "pooled ns",
+	    "switch ns", "KB/fiber");
+	fflush(stdout);
+	for (i = 0; i < ncounts; i++) {
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			run(counts[i], stack);
+			exit(0);
+		}
+		if (waitpid(pid, &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			warnx("%zu fibers failed", counts[i]);
+	}
+	return (0);
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * How much does a server send in answer to a ClientHello, with each of
+ * the certificates in the tutorial CA? That first flight - the server
+ * hello, its certificate chain, and a signature - has to get through
+ * the client's network before the first ACK comes back. TCP only sends
+ * an initial congestion window's worth of segments before it waits
+ * for one, so a flight that's bigger than that costs the handshake
+ * another round trip.
+ *
+ * For each profile (a "name.crt" chain and its "name.key") this does a
+ * handshake with itself in memory, for TLS 1.3 and 1.2, with libtls
+ * reading and writing through callbacks so every byte it sends is
+ * counted, record headers and all. It prints the chain (how many
+ * certificates, their size, and if the root is in there - the client
+ * already has that), the size of the server's first flight, and how
+ * many segments that is. Any flight over the window is marked OVER,
+ * and flight exits 1.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#define DEFAULT_PROFILES	"server", "server-min", "server-ec", "server-ecc"
+#define SERVERNAME		"localhost"
+#define WIRE_SIZE		65536
+#define MAX_FLIGHTS		8
+#define PEM_BEGIN		"-----BEGIN CERTIFICATE-----"
+#define PEM_END			"-----END CERTIFICATE-----"
+
+/* one direction of the connection */
+struct wire {
+	unsigned char buf[WIRE_SIZE];
+	size_t len;
+};
+
+/*
+ * One end of it. Everything written between one read and the next is a
+ * flight.
+ */
+struct end {
+	struct wire *in, *out;
+	size_t flights[MAX_FLIGHTS];
+	int nflights;
+	int has_read;
+};
+
+static const char *cadir = "../CA";
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-C cadir] [-m mss] [-w segments] "
+	    "[profile ...]\n", __progname);
+	exit(1);
+}
+
+static ssize_t
+wire_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct end *e = arg;
+	struct wire *w = e->in;
+
+	if (w->len == 0)
+		return (TLS_WANT_POLLIN);
+	if (len > w->len)
+		len = w->len;
+	memcpy(buf, w->buf, len);
+	memmove(w->buf, w->buf + len, w->len - len);
+	w->len -= len;
+	e->has_read = 1;
+	return (len);
+}
+
+static ssize_t
+wire_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct end *e = arg;
+	struct wire *w = e->out;
+
+	if (len > sizeof(w->buf) - w->len)
+		return (TLS_WANT_POLLOUT);
+	if (e->nflights == 0 || (e->has_read && e->nflights < MAX_FLIGHTS))
+		e->nflights++;
+	e->has_read = 0;
+	e->flights[e->nflights - 1] += len;
+	memcpy(w->buf + w->len, buf, len);
+	w->len += len;
+	return (len);
+}
+
+/*
+ * Read a whole PEM file, and hand back the base64 of each certificate
+ * in it with the line breaks taken out, one after the other, each one
+ * NUL terminated.
+ */
+static char *
+pem_certs(const char *file, int *ncerts)
+{
+	FILE *f;
+	char *pem, *out, *p, *end, *o;
+	size_t len;
+
+	if ((f = fopen(file, "r")) == NULL)
+		return (NULL);
+	if ((pem = calloc(1, WIRE_SIZE + 1)) == NULL ||
+	    (out = calloc(1, WIRE_SIZE + 1)) == NULL)
+		err(1, "calloc");
+	len = fread(pem, 1, WIRE_SIZE, f);
+	if (ferror(f))
+		err(1, "%s", file);
+	fclose(f);
+	pem[len] = '\0';
+
+	*ncerts = 0;
+	o = out;
+	for (p = pem; (p = strstr(p, PEM_BEGIN)) != NULL; p = end) {
+		p += strlen(PEM_BEGIN);
+		if ((end = strstr(p, PEM_END)) == NULL)
+			break;
+		for (; p < end; p++)
+			if (*p != '\n' && *p != '\r')
+				*o++ = *p;
+		*o++ = '\0';
+		(*ncerts)++;
+	}
+	free(pem);
+	return (out);
+}
+
+/* Bytes of DER in the base64 "b64". */
+static size_t
+der_size(const char *b64)
+{
+	size_t len = strlen(b64);
+
+	while (len > 0 && b64[len - 1] == '=')
+		len--;
+	return (len * 3 / 4);
+}
+
+/*
+ * Handshake with ourselves, the server using "sconf". Returns the size
+ * of the server's first flight, or 0 if the handshake failed.
+ */
+static size_t
+first_flight(struct tls_config *sconf, struct tls_config *cconf)
+{
+	static struct wire c2s, s2c;
+	struct end client = { &s2c, &c2s }, server = { &c2s, &s2c };
+	struct tls *sctx, *cctx, *tls;
+	int cdone = 0, sdone = 0, i, r;
+
+	c2s.len = s2c.len = 0;
+	if ((sctx = tls_server()) == NULL || (cctx = tls_client()) == NULL)
+		errx(1, "out of memory");
+	if (tls_configure(sctx, sconf) == -1)
+		errx(1, "tls_configure: %s", tls_error(sctx));
+	if (tls_configure(cctx, cconf) == -1)
+		errx(1, "tls_configure: %s", tls_error(cctx));
+	if (tls_accept_cbs(sctx, &tls, wire_read, wire_write, &server) == -1)
+		errx(1, "tls_accept_cbs: %s", tls_error(sctx));
+	if (tls_connect_cbs(cctx, wire_read, wire_write, &client,
+	    SERVERNAME) == -1)
+		errx(1, "tls_connect_cbs: %s", tls_error(cctx));
+
+	/* each side in turn, until both are done or one of them fails */
+	for (i = 0; i < 100 && (!cdone || !sdone); i++) {
+		if (!cdone) {
+			if ((r = tls_handshake(cctx)) == 0)
+				cdone = 1;
+			else if (r == -1) {
+				warnx("client: %s", tls_error(cctx));
+				break;
+			}
+		}
+		if (!sdone) {
+			if ((r = tls_handshake(tls)) == 0)
+				sdone = 1;
+			else if (r == -1) {
+				warnx("server: %s", tls_error(tls));
+				break;
+			}
+		}
+	}
+	tls_free(tls);
+	tls_free(cctx);
+	tls_free(sctx);
+	if (!cdone || !sdone || server.nflights == 0)
+		return (0);
+	return (server.flights[0]);
+}
+
+int main(int argc, char **argv) {
+	static const char *defaults[] = { DEFAULT_PROFILES };
+	static const struct {
+		const char *name;
+		uint32_t protocols;
+	} versions[] = {
+		{ "TLSv1.3", TLS_PROTOCOL_TLSv1_3 },
+		{ "TLSv1.2", TLS_PROTOCOL_TLSv1_2 },
+	};
+	struct tls_config *sconf, *cconf;
+	char cert[PATH_MAX], key[PATH_MAX], root[PATH_MAX];
+	char *certs, *rootcert, *p;
+	const char **profiles;
+	size_t chain, flight, window;
+	unsigned long mss = 1460, segments = 10, l;
+	int ch, i, j, k, ncerts, nroot, hasroot, over = 0;
+	char *ep;
+
+	while ((ch = getopt(argc, argv, "C:m:w:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cadir = optarg;
+			break;
+		case 'm':
+		case 'w':
+			errno = 0;
+			l = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l == 0) {
+				fprintf(stderr, "%s - bad number\n", optarg);
+				usage();
+			}
+			if (ch == 'm')
+				mss = l;
+			else
+				segments = l;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		profiles = defaults;
+		argc = sizeof(defaults) / sizeof(defaults[0]);
+	} else
+		profiles = (const char **)argv;
+	window = mss * segments;
+
+	snprintf(root, sizeof(root), "%s/root.pem", cadir);
+	if ((rootcert = pem_certs(root, &nroot)) == NULL || nroot == 0)
+		errx(1, "no root certificate in %s - run make there first",
+		    root);
+	if ((cconf = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_ca_file(cconf, root) == -1)
+		errx(1, "%s", tls_config_error(cconf));
+
+	printf("%-12s %-8s %5s %6s %4s %7s %5s\n", "profile", "version",
+	    "certs", "chain", "root", "flight", "segs");
+	for (i = 0; i < argc; i++) {
+		snprintf(cert, sizeof(cert), "%s/%s.crt", cadir, profiles[i]);
+		snprintf(key, sizeof(key), "%s/%s.key", cadir, profiles[i]);
+		if ((certs = pem_certs(cert, &ncerts)) == NULL) {
+			warn("skipping %s (\"make minimal\" in %s?)", cert,
+			    cadir);
+			continue;
+		}
+		chain = 0;
+		hasroot = 0;
+		for (p = certs, k = 0; k < ncerts; p += strlen(p) + 1, k++) {
+			chain += der_size(p);
+			if (strcmp(p, rootcert) == 0)
+				hasroot = 1;
+		}
+		free(certs);
+
+		if ((sconf = tls_config_new()) == NULL)
+			errx(1, "tls_config_new failed");
+		if (tls_config_set_keypair_file(sconf, cert, key) == -1) {
+			warnx("skipping %s: %s", profiles[i],
+			    tls_config_error(sconf));
+			tls_config_free(sconf);
+			continue;
+		}
+		for (j = 0; j < sizeof(versions) / sizeof(versions[0]); j++) {
+			tls_config_set_protocols(sconf, versions[j].protocols);
+			tls_config_set_protocols(cconf, versions[j].protocols);
+			if ((flight = first_flight(sconf, cconf)) == 0) {
+				warnx("%s: %s handshake failed", profiles[i],
+				    versions[j].name);
+				over = 1;
+				continue;
+			}
+			printf("%-12s %-8s %5d %6zu %4s %7zu %5zu%s\n",
+			    profiles[i], versions[j].name, ncerts, chain,
+			    hasroot ? "yes" : "no", flight,
+			    (flight + mss - 1) / mss,
+			    flight > window ? "  OVER" : "");
+			if (flight > window)
+				over = 1;
+		}
+		tls_config_free(sconf);
+	}
+	printf("initial window %lu segments of %lu bytes, %zu bytes\n",
+	    segments, mss, window);
+	return (over);
+}
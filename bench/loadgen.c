@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A load generator for the exercise servers.
+ *
+ * It talks length prefixed messages (../common/message.c), which is
+ * what the ex0 and ex1 servers answer with "-k", and what the ex2 echo
+ * server echoes with "-f length". First it times full TLS handshakes,
+ * a new connection for each, then it sends messages of each size one
+ * at a time over one connection, timing each from sending it to having
+ * the whole answer. "-T" talks plain TCP, for the ex0 server.
+ *
+ * Results are one "name value" pair a line, so bench/pgo.sh can put
+ * runs side by side:
+ *
+ *	handshake/s 405.2
+ *	msg/s@16 24630.5
+ *	p50us@16 38.2
+ *	p99us@16 80.1
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "message.h"
+
+#define CA_FILE		"../CA/root.pem"
+#define SERVERNAME	"localhost"
+#define DEFAULT_SIZES	"16,256,2048"
+
+static struct addrinfo *server;
+static struct tls_config *tls_cfg;
+static int plain = 0;
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-T] [-c handshakes] [-n messages] "
+	    "[-s size,...] host portnumber\n", __progname);
+	exit(1);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+struct conn {
+	int fd;
+	struct tls *tls;
+};
+
+/* message_io functions, see message.h */
+static ssize_t
+conn_read(void *arg, void *buf, size_t len)
+{
+	struct conn *c = arg;
+	ssize_t r;
+
+	if (plain)
+		return (read(c->fd, buf, len));
+	do {
+		r = tls_read(c->tls, buf, len);
+	} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
+	return (r);
+}
+
+static ssize_t
+conn_write(void *arg, void *buf, size_t len)
+{
+	struct conn *c = arg;
+	ssize_t w;
+
+	if (plain)
+		return (write(c->fd, buf, len));
+	do {
+		w = tls_write(c->tls, buf, len);
+	} while (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT);
+	return (w);
+}
+
+static void
+conn_open(struct conn *c)
+{
+	int i, one = 1;
+
+	if ((c->fd = socket(server->ai_family, server->ai_socktype,
+	    server->ai_protocol)) == -1)
+		err(1, "socket");
+	if (connect(c->fd, server->ai_addr, server->ai_addrlen) == -1)
+		err(1, "connect");
+	/* one small message at a time, Nagle would only get in the way */
+	if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one,
+	    sizeof(one)) == -1)
+		err(1, "setsockopt");
+	c->tls = NULL;
+	if (plain)
+		return;
+	if ((c->tls = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(c->tls, tls_cfg) == -1)
+		errx(1, "tls_configure: %s", tls_error(c->tls));
+	if (tls_connect_socket(c->tls, c->fd, SERVERNAME) == -1)
+		errx(1, "tls_connect_socket: %s", tls_error(c->tls));
+	do {
+		i = tls_handshake(c->tls);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (i == -1)
+		errx(1, "tls_handshake: %s", tls_error(c->tls));
+}
+
+static void
+conn_close(struct conn *c)
+{
+	if (c->tls != NULL) {
+		tls_close(c->tls);
+		tls_free(c->tls);
+	}
+	close(c->fd);
+}
+
+/* Full handshakes, one after the other. */
+static void
+handshakes(unsigned long count)
+{
+	struct conn c;
+	uint64_t start;
+	unsigned long i;
+
+	start = now();
+	for (i = 0; i < count; i++) {
+		conn_open(&c);
+		conn_close(&c);
+	}
+	printf("handshake/s %.1f\n", count * 1e9 / (now() - start));
+}
+
+/* "count" messages of "size", after a tenth as many to warm up. */
+static void
+messages(struct conn *c, size_t size, unsigned long count)
+{
+	static unsigned char msg[MESSAGE_MAX], reply[MESSAGE_MAX];
+	static struct latency latency;
+	uint64_t start, t;
+	unsigned long i;
+	size_t len;
+
+	memset(msg, 'x', size);
+	memset(&latency, 0, sizeof(latency));
+	start = now();
+	for (i = 0; i < count / 10 + count; i++) {
+		if (i == count / 10)
+			start = now();
+		t = now();
+		if (message_send(conn_write, c, msg, size) == -1)
+			err(1, "sending message");
+		if (message_recv(conn_read, c, reply, sizeof(reply),
+		    &len) != 1)
+			errx(1, "no answer to a %zu byte message", size);
+		if (i >= count / 10)
+			latency_add(&latency, now() - t);
+	}
+	t = now();
+	printf("msg/s@%zu %.1f\n", size, count * 1e9 / (t - start));
+	printf("p50us@%zu %.1f\n", size,
+	    latency_quantile(&latency, 0.5) / 1000.0);
+	printf("p99us@%zu %.1f\n", size,
+	    latency_quantile(&latency, 0.99) / 1000.0);
+}
+
+int main(int argc, char **argv) {
+	struct addrinfo hints;
+	struct conn c;
+	unsigned long nhandshakes = 200, nmessages = 20000, l;
+	const char *sizes = DEFAULT_SIZES;
+	char *s, *ep;
+	int ch, error;
+
+	while ((ch = getopt(argc, argv, "c:n:s:T")) != -1) {
+		switch (ch) {
+		case 'c':
+		case 'n':
+			errno = 0;
+			l = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0) {
+				fprintf(stderr, "%s - bad count\n", optarg);
+				usage();
+			}
+			if (ch == 'c')
+				nhandshakes = l;
+			else
+				nmessages = l;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'T':
+			plain = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+	/* a server that hangs up on us is an error, not a reason to die */
+	signal(SIGPIPE, SIG_IGN);
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &server))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+	if (!plain) {
+		if (tls_init() == -1)
+			errx(1, "tls_init failed");
+		if ((tls_cfg = tls_config_new()) == NULL)
+			errx(1, "tls_config_new failed");
+		if (tls_config_set_ca_file(tls_cfg, CA_FILE) == -1)
+			errx(1, "unable to set root CA file %s: %s", CA_FILE,
+			    tls_config_error(tls_cfg));
+		if (nhandshakes > 0)
+			handshakes(nhandshakes);
+	}
+
+	if (nmessages > 0) {
+		if ((s = strdup(sizes)) == NULL)
+			err(1, "strdup");
+		conn_open(&c);
+		for (s = strtok(s, ","); s != NULL; s = strtok(NULL, ",")) {
+			errno = 0;
+			l = strtoul(s, &ep, 10);
+			if (*s == '\0' || *ep != '\0' || errno != 0 ||
+			    l > MESSAGE_MAX) {
+				fprintf(stderr, "%s - bad size\n", s);
+				usage();
+			}
+			messages(&c, l, nmessages);
+		}
+		conn_close(&c);
+	}
+	freeaddrinfo(server);
+	return (0);
+}
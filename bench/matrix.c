@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * What do the choices we can make with tls_config_set_protocols(),
+ * tls_config_set_ciphers() and tls_config_set_ecdhecurves() cost?
+ *
+ * For every certificate profile (a "name.crt" and "name.key", as for
+ * flight), TLS version, cipher and key exchange group, this does "-n"
+ * full handshakes with itself in memory, the way flight does, and then
+ * sends "-b" megabytes from the client to the server over the last
+ * one. Only the time spent in libtls is counted, in cpu time, so the
+ * numbers are per core, and the client and server sides separately.
+ * It prints one line for each combination, ranked by what "-r" says:
+ *
+ *	hs	server handshakes a second (the default)
+ *	bulk	megabytes a second encrypted and decrypted
+ *	bytes	bytes on the wire for a handshake, both ways
+ *
+ * A combination that libtls won't configure, or that doesn't manage a
+ * handshake, gets a warning and is left out.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#define DEFAULT_PROFILES	"server", "server-ec"
+#define SERVERNAME		"localhost"
+#define WIRE_SIZE		65536
+#define CHUNK			16384
+
+static const struct {
+	const char *name;
+	uint32_t protocols;
+} versions[] = {
+	{ "TLSv1.3", TLS_PROTOCOL_TLSv1_3 },
+	{ "TLSv1.2", TLS_PROTOCOL_TLSv1_2 },
+};
+
+/*
+ * TLS 1.2 names its ciphers with the key exchange and the kind of key
+ * in the certificate, so those are picked by rule, to work with both.
+ */
+static const struct {
+	const char *name;
+	const char *tls12;
+	const char *tls13;
+} ciphers[] = {
+	{ "AES128-GCM", "ECDHE+AES128+AESGCM", "TLS_AES_128_GCM_SHA256" },
+	{ "AES256-GCM", "ECDHE+AES256+AESGCM", "TLS_AES_256_GCM_SHA384" },
+	{ "CHACHA20", "ECDHE+CHACHA20", "TLS_CHACHA20_POLY1305_SHA256" },
+};
+
+static const char *groups[] = { "X25519", "P-256", "P-384" };
+
+/* one direction of the connection */
+struct wire {
+	unsigned char buf[WIRE_SIZE];
+	size_t off, len;
+};
+
+/* one end of it, and how much it has sent */
+struct end {
+	struct wire *in, *out;
+	size_t sent;
+};
+
+/* how one combination did */
+struct result {
+	const char *profile, *version, *group;
+	char cipher[64];
+	double shs, chs;	/* handshakes a second, server and client */
+	double mbs;		/* megabytes a second, sealed and opened */
+	size_t bytes;		/* handshake bytes, both ways */
+};
+
+static const char *cadir = "../CA";
+static int rankby = 0;		/* 0 hs, 1 bulk, 2 bytes */
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-b megabytes] [-C cadir] [-n handshakes] "
+	    "[-r hs|bulk|bytes] [profile ...]\n", __progname);
+	exit(1);
+}
+
+/* cpu nanoseconds this process has used */
+static double
+cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static ssize_t
+wire_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct end *e = arg;
+	struct wire *w = e->in;
+
+	if (w->len == 0)
+		return (TLS_WANT_POLLIN);
+	if (len > w->len)
+		len = w->len;
+	memcpy(buf, w->buf + w->off, len);
+	w->off += len;
+	w->len -= len;
+	if (w->len == 0)
+		w->off = 0;
+	return (len);
+}
+
+static ssize_t
+wire_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct end *e = arg;
+	struct wire *w = e->out;
+
+	if (len > sizeof(w->buf) - w->off - w->len)
+		return (TLS_WANT_POLLOUT);
+	memcpy(w->buf + w->off + w->len, buf, len);
+	w->len += len;
+	e->sent += len;
+	return (len);
+}
+
+/*
+ * One handshake between "sctx" and a new client, adding the time each
+ * side spent in it to "sns" and "cns". On success the connection is
+ * left in "*cli" and "*srv", and the bytes it took are returned, or 0
+ * if it failed.
+ */
+static size_t
+handshake(struct tls *sctx, struct tls_config *cconf, struct end *client,
+    struct end *server, struct tls **cli, struct tls **srv, double *sns,
+    double *cns)
+{
+	struct tls *cctx, *tls;
+	int cdone = 0, sdone = 0, i, r;
+	double t;
+
+	client->in->off = client->in->len = 0;
+	client->out->off = client->out->len = 0;
+	client->sent = server->sent = 0;
+	if ((cctx = tls_client()) == NULL)
+		errx(1, "out of memory");
+	if (tls_configure(cctx, cconf) == -1)
+		errx(1, "tls_configure: %s", tls_error(cctx));
+	if (tls_accept_cbs(sctx, &tls, wire_read, wire_write, server) == -1)
+		errx(1, "tls_accept_cbs: %s", tls_error(sctx));
+	if (tls_connect_cbs(cctx, wire_read, wire_write, client,
+	    SERVERNAME) == -1)
+		errx(1, "tls_connect_cbs: %s", tls_error(cctx));
+
+	for (i = 0; i < 100 && (!cdone || !sdone); i++) {
+		if (!cdone) {
+			t = cpu_ns();
+			r = tls_handshake(cctx);
+			*cns += cpu_ns() - t;
+			if (r == 0)
+				cdone = 1;
+			else if (r == -1) {
+				warnx("client: %s", tls_error(cctx));
+				break;
+			}
+		}
+		if (!sdone) {
+			t = cpu_ns();
+			r = tls_handshake(tls);
+			*sns += cpu_ns() - t;
+			if (r == 0)
+				sdone = 1;
+			else if (r == -1) {
+				warnx("server: %s", tls_error(tls));
+				break;
+			}
+		}
+	}
+	if (!cdone || !sdone) {
+		tls_free(tls);
+		tls_free(cctx);
+		return (0);
+	}
+	*cli = cctx;
+	*srv = tls;
+	return (client->sent + server->sent);
+}
+
+/*
+ * Send "total" bytes from "cli" to "srv", and return the nanoseconds
+ * spent sealing and opening them, or 0 if that didn't work.
+ */
+static double
+bulk(struct tls *cli, struct tls *srv, size_t total)
+{
+	static unsigned char out[CHUNK], in[CHUNK];
+	size_t sent = 0, received = 0;
+	ssize_t r;
+	double t, ns = 0;
+
+	while (received < total) {
+		if (sent < total) {
+			t = cpu_ns();
+			r = tls_write(cli, out, total - sent < CHUNK ?
+			    total - sent : CHUNK);
+			ns += cpu_ns() - t;
+			if (r == -1) {
+				warnx("tls_write: %s", tls_error(cli));
+				return (0);
+			}
+			if (r > 0)
+				sent += r;
+		}
+		do {
+			t = cpu_ns();
+			r = tls_read(srv, in, sizeof(in));
+			ns += cpu_ns() - t;
+			if (r == -1) {
+				warnx("tls_read: %s", tls_error(srv));
+				return (0);
+			}
+			if (r > 0)
+				received += r;
+		} while (r > 0);
+		if (r == 0)
+			break;
+	}
+	return (received == total ? ns : 0);
+}
+
+/*
+ * Run one combination, with the server using "sconf" and the client
+ * "cconf", and fill in "res". Returns -1 if it didn't work.
+ */
+static int
+run(struct tls_config *sconf, struct tls_config *cconf, int n,
+    size_t total, struct result *res)
+{
+	static struct wire c2s, s2c;
+	struct end client = { &s2c, &c2s }, server = { &c2s, &s2c };
+	struct tls *sctx, *cli = NULL, *srv = NULL;
+	double sns = 0, cns = 0, ns;
+	size_t bytes = 0;
+	int i;
+
+	if ((sctx = tls_server()) == NULL)
+		errx(1, "out of memory");
+	if (tls_configure(sctx, sconf) == -1) {
+		warnx("tls_configure: %s", tls_error(sctx));
+		tls_free(sctx);
+		return (-1);
+	}
+	/* the first one warms things up, and isn't counted */
+	for (i = 0; i <= n; i++) {
+		if (cli != NULL) {
+			tls_free(cli);
+			tls_free(srv);
+		}
+		if ((bytes = handshake(sctx, cconf, &client, &server, &cli,
+		    &srv, &sns, &cns)) == 0) {
+			tls_free(sctx);
+			return (-1);
+		}
+		if (i == 0)
+			sns = cns = 0;
+	}
+	snprintf(res->cipher, sizeof(res->cipher), "%s", tls_conn_cipher(cli));
+	res->bytes = bytes;
+	res->shs = n / (sns / 1e9);
+	res->chs = n / (cns / 1e9);
+	ns = bulk(cli, srv, total);
+	res->mbs = ns > 0 ? total / 1048576.0 / (ns / 1e9) : 0;
+	tls_free(cli);
+	tls_free(srv);
+	tls_free(sctx);
+	return (ns > 0 ? 0 : -1);
+}
+
+static int
+rankcmp(const void *a, const void *b)
+{
+	const struct result *x = a, *y = b;
+
+	switch (rankby) {
+	case 1:
+		return (x->mbs < y->mbs ? 1 : x->mbs > y->mbs ? -1 : 0);
+	case 2:
+		return (x->bytes > y->bytes ? 1 : x->bytes < y->bytes ? -1 : 0);
+	default:
+		return (x->shs < y->shs ? 1 : x->shs > y->shs ? -1 : 0);
+	}
+}
+
+int main(int argc, char **argv) {
+	static const char *defaults[] = { DEFAULT_PROFILES };
+	static const char *ranks[] = { "hs", "bulk", "bytes" };
+	struct tls_config *sconf, *cconf;
+	char cert[PATH_MAX], key[PATH_MAX], root[PATH_MAX];
+	const char **profiles, *c;
+	struct result *results, *res;
+	size_t nresults = 0, max, total = 8 * 1048576;
+	unsigned long l;
+	int ch, i, j, k, g, n = 100;
+	char *ep;
+
+	while ((ch = getopt(argc, argv, "b:C:n:r:")) != -1) {
+		switch (ch) {
+		case 'b':
+		case 'n':
+			errno = 0;
+			l = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l == 0 || l > 100000) {
+				fprintf(stderr, "%s - bad number\n", optarg);
+				usage();
+			}
+			if (ch == 'b')
+				total = l * 1048576;
+			else
+				n = l;
+			break;
+		case 'C':
+			cadir = optarg;
+			break;
+		case 'r':
+			for (rankby = 0; rankby < 3; rankby++)
+				if (strcmp(optarg, ranks[rankby]) == 0)
+					break;
+			if (rankby == 3) {
+				fprintf(stderr, "%s - can't rank by that\n",
+				    optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		profiles = defaults;
+		argc = sizeof(defaults) / sizeof(defaults[0]);
+	} else
+		profiles = (const char **)argv;
+
+	max = argc * (sizeof(versions) / sizeof(versions[0])) *
+	    (sizeof(ciphers) / sizeof(ciphers[0])) *
+	    (sizeof(groups) / sizeof(groups[0]));
+	if ((results = calloc(max, sizeof(*results))) == NULL)
+		err(1, "calloc");
+
+	snprintf(root, sizeof(root), "%s/root.pem", cadir);
+	if (access(root, R_OK) == -1)
+		err(1, "%s - run make in %s first", root, cadir);
+
+	for (i = 0; i < argc; i++) {
+		snprintf(cert, sizeof(cert), "%s/%s.crt", cadir, profiles[i]);
+		snprintf(key, sizeof(key), "%s/%s.key", cadir, profiles[i]);
+		if ((sconf = tls_config_new()) == NULL ||
+		    (cconf = tls_config_new()) == NULL)
+			errx(1, "tls_config_new failed");
+		if (tls_config_set_keypair_file(sconf, cert, key) == -1) {
+			warnx("skipping %s: %s (\"make minimal\" in %s?)",
+			    profiles[i], tls_config_error(sconf), cadir);
+			tls_config_free(sconf);
+			tls_config_free(cconf);
+			continue;
+		}
+		if (tls_config_set_ca_file(cconf, root) == -1)
+			errx(1, "%s", tls_config_error(cconf));
+		for (j = 0; j < sizeof(versions) / sizeof(versions[0]); j++) {
+			tls_config_set_protocols(sconf, versions[j].protocols);
+			tls_config_set_protocols(cconf, versions[j].protocols);
+			for (k = 0; k < sizeof(ciphers) / sizeof(ciphers[0]);
+			    k++) {
+				c = versions[j].protocols ==
+				    TLS_PROTOCOL_TLSv1_3 ? ciphers[k].tls13 :
+				    ciphers[k].tls12;
+				if (tls_config_set_ciphers(sconf, c) == -1 ||
+				    tls_config_set_ciphers(cconf, c) == -1) {
+					warnx("%s %s: %s", versions[j].name, c,
+					    tls_config_error(sconf));
+					continue;
+				}
+				for (g = 0; g < sizeof(groups) /
+				    sizeof(groups[0]); g++) {
+					if (tls_config_set_ecdhecurves(sconf,
+					    groups[g]) == -1 ||
+					    tls_config_set_ecdhecurves(cconf,
+					    groups[g]) == -1)
+						errx(1, "%s: %s", groups[g],
+						    tls_config_error(sconf));
+					res = &results[nresults];
+					res->profile = profiles[i];
+					res->version = versions[j].name;
+					res->group = groups[g];
+					if (run(sconf, cconf, n, total,
+					    res) == -1) {
+						warnx("%s %s %s %s failed",
+						    profiles[i],
+						    versions[j].name,
+						    ciphers[k].name, groups[g]);
+						continue;
+					}
+					nresults++;
+				}
+			}
+		}
+		tls_config_free(sconf);
+		tls_config_free(cconf);
+	}
+
+	qsort(results, nresults, sizeof(*results), rankcmp);
+	printf("%4s %-10s %-8s %-30s %-7s %8s %8s %6s %8s\n", "rank",
+	    "profile", "version", "cipher", "group", "srv hs/s", "cli hs/s",
+	    "bytes", "MB/s");
+	for (i = 0; i < nresults; i++) {
+		res = &results[i];
+		printf("%4d %-10s %-8s %-30s %-7s %8.0f %8.0f %6zu %8.0f\n",
+		    i + 1, res->profile, res->version, res->cipher, res->group,
+		    res->shs, res->chs, res->bytes, res->mbs);
+	}
+	printf("%d handshakes and %zu MB each, per core, ranked by %s\n", n,
+	    total / 1048576, ranks[rankby]);
+	free(results);
+	return (nresults == 0);
+}
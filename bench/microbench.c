@@ -0,0 +1,866 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro benchmarks for the building blocks the exercise programs are
+ * made of: the ring buffers from the ex2 echo server and client,
+ * finding where messages end in them, strlcpy, newconn() setup of a
+ * new descriptor, report_tls(), writing over TLS with and without
+ * coalescing, a TLS handshake with and without certificate
+ * pinning, and the echo server's per connection buffers with and
+ * without its -P pools.
+ *
+ * Each benchmark is calibrated to run for a while, then timed over a
+ * number of trials. We report the median time per operation, bytes
+ * moved per cycle where that makes sense, heap allocations per
+ * operation, and the spread of the trials. A previous run saved to a
+ * file can be given as a baseline, in which case anything that got
+ * slower than the threshold is flagged and we exit non zero.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "bufpool.h"
+#include "clienthello.h"
+#include "fiber.h"
+#include "frame.h"
+#include "pinset.h"
+#include "tlsbuf.h"
+#include "tlswriter.h"
+
+#define MAXSIZE		65536
+#define MINTRIAL_NS	20000000.0	/* calibrate trials to >= 20ms */
+#define MAXTRIALS	101
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr,
+	    "usage: %s [-l] [-b baseline] [-C cadir] [-r trials] "
+	    "[-t threshold] [name ...]\n", __progname);
+	exit(1);
+}
+
+static const size_t sizes[] = {
+	1, 16, 64, 256, 1024, 4096, 16384, 65536
+};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static unsigned char src[MAXSIZE], dst[MAXSIZE];
+static char strsrc[MAXSIZE], strdst[MAXSIZE];
+static volatile ssize_t sink;
+static const char *cadir = "../CA";
+
+static void *echo_ring, *client_ring;
+static struct pollfd pfd;
+static int sv[2] = { -1, -1 };
+static struct tls *tls_client_ctx, *tls_server_ctx, *tls_conn_ctx;
+static int devnull = -1;
+
+static uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__builtin_ia32_rdtsc());
+#else
+	return (0);
+#endif
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * The ring benchmarks move "size" bytes through the routine being
+ * measured, in chunks no bigger than the ring can hold at once.
+ */
+#define RING_BENCH(NAME, PFX)						\
+static int								\
+NAME##_put_setup(size_t size)						\
+{									\
+	if (PFX##_ring == NULL)						\
+		PFX##_ring = PFX##_ring_new();				\
+	return (0);							\
+}									\
+static void								\
+NAME##_put_run(size_t size, unsigned long iters)			\
+{									\
+	size_t left, n, room = PFX##_ring_room();			\
+									\
+	while (iters-- > 0) {						\
+		for (left = size; left > 0; left -= n) {		\
+			n = left < room ? left : room;			\
+			PFX##_ring_reset(PFX##_ring);			\
+			sink += PFX##_ring_put(PFX##_ring, src, n);	\
+		}							\
+	}								\
+}									\
+static int								\
+NAME##_get_setup(size_t size)						\
+{									\
+	NAME##_put_setup(size);						\
+	PFX##_ring_reset(PFX##_ring);					\
+	PFX##_ring_put(PFX##_ring, src, PFX##_ring_room());		\
+	return (0);							\
+}									\
+static void								\
+NAME##_get_run(size_t size, unsigned long iters)			\
+{									\
+	size_t left, n, room = PFX##_ring_room();			\
+									\
+	while (iters-- > 0) {						\
+		for (left = size; left > 0; left -= n) {		\
+			n = left < room ? left : room;			\
+			sink += PFX##_ring_get(PFX##_ring, dst, n);	\
+		}							\
+	}								\
+}									\
+static void								\
+NAME##_consume_run(size_t size, unsigned long iters)			\
+{									\
+	size_t left, n, room = PFX##_ring_room();			\
+									\
+	while (iters-- > 0) {						\
+		for (left = size; left > 0; left -= n) {		\
+			n = left < room ? left : room;			\
+			PFX##_ring_mark(PFX##_ring, n);			\
+			sink += PFX##_ring_consume(PFX##_ring, n);	\
+		}							\
+	}								\
+}
+
+RING_BENCH(client, echo)
+RING_BENCH(server, client)
+
+/*
+ * Searching "size" bytes for the newline at the end of them, with each
+ * of the ways frame_memchr() can do it.
+ */
+#define SCAN_BENCH(NAME)						\
+static int								\
+scan_##NAME##_setup(size_t size)					\
+{									\
+	if (frame_scanner(#NAME) == NULL)				\
+		return (-1);						\
+	memset(dst, 'x', size);						\
+	dst[size - 1] = '\n';						\
+	return (0);							\
+}									\
+static void								\
+scan_##NAME##_run(size_t size, unsigned long iters)			\
+{									\
+	while (iters-- > 0)						\
+		sink += (const unsigned char *)frame_memchr(dst, '\n',	\
+		    size) - dst;					\
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+SCAN_BENCH(avx2)
+SCAN_BENCH(sse2)
+#endif
+SCAN_BENCH(scalar)
+SCAN_BENCH(memchr)
+
+/*
+ * Framing a stream of "size" byte lines out of a ring buffer full of
+ * them, a line at a time, the way the echo server does. The lines
+ * don't line up with the end of the ring, so some of them wrap.
+ */
+static struct framer framer;
+static size_t frame_pos, frame_ringlen;
+
+static int
+frame_lines_setup(size_t size)
+{
+	size_t i;
+
+	frame_scanner(NULL);
+	framer_init(&framer, FRAME_LINE, MAXSIZE);
+	frame_ringlen = MAXSIZE / size * size;
+	memset(dst, 'x', frame_ringlen);
+	for (i = size / 2 + size - 1; i < frame_ringlen + size / 2; i += size)
+		dst[i % frame_ringlen] = '\n';
+	frame_pos = size / 2;
+	return (0);
+}
+
+static void
+frame_lines_run(size_t size, unsigned long iters)
+{
+	struct iovec data[2];
+	struct frame f;
+
+	while (iters-- > 0) {
+		data[0].iov_base = dst + frame_pos;
+		data[0].iov_len = frame_ringlen - frame_pos;
+		data[1].iov_base = dst;
+		data[1].iov_len = frame_pos;
+		if (framer_next(&framer, data, 2, &f) != 1)
+			errx(1, "no line at %zu", frame_pos);
+		sink += f.iovcnt;
+		frame_pos = (frame_pos + f.len) % frame_ringlen;
+	}
+}
+
+static int
+nothing_setup(size_t size)
+{
+	return (0);
+}
+
+/* what the ex2 client's -l costs per message */
+static void
+latency_add_run(size_t size, unsigned long iters)
+{
+	static struct latency l;
+
+	while (iters-- > 0)
+		latency_add(&l, iters & 0xfffff);
+	sink += l.count;
+}
+
+static int
+strlcpy_setup(size_t size)
+{
+	memset(strsrc, 'x', sizeof(strsrc));
+	strsrc[size - 1] = '\0';
+	return (0);
+}
+
+static void
+strlcpy_run(size_t size, unsigned long iters)
+{
+	while (iters-- > 0)
+		sink += bench_strlcpy(strdst, strsrc, size);
+}
+
+static int
+newconn_setup(size_t size)
+{
+	if (sv[0] == -1 && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "socketpair failed");
+	return (0);
+}
+
+static void
+newconn_run(size_t size, unsigned long iters)
+{
+	while (iters-- > 0)
+		echo_newconn(&pfd, sv[0]);
+}
+
+static int
+tls_step(struct tls *ctx, int *done)
+{
+	int ret;
+
+	if (*done)
+		return (0);
+	ret = tls_handshake(ctx);
+	if (ret == 0)
+		*done = 1;
+	else if (ret != TLS_WANT_POLLIN && ret != TLS_WANT_POLLOUT) {
+		warnx("handshake failed: %s", tls_error(ctx));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * The TLS benchmarks talk to themselves over a socketpair, using the
+ * tutorial CA. The client config either verifies the server's chain
+ * against the root, or pins the server certificate, see
+ * ../common/pinset.c
+ */
+static struct tls_config *tls_sconf, *tls_cconf, *tls_pconf;
+static struct pinset pins;
+
+static int
+tls_setup(void)
+{
+	static int done, ok;
+	char cert[PATH_MAX], key[PATH_MAX], root[PATH_MAX];
+
+	if (done)
+		return (ok ? 0 : -1);
+	done = 1;
+	snprintf(cert, sizeof(cert), "%s/server.crt", cadir);
+	snprintf(key, sizeof(key), "%s/server.key", cadir);
+	snprintf(root, sizeof(root), "%s/root.pem", cadir);
+
+	if ((tls_sconf = tls_config_new()) == NULL ||
+	    (tls_cconf = tls_config_new()) == NULL ||
+	    (tls_pconf = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_keypair_file(tls_sconf, cert, key) == -1) {
+		warnx("skipping TLS benchmarks: %s",
+		    tls_config_error(tls_sconf));
+		return (-1);
+	}
+	if (tls_config_set_ca_file(tls_cconf, root) == -1) {
+		warnx("skipping TLS benchmarks: %s",
+		    tls_config_error(tls_cconf));
+		return (-1);
+	}
+	tls_config_insecure_noverifycert(tls_pconf);
+	if ((tls_server_ctx = tls_server()) == NULL)
+		errx(1, "tls_server failed");
+	if (tls_configure(tls_server_ctx, tls_sconf) == -1)
+		errx(1, "tls_configure: %s", tls_error(tls_server_ctx));
+	pinset_init(&pins);
+	ok = 1;
+	return (0);
+}
+
+/*
+ * Handshake "client" with our server over a fresh socketpair "tsv",
+ * leaving the server side in "*conn". Returns -1 if it didn't work.
+ */
+static int
+tls_pair(struct tls *client, struct tls **conn, int tsv[2])
+{
+	int cdone = 0, sdone = 0, i, ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, tsv) == -1)
+		err(1, "socketpair failed");
+	for (i = 0; i < 2; i++)
+		if (fcntl(tsv[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl failed");
+	if (tls_connect_socket(client, tsv[0], "localhost") == -1)
+		errx(1, "tls_connect_socket: %s", tls_error(client));
+	if (tls_accept_socket(tls_server_ctx, conn, tsv[1]) == -1)
+		errx(1, "tls_accept_socket: %s", tls_error(tls_server_ctx));
+	while (!cdone || !sdone) {
+		if (tls_step(client, &cdone) == -1 ||
+		    tls_step(*conn, &sdone) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+	return (ret);
+}
+
+/*
+ * report_tls() wants a context that has completed a handshake, so
+ * keep one around from a handshake with ourselves. It also gives us
+ * the hash of our server certificate to pin.
+ */
+static int
+report_tls_setup(size_t size)
+{
+	int tsv[2];
+
+	if (tls_client_ctx != NULL)
+		return (0);
+	if (tls_setup() == -1)
+		return (-1);
+	if ((tls_client_ctx = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(tls_client_ctx, tls_cconf) == -1)
+		errx(1, "tls_configure: %s", tls_error(tls_client_ctx));
+	if (tls_pair(tls_client_ctx, &tls_conn_ctx, tsv) == -1)
+		return (-1);
+	if (pinset_add(&pins, tls_peer_cert_hash(tls_client_ctx)) == -1)
+		err(1, "pinset_add");
+
+	if ((devnull = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+	return (0);
+}
+
+static void
+report_tls_run(size_t size, unsigned long iters)
+{
+	int saved;
+
+	/* report_tls writes to stderr, send that somewhere harmless */
+	if ((saved = dup(STDERR_FILENO)) == -1)
+		err(1, "dup failed");
+	dup2(devnull, STDERR_FILENO);
+	while (iters-- > 0)
+		report_tls(tls_client_ctx, "localhost");
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+}
+
+/*
+ * A whole handshake, with the client either verifying the chain, or
+ * checking the certificate against the pin set instead. The difference
+ * between the two is what pinning saves on each new connection.
+ */
+static void
+handshake(struct tls_config *conf, int pinned, unsigned long iters)
+{
+	struct tls *client, *conn;
+	int tsv[2];
+
+	while (iters-- > 0) {
+		if ((client = tls_client()) == NULL)
+			errx(1, "tls_client failed");
+		if (tls_configure(client, conf) == -1)
+			errx(1, "tls_configure: %s", tls_error(client));
+		conn = NULL;
+		if (tls_pair(client, &conn, tsv) == -1)
+			errx(1, "handshake failed");
+		if (pinned && pinset_check(&pins, client) == -1)
+			errx(1, "pin check failed");
+		tls_free(client);
+		tls_free(conn);
+		close(tsv[0]);
+		close(tsv[1]);
+	}
+}
+
+static void
+handshake_verify_run(size_t size, unsigned long iters)
+{
+	handshake(tls_cconf, 0, iters);
+}
+
+static void
+handshake_pinned_run(size_t size, unsigned long iters)
+{
+	handshake(tls_pconf, 1, iters);
+}
+
+/*
+ * Sending "size" byte messages over the connection report_tls_setup()
+ * made, either with a tls_write for each, or through a tlswriter that
+ * puts as many as fit in each record. The other end reads it all
+ * whenever the socket fills up.
+ */
+static struct tlswriter writer;
+
+static void
+drain(void)
+{
+	while (tls_read(tls_conn_ctx, dst, sizeof(dst)) > 0)
+		;
+}
+
+static void
+write_direct_run(size_t size, unsigned long iters)
+{
+	size_t off;
+	ssize_t w;
+
+	while (iters-- > 0) {
+		for (off = 0; off < size; off += w) {
+			w = tls_write(tls_client_ctx, src + off, size - off);
+			if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT) {
+				drain();
+				w = 0;
+			} else if (w == -1)
+				errx(1, "tls_write: %s",
+				    tls_error(tls_client_ctx));
+		}
+	}
+	drain();
+}
+
+static int
+write_coalesced_setup(size_t size)
+{
+	if (report_tls_setup(size) == -1)
+		return (-1);
+	tlsw_init(&writer, tls_client_ctx);
+	return (0);
+}
+
+static void
+coalesced_flush(int all)
+{
+	int ret;
+
+	while ((ret = tlsw_flush(&writer, all)) == TLS_WANT_POLLIN ||
+	    ret == TLS_WANT_POLLOUT)
+		drain();
+	if (ret == -1)
+		errx(1, "tls_write: %s", tls_error(tls_client_ctx));
+}
+
+static void
+write_coalesced_run(size_t size, unsigned long iters)
+{
+	struct iovec iov;
+	size_t n;
+
+	while (iters-- > 0) {
+		iov.iov_base = src;
+		iov.iov_len = size;
+		while (iov.iov_len > 0) {
+			n = tlsw_writev(&writer, &iov, 1);
+			iov.iov_base = (char *)iov.iov_base + n;
+			iov.iov_len -= n;
+			coalesced_flush(0);
+		}
+	}
+	coalesced_flush(1);
+	drain();
+}
+
+/* just the lookup, on the connection report_tls_setup() made */
+static void
+pinset_check_run(size_t size, unsigned long iters)
+{
+	while (iters-- > 0)
+		sink += pinset_check(&pins, tls_client_ctx);
+}
+
+/*
+ * Two fibers taking turns, so each op is a fiber_yield() and the switch
+ * to the other fiber that goes with it. fiber_spawn starts a fiber that
+ * does nothing, with a stack from the pool, and runs it.
+ */
+static unsigned long fiber_turns;
+
+static void
+fiber_turn(void *arg)
+{
+	unsigned long i;
+
+	for (i = 0; i < fiber_turns; i++)
+		fiber_yield();
+}
+
+static void
+fiber_nothing(void *arg)
+{
+}
+
+static int
+fiber_setup(size_t size)
+{
+	static int ready;
+
+	if (!ready && fiber_init(0, 16) == -1)
+		return (-1);
+	ready = 1;
+	return (0);
+}
+
+static void
+fiber_switch_run(size_t size, unsigned long iters)
+{
+	fiber_turns = (iters + 1) / 2;
+	if (fiber_new(fiber_turn, NULL) == NULL ||
+	    fiber_new(fiber_turn, NULL) == NULL)
+		err(1, "fiber_new");
+	fiber_loop();
+}
+
+static void
+fiber_spawn_run(size_t size, unsigned long iters)
+{
+	while (iters-- > 0) {
+		if (fiber_new(fiber_nothing, NULL) == NULL)
+			err(1, "fiber_new");
+		fiber_loop();
+	}
+}
+
+/*
+ * What the echo server with -A, -B and -c gets for every connection,
+ * and gives back when it closes, with each one touched like a new
+ * connection would.
+ */
+static struct bufpool hellopool, writerpool, iopool;
+
+static int
+conn_buffers_setup(size_t size)
+{
+	static int ready;
+
+	if (!ready && (bufpool_init(&hellopool, CLIENTHELLO_MAX, 16) == -1 ||
+	    bufpool_init(&writerpool, sizeof(struct tlswriter), 16) == -1 ||
+	    bufpool_init(&iopool, 2 * TLSB_SIZE, 16) == -1))
+		return (-1);
+	ready = 1;
+	return (0);
+}
+
+static void
+conn_buffers(struct bufpool *hp, struct bufpool *wp, struct bufpool *ip)
+{
+	unsigned char *hello, *io;
+	struct tlswriter *w;
+
+	if ((hello = bufpool_get(hp)) == NULL ||
+	    (w = bufpool_get(wp)) == NULL || (io = bufpool_get(ip)) == NULL)
+		err(1, "malloc");
+	hello[0] = 0x16;
+	w->len = 0;
+	io[0] = io[TLSB_SIZE] = 0;
+	sink += hello[0] + io[0];
+	bufpool_put(ip, io);
+	bufpool_put(wp, w);
+	bufpool_put(hp, hello);
+}
+
+static void
+conn_malloc_run(size_t size, unsigned long iters)
+{
+	struct bufpool hp, wp, ip;
+
+	/* pools that keep nothing are just malloc and free */
+	bufpool_init(&hp, CLIENTHELLO_MAX, 0);
+	bufpool_init(&wp, sizeof(struct tlswriter), 0);
+	bufpool_init(&ip, 2 * TLSB_SIZE, 0);
+	while (iters-- > 0)
+		conn_buffers(&hp, &wp, &ip);
+}
+
+static void
+conn_pooled_run(size_t size, unsigned long iters)
+{
+	while (iters-- > 0)
+		conn_buffers(&hellopool, &writerpool, &iopool);
+}
+
+struct bench {
+	const char	*name;
+	int		 sized;
+	int		(*setup)(size_t);
+	void		(*run)(size_t, unsigned long);
+	int		 skip;
+};
+
+static struct bench benches[] = {
+	{ "client_put",		1, client_put_setup,	client_put_run },
+	{ "client_get",		1, client_get_setup,	client_get_run },
+	{ "client_consume",	1, client_put_setup,	client_consume_run },
+	{ "server_put",		1, server_put_setup,	server_put_run },
+	{ "server_get",		1, server_get_setup,	server_get_run },
+	{ "server_consume",	1, server_put_setup,	server_consume_run },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "scan_avx2",		1, scan_avx2_setup,	scan_avx2_run },
+	{ "scan_sse2",		1, scan_sse2_setup,	scan_sse2_run },
+#endif
+	{ "scan_scalar",	1, scan_scalar_setup,	scan_scalar_run },
+	{ "scan_memchr",	1, scan_memchr_setup,	scan_memchr_run },
+	{ "frame_lines",	1, frame_lines_setup,	frame_lines_run },
+	{ "latency_add",	0, nothing_setup,	latency_add_run },
+	{ "strlcpy",		1, strlcpy_setup,	strlcpy_run },
+	{ "newconn",		0, newconn_setup,	newconn_run },
+	{ "report_tls",		0, report_tls_setup,	report_tls_run },
+	{ "write_direct",	1, report_tls_setup,	write_direct_run },
+	{ "write_coalesced",	1, write_coalesced_setup, write_coalesced_run },
+	{ "handshake_verify",	0, report_tls_setup,	handshake_verify_run },
+	{ "handshake_pinned",	0, report_tls_setup,	handshake_pinned_run },
+	{ "pinset_check",	0, report_tls_setup,	pinset_check_run },
+	{ "fiber_switch",	0, fiber_setup,		fiber_switch_run },
+	{ "fiber_spawn",	0, fiber_setup,		fiber_spawn_run },
+	{ "conn_malloc",	0, conn_buffers_setup,	conn_malloc_run },
+	{ "conn_pooled",	0, conn_buffers_setup,	conn_pooled_run },
+};
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+struct result {
+	double		ns;		/* median ns per op */
+	double		cyc;		/* median cycles per op */
+	double		allocs;		/* allocations per op */
+	double		spread;		/* half the IQR, percent of median */
+};
+
+static int
+dblcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+measure(struct bench *b, size_t size, int trials, struct result *res)
+{
+	double ns[MAXTRIALS], cyc[MAXTRIALS], t0, t;
+	unsigned long iters, allocs, total = 0;
+	uint64_t c0;
+	int i;
+
+	/* warm up, and find an iteration count that runs long enough */
+	for (iters = 1; ; iters *= 2) {
+		t0 = now_ns();
+		b->run(size, iters);
+		if (now_ns() - t0 >= MINTRIAL_NS || iters >= ULONG_MAX / 2)
+			break;
+	}
+
+	allocs = alloc_count;
+	for (i = 0; i < trials; i++) {
+		c0 = cycles();
+		t0 = now_ns();
+		b->run(size, iters);
+		t = now_ns();
+		cyc[i] = (double)(cycles() - c0) / iters;
+		ns[i] = (t - t0) / iters;
+		total += iters;
+	}
+	allocs = alloc_count - allocs;
+
+	qsort(ns, trials, sizeof(double), dblcmp);
+	qsort(cyc, trials, sizeof(double), dblcmp);
+	res->ns = ns[trials / 2];
+	res->cyc = cyc[trials / 2];
+	res->allocs = (double)allocs / total;
+	res->spread = res->ns > 0 ?
+	    (ns[trials * 3 / 4] - ns[trials / 4]) / 2 / res->ns * 100 : 0;
+}
+
+/*
+ * A baseline is just the saved output of an earlier run. Find the
+ * ns/op it recorded for this benchmark and size, or -1 if it has none.
+ */
+static double
+baseline_ns(FILE *fp, const char *name, size_t size)
+{
+	char line[256], bname[64];
+	size_t bsize;
+	double ns;
+
+	if (fp == NULL)
+		return (-1);
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %zu %lf", bname, &bsize, &ns) != 3)
+			continue;
+		if (strcmp(bname, name) == 0 && bsize == size)
+			return (ns);
+	}
+	return (-1);
+}
+
+static int
+selected(struct bench *b, int argc, char **argv)
+{
+	int i;
+
+	if (argc == 0)
+		return (1);
+	for (i = 0; i < argc; i++)
+		if (strcmp(argv[i], b->name) == 0)
+			return (1);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct result res;
+	FILE *base = NULL;
+	double threshold = 5.0, old, delta;
+	char bpc[32], *ep;
+	int ch, trials = 11, regressions = 0;
+	size_t i, j, size;
+	long l;
+
+	while ((ch = getopt(argc, argv, "b:C:lr:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			if ((base = fopen(optarg, "r")) == NULL)
+				err(1, "%s", optarg);
+			break;
+		case 'C':
+			cadir = optarg;
+			break;
+		case 'l':
+			for (i = 0; i < NBENCHES; i++)
+				printf("%s\n", benches[i].name);
+			exit(0);
+		case 'r':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 3 || l > MAXTRIALS)
+				errx(1, "trials must be between 3 and %d",
+				    MAXTRIALS);
+			trials = l;
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			if (threshold <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	memset(src, 'x', sizeof(src));
+
+	printf("# %-16s %7s %12s %11s %9s %7s%s\n", "name", "size", "ns/op",
+	    "bytes/cycle", "allocs/op", "spread", base ? "   vs base" : "");
+	for (i = 0; i < NBENCHES; i++) {
+		struct bench *b = &benches[i];
+
+		if (!selected(b, argc, argv))
+			continue;
+		for (j = 0; j < (b->sized ? NSIZES : 1); j++) {
+			size = b->sized ? sizes[j] : 0;
+			if (b->skip || b->setup(size) == -1) {
+				b->skip = 1;
+				break;
+			}
+			measure(b, size, trials, &res);
+			if (b->sized && res.cyc > 0)
+				snprintf(bpc, sizeof(bpc), "%.3f",
+				    size / res.cyc);
+			else
+				snprintf(bpc, sizeof(bpc), "-");
+			printf("  %-16s %7zu %12.1f %11s %9.2f %6.1f%%",
+			    b->name, size, res.ns, bpc, res.allocs,
+			    res.spread);
+			if ((old = baseline_ns(base, b->name, size)) > 0) {
+				delta = (res.ns - old) / old * 100;
+				printf("  %+7.1f%%", delta);
+				if (delta > threshold) {
+					printf(" REGRESSION");
+					regressions++;
+				}
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	if (base != NULL)
+		fclose(base);
+	return (regressions ? 1 : 0);
+}
@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# Build one of the exercises with link time optimization and profile
+# guided optimization, and see whether it was worth it. "make pgo" in
+# ex0, ex1 or ex2 runs this with the exercise directory, see README.md.
+#
+# The exercise is built four ways, in a scratch directory:
+#
+#	default	what "make" gives you - no optimization at all
+#	O2	-O2
+#	lto	-O2 -flto
+#	pgo	-O2 -flto, using a profile from an instrumented build
+#		trained with loadgen and the exercise's own client
+#
+# then each server is run under loadgen three times, and the best of
+# each number is printed side by side, with how it compares to the
+# default build. The pgo binaries are copied back into the exercise.
+#
+# CC, CFLAGS and LDFLAGS from the environment are used for every build.
+# PORT, HANDSHAKES and MESSAGES change what loadgen does.
+
+set -e
+
+ex=$(cd "${1:-.}" && pwd)
+name=$(basename "$ex")
+top=$(dirname "$ex")
+CC=${CC:-cc}
+MAKE=${MAKE:-make}
+PORT=${PORT:-9876}
+HANDSHAKES=${HANDSHAKES:-200}
+MESSAGES=${MESSAGES:-20000}
+export CC
+
+case $name in
+ex0)
+	bins="client server"
+	server="./server -k $PORT"
+	client="./client -k 2000 127.0.0.1 $PORT"
+	loadgen="../bench/loadgen -T"
+	;;
+ex1)
+	bins="client server"
+	server="./server -k $PORT"
+	client="./client -k 2000 127.0.0.1 $PORT"
+	loadgen="../bench/loadgen"
+	;;
+ex2)
+	bins="echo client"
+	server="./echo -f length -U handoff.sock 127.0.0.1 $PORT"
+	client="./client -f length -n localhost 127.0.0.1 $PORT"
+	loadgen="../bench/loadgen"
+	;;
+*)
+	echo "usage: $0 ex0|ex1|ex2" >&2
+	exit 1
+esac
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/pgo.XXXXXX")
+pid=
+cleanup() {
+	[ -n "$pid" ] && kill $pid 2>/dev/null
+	rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+if $CC --version 2>/dev/null | grep -q clang; then
+	PROFDATA=${PROFDATA:-llvm-profdata}
+	gen="-fprofile-generate=$work/profile"
+	use="-fprofile-use=$work/profile/default.profdata"
+	use="$use -Wno-profile-instr-unprofiled -Wno-profile-instr-missing"
+else
+	gen="-fprofile-generate=$work/profile"
+	# our training doesn't reach everything, don't treat the rest as cold
+	use="-fprofile-use=$work/profile -fprofile-partial-training"
+	use="$use -Wno-missing-profile"
+fi
+
+cp -R "$ex" "$top/common" "$top/bench" "$work/"
+ln -s "$top/CA" "$work/CA"
+(cd "$work/bench" && $MAKE clean >/dev/null && $MAKE loadgen >/dev/null)
+
+# build <variant> <cflags>: build into $work/<variant>
+build() {
+	echo "building $1" >&2
+	(cd "$work/$name" && $MAKE clean >/dev/null &&
+	    CFLAGS="$CFLAGS $2" LDFLAGS="$LDFLAGS $2" $MAKE >/dev/null)
+	mkdir -p "$work/$1"
+	(cd "$work/$name" && cp $bins "$work/$1/")
+}
+
+# Start the server from <variant>, and give it a moment to listen. A
+# child of the last ex0 or ex1 server may not have let go of the port.
+start() {
+	for try in 1 2 3 4 5; do
+		(cd "$work/$1" && exec $server) >/dev/null 2>&1 &
+		pid=$!
+		sleep 1
+		kill -0 $pid 2>/dev/null && return
+	done
+	echo "the $1 server won't start" >&2
+	exit 1
+}
+
+# Stop the server. The ex2 echo server only writes out its profile if
+# it exits, so we hand it off to another one and let it finish.
+stop() {
+	if [ $name = ex2 ] && [ -n "$1" ]; then
+		(cd "$work/$1" && exec $server) >/dev/null 2>&1 &
+		wait $pid || true
+		pid=$!
+		sleep 1
+	fi
+	kill $pid
+	wait $pid 2>/dev/null || true
+	pid=
+}
+
+# train an instrumented build, and build with what it learned
+build train "-O2 -flto $gen"
+start train
+(cd "$work/train" && $loadgen -c $((HANDSHAKES / 4)) -n $((MESSAGES / 4)) \
+    127.0.0.1 $PORT >/dev/null)
+awk 'BEGIN { for (i = 0; i < 4000; i++) printf("%0" 1 + i * 37 % 2000 "d\n", i) }' \
+    > "$work/lines"
+(cd "$work/train" && $client < "$work/lines" >/dev/null 2>&1)
+stop train
+if [ -n "$PROFDATA" ]; then
+	$PROFDATA merge -output="$work/profile/default.profdata" \
+	    "$work"/profile/*.profraw
+fi
+
+build default ""
+build O2 "-O2"
+build lto "-O2 -flto"
+build pgo "-O2 -flto $use"
+
+for v in default O2 lto pgo; do
+	echo "measuring $v" >&2
+	start $v
+	for run in 1 2 3; do
+		(cd "$work/$v" && $loadgen -c $HANDSHAKES -n $MESSAGES \
+		    127.0.0.1 $PORT) >> "$work/results.$v"
+	done
+	stop
+done
+
+# the best of each number, higher is better except for latency
+cd "$work"
+awk '
+{
+	v = FILENAME
+	sub(/^results\./, "", v)
+	k = $1 SUBSEP v
+	if (!(k in val) || ($1 ~ /^p[0-9]/ ? $2 < val[k] : $2 > val[k]))
+		val[k] = $2
+	if (!($1 in seen)) {
+		seen[$1] = 1
+		order[n++] = $1
+	}
+}
+END {
+	split("default O2 lto pgo", vs, " ")
+	printf("%-14s %10s", "", "default")
+	for (i = 2; i <= 4; i++)
+		printf(" %17s", vs[i])
+	printf("\n")
+	for (j = 0; j < n; j++) {
+		m = order[j]
+		b = val[m, "default"]
+		printf("%-14s %10.1f", m, b)
+		for (i = 2; i <= 4; i++) {
+			x = val[m, vs[i]]
+			d = ""
+			if (b > 0)
+				d = sprintf("%+.0f", (x - b) * 100 / b)
+			printf(" %10.1f %5s%%", x, d)
+		}
+		printf("\n")
+	}
+}' results.default results.O2 results.lto results.pgo
+
+cd "$work/pgo" && cp $bins "$ex/"
+echo "pgo built $bins in $ex" >&2
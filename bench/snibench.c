@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * snibench - handshake latency and memory of a server with many
+ * certificates, picked by server name.
+ *
+ * For each number of names we compare two ways of doing it:
+ *
+ * - indexed: what the ex2 echo server does with -S. Read the
+ *   ClientHello ourselves, look the name up in ../common/certmap.c,
+ *   which loads that one certificate the first time it is asked for.
+ * - libtls: add every keypair to one config with
+ *   tls_config_add_keypair_file(3), and let libtls pick.
+ *
+ * Each one runs in its own process, so the maximum resident size it
+ * reports is its own. Clients ask for names picked at random from the
+ * set, and then for the same names again. With few handshakes and many
+ * names, most of the first ("cold") indexed handshakes also pay for
+ * loading a certificate - which is the point, the ones nobody asks for
+ * are never loaded. The second ("warm") time round they are all there.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "certmap.h"
+#include "clienthello.h"
+
+#define SESSION_LIFETIME	(60 * 60)
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-C cadir] [-n handshakes] bulkdir "
+	    "[count ...]\n", __progname);
+	exit(1);
+}
+
+static const char *cadir = "../CA";
+static char **names, **files;
+static size_t nnames;
+
+struct conn {
+	int		 fd;
+	unsigned char	 hello[CLIENTHELLO_MAX];
+	size_t		 hellolen, hellooff;
+};
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static long
+maxrss_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+	return (ru.ru_maxrss);
+}
+
+static int
+dblcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* the names and file names of everything bulkcert issued */
+static void
+load_index(const char *dir)
+{
+	char path[PATH_MAX], *line = NULL, *p, *f[6], *cn;
+	size_t linesize = 0, max = 0;
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/index.txt", dir);
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (getline(&line, &linesize, fp) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		p = line;
+		for (i = 0; i < 6; i++)
+			f[i] = strsep(&p, "\t");
+		if (f[5] == NULL || (cn = strstr(f[5], "/CN=")) == NULL ||
+		    strchr(cn, '*') != NULL)
+			continue;
+		if (nnames == max) {
+			max = max ? max * 2 : 1024;
+			if ((names = reallocarray(names, max,
+			    sizeof(char *))) == NULL ||
+			    (files = reallocarray(files, max,
+			    sizeof(char *))) == NULL)
+				err(1, "reallocarray");
+		}
+		if ((names[nnames] = strdup(cn + 4)) == NULL ||
+		    (files[nnames] = strdup(f[4])) == NULL)
+			err(1, "strdup");
+		nnames++;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * certmap wants a directory with an index, so make one with the first
+ * "count" certificates in it.
+ */
+static void
+make_subset(const char *bulkdir, const char *dir, size_t count)
+{
+	char path[PATH_MAX], target[PATH_MAX], *abs;
+	const char *ext[] = { "crt", "key" };
+	FILE *fp;
+	size_t i;
+	int j;
+
+	if ((abs = realpath(bulkdir, NULL)) == NULL)
+		err(1, "%s", bulkdir);
+	snprintf(path, sizeof(path), "%s/index.txt", dir);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	for (i = 0; i < count; i++) {
+		fprintf(fp, "V\t\t\t0\t%s\t/CN=%s\n", files[i], names[i]);
+		for (j = 0; j < 2; j++) {
+			snprintf(target, sizeof(target), "%s/%s.%s", abs,
+			    files[i], ext[j]);
+			snprintf(path, sizeof(path), "%s/%s.%s", dir,
+			    files[i], ext[j]);
+			if (symlink(target, path) == -1)
+				err(1, "%s", path);
+		}
+	}
+	fclose(fp);
+	free(abs);
+}
+
+static void
+remove_subset(const char *dir, size_t count)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%s.crt", dir, files[i]);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/%s.key", dir, files[i]);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/index.txt", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+static ssize_t
+conn_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct conn *c = arg;
+	ssize_t r;
+
+	if (c->hellooff < c->hellolen) {
+		r = c->hellolen - c->hellooff;
+		if ((size_t)r > len)
+			r = len;
+		memcpy(buf, c->hello + c->hellooff, r);
+		c->hellooff += r;
+		return (r);
+	}
+	if ((r = read(c->fd, buf, len)) == -1 && errno == EAGAIN)
+		return (TLS_WANT_POLLIN);
+	return (r);
+}
+
+static ssize_t
+conn_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct conn *c = arg;
+	ssize_t w;
+
+	if ((w = write(c->fd, buf, len)) == -1 && errno == EAGAIN)
+		return (TLS_WANT_POLLOUT);
+	return (w);
+}
+
+static int
+step(struct tls *ctx, int *done)
+{
+	int ret;
+
+	if (*done)
+		return (0);
+	if ((ret = tls_handshake(ctx)) == 0)
+		*done = 1;
+	else if (ret != TLS_WANT_POLLIN && ret != TLS_WANT_POLLOUT) {
+		warnx("handshake failed: %s", tls_error(ctx));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * One handshake for "name" over a socketpair. With a certmap we pick
+ * the server context from the hello ourselves, otherwise "server" is
+ * libtls' own multi certificate context.
+ */
+static void
+handshake(struct tls_config *ccfg, struct tls *server, struct certmap *map,
+    const char *name)
+{
+	char sni[CLIENTHELLO_MAXNAME + 1];
+	struct tls *client, *conn = NULL, *ctx;
+	struct conn c;
+	int sv[2], cdone = 0, sdone = 0, i, found;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "socketpair");
+	for (i = 0; i < 2; i++)
+		if (fcntl(sv[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	if ((client = tls_client()) == NULL ||
+	    tls_configure(client, ccfg) == -1 ||
+	    tls_connect_socket(client, sv[0], name) == -1)
+		errx(1, "client setup failed");
+
+	if (map != NULL) {
+		c.fd = sv[1];
+		c.hellolen = c.hellooff = 0;
+		do {
+			if (step(client, &cdone) == -1)
+				errx(1, "%s: client failed", name);
+			i = read(sv[1], c.hello + c.hellolen,
+			    sizeof(c.hello) - c.hellolen);
+			if (i > 0)
+				c.hellolen += i;
+			found = clienthello_servername(c.hello, c.hellolen,
+			    sni, sizeof(sni));
+		} while (found == -1);
+		if (found != 1 || (ctx = certmap_lookup(map, sni)) == NULL)
+			errx(1, "%s: no certificate", name);
+		if (tls_accept_cbs(ctx, &conn, conn_read, conn_write,
+		    &c) == -1)
+			errx(1, "tls_accept_cbs: %s", tls_error(ctx));
+	} else if (tls_accept_socket(server, &conn, sv[1]) == -1)
+		errx(1, "tls_accept_socket: %s", tls_error(server));
+
+	while (!cdone || !sdone)
+		if (step(client, &cdone) == -1 || step(conn, &sdone) == -1)
+			errx(1, "%s: handshake failed", name);
+	tls_free(client);
+	tls_free(conn);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void
+run(const char *mode, const char *bulkdir, size_t count, int handshakes)
+{
+	char root[PATH_MAX], cert[PATH_MAX], key[PATH_MAX];
+	char dir[] = "/tmp/snibench.XXXXXXXX";
+	struct tls_config *ccfg, *scfg;
+	struct tls *server = NULL;
+	struct certmap map, *mapp = NULL;
+	double t0, setup, median[2], *ns;
+	long rss0, rss1;
+	size_t i;
+	int h, pass;
+
+	snprintf(root, sizeof(root), "%s/root.pem", cadir);
+	if ((ccfg = tls_config_new()) == NULL ||
+	    tls_config_set_ca_file(ccfg, root) == -1)
+		errx(1, "client config failed");
+	if ((ns = calloc(handshakes, sizeof(double))) == NULL)
+		err(1, "calloc");
+
+	rss0 = maxrss_kb();
+	t0 = now_ns();
+	if (strcmp(mode, "indexed") == 0) {
+		if (mkdtemp(dir) == NULL)
+			err(1, "mkdtemp");
+		make_subset(bulkdir, dir, count);
+		t0 = now_ns();
+		if (certmap_load(&map, dir, SESSION_LIFETIME) == -1)
+			exit(1);
+		mapp = &map;
+	} else {
+		/* the first keypair is the default, the rest go by name */
+		if ((scfg = tls_config_new()) == NULL)
+			errx(1, "tls_config_new failed");
+		for (i = 0; i < count; i++) {
+			snprintf(cert, sizeof(cert), "%s/%s.crt", bulkdir,
+			    files[i]);
+			snprintf(key, sizeof(key), "%s/%s.key", bulkdir,
+			    files[i]);
+			if (tls_config_add_keypair_file(scfg, cert, key) == -1)
+				errx(1, "%s", tls_config_error(scfg));
+		}
+		if ((server = tls_server()) == NULL ||
+		    tls_configure(server, scfg) == -1)
+			errx(1, "server setup failed");
+	}
+	setup = now_ns() - t0;
+	rss1 = maxrss_kb();
+
+	/*
+	 * the same names twice - the first time round the indexed server
+	 * has to load most of them, the second time they are all there.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		srandom(1);
+		for (h = 0; h < handshakes; h++) {
+			const char *name = names[random() % count];
+
+			t0 = now_ns();
+			handshake(ccfg, server, mapp, name);
+			ns[h] = now_ns() - t0;
+		}
+		qsort(ns, handshakes, sizeof(double), dblcmp);
+		median[pass] = ns[handshakes / 2];
+	}
+	printf("  %-8s %6zu %10.1f %10ld %10ld %9.1f %9.1f %9.1f %7lu\n",
+	    mode, count, setup / 1e6, rss1 - rss0, maxrss_kb() - rss0,
+	    median[0] / 1e3, median[1] / 1e3, ns[handshakes * 99 / 100] / 1e3,
+	    mapp ? mapp->loaded : (unsigned long)count);
+	fflush(stdout);
+
+	if (mapp != NULL)
+		remove_subset(dir, count);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *modes[] = { "indexed", "libtls" };
+	size_t counts[16], ncounts = 0, i;
+	int ch, handshakes = 200, m, status;
+	const char *bulkdir;
+	long l;
+	char *ep;
+	pid_t pid;
+
+	while ((ch = getopt(argc, argv, "C:n:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cadir = optarg;
+			break;
+		case 'n':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || l > 1000000)
+				usage();
+			handshakes = l;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+	bulkdir = argv[0];
+	for (i = 1; i < (size_t)argc && ncounts < 16; i++) {
+		l = strtol(argv[i], &ep, 10);
+		if (*argv[i] == '\0' || *ep != '\0' || l < 1)
+			usage();
+		counts[ncounts++] = l;
+	}
+	if (ncounts == 0) {
+		counts[0] = 10;
+		counts[1] = 1000;
+		counts[2] = 10000;
+		ncounts = 3;
+	}
+
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	load_index(bulkdir);
+
+	printf("# %-8s %6s %10s %10s %10s %9s %9s %9s %7s\n", "mode",
+	    "names", "setup ms", "setup KB", "total KB", "cold us", "warm us",
+	    "warm p99", "loaded");
+	fflush(stdout);
+	for (i = 0; i < ncounts; i++) {
+		if (counts[i] > nnames) {
+			warnx("only %zu names in %s, skipping %zu", nnames,
+			    bulkdir, counts[i]);
+			continue;
+		}
+		for (m = 0; m < 2; m++) {
+			if ((pid = fork()) == -1)
+				err(1, "fork");
+			if (pid == 0) {
+				run(modes[m], bulkdir, counts[i], handshakes);
+				exit(0);
+			}
+			if (waitpid(pid, &status, 0) == -1)
+				err(1, "waitpid");
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				warnx("%s with %zu names failed", modes[m],
+				    counts[i]);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Admission control for new TLS connections.
+ *
+ * A full handshake costs the server a private key operation, which is
+ * far more cpu than anything else it does for a connection. A flood of
+ * new clients (or one busy one that never resumes) can use it all up,
+ * and then everyone waits, including the clients we're already talking
+ * to. Rather than let that happen, we decide as each ClientHello comes
+ * in whether to take it on:
+ *
+ * - A full handshake needs a token from a bucket that fills at "rate"
+ *   per second, and holds ADMIT_PERIOD ms worth of them. With no token,
+ *   the connection is shed - reset straight away, which costs us next
+ *   to nothing, and tells the client to go elsewhere or try later.
+ * - A client offering to resume a session gets a token from a second
+ *   bucket, ADMIT_RESUME times the size. Its handshake is cheap, and it
+ *   is most likely someone we were already serving. But anyone can put
+ *   a made up ticket in a hello, so once the handshake is done,
+ *   admit_handshake() charges a full handshake token for one that
+ *   didn't resume after all - taking the first bucket into debt if it
+ *   has to, up to a second's worth. Until the debt is paid off, full
+ *   handshakes and offers to resume are both shed, so making up
+ *   tickets gets no more full handshakes than asking for them.
+ *
+ * The rate starts at the ceiling we are given, and every ADMIT_PERIOD
+ * ms we look at the longest time the event loop took to get through
+ * what one poll handed it (which is how long anything that became
+ * ready during that pass waited for us), and how much cpu we used. If
+ * either is more than we'd like, we aren't keeping up, so we cut the
+ * rate by 30%; otherwise it grows back by 5% of the ceiling at a time.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "admit.h"
+
+static long long
+us_since(const struct timespec *then, const struct timespec *now)
+{
+	return ((now->tv_sec - then->tv_sec) * 1000000LL +
+	    (now->tv_nsec - then->tv_nsec) / 1000);
+}
+
+/* cpu seconds this process has used */
+static double
+cputime(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return (0);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+}
+
+static double
+burst(const struct admit *a)
+{
+	double b = a->rate * ADMIT_PERIOD / 1000;
+
+	return (b < 1 ? 1 : b);
+}
+
+/* Top up both buckets for the time since we last did. */
+static void
+refill(struct admit *a, const struct timespec *now)
+{
+	double elapsed = us_since(&a->refilled, now) / 1e6;
+
+	a->tokens += a->rate * elapsed;
+	if (a->tokens > burst(a))
+		a->tokens = burst(a);
+	a->rtokens += a->rate * ADMIT_RESUME * elapsed;
+	if (a->rtokens > burst(a) * ADMIT_RESUME)
+		a->rtokens = burst(a) * ADMIT_RESUME;
+	a->refilled = *now;
+}
+
+/* Allow at most "rate" full handshakes a second. */
+void
+admit_init(struct admit *a, double rate)
+{
+	a->ceiling = a->rate = rate;
+	a->tokens = burst(a);
+	a->rtokens = burst(a) * ADMIT_RESUME;
+	clock_gettime(CLOCK_MONOTONIC, &a->refilled);
+	a->period = a->reported = a->refilled;
+	a->cpu = cputime();
+	a->worst = 0;
+	a->full = a->resumed = a->shed = 0;
+}
+
+/* Once a period, see whether we are keeping up, and adjust the rate. */
+static void
+adjust(struct admit *a, const struct timespec *now)
+{
+	long long elapsed;
+	double cpu, busy;
+
+	elapsed = us_since(&a->period, now);
+	if (elapsed < ADMIT_PERIOD * 1000)
+		return;
+	cpu = cputime();
+	busy = (cpu - a->cpu) * 1e8 / elapsed;	/* percent */
+	if (a->worst > ADMIT_TARGET || busy > ADMIT_CPU) {
+		a->rate *= 0.7;
+		if (a->rate < ADMIT_MIN)
+			a->rate = ADMIT_MIN;
+	} else if (a->rate < a->ceiling) {
+		a->rate += a->ceiling / 20;
+		if (a->rate > a->ceiling)
+			a->rate = a->ceiling;
+	}
+	if (a->tokens > burst(a))
+		a->tokens = burst(a);
+	if (a->rtokens > burst(a) * ADMIT_RESUME)
+		a->rtokens = burst(a) * ADMIT_RESUME;
+
+	/* say what we're doing, once a second while we're shedding */
+	if (us_since(&a->reported, now) >= 1000000) {
+		if (a->shed > 0)
+			fprintf(stderr, "admission: %lu full, %lu resumed, "
+			    "%lu shed in %lld ms, now allowing %.0f/s "
+			    "(loop took %lld us, cpu %.0f%%)\n", a->full,
+			    a->resumed, a->shed,
+			    us_since(&a->reported, now) / 1000, a->rate,
+			    a->worst, busy);
+		a->full = a->resumed = a->shed = 0;
+		a->reported = *now;
+	}
+	a->period = *now;
+	a->cpu = cpu;
+	a->worst = 0;
+}
+
+/*
+ * A hello has arrived. Returns 1 if we should do the handshake, or 0
+ * if the connection should be shed. "resumed" says whether the client
+ * wants to resume a session.
+ */
+int
+admit_hello(struct admit *a, int resumed)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill(a, &now);
+	adjust(a, &now);
+
+	/*
+	 * only clients that said they'd resume and didn't put the full
+	 * handshake bucket in debt, so until it's paid off, stop
+	 * believing anyone who says so.
+	 */
+	if (resumed) {
+		if (a->rtokens >= 1 && a->tokens >= 0) {
+			a->rtokens--;
+			a->resumed++;
+			return (1);
+		}
+		a->shed++;
+		return (0);
+	}
+	if (a->tokens >= 1) {
+		a->tokens--;
+		a->full++;
+		return (1);
+	}
+	a->shed++;
+	return (0);
+}
+
+/*
+ * A handshake let in by admit_hello() has finished, or the client hung
+ * up before it did. If the client said it would resume and didn't, it
+ * cost a full handshake, so it pays for one now.
+ */
+void
+admit_handshake(struct admit *a, int offered, int resumed)
+{
+	struct timespec now;
+
+	if (!offered || resumed)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	refill(a, &now);
+	a->tokens--;
+	if (a->tokens < -burst(a) * ADMIT_RESUME)
+		a->tokens = -burst(a) * ADMIT_RESUME;
+	/* it was counted as resumed, unless we've reported since */
+	if (a->resumed > 0)
+		a->resumed--;
+	a->full++;
+}
+
+/*
+ * The event loop has finished a pass that started when poll returned
+ * at "start".
+ */
+void
+admit_loop(struct admit *a, const struct timespec *start)
+{
+	struct timespec now;
+	long long took;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	took = us_since(start, &now);
+	if (took > a->worst)
+		a->worst = took;
+}
+
+/* Count a connection we turned away before it sent a hello. */
+void
+admit_reject(struct admit *a)
+{
+	a->shed++;
+}
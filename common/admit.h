@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Admission control for new TLS connections: a token bucket on full
+ * handshakes, that shrinks when they start to queue up.
+ */
+
+#include <time.h>
+
+#define ADMIT_PERIOD	100	/* ms between looks at how we're doing */
+#define ADMIT_TARGET	10000	/* us a pass of the event loop may take */
+#define ADMIT_CPU	90	/* percent of a cpu before we back off */
+#define ADMIT_MIN	10	/* full handshakes/s we always allow */
+#define ADMIT_RESUME	10	/* resumptions allowed per full handshake */
+
+struct admit {
+	double		 ceiling;	/* full handshakes/s we're asked for */
+	double		 rate;		/* what we allow right now */
+	double		 tokens;
+	double		 rtokens;	/* for clients offering to resume */
+	struct timespec	 refilled;	/* when tokens were last added */
+	struct timespec	 period;	/* when this period started */
+	double		 cpu;		/* cpu seconds used when it started */
+	long long	 worst;		/* longest pass this period, us */
+	unsigned long	 full, resumed, shed;	/* since we last said */
+	struct timespec	 reported;
+};
+
+void	 admit_init(struct admit *, double);
+int	 admit_hello(struct admit *, int);
+void	 admit_handshake(struct admit *, int, int);
+void	 admit_reject(struct admit *);
+void	 admit_loop(struct admit *, const struct timespec *);
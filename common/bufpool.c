@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pools of per connection buffers.
+ *
+ * A server taking millions of short connections a day mallocs and
+ * frees the same few buffers for every one of them, and the 128k ones
+ * are big enough that malloc may give each its own mmap(2). Handing
+ * them back to a pool instead, and taking them from there next time,
+ * skips all that, and keeps the same memory in use rather than
+ * fragmenting the heap.
+ *
+ * Nothing is allocated up front: buffers go into the pool as
+ * connections close, so it only ever holds as many as we once needed
+ * at the same time, and never more than "max". With a max of 0 it's
+ * plain malloc and free, with the counting.
+ *
+ * The struct tls for each connection can't be kept like this. libtls
+ * makes a new one in every tls_accept_*(), and has no way to accept
+ * into one we already have.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+/* A pool of "size" byte buffers, keeping up to "max" of them. */
+int
+bufpool_init(struct bufpool *p, size_t size, size_t max)
+{
+	memset(p, 0, sizeof(*p));
+	p->size = size;
+	p->max = max;
+	if (max > 0 && (p->free = calloc(max, sizeof(*p->free))) == NULL)
+		return (-1);
+	return (0);
+}
+
+/* A buffer, from the pool if there's one there. NULL if malloc fails. */
+void *
+bufpool_get(struct bufpool *p)
+{
+	p->gets++;
+	if (p->nfree > 0) {
+		p->reused++;
+		return (p->free[--p->nfree]);
+	}
+	return (malloc(p->size));
+}
+
+/* Give back a buffer from bufpool_get(). */
+void
+bufpool_put(struct bufpool *p, void *buf)
+{
+	if (buf == NULL)
+		return;
+	if (p->nfree < p->max) {
+		p->free[p->nfree++] = buf;
+		return;
+	}
+	p->freed++;
+	free(buf);
+}
+
+/* How much malloc and free the pool has saved, if it's been used. */
+void
+bufpool_report(const struct bufpool *p, const char *name)
+{
+	if (p->gets == 0)
+		return;
+	fprintf(stderr, "%s: %llu malloc and %llu free instead of %llu each, "
+	    "%zu kept (%zuk)\n", name,
+	    (unsigned long long)(p->gets - p->reused),
+	    (unsigned long long)p->freed, (unsigned long long)p->gets,
+	    p->nfree, p->nfree * p->size / 1024);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A free list of same sized buffers, for what a server allocates for
+ * every connection and frees when it closes.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+struct bufpool {
+	size_t		  size;		/* of every buffer */
+	size_t		  max;		/* the most we keep */
+	size_t		  nfree;
+	void		**free;
+	uint64_t	  gets;		/* buffers handed out */
+	uint64_t	  reused;	/* of those, from the pool */
+	uint64_t	  freed;	/* given back with the pool full */
+};
+
+int	 bufpool_init(struct bufpool *, size_t, size_t);
+void	*bufpool_get(struct bufpool *);
+void	 bufpool_put(struct bufpool *, void *);
+void	 bufpool_report(const struct bufpool *, const char *);
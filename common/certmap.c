@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Certificate selection by server name.
+ *
+ * libtls can serve more than one certificate - add each keypair with
+ * tls_config_add_keypair_file(3) and it picks one by the name the
+ * client asks for. But it loads them all when the context is
+ * configured, makes an SSL_CTX for each, and finds the right one by
+ * trying them in turn. That's fine for a few names, and not for ten
+ * thousand.
+ *
+ * Instead we keep a table of names from the index.txt that
+ * ../CA/bulkcert writes next to the certificates it issues, and make a
+ * server context with just the one keypair for a name the first time
+ * a client asks for it. The table is open addressed, hashed on the
+ * name. A name that isn't there is tried again with its first label
+ * replaced by "*", so "*.example.com" covers "www.example.com" (but
+ * not "example.com" or "a.b.example.com", as RFC 6125 would have it).
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+
+#include "certmap.h"
+#include "handoff.h"
+
+#define CERTMAP_MINSIZE	64
+
+/* FNV-1a */
+static uint64_t
+name_hash(const char *name)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *name != '\0'; name++) {
+		h ^= (unsigned char)*name;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/* Returns the slot holding "name", or the empty one it would go in */
+static struct certentry *
+certmap_find(struct certmap *map, const char *name)
+{
+	struct certentry *e;
+	size_t i;
+
+	for (i = name_hash(name) & (map->size - 1); ;
+	    i = (i + 1) & (map->size - 1)) {
+		e = &map->entries[i];
+		if (e->name == NULL || strcmp(e->name, name) == 0)
+			return (e);
+	}
+}
+
+/* Keep the table at most half full, so a miss is found quickly. */
+static void
+certmap_grow(struct certmap *map)
+{
+	struct certentry *old = map->entries;
+	size_t i, oldsize = map->size;
+
+	map->size = oldsize == 0 ? CERTMAP_MINSIZE : oldsize * 2;
+	if ((map->entries = calloc(map->size, sizeof(*map->entries))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < oldsize; i++)
+		if (old[i].name != NULL)
+			*certmap_find(map, old[i].name) = old[i];
+	free(old);
+}
+
+static void
+lowercase(char *s)
+{
+	for (; *s != '\0'; s++)
+		*s = tolower((unsigned char)*s);
+}
+
+/*
+ * Read the index from "dir". Each line is tab separated, as openssl
+ * keeps its index: status, expiry, revocation, serial, file name and
+ * subject. We want the valid ones, with the CN from the subject.
+ */
+int
+certmap_load(struct certmap *map, const char *dir, int lifetime)
+{
+	char path[PATH_MAX], *line = NULL, *field[6], *p, *cn;
+	struct certentry *e;
+	size_t linesize = 0;
+	int i, lineno = 0;
+	FILE *fp;
+
+	memset(map, 0, sizeof(*map));
+	map->lifetime = lifetime;
+	if ((map->dir = strdup(dir)) == NULL)
+		err(1, "strdup");
+	snprintf(path, sizeof(path), "%s/index.txt", dir);
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return (-1);
+	}
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		p = line;
+		for (i = 0; i < 6; i++)
+			field[i] = strsep(&p, "\t");
+		if (field[5] == NULL) {
+			warnx("%s:%d: bad index line", path, lineno);
+			continue;
+		}
+		if (strcmp(field[0], "V") != 0)
+			continue;
+		if ((cn = strstr(field[5], "/CN=")) == NULL)
+			continue;
+		cn += 4;
+		cn[strcspn(cn, "/")] = '\0';
+		lowercase(cn);
+
+		if ((map->count + 1) * 2 > map->size)
+			certmap_grow(map);
+		e = certmap_find(map, cn);
+		if (e->name != NULL)
+			continue;	/* first one wins */
+		if ((e->name = strdup(cn)) == NULL ||
+		    (e->file = strdup(field[4])) == NULL)
+			err(1, "strdup");
+		map->count++;
+	}
+	free(line);
+	fclose(fp);
+	if (map->count == 0) {
+		warnx("%s: no certificates", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Make a server context for "e" from its keypair */
+static struct tls *
+certmap_context(struct certmap *map, struct certentry *e)
+{
+	char cert[PATH_MAX], key[PATH_MAX];
+	struct tls_config *cfg;
+	uint8_t *certmem = NULL, *keymem = NULL;
+	size_t certlen, keylen;
+	struct tls *ctx = NULL;
+
+	snprintf(cert, sizeof(cert), "%s/%s.crt", map->dir, e->file);
+	snprintf(key, sizeof(key), "%s/%s.key", map->dir, e->file);
+	if ((cfg = tls_config_new()) == NULL) {
+		warnx("tls_config_new failed");
+		return (NULL);
+	}
+	if ((certmem = tls_load_file(cert, &certlen, NULL)) == NULL ||
+	    (keymem = tls_load_file(key, &keylen, NULL)) == NULL) {
+		warn("%s: unable to load keypair", e->name);
+		goto done;
+	}
+	if (tls_config_set_keypair_mem(cfg, certmem, certlen, keymem,
+	    keylen) == -1 ||
+	    tls_config_set_session_lifetime(cfg, map->lifetime) == -1 ||
+	    (map->keys != NULL &&
+	    handoff_configure(cfg, map->keys, e->name) == -1)) {
+		warnx("%s: %s", e->name, tls_config_error(cfg));
+		goto done;
+	}
+	if ((ctx = tls_server()) == NULL) {
+		warnx("tls_server failed");
+		goto done;
+	}
+	if (tls_configure(ctx, cfg) == -1) {
+		warnx("%s: %s", e->name, tls_error(ctx));
+		tls_free(ctx);
+		ctx = NULL;
+		goto done;
+	}
+	map->loaded++;
+ done:
+	if (keymem != NULL)
+		tls_unload_file(keymem, keylen);
+	if (certmem != NULL)
+		tls_unload_file(certmem, certlen);
+	tls_config_free(cfg);
+	return (ctx);
+}
+
+/*
+ * The server context for "servername", loading it if this is the first
+ * time anyone has asked. NULL if we have nothing for that name, in
+ * which case the caller should use its default certificate.
+ */
+struct tls *
+certmap_lookup(struct certmap *map, const char *servername)
+{
+	char name[256], *dot;
+	struct certentry *e;
+	size_t len;
+
+	len = strlcpy(name, servername, sizeof(name));
+	if (len >= sizeof(name) || len == 0)
+		return (NULL);
+	if (name[len - 1] == '.')
+		name[len - 1] = '\0';
+	lowercase(name);
+
+	e = certmap_find(map, name);
+	if (e->name == NULL && (dot = strchr(name, '.')) != NULL &&
+	    dot > name) {
+		*--dot = '*';
+		e = certmap_find(map, dot);
+	}
+	if (e->name == NULL)
+		return (NULL);
+	if (e->ctx == NULL)
+		e->ctx = certmap_context(map, e);
+	return (e->ctx);
+}
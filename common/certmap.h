@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Certificates for many host names, found by name through a hash index
+ * and loaded the first time a client asks for them.
+ */
+
+struct handoff_keys;
+struct tls;
+
+struct certentry {
+	char		*name;		/* lower case, maybe "*.example.com" */
+	char		*file;		/* .crt and .key in the directory */
+	struct tls	*ctx;		/* server context, once loaded */
+};
+
+struct certmap {
+	char			*dir;
+	struct certentry	*entries;	/* open addressed, by name */
+	size_t			 size;		/* a power of two */
+	size_t			 count;
+	int			 lifetime;	/* session lifetime */
+	const struct handoff_keys *keys;	/* ticket keys, if ours */
+	unsigned long		 loaded;	/* contexts we have made */
+};
+
+int		 certmap_load(struct certmap *, const char *, int);
+struct tls	*certmap_lookup(struct certmap *, const char *);
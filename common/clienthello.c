@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pull the server name out of a TLS ClientHello, and see whether the
+ * client wants to resume a session.
+ *
+ * libtls only tells us which name the client asked for once the
+ * handshake is done, and by then we have had to pick a certificate.
+ * A server with many certificates instead reads the first record from
+ * the client itself, looks at the server_name extension, picks the
+ * context with the right certificate, and then lets libtls have the
+ * connection - including the bytes we already read.
+ *
+ * We only look at the first record. A ClientHello that doesn't fit in
+ * one is legal, but nobody sends one, and we just treat it as having
+ * no server name.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "clienthello.h"
+
+#define REC_HANDSHAKE		22
+#define HS_CLIENTHELLO		1
+#define EXT_SERVER_NAME		0
+#define EXT_SESSION_TICKET	35
+#define EXT_PRE_SHARED_KEY	41
+#define NAMETYPE_HOSTNAME	0
+
+struct cursor {
+	const unsigned char	*p;
+	size_t			 left;
+};
+
+static int
+get8(struct cursor *c, size_t *v)
+{
+	if (c->left < 1)
+		return (-1);
+	*v = c->p[0];
+	c->p++;
+	c->left--;
+	return (0);
+}
+
+static int
+get16(struct cursor *c, size_t *v)
+{
+	if (c->left < 2)
+		return (-1);
+	*v = (c->p[0] << 8) | c->p[1];
+	c->p += 2;
+	c->left -= 2;
+	return (0);
+}
+
+static int
+get24(struct cursor *c, size_t *v)
+{
+	if (c->left < 3)
+		return (-1);
+	*v = (c->p[0] << 16) | (c->p[1] << 8) | c->p[2];
+	c->p += 3;
+	c->left -= 3;
+	return (0);
+}
+
+static int
+skip(struct cursor *c, size_t n)
+{
+	if (c->left < n)
+		return (-1);
+	c->p += n;
+	c->left -= n;
+	return (0);
+}
+
+/* Split "n" bytes off the front of "c" into "sub" */
+static int
+sub(struct cursor *c, size_t n, struct cursor *sub)
+{
+	sub->p = c->p;
+	sub->left = n;
+	return (skip(c, n));
+}
+
+/*
+ * Find the extensions in the "len" bytes we have read from the client.
+ * Returns 1 with them in "exts", 0 if this isn't a hello we understand
+ * (libtls can tell the client what it thinks of it), or -1 if we need
+ * more bytes to tell.
+ */
+static int
+extensions(const unsigned char *buf, size_t len, struct cursor *exts)
+{
+	struct cursor c, rec;
+	size_t type, n, reclen;
+
+	c.p = buf;
+	c.left = len;
+	if (get8(&c, &type) == -1 || skip(&c, 2) == -1 ||
+	    get16(&c, &reclen) == -1)
+		return (-1);
+	if (type != REC_HANDSHAKE)
+		return (0);
+	if (c.left < reclen)
+		return (reclen + 5 > CLIENTHELLO_MAX ? 0 : -1);
+	sub(&c, reclen, &rec);
+
+	/* handshake header, version, random and session id */
+	if (get8(&rec, &type) == -1 || type != HS_CLIENTHELLO ||
+	    get24(&rec, &n) == -1 || n > rec.left ||
+	    skip(&rec, 2 + 32) == -1 ||
+	    get8(&rec, &n) == -1 || skip(&rec, n) == -1)
+		return (0);
+	/* cipher suites, compression methods */
+	if (get16(&rec, &n) == -1 || skip(&rec, n) == -1 ||
+	    get8(&rec, &n) == -1 || skip(&rec, n) == -1)
+		return (0);
+	if (get16(&rec, &n) == -1 || sub(&rec, n, exts) == -1)
+		return (0);
+	return (1);
+}
+
+/*
+ * Look in the "len" bytes we have read from the client for the host
+ * name it wants. Returns 1 with the name in "name", 0 if the hello has
+ * no host name (or isn't a hello we understand), or -1 if we need more
+ * bytes to tell.
+ */
+int
+clienthello_servername(const unsigned char *buf, size_t len, char *name,
+    size_t namelen)
+{
+	struct cursor exts, ext, list;
+	size_t type, n, extlen;
+	int r;
+
+	if ((r = extensions(buf, len, &exts)) != 1)
+		return (r);
+	while (exts.left > 0) {
+		if (get16(&exts, &type) == -1 || get16(&exts, &extlen) == -1 ||
+		    sub(&exts, extlen, &ext) == -1)
+			return (0);
+		if (type != EXT_SERVER_NAME)
+			continue;
+		if (get16(&ext, &n) == -1 || sub(&ext, n, &list) == -1)
+			return (0);
+		while (list.left > 0) {
+			if (get8(&list, &type) == -1 || get16(&list, &n) == -1)
+				return (0);
+			if (type != NAMETYPE_HOSTNAME) {
+				if (skip(&list, n) == -1)
+					return (0);
+				continue;
+			}
+			if (n == 0 || n >= namelen || n > list.left ||
+			    memchr(list.p, '\0', n) != NULL)
+				return (0);
+			memcpy(name, list.p, n);
+			name[n] = '\0';
+			return (1);
+		}
+		return (0);
+	}
+	return (0);
+}
+
+/*
+ * Does the client want to resume a session, so the handshake will be
+ * a cheap one? Returns 1 if it offers a ticket (TLS 1.2) or a pre
+ * shared key (TLS 1.3), 0 if not, or -1 if we need more bytes to tell.
+ * TLS 1.2 resumption by session id doesn't count - TLS 1.3 clients
+ * send a made up session id anyway, so we can't tell it apart.
+ */
+int
+clienthello_resuming(const unsigned char *buf, size_t len)
+{
+	struct cursor exts, ext;
+	size_t type, extlen;
+	int r;
+
+	if ((r = extensions(buf, len, &exts)) != 1)
+		return (r);
+	while (exts.left > 0) {
+		if (get16(&exts, &type) == -1 || get16(&exts, &extlen) == -1 ||
+		    sub(&exts, extlen, &ext) == -1)
+			return (0);
+		if (type == EXT_PRE_SHARED_KEY ||
+		    (type == EXT_SESSION_TICKET && extlen > 0))
+			return (1);
+	}
+	return (0);
+}
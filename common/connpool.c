@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Client side pool of TLS connections.
+ *
+ * connpool_get() hands out an idle established connection if there is
+ * one, and only connects and handshakes when there isn't. When the
+ * caller is done with it, connpool_put() puts it back for the next
+ * request, or closes it if the caller saw it go bad or the pool is
+ * already full.
+ *
+ * A pooled connection may have been closed by the server while it sat
+ * idle, and we won't know until we use it - so a request that fails on
+ * a reused connection is worth trying once more on a fresh one.
+ *
+ * With an OCSP policy, a new connection's certificate is checked with
+ * its CA's responder (../common/ocspcheck.c) while the first request
+ * goes out, and connpool_read() waits for the verdict before it hands
+ * over anything the server said.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "connpool.h"
+#include "ocspcheck.h"
+#include "pinset.h"
+#include "sesscache.h"
+#include "sockopt.h"
+
+void
+connpool_init(struct connpool *pool, struct tls_config *config,
+    const struct sockaddr *sa, socklen_t salen, const char *servername,
+    const struct sockopt *so)
+{
+	pool->config = config;
+	pool->sa = sa;
+	pool->salen = salen;
+	pool->servername = servername;
+	pool->so = so;
+	pool->pins = NULL;
+	pool->ocsp = -1;
+	pool->ocspdir = NULL;
+	pool->nidle = 0;
+	pool->opened = pool->reused = 0;
+}
+
+static void
+pconn_free(struct pconn *pc)
+{
+	int i;
+
+	do {
+		i = tls_close(pc->tls);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	tls_free(pc->tls);
+	close(pc->fd);
+	if (pc->ocsp != NULL)
+		ocspcheck_free(pc->ocsp);
+	free(pc->ocsp);
+	free(pc);
+}
+
+/* Make a new connection, and do the handshake. NULL if we can't. */
+static struct pconn *
+pconn_new(struct connpool *pool)
+{
+	struct pconn *pc;
+	ssize_t sent;
+	int i;
+
+	if ((pc = calloc(1, sizeof(*pc))) == NULL) {
+		warn("calloc");
+		return (NULL);
+	}
+	if ((pc->fd = socket(pool->sa->sa_family, SOCK_STREAM, 0)) == -1) {
+		warn("socket failed");
+		free(pc);
+		return (NULL);
+	}
+	if (sockopt_connect(pc->fd, pool->sa, pool->salen, pool->so, NULL, 0,
+	    &sent) == -1) {
+		warn("connect failed");
+		goto bad;
+	}
+	if ((pc->tls = tls_client()) == NULL) {
+		warnx("tls_client failed");
+		goto bad;
+	}
+	if (tls_configure(pc->tls, pool->config) == -1 ||
+	    tls_connect_socket(pc->tls, pc->fd, pool->servername) == -1) {
+		warnx("tls setup failed: %s", tls_error(pc->tls));
+		goto bad;
+	}
+	do {
+		i = tls_handshake(pc->tls);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (i == -1) {
+		warnx("TLS handshake failed: %s", tls_error(pc->tls));
+		goto bad;
+	}
+	if (pool->pins != NULL && pinset_check(pool->pins, pc->tls) == -1)
+		goto bad;
+	sesscache_report(pc->tls);
+	if (pool->ocsp != -1) {
+		if ((pc->ocsp = malloc(sizeof(*pc->ocsp))) == NULL) {
+			warn("malloc");
+			goto bad;
+		}
+		ocspcheck_start(pc->ocsp, pc->tls, pool->ocsp, pool->ocspdir);
+	}
+	pool->opened++;
+	return (pc);
+ bad:
+	tls_free(pc->tls);
+	close(pc->fd);
+	free(pc);
+	return (NULL);
+}
+
+struct pconn *
+connpool_get(struct connpool *pool)
+{
+	if (pool->nidle > 0) {
+		pool->reused++;
+		return (pool->idle[--pool->nidle]);
+	}
+	return (pconn_new(pool));
+}
+
+/*
+ * Give "pc" back to the pool. "reusable" should be 0 if anything went
+ * wrong on it, in which case we don't trust it with another request.
+ */
+void
+connpool_put(struct connpool *pool, struct pconn *pc, int reusable)
+{
+	if (reusable && pool->nidle < CONNPOOL_MAX)
+		pool->idle[pool->nidle++] = pc;
+	else
+		pconn_free(pc);
+}
+
+void
+connpool_finish(struct connpool *pool)
+{
+	while (pool->nidle > 0)
+		pconn_free(pool->idle[--pool->nidle]);
+}
+
+/*
+ * Wait for the revocation check on "pc", if it's still going. Returns
+ * -1 if the server's certificate didn't pass.
+ */
+int
+connpool_check(struct pconn *pc)
+{
+	int ret;
+
+	if (pc->ocsp == NULL)
+		return (0);
+	ret = ocspcheck_wait(pc->ocsp);
+	ocspcheck_free(pc->ocsp);
+	free(pc->ocsp);
+	pc->ocsp = NULL;
+	return (ret);
+}
+
+/* message_io functions for a pooled connection, see message.h */
+ssize_t
+connpool_read(void *arg, void *buf, size_t len)
+{
+	struct pconn *pc = arg;
+	ssize_t r;
+
+	/* the request is on its way, so now get the responder's answer going */
+	if (pc->ocsp != NULL)
+		ocspcheck_io(pc->ocsp);
+	do {
+		r = tls_read(pc->tls, buf, len);
+	} while (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT);
+	if (r > 0 && connpool_check(pc) == -1)
+		return (-1);
+	return (r);
+}
+
+ssize_t
+connpool_write(void *arg, void *buf, size_t len)
+{
+	struct pconn *pc = arg;
+	ssize_t w;
+
+	do {
+		w = tls_write(pc->tls, buf, len);
+	} while (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT);
+	return (w);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A small pool of established TLS client connections to one server,
+ * so a client making many requests only pays for the handshake once.
+ */
+
+#define CONNPOOL_MAX	8
+
+struct ocspcheck;
+struct pinset;
+struct sockaddr;
+struct sockopt;
+struct tls;
+struct tls_config;
+
+struct pconn {
+	int		 fd;
+	struct tls	*tls;
+	unsigned long	 requests;	/* requests made on this connection */
+	struct ocspcheck *ocsp;		/* revocation check, until it's done */
+};
+
+struct connpool {
+	struct tls_config	*config;
+	const struct sockaddr	*sa;
+	socklen_t		 salen;
+	const char		*servername;
+	const struct sockopt	*so;
+	const struct pinset	*pins;		/* if set, pin the server cert */
+	int			 ocsp;		/* OCSP policy, -1 for none */
+	const char		*ocspdir;	/* where OCSP answers are kept */
+	struct pconn		*idle[CONNPOOL_MAX];
+	int			 nidle;
+	unsigned long		 opened;	/* connections we made */
+	unsigned long		 reused;	/* times one came from the pool */
+};
+
+void		 connpool_init(struct connpool *, struct tls_config *,
+		    const struct sockaddr *, socklen_t, const char *,
+		    const struct sockopt *);
+struct pconn	*connpool_get(struct connpool *);
+void		 connpool_put(struct connpool *, struct pconn *, int);
+void		 connpool_finish(struct connpool *);
+int		 connpool_check(struct pconn *);
+ssize_t		 connpool_read(void *, void *, size_t);
+ssize_t		 connpool_write(void *, void *, size_t);
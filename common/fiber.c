@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fibers for the servers - each one has its own stack, and runs until
+ * it has to wait for a socket, at which point the next one that can
+ * run gets the cpu. fiber_loop() is the poll loop underneath: when no
+ * fiber can run it polls for the sockets the waiting ones want, and
+ * runs them again as their sockets become ready. That lets a server
+ * handle each connection with plain sequential code, a tls_read then
+ * a tls_write, instead of a state machine driven by poll.
+ *
+ * Switching fibers is a function call that saves the registers the
+ * ABI says we must keep, and swaps the stack pointer, so it costs a
+ * few ns on amd64 and arm64. Anywhere else we fall back to
+ * swapcontext(3), which is much slower, as it saves the signal mask
+ * with a system call.
+ *
+ * Stacks come from mmap with a guard page below each one, so a fiber
+ * that overflows its stack dies on the spot rather than scribbling on
+ * its neighbour. A fiber's stack goes back in a pool when it's done,
+ * ready for the next one, so starting a fiber costs no system calls
+ * once the pool has warmed up. Most of a stack is never touched, so
+ * costs nothing but address space - but each guard page is a separate
+ * mapping, and Linux only allows vm.max_map_count (65530) mappings by
+ * default, which is about 30000 fibers. Raise it for more.
+ *
+ * Everything here is single threaded, like the rest of the servers.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#define FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK	0
+#endif
+
+struct fiber {
+	void		*sp;		/* saved stack pointer */
+#ifdef FIBER_UCONTEXT
+	ucontext_t	 uc;
+#endif
+	void		(*fn)(void *);
+	void		*arg;
+	unsigned char	*map;		/* the guard page, then the stack */
+	struct fiber	*next;		/* on a run queue, or the pool */
+	int64_t		 deadline;	/* ms, when waiting with a timeout */
+	int		 revents;	/* what woke us from fiber_wait */
+};
+
+struct fiberq {
+	struct fiber	*head, *tail;
+};
+
+static struct fiber	 sched;		/* fiber_loop(), on the real stack */
+static struct fiber	*current = &sched;
+static struct fiber	*dead;		/* finished, and waiting to be pooled */
+static struct fiber	*pool;
+static struct fiberq	 runq;		/* ready to run in the next round */
+static struct fiberq	 batch;		/* ready to run in this round */
+static struct pollfd	*pfds;		/* what the waiting fibers want */
+static struct fiber	**waiters;
+static int		 nwait, ntimed;
+static int		 nfibers, nstacks, maxfibers;
+static size_t		 stacksize, pagesize;
+
+static void
+fiberq_push(struct fiberq *q, struct fiber *f)
+{
+	f->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = f;
+	else
+		q->head = f;
+	q->tail = f;
+}
+
+static struct fiber *
+fiberq_pop(struct fiberq *q)
+{
+	struct fiber *f;
+
+	if ((f = q->head) != NULL && (q->head = f->next) == NULL)
+		q->tail = NULL;
+	return (f);
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#ifndef FIBER_UCONTEXT
+/*
+ * fiber_swap_ctx(&from->sp, to->sp) pushes the callee saved registers
+ * on the current stack, saves the stack pointer in *from, switches to
+ * the stack "to", and pops its registers off it, returning to wherever
+ * "to" called fiber_swap_ctx from - or, for a new fiber, into
+ * fiber_entry(), because fiber_new() left it a stack that looks like
+ * that's where it came from.
+ */
+void	 fiber_swap_ctx(void **, void *) __asm__("fiber_swap_ctx");
+
+#if defined(__ELF__)
+#define FIBER_FUNC(name)	".globl " name "\n .hidden " name "\n" \
+				".type " name ",@function\n"
+#else
+#define FIBER_FUNC(name)	".globl " name "\n"
+#endif
+
+#if defined(__x86_64__)
+/* the SysV ABI keeps rbx, rbp and r12-r15, and the fpu control words */
+#define FIBER_FRAME	72	/* mxcsr and fpucw, 6 registers, %rip */
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	FIBER_FUNC("fiber_swap_ctx")
+"fiber_swap_ctx:\n"
+	"pushq	%rbp\n"
+	"pushq	%rbx\n"
+	"pushq	%r12\n"
+	"pushq	%r13\n"
+	"pushq	%r14\n"
+	"pushq	%r15\n"
+	"subq	$8, %rsp\n"
+	"stmxcsr	(%rsp)\n"
+	"fnstcw	4(%rsp)\n"
+	"movq	%rsp, (%rdi)\n"
+	"movq	%rsi, %rsp\n"
+	"ldmxcsr	(%rsp)\n"
+	"fldcw	4(%rsp)\n"
+	"addq	$8, %rsp\n"
+	"popq	%r15\n"
+	"popq	%r14\n"
+	"popq	%r13\n"
+	"popq	%r12\n"
+	"popq	%rbx\n"
+	"popq	%rbp\n"
+	"ret\n"
+);
+#elif defined(__aarch64__)
+/* AAPCS64 keeps x19-x28, the frame pointer and d8-d15, and we need lr */
+#define FIBER_FRAME	160
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	FIBER_FUNC("fiber_swap_ctx")
+"fiber_swap_ctx:\n"
+	"sub	sp, sp, #160\n"
+	"stp	x19, x20, [sp, #0]\n"
+	"stp	x21, x22, [sp, #16]\n"
+	"stp	x23, x24, [sp, #32]\n"
+	"stp	x25, x26, [sp, #48]\n"
+	"stp	x27, x28, [sp, #64]\n"
+	"stp	x29, x30, [sp, #80]\n"
+	"stp	d8, d9, [sp, #96]\n"
+	"stp	d10, d11, [sp, #112]\n"
+	"stp	d12, d13, [sp, #128]\n"
+	"stp	d14, d15, [sp, #144]\n"
+	"mov	x9, sp\n"
+	"str	x9, [x0]\n"
+	"mov	sp, x1\n"
+	"ldp	x19, x20, [sp, #0]\n"
+	"ldp	x21, x22, [sp, #16]\n"
+	"ldp	x23, x24, [sp, #32]\n"
+	"ldp	x25, x26, [sp, #48]\n"
+	"ldp	x27, x28, [sp, #64]\n"
+	"ldp	x29, x30, [sp, #80]\n"
+	"ldp	d8, d9, [sp, #96]\n"
+	"ldp	d10, d11, [sp, #112]\n"
+	"ldp	d12, d13, [sp, #128]\n"
+	"ldp	d14, d15, [sp, #144]\n"
+	"add	sp, sp, #160\n"
+	"ret\n"
+);
+#endif
+#endif /* !FIBER_UCONTEXT */
+
+/* Put the fiber that just finished in the pool, for fiber_new() */
+static void
+fiber_reap(void)
+{
+	if (dead != NULL) {
+		dead->next = pool;
+		pool = dead;
+		dead = NULL;
+		nfibers--;
+	}
+}
+
+static void
+fiber_switch(struct fiber *from, struct fiber *to)
+{
+	current = to;
+#ifdef FIBER_UCONTEXT
+	swapcontext(&from->uc, &to->uc);
+#else
+	fiber_swap_ctx(&from->sp, to->sp);
+#endif
+	fiber_reap();
+}
+
+/*
+ * Run the next fiber in this round, or go back to fiber_loop() to poll
+ * if there are none. "self" is on a run queue or waiting, or dead.
+ */
+static void
+fiber_next(struct fiber *self)
+{
+	struct fiber *next;
+
+	if ((next = fiberq_pop(&batch)) == NULL)
+		next = &sched;
+	fiber_switch(self, next);
+}
+
+/* where every fiber starts, and finishes */
+static void
+fiber_entry(void)
+{
+	struct fiber *f = current;
+
+	fiber_reap();
+	f->fn(f->arg);
+	dead = f;
+	fiber_next(f);
+	abort();	/* nobody switches to a dead fiber */
+}
+
+/*
+ * Set up for at most "max" fibers at once, each with "size" bytes of
+ * stack, or FIBER_STACK if it's 0.
+ */
+int
+fiber_init(size_t size, int max)
+{
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (size == 0)
+		size = FIBER_STACK;
+	stacksize = (size + pagesize - 1) & ~(pagesize - 1);
+	if ((pfds = reallocarray(NULL, max, sizeof(*pfds))) == NULL ||
+	    (waiters = reallocarray(NULL, max, sizeof(*waiters))) == NULL) {
+		free(pfds);
+		pfds = NULL;
+		return (-1);
+	}
+	maxfibers = max;
+	return (0);
+}
+
+/*
+ * Make a fiber that runs fn(arg), the next time fiber_loop() gets
+ * round to it. Returns NULL with errno set if we can't - EAGAIN if
+ * there are already as many fibers as fiber_init() said.
+ */
+struct fiber *
+fiber_new(void (*fn)(void *), void *arg)
+{
+	unsigned char *map, *top;
+	struct fiber *f;
+#ifndef FIBER_UCONTEXT
+	void **sp;
+#endif
+
+	if ((f = pool) != NULL)
+		pool = f->next;
+	else {
+		if (nstacks == maxfibers) {
+			errno = EAGAIN;
+			return (NULL);
+		}
+		map = mmap(NULL, pagesize + stacksize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON | MAP_STACK, -1, 0);
+		if (map == MAP_FAILED)
+			return (NULL);
+		if (mprotect(map, pagesize, PROT_NONE) == -1) {
+			munmap(map, pagesize + stacksize);
+			return (NULL);
+		}
+		/* the fiber itself lives at the top of its stack */
+		f = (struct fiber *)(map + pagesize + stacksize) - 1;
+		f->map = map;
+		nstacks++;
+	}
+	f->fn = fn;
+	f->arg = arg;
+	f->deadline = 0;
+	f->revents = 0;
+
+	top = (unsigned char *)((uintptr_t)f & ~(uintptr_t)15);
+#ifdef FIBER_UCONTEXT
+	if (getcontext(&f->uc) == -1) {
+		f->next = pool;
+		pool = f;
+		return (NULL);
+	}
+	f->uc.uc_stack.ss_sp = f->map + pagesize;
+	f->uc.uc_stack.ss_size = top - (f->map + pagesize);
+	f->uc.uc_link = NULL;
+	makecontext(&f->uc, fiber_entry, 0);
+#else
+	/* what fiber_swap_ctx() will pop, returning into fiber_entry() */
+	sp = (void **)(top - FIBER_FRAME);
+	memset(sp, 0, FIBER_FRAME);
+#if defined(__x86_64__)
+	((uint32_t *)sp)[0] = 0x1f80;		/* mxcsr, the default */
+	((uint16_t *)sp)[2] = 0x37f;		/* fpucw, the default */
+	sp[7] = (void *)fiber_entry;
+#elif defined(__aarch64__)
+	sp[11] = (void *)fiber_entry;		/* x30 */
+#endif
+	f->sp = sp;
+#endif
+	nfibers++;
+	fiberq_push(&runq, f);
+	return (f);
+}
+
+/* Let the other fibers that can run have a turn */
+void
+fiber_yield(void)
+{
+	if (current == &sched)
+		return;
+	fiberq_push(&runq, current);
+	fiber_next(current);
+}
+
+/*
+ * Wait until "fd" is ready for "events" (POLLIN, POLLOUT), or for
+ * "timeout" ms if it's not -1. Returns the revents poll gave us, or 0
+ * if we timed out.
+ */
+int
+fiber_wait(int fd, int events, int timeout)
+{
+	struct fiber *f = current;
+
+	if (f == &sched)
+		errx(1, "fiber_wait called outside a fiber");
+	pfds[nwait].fd = fd;
+	pfds[nwait].events = events;
+	pfds[nwait].revents = 0;
+	waiters[nwait++] = f;
+	f->deadline = 0;
+	if (timeout >= 0) {
+		f->deadline = now_ms() + timeout;
+		ntimed++;
+	}
+	f->revents = 0;
+	fiber_next(f);
+	return (f->revents);
+}
+
+void
+fiber_sleep(int ms)
+{
+	fiber_wait(-1, 0, ms);
+}
+
+/*
+ * Run fibers until there are none left. Each round runs every fiber
+ * that was ready at the start of it, then polls for the ones waiting,
+ * so fibers that only ever yield can't keep the others from their
+ * sockets.
+ */
+void
+fiber_loop(void)
+{
+	struct fiber *f;
+	int64_t now, next;
+	int i, timeout;
+
+	while (nfibers > 0) {
+		batch = runq;
+		runq.head = runq.tail = NULL;
+		if ((f = fiberq_pop(&batch)) != NULL)
+			fiber_switch(&sched, f);
+		if (nfibers == 0 || (nwait == 0 && runq.head == NULL))
+			break;
+
+		timeout = -1;
+		if (runq.head != NULL)
+			timeout = 0;
+		else if (ntimed > 0) {
+			now = now_ms();
+			next = INT64_MAX;
+			for (i = 0; i < nwait; i++)
+				if (waiters[i]->deadline != 0 &&
+				    waiters[i]->deadline < next)
+					next = waiters[i]->deadline;
+			if (next <= now)
+				timeout = 0;
+			else if (next - now < INT_MAX)
+				timeout = next - now;
+			else
+				timeout = INT_MAX;
+		}
+		if (nwait == 0)
+			continue;	/* only fibers that yielded */
+		if (poll(pfds, nwait, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+
+		/*
+		 * wake everyone whose socket is ready, or who has waited
+		 * long enough, filling their slot from the end.
+		 */
+		now = ntimed > 0 ? now_ms() : 0;
+		for (i = nwait - 1; i >= 0; i--) {
+			f = waiters[i];
+			if (pfds[i].revents == 0 &&
+			    (f->deadline == 0 || f->deadline > now))
+				continue;
+			f->revents = pfds[i].revents;
+			if (f->deadline != 0)
+				ntimed--;
+			pfds[i] = pfds[--nwait];
+			waiters[i] = waiters[nwait];
+			fiberq_push(&runq, f);
+		}
+	}
+}
+
+/*
+ * The libtls calls, for a fiber. Each waits for whatever libtls wants
+ * from the socket "fd", for up to "timeout" ms each time (or forever
+ * with -1), failing with ETIMEDOUT if it runs out.
+ */
+static int
+fiber_want(int fd, ssize_t r, int timeout)
+{
+	if (fiber_wait(fd, r == TLS_WANT_POLLIN ? POLLIN : POLLOUT,
+	    timeout) == 0) {
+		errno = ETIMEDOUT;
+		return (-1);
+	}
+	return (0);
+}
+
+int
+fiber_tls_handshake(struct tls *ctx, int fd, int timeout)
+{
+	int r;
+
+	while ((r = tls_handshake(ctx)) == TLS_WANT_POLLIN ||
+	    r == TLS_WANT_POLLOUT)
+		if (fiber_want(fd, r, timeout) == -1)
+			return (-1);
+	return (r);
+}
+
+ssize_t
+fiber_tls_read(struct tls *ctx, int fd, void *buf, size_t len, int timeout)
+{
+	ssize_t r;
+
+	while ((r = tls_read(ctx, buf, len)) == TLS_WANT_POLLIN ||
+	    r == TLS_WANT_POLLOUT)
+		if (fiber_want(fd, r, timeout) == -1)
+			return (-1);
+	return (r);
+}
+
+/* Unlike tls_write, this writes all of "buf", or fails */
+ssize_t
+fiber_tls_write(struct tls *ctx, int fd, const void *buf, size_t len,
+    int timeout)
+{
+	size_t off;
+	ssize_t w;
+
+	for (off = 0; off < len; off += w) {
+		w = tls_write(ctx, (const unsigned char *)buf + off,
+		    len - off);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT) {
+			if (fiber_want(fd, w, timeout) == -1)
+				return (-1);
+			w = 0;
+		} else if (w == -1)
+			return (-1);
+	}
+	return (len);
+}
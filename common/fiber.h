@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fibers - lightweight threads that take turns, for writing a
+ * connection's handling as straight line code on top of a poll loop.
+ * See ../common/fiber.c
+ */
+
+#include <sys/types.h>
+
+#define FIBER_STACK	(64 * 1024)	/* enough for libtls and a buffer */
+
+struct fiber;
+struct tls;
+
+int		 fiber_init(size_t, int);
+struct fiber	*fiber_new(void (*)(void *), void *);
+void		 fiber_loop(void);
+void		 fiber_yield(void);
+int		 fiber_wait(int, int, int);
+void		 fiber_sleep(int);
+
+/* libtls calls that wait in the fiber until they are done */
+int		 fiber_tls_handshake(struct tls *, int, int);
+ssize_t		 fiber_tls_read(struct tls *, int, void *, size_t, int);
+ssize_t		 fiber_tls_write(struct tls *, int, const void *, size_t, int);
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Message framing.
+ *
+ * The ex2 echo protocol is a stream of bytes, so nothing says where one
+ * message ends and the next starts - a line can come in over several
+ * reads, and one read can hold several lines. A framer finds the end of
+ * the first message in what has been buffered so far: either a newline,
+ * or the length given in a FRAME_HDRLEN byte header in network byte
+ * order, same as ../common/message.c uses.
+ *
+ * The data is handed to us as an iovec or two, so a ring buffer can
+ * give us what it has without straightening it out first, and the
+ * message we hand back is an iovec or two pointing at the same bytes.
+ * Nothing gets copied.
+ *
+ * Finding newlines is where the time goes with small messages at high
+ * rates, so frame_memchr() looks 16 or 32 bytes at a time with SSE2 or
+ * AVX2 where the cpu has them, and a word at a time where it doesn't.
+ * We remember how far we have looked, so a long line arriving in
+ * pieces is only searched once.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_X86
+#endif
+
+#include "frame.h"
+
+void
+framer_init(struct framer *fr, int type, size_t max)
+{
+	fr->type = type;
+	fr->max = max;
+	fr->scanned = 0;
+}
+
+/* FRAME_LINE or FRAME_LENGTH for "line" or "length", -1 for neither */
+int
+framer_type(const char *name)
+{
+	if (strcmp(name, "line") == 0)
+		return (FRAME_LINE);
+	if (strcmp(name, "length") == 0)
+		return (FRAME_LENGTH);
+	return (-1);
+}
+
+/* copy the first "len" bytes of "data" to "out" */
+static void
+gather(const struct iovec *data, int cnt, unsigned char *out, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < cnt && len > 0; i++) {
+		n = data[i].iov_len < len ? data[i].iov_len : len;
+		memcpy(out, data[i].iov_base, n);
+		out += n;
+		len -= n;
+	}
+}
+
+/* the length of the first line in "data", or 0 if it isn't all there */
+static size_t
+line_len(struct framer *fr, const struct iovec *data, int cnt)
+{
+	const unsigned char *base, *p;
+	size_t off, start;
+	int i;
+
+	for (i = 0, off = 0; i < cnt; off += data[i].iov_len, i++) {
+		if (fr->scanned >= off + data[i].iov_len)
+			continue;
+		base = data[i].iov_base;
+		start = fr->scanned - off;
+		if ((p = frame_memchr(base + start, '\n',
+		    data[i].iov_len - start)) != NULL)
+			return (off + (p - base) + 1);
+		fr->scanned = off + data[i].iov_len;
+	}
+	return (0);
+}
+
+/*
+ * Look for a complete message at the start of "data", "cnt" iovecs of
+ * buffered input. Returns 1 and fills in "f" if there is one, 0 if
+ * there isn't yet, and -1 with errno set to EMSGSIZE if the message is
+ * bigger than we allow. Until it returns 1, each call must see the
+ * same data as the last, with maybe more added on the end. After that
+ * the caller should take the message out of its buffer before looking
+ * for another.
+ */
+int
+framer_next(struct framer *fr, const struct iovec *data, int cnt,
+    struct frame *f)
+{
+	unsigned char hdr[FRAME_HDRLEN];
+	size_t total = 0, len, n;
+	uint32_t msglen;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		total += data[i].iov_len;
+
+	if (fr->type == FRAME_LENGTH) {
+		if (total < FRAME_HDRLEN)
+			return (0);
+		gather(data, cnt, hdr, sizeof(hdr));
+		memcpy(&msglen, hdr, sizeof(msglen));
+		len = FRAME_HDRLEN + (size_t)ntohl(msglen);
+	} else if ((len = line_len(fr, data, cnt)) == 0)
+		len = total + 1;	/* all we know is it's longer */
+	if (len > fr->max) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (len > total)
+		return (0);
+	fr->scanned = 0;
+
+	f->len = len;
+	f->iovcnt = 0;
+	for (i = 0; i < cnt && len > 0; i++) {
+		n = data[i].iov_len < len ? data[i].iov_len : len;
+		f->iov[f->iovcnt].iov_base = data[i].iov_base;
+		f->iov[f->iovcnt].iov_len = n;
+		f->iovcnt++;
+		len -= n;
+	}
+	return (1);
+}
+
+/* a word at a time, for cpus we have nothing better for */
+static const void *
+scan_scalar(const void *buf, int c, size_t len)
+{
+	const uint64_t ones = 0x0101010101010101ULL, highs = ones << 7;
+	const uint64_t pat = ones * (unsigned char)c;
+	const unsigned char *p = buf;
+	uint64_t w;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; p++, len--)
+		if (*p == (unsigned char)c)
+			return (p);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, sizeof(w));
+		w ^= pat;
+		/* a zero byte in w is a match */
+		if (((w - ones) & ~w & highs) != 0)
+			break;
+	}
+	for (; len > 0; p++, len--)
+		if (*p == (unsigned char)c)
+			return (p);
+	return (NULL);
+}
+
+static const void *
+scan_libc(const void *buf, int c, size_t len)
+{
+	return (memchr(buf, c, len));
+}
+
+#ifdef FRAME_X86
+/*
+ * Rather than finish up a byte at a time, the vector versions look at
+ * the last 16 or 32 bytes in one go, overlapping what they've already
+ * looked at. Anything in the overlap is known not to match.
+ */
+__attribute__((target("sse2")))
+static const void *
+scan_sse2(const void *buf, int c, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	__m128i pat = _mm_set1_epi8((char)c), a, b, d, e;
+	unsigned int m;
+
+	if (len < 16)
+		return (scan_scalar(buf, c, len));
+	for (; end - p >= 64; p += 64) {
+		a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), pat);
+		b = _mm_cmpeq_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 16)), pat);
+		d = _mm_cmpeq_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 32)), pat);
+		e = _mm_cmpeq_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 48)), pat);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+		    _mm_or_si128(d, e))) != 0)
+			break;
+	}
+	for (; end - p >= 16; p += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)p), pat));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+	if (p == end)
+		return (NULL);
+	p = end - 16;
+	m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+	    _mm_loadu_si128((const __m128i *)p), pat));
+	return (m != 0 ? p + __builtin_ctz(m) : NULL);
+}
+
+__attribute__((target("avx2")))
+static const void *
+scan_avx2(const void *buf, int c, size_t len)
+{
+	const unsigned char *p = buf, *end = p + len;
+	__m256i pat = _mm256_set1_epi8((char)c), a, b, d, e;
+	unsigned int m;
+
+	if (len < 32) {
+		__m128i pat16 = _mm_set1_epi8((char)c);
+
+		/* not scan_sse2(), mixing it with AVX code is slow */
+		if (len < 16)
+			return (scan_scalar(buf, c, len));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)p), pat16));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+		p = end - 16;
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)p), pat16));
+		return (m != 0 ? p + __builtin_ctz(m) : NULL);
+	}
+	/* four vectors at a time, so the loads overlap the compares */
+	for (; end - p >= 128; p += 128) {
+		a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p),
+		    pat);
+		b = _mm256_cmpeq_epi8(_mm256_loadu_si256(
+		    (const __m256i *)(p + 32)), pat);
+		d = _mm256_cmpeq_epi8(_mm256_loadu_si256(
+		    (const __m256i *)(p + 64)), pat);
+		e = _mm256_cmpeq_epi8(_mm256_loadu_si256(
+		    (const __m256i *)(p + 96)), pat);
+		if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b),
+		    _mm256_or_si256(d, e))) != 0)
+			break;
+	}
+	for (; end - p >= 32; p += 32) {
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const __m256i *)p), pat));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+	if (p == end)
+		return (NULL);
+	p = end - 32;
+	m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+	    _mm256_loadu_si256((const __m256i *)p), pat));
+	return (m != 0 ? p + __builtin_ctz(m) : NULL);
+}
+
+static int
+have_sse2(void)
+{
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("sse2"));
+}
+
+static int
+have_avx2(void)
+{
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("avx2"));
+}
+#endif
+
+static int
+have_always(void)
+{
+	return (1);
+}
+
+typedef const void *(*scanfn)(const void *, int, size_t);
+
+/* best first */
+static const struct scanner {
+	const char	*name;
+	scanfn		 fn;
+	int		(*usable)(void);
+} scanners[] = {
+#ifdef FRAME_X86
+	{ "avx2",	scan_avx2,	have_avx2 },
+	{ "sse2",	scan_sse2,	have_sse2 },
+#endif
+	{ "scalar",	scan_scalar,	have_always },
+	{ "memchr",	scan_libc,	have_always },
+};
+
+static const void *scan_first(const void *, int, size_t);
+static scanfn scan = scan_first;
+
+/*
+ * Use the scanner called "name", or the best one this cpu can run if
+ * "name" is NULL. Returns the name of the one we use, or NULL if there
+ * is no such scanner or we can't run it here.
+ */
+const char *
+frame_scanner(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+		if (name != NULL && strcmp(name, scanners[i].name) != 0)
+			continue;
+		if (!scanners[i].usable())
+			continue;
+		scan = scanners[i].fn;
+		return (scanners[i].name);
+	}
+	return (NULL);
+}
+
+/* the first search picks the scanner for all the others */
+static const void *
+scan_first(const void *buf, int c, size_t len)
+{
+	frame_scanner(NULL);
+	return (scan(buf, c, len));
+}
+
+/* memchr(3), but with the scanner we picked */
+const void *
+frame_memchr(const void *buf, int c, size_t len)
+{
+	return (scan(buf, c, len));
+}
+
+/*
+ * Latency buckets: values under LATENCY_SUB get a bucket each, after
+ * that each power of two is split into LATENCY_SUB buckets, so every
+ * bucket is within 1/LATENCY_SUB of the values in it.
+ */
+static size_t
+latency_bucket(uint64_t v)
+{
+	int msb;
+
+	if (v < LATENCY_SUB)
+		return (v);
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - 3) * LATENCY_SUB + ((v >> (msb - 4)) &
+	    (LATENCY_SUB - 1)));
+}
+
+/* the middle of the values in bucket "b" */
+static uint64_t
+latency_value(size_t b)
+{
+	int shift;
+
+	if (b < LATENCY_SUB)
+		return (b);
+	shift = b / LATENCY_SUB - 1;
+	return (((uint64_t)(LATENCY_SUB + b % LATENCY_SUB) << shift) +
+	    ((1ULL << shift) >> 1));
+}
+
+void
+latency_add(struct latency *l, uint64_t v)
+{
+	if (l->count == 0 || v < l->min)
+		l->min = v;
+	if (v > l->max)
+		l->max = v;
+	l->count++;
+	l->buckets[latency_bucket(v)]++;
+}
+
+/* the "q" quantile, 0.5 for the median, and so on */
+uint64_t
+latency_quantile(const struct latency *l, double q)
+{
+	uint64_t want, seen = 0, v;
+	size_t b;
+
+	if (l->count == 0)
+		return (0);
+	if ((want = q * l->count + 0.5) < 1)
+		want = 1;
+	for (b = 0; b < LATENCY_BUCKETS; b++) {
+		if ((seen += l->buckets[b]) >= want)
+			break;
+	}
+	v = latency_value(b);
+	if (v < l->min)
+		v = l->min;
+	if (v > l->max)
+		v = l->max;
+	return (v);
+}
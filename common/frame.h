@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Message framing for the ex2 echo client and server, over buffered
+ * data that can be in two pieces when it wraps around the end of a
+ * ring buffer.
+ */
+
+#include <sys/uio.h>
+#include <stdint.h>
+
+#define FRAME_LINE	0	/* ends with a newline */
+#define FRAME_LENGTH	1	/* a length first, like message.h */
+
+#define FRAME_HDRLEN	4	/* FRAME_LENGTH's 32 bit length */
+
+/* A complete message, pointing into the caller's buffer */
+struct frame {
+	struct iovec	iov[2];
+	int		iovcnt;
+	size_t		len;	/* including the newline or header */
+};
+
+struct framer {
+	int		type;
+	size_t		max;		/* biggest message we'll take */
+	size_t		scanned;	/* searched so far for a newline */
+};
+
+void		 framer_init(struct framer *, int, size_t);
+int		 framer_type(const char *);
+int		 framer_next(struct framer *, const struct iovec *, int,
+		    struct frame *);
+
+/* search for a byte, with the best implementation this cpu has */
+const void	*frame_memchr(const void *, int, size_t);
+const char	*frame_scanner(const char *);
+
+/*
+ * Latency of each message, in buckets a few percent wide, so adding
+ * one is cheap enough to do for every message at full speed.
+ */
+#define LATENCY_SUB	16
+#define LATENCY_BUCKETS	(64 * LATENCY_SUB)
+
+struct latency {
+	uint64_t	count;
+	uint64_t	min, max;
+	uint64_t	buckets[LATENCY_BUCKETS];
+};
+
+void		 latency_add(struct latency *, uint64_t);
+uint64_t	 latency_quantile(const struct latency *, double);
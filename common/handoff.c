@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Restarting a server without anyone noticing.
+ *
+ * A server started with "-U path" listens on a unix socket at "path".
+ * When a new copy of it starts up with the same path, it connects
+ * there, and the old one sends it the listening sockets (SCM_RIGHTS),
+ * along with the TLS session ticket keys and session id context. The
+ * new server sets up its TLS with them and says it's ready, then it
+ * accepts new connections while the old one finishes with the ones it
+ * has and exits. The listening sockets are never closed, so anyone who
+ * connects in between just waits in the queue, and the sessions the
+ * old server handed out can be resumed with the new one.
+ *
+ * libtls makes and rotates its own ticket keys if we let it, but won't
+ * tell us what they are - so with -U we make them ourselves. Each new
+ * server adds a key to the ones it was given and uses it for new
+ * tickets, keeping the last HANDOFF_MAXKEYS so tickets from the last
+ * few servers still work.
+ *
+ * Whoever gets those can accept our clients and decrypt their tickets,
+ * so the socket is made mode 0600, and each end checks the other is
+ * running as the same user as it is before going any further.
+ *
+ * The old server waits for the new one to say it's ready in
+ * handoff_send(), for up to HANDOFF_TIMEOUT seconds, and an event loop
+ * server is doing nothing else while it waits. A new server that takes
+ * its time starting up stalls the old one's clients for that long.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* for struct ucred */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#define HANDOFF_VERSION	1
+
+static int
+handoff_addr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+	    sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Is the other end of "s" running as our user? */
+static int
+handoff_peer_ok(int s)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		warn("handoff SO_PEERCRED");
+		return (0);
+	}
+	if (cred.uid != geteuid()) {
+		warnx("handoff peer is uid %u, not us", (unsigned)cred.uid);
+		return (0);
+	}
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(s, &uid, &gid) == -1) {
+		warn("handoff getpeereid");
+		return (0);
+	}
+	if (uid != geteuid()) {
+		warnx("handoff peer is uid %u, not us", (unsigned)uid);
+		return (0);
+	}
+#endif
+	return (1);
+}
+
+/* wait for the other side to say something, but not forever */
+static int
+handoff_wait(int fd)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ((r = poll(&pfd, 1, HANDOFF_TIMEOUT * 1000)) == 0)
+		errno = ETIMEDOUT;
+	return (r > 0 ? 0 : -1);
+}
+
+/*
+ * Ask the server listening at "path" for its sockets and keys. Returns
+ * 1 if we got them, 0 if there's nobody there and we are starting
+ * afresh, or -1 if something went wrong. After a 1, the old server is
+ * still accepting until we call handoff_ready().
+ */
+int
+handoff_receive(struct handoff *h, const char *path)
+{
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAXFDS)];
+	} cmsgbuf;
+	struct sockaddr_un sun;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t r;
+
+	memset(h, 0, sizeof(*h));
+	if (handoff_addr(&sun, path) == -1) {
+		warn("%s", path);
+		return (-1);
+	}
+	if ((h->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return (-1);
+	}
+	if (connect(h->sock, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			close(h->sock);
+			h->sock = -1;
+			return (0);
+		}
+		warn("connect %s", path);
+		goto fail;
+	}
+	if (!handoff_peer_ok(h->sock))
+		goto fail;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &h->keys;
+	iov.iov_len = sizeof(h->keys);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	if (handoff_wait(h->sock) == -1 ||
+	    (r = recvmsg(h->sock, &msg, MSG_WAITALL)) == -1) {
+		warn("handoff from %s", path);
+		goto fail;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		h->nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(h->fds, CMSG_DATA(cmsg), h->nfds * sizeof(int));
+	}
+	if (r != sizeof(h->keys) || (msg.msg_flags & MSG_CTRUNC) ||
+	    h->keys.version != HANDOFF_VERSION ||
+	    h->keys.nkeys > HANDOFF_MAXKEYS || h->nfds == 0) {
+		warnx("bad handoff from %s", path);
+		goto fail;
+	}
+	return (1);
+
+ fail:
+	while (h->nfds > 0)
+		close(h->fds[--h->nfds]);
+	close(h->sock);
+	h->sock = -1;
+	return (-1);
+}
+
+/* Tell the old server we are ready, so it can stop accepting */
+int
+handoff_ready(struct handoff *h)
+{
+	int r = 0;
+
+	if (write(h->sock, "", 1) != 1) {
+		warn("handoff");
+		r = -1;
+	}
+	close(h->sock);
+	h->sock = -1;
+	return (r);
+}
+
+/* Wait at "path" for the server that's going to replace us */
+int
+handoff_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t omask;
+	int s, r;
+
+	if (handoff_addr(&sun, path) == -1) {
+		warn("%s", path);
+		return (-1);
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		warn("socket");
+		return (-1);
+	}
+	/* it's either stale, or the server we're replacing is done with it */
+	if (unlink(path) == -1 && errno != ENOENT)
+		warn("unlink %s", path);
+	/* nobody else gets to connect */
+	omask = umask(077);
+	r = bind(s, (struct sockaddr *)&sun, sizeof(sun));
+	umask(omask);
+	if (r == -1 || listen(s, 1) == -1) {
+		warn("%s", path);
+		close(s);
+		return (-1);
+	}
+	return (s);
+}
+
+/*
+ * Someone is connecting to "lsock" - hand them our listening sockets and
+ * keys. Returns 0 once they say they have taken over, after which we
+ * should stop accepting, or -1 if they didn't and we should carry on.
+ */
+int
+handoff_send(int lsock, const int *fds, int nfds,
+    const struct handoff_keys *keys)
+{
+	union {
+		struct cmsghdr hdr;
+		unsigned char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAXFDS)];
+	} cmsgbuf;
+	struct handoff_keys k;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int r = -1, s;
+	char c;
+
+	if (nfds < 1 || nfds > HANDOFF_MAXFDS) {
+		warnx("can't hand off %d sockets", nfds);
+		return (-1);
+	}
+	if ((s = accept(lsock, NULL, NULL)) == -1) {
+		warn("handoff accept");
+		return (-1);
+	}
+	if (!handoff_peer_ok(s)) {
+		close(s);
+		return (-1);
+	}
+	k = *keys;
+	k.version = HANDOFF_VERSION;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &k;
+	iov.iov_len = sizeof(k);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	if (sendmsg(s, &msg, 0) != sizeof(k))
+		warn("handoff");
+	else if (handoff_wait(s) == -1 || read(s, &c, 1) != 1)
+		warnx("new server didn't take over, carrying on");
+	else
+		r = 0;
+	explicit_bzero(&k, sizeof(k));
+	close(s);
+	return (r);
+}
+
+/*
+ * Add a new ticket key, and make up a session id context if this is
+ * the first server. The oldest key goes if we have too many.
+ */
+void
+handoff_rekey(struct handoff_keys *keys)
+{
+	uint32_t rev = 0;
+
+	if (keys->nkeys == 0)
+		arc4random_buf(keys->sid, sizeof(keys->sid));
+	else
+		rev = keys->rev[keys->nkeys - 1] + 1;
+	if (keys->nkeys == HANDOFF_MAXKEYS) {
+		memmove(&keys->rev[0], &keys->rev[1],
+		    sizeof(keys->rev[0]) * (HANDOFF_MAXKEYS - 1));
+		memmove(&keys->key[0], &keys->key[1],
+		    sizeof(keys->key[0]) * (HANDOFF_MAXKEYS - 1));
+		keys->nkeys--;
+	}
+	keys->rev[keys->nkeys] = rev;
+	arc4random_buf(keys->key[keys->nkeys], HANDOFF_KEYLEN);
+	keys->nkeys++;
+}
+
+/*
+ * Give "cfg" our session id context and ticket keys. Call it after
+ * setting the session lifetime. Servers with a context per certificate
+ * pass the name it is for, so each gets its own session id context, and
+ * a session for one name can't be resumed by asking for another.
+ */
+int
+handoff_configure(struct tls_config *cfg, const struct handoff_keys *keys,
+    const char *name)
+{
+	unsigned char sid[HANDOFF_SIDLEN], key[HANDOFF_KEYLEN];
+	uint64_t hash = 14695981039346656037ULL;	/* FNV-1a */
+	uint32_t i;
+	int r = 0;
+
+	memcpy(sid, keys->sid, sizeof(sid));
+	if (name != NULL) {
+		for (; *name != '\0'; name++)
+			hash = (hash ^ (unsigned char)*name) *
+			    1099511628211ULL;
+		for (i = 0; i < sizeof(hash); i++)
+			sid[i] ^= hash >> (i * 8);
+	}
+	if (tls_config_set_session_id(cfg, sid, sizeof(sid)) == -1)
+		return (-1);
+	/* oldest first, libtls makes tickets with the one added last */
+	for (i = 0; i < keys->nkeys && r == 0; i++) {
+		memcpy(key, keys->key[i], sizeof(key));
+		r = tls_config_add_ticket_key(cfg, keys->rev[i], key,
+		    sizeof(key));
+	}
+	explicit_bzero(key, sizeof(key));
+	return (r);
+}
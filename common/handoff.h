@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Handing a server's listening sockets and TLS session keys over to a
+ * new copy of itself, so it can be restarted without refusing anyone
+ * or forgetting their sessions. See ../common/handoff.c
+ */
+
+#include <stdint.h>
+
+#define HANDOFF_MAXFDS	8	/* listening sockets we can pass */
+#define HANDOFF_MAXKEYS	4	/* ticket keys we keep, newest last */
+#define HANDOFF_KEYLEN	48	/* TLS_TICKET_KEY_SIZE */
+#define HANDOFF_SIDLEN	32	/* TLS_MAX_SESSION_ID_LENGTH */
+#define HANDOFF_TIMEOUT	10	/* seconds to wait for the other side */
+
+struct tls_config;
+
+/* what goes over the socket, along with the descriptors */
+struct handoff_keys {
+	uint32_t	 version;
+	uint32_t	 nkeys;
+	uint32_t	 rev[HANDOFF_MAXKEYS];
+	unsigned char	 key[HANDOFF_MAXKEYS][HANDOFF_KEYLEN];
+	unsigned char	 sid[HANDOFF_SIDLEN];	/* session id context */
+};
+
+struct handoff {
+	int			 sock;	/* to the old process, until ready */
+	int			 fds[HANDOFF_MAXFDS];
+	int			 nfds;
+	struct handoff_keys	 keys;
+};
+
+int	 handoff_receive(struct handoff *, const char *);
+int	 handoff_ready(struct handoff *);
+int	 handoff_listen(const char *);
+int	 handoff_send(int, const int *, int, const struct handoff_keys *);
+void	 handoff_rekey(struct handoff_keys *);
+int	 handoff_configure(struct tls_config *, const struct handoff_keys *,
+	    const char *);
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Length prefixed messages.
+ *
+ * A message is a 4 byte length in network byte order, followed by that
+ * many bytes. Without this, the only way the ex0/ex1 client knows it
+ * has the whole answer is the server closing the connection, which
+ * means one connection (and in ex1 one TLS handshake) per request.
+ *
+ * These are for blocking descriptors - the caller hands us a function
+ * that does the actual reading or writing on whatever it has, be it a
+ * socket or a TLS context.
+ */
+
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "message.h"
+
+/*
+ * Send "len" bytes of "buf" as one message. The header and the payload
+ * go out in a single write, so over TLS they end up in one record.
+ */
+int
+message_send(message_io wr, void *arg, const void *buf, size_t len)
+{
+	unsigned char out[MESSAGE_HDRLEN + MESSAGE_MAX];
+	uint32_t hdr;
+	size_t off = 0;
+	ssize_t w;
+
+	if (len > MESSAGE_MAX) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	hdr = htonl((uint32_t)len);
+	memcpy(out, &hdr, sizeof(hdr));
+	memcpy(out + MESSAGE_HDRLEN, buf, len);
+	len += MESSAGE_HDRLEN;
+
+	while (off < len) {
+		if ((w = wr(arg, out + off, len - off)) <= 0)
+			return (-1);
+		off += w;
+	}
+	return (0);
+}
+
+/* read exactly "len" bytes, returns 0 on EOF before we got any */
+static int
+readall(message_io rd, void *arg, unsigned char *buf, size_t len)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < len) {
+		if ((r = rd(arg, buf + off, len - off)) == -1)
+			return (-1);
+		if (r == 0) {
+			if (off == 0)
+				return (0);
+			errno = EPIPE;	/* EOF in the middle of a message */
+			return (-1);
+		}
+		off += r;
+	}
+	return (1);
+}
+
+/*
+ * Receive one message into "buf", setting "*len" to its length.
+ * Returns 1 if we got one, 0 if the other side closed the connection
+ * cleanly between messages, and -1 on error, including a message too
+ * big for "buf".
+ */
+int
+message_recv(message_io rd, void *arg, void *buf, size_t buflen,
+    size_t *len)
+{
+	unsigned char hdr[MESSAGE_HDRLEN];
+	uint32_t n;
+	int ret;
+
+	if ((ret = readall(rd, arg, hdr, sizeof(hdr))) != 1)
+		return (ret);
+	memcpy(&n, hdr, sizeof(n));
+	n = ntohl(n);
+	if (n > buflen || n > MESSAGE_MAX) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (n > 0 && readall(rd, arg, buf, n) != 1) {
+		errno = EPIPE;
+		return (-1);
+	}
+	*len = n;
+	return (1);
+}
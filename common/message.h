@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Length prefixed messages, for the keep-alive mode of the ex0/ex1
+ * client and server, where many requests share one connection.
+ */
+
+#define MESSAGE_HDRLEN	4		/* 32 bit length, network order */
+#define MESSAGE_MAX	(16 * 1024)	/* one TLS record's worth */
+
+/*
+ * Reads or writes some of a buffer, like read(2) and write(2), retrying
+ * anything (EINTR, TLS_WANT_POLLIN...) that just means "try again".
+ */
+typedef ssize_t (*message_io)(void *, void *, size_t);
+
+int	message_send(message_io, void *, const void *, size_t);
+int	message_recv(message_io, void *, void *, size_t, size_t *);
@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Client side OCSP, for servers that don't staple.
+ *
+ * libtls checks a stapled OCSP response during the handshake, but when
+ * the server doesn't send one all it gives us is the responder's URL,
+ * from the certificate. ocspcheck_start() builds a request for the
+ * server's certificate (that part needs libcrypto), starts looking up
+ * the responder's name in a child (see resolve.c), and then makes a
+ * nonblocking HTTP POST of the request to it. The caller keeps the
+ * connection going, calling ocspcheck_io() when poll says oc->fd is
+ * ready, and ocspcheck_wait() when it needs the answer - before
+ * believing anything the server has said.
+ * tls_ocsp_process_response(3) checks the response is signed by the
+ * right CA and current, and gives us the status.
+ *
+ * Good and revoked answers are kept in files in a cache directory,
+ * named for the issuer's key hash and the certificate's serial, until
+ * the response's next update time. They're checked all over again on
+ * the way back in, so nothing in the cache is taken on trust.
+ *
+ * A revoked certificate always fails. Not getting an answer - no
+ * responder, a timeout, something we can't make sense of - fails only
+ * with OCSP_FAIL_CLOSED, otherwise we say so and carry on.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include <openssl/bio.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "ocspcheck.h"
+
+#define OCSP_MAX	65536	/* biggest answer we'll take */
+
+#define STATE_RESOLVING		0
+#define STATE_CONNECTING	1
+#define STATE_SENDING		2
+#define STATE_RECEIVING		3
+#define STATE_DONE		4
+
+/* "open" or "closed", for a command line option */
+int
+ocspcheck_policy(const char *s)
+{
+	if (strcmp(s, "open") == 0)
+		return (OCSP_FAIL_OPEN);
+	if (strcmp(s, "closed") == 0)
+		return (OCSP_FAIL_CLOSED);
+	return (-1);
+}
+
+/*
+ * We have an answer, or know we won't get one. "status" is a
+ * TLS_OCSP_CERT_* value, or -1 for no answer, in which case "why" says
+ * what went wrong.
+ */
+static void
+finish(struct ocspcheck *oc, int status, const char *from, const char *why)
+{
+	time_t next;
+
+	if (oc->state == STATE_RESOLVING)
+		resolve_cancel(&oc->resolve);
+	else if (oc->fd != -1)
+		close(oc->fd);
+	oc->fd = -1;
+	oc->state = STATE_DONE;
+	free(oc->buf);
+	oc->buf = NULL;
+
+	switch (status) {
+	case TLS_OCSP_CERT_GOOD:
+		oc->result = 0;
+		next = tls_peer_ocsp_next_update(oc->tls);
+		if (next == -1)
+			fprintf(stderr, "OCSP: good (%s)\n", from);
+		else
+			fprintf(stderr, "OCSP: good (%s), next update in "
+			    "%llds\n", from, (long long)(next - time(NULL)));
+		return;
+	case TLS_OCSP_CERT_REVOKED:
+		oc->result = -1;
+		warnx("OCSP: certificate revoked (%s)", from);
+		return;
+	case TLS_OCSP_CERT_UNKNOWN:
+		why = "responder doesn't know the certificate";
+		break;
+	}
+	if (oc->policy == OCSP_FAIL_CLOSED) {
+		oc->result = -1;
+		warnx("OCSP: %s, failing closed", why);
+	} else {
+		oc->result = 0;
+		warnx("OCSP: %s, carrying on", why);
+	}
+}
+
+/*
+ * Run "der" past libtls. Returns the certificate's status, or -1 if it
+ * wasn't a response we could use.
+ */
+static int
+process(struct ocspcheck *oc, const unsigned char *der, size_t len)
+{
+	if (tls_ocsp_process_response(oc->tls, der, len) == 0)
+		return (TLS_OCSP_CERT_GOOD);
+	/* a revoked certificate is a failure to libtls, but an answer */
+	if (tls_peer_ocsp_response_status(oc->tls) ==
+	    TLS_OCSP_RESPONSE_SUCCESSFUL &&
+	    tls_peer_ocsp_cert_status(oc->tls) == TLS_OCSP_CERT_REVOKED)
+		return (TLS_OCSP_CERT_REVOKED);
+	return (-1);
+}
+
+static void
+cache_path(struct ocspcheck *oc, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s.der", oc->cachedir, oc->key);
+}
+
+/* A cached answer that is still good, or -1 */
+static int
+cache_get(struct ocspcheck *oc)
+{
+	unsigned char der[OCSP_MAX];
+	char path[PATH_MAX];
+	time_t next;
+	ssize_t n;
+	int fd, status;
+
+	if (oc->cachedir == NULL)
+		return (-1);
+	cache_path(oc, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	n = read(fd, der, sizeof(der));
+	close(fd);
+	if (n <= 0 || (status = process(oc, der, n)) == -1)
+		return (-1);
+	next = tls_peer_ocsp_next_update(oc->tls);
+	if (next == -1 || next <= time(NULL))
+		return (-1);
+	return (status);
+}
+
+/* Keep an answer, if it says how long for. */
+static void
+cache_put(struct ocspcheck *oc, const unsigned char *der, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+
+	if (oc->cachedir == NULL || tls_peer_ocsp_next_update(oc->tls) == -1)
+		return;
+	if (mkdir(oc->cachedir, 0700) == -1 && errno != EEXIST) {
+		warn("OCSP cache %s", oc->cachedir);
+		return;
+	}
+	cache_path(oc, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", oc->cachedir, oc->key);
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("OCSP cache %s", tmp);
+		return;
+	}
+	/* whole, or not at all, for anyone else reading the cache */
+	if (write(fd, der, len) != (ssize_t)len || close(fd) == -1 ||
+	    rename(tmp, path) == -1) {
+		warn("OCSP cache %s", path);
+		unlink(tmp);
+	}
+}
+
+static void
+hex(char *out, size_t size, const unsigned char *p, int len)
+{
+	size_t o = strlen(out);
+	int i;
+
+	for (i = 0; i < len && o + 2 < size; i++, o += 2)
+		snprintf(out + o, size - o, "%02x", p[i]);
+}
+
+/*
+ * The DER of a request for the status of the server's certificate, and
+ * the cache key for it. Returns NULL if we can't make one.
+ */
+static unsigned char *
+make_request(struct ocspcheck *oc, int *len)
+{
+	ASN1_OCTET_STRING *keyhash;
+	ASN1_INTEGER *serial;
+	const uint8_t *pem;
+	OCSP_CERTID *id = NULL;
+	OCSP_REQUEST *req = NULL;
+	X509 *leaf = NULL, *issuer = NULL;
+	unsigned char *der = NULL;
+	size_t pemlen;
+	BIO *bio;
+
+	/* the server's certificate, and the one that signed it */
+	if ((pem = tls_peer_cert_chain_pem(oc->tls, &pemlen)) == NULL ||
+	    (bio = BIO_new_mem_buf(pem, pemlen)) == NULL)
+		return (NULL);
+	leaf = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	issuer = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (leaf == NULL || issuer == NULL)
+		goto done;
+
+	if ((id = OCSP_cert_to_id(NULL, leaf, issuer)) == NULL)
+		goto done;
+	OCSP_id_get0_info(NULL, NULL, &keyhash, &serial, id);
+	oc->key[0] = '\0';
+	hex(oc->key, sizeof(oc->key), ASN1_STRING_get0_data(keyhash),
+	    ASN1_STRING_length(keyhash));
+	if (strlen(oc->key) + 1 < sizeof(oc->key))
+		strcat(oc->key, "-");
+	hex(oc->key, sizeof(oc->key), ASN1_STRING_get0_data(serial),
+	    ASN1_STRING_length(serial));
+
+	/*
+	 * no nonce, the responder wouldn't sign a fresh answer for each
+	 * of us, and we want to keep the answers anyway.
+	 */
+	if ((req = OCSP_REQUEST_new()) == NULL ||
+	    OCSP_request_add0_id(req, id) == NULL)
+		goto done;
+	id = NULL;
+	if ((*len = i2d_OCSP_REQUEST(req, &der)) <= 0)
+		der = NULL;
+ done:
+	OCSP_CERTID_free(id);
+	OCSP_REQUEST_free(req);
+	X509_free(leaf);
+	X509_free(issuer);
+	return (der);
+}
+
+/*
+ * Split "url" into host, port and path. Returns -1 and why in "why" if
+ * we can't.
+ */
+static int
+responder_parse(const char *url, char *host, size_t hostlen, char *port,
+    size_t portlen, const char **path, const char **why)
+{
+	const char *p, *h, *end;
+
+	if (strncmp(url, "http://", 7) != 0) {
+		*why = "responder URL isn't http";
+		return (-1);
+	}
+	h = url + 7;
+	if ((end = strchr(h, '/')) != NULL)
+		*path = end;
+	else {
+		*path = "/";
+		end = h + strlen(h);
+	}
+	snprintf(port, portlen, "80");
+	if ((p = memchr(h, ':', end - h)) != NULL) {
+		snprintf(port, portlen, "%.*s", (int)(end - p - 1), p + 1);
+		end = p;
+	}
+	if ((size_t)(end - h) >= hostlen) {
+		*why = "responder host name too long";
+		return (-1);
+	}
+	snprintf(host, hostlen, "%.*s", (int)(end - h), h);
+	return (0);
+}
+
+/* We know where the responder is, so connect to it without waiting. */
+static void
+responder_connect(struct ocspcheck *oc)
+{
+	struct resolve *r = &oc->resolve;
+
+	oc->fd = -1;
+	if (r->why != NULL) {
+		finish(oc, -1, NULL, r->why);
+		return;
+	}
+	oc->state = STATE_CONNECTING;
+	if ((oc->fd = socket(r->family, r->socktype, r->protocol)) == -1 ||
+	    fcntl(oc->fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    (connect(oc->fd, (struct sockaddr *)&r->addr, r->addrlen) == -1 &&
+	    errno != EINPROGRESS))
+		finish(oc, -1, NULL, strerror(errno));
+}
+
+/*
+ * Start checking the certificate of the server on "tls", which has
+ * done its handshake. It may be over before we return, if the server
+ * stapled an answer, or we have one in "cachedir" (which may be NULL).
+ */
+void
+ocspcheck_start(struct ocspcheck *oc, struct tls *tls, int policy,
+    const char *cachedir)
+{
+	unsigned char *der;
+	const char *url, *path, *why;
+	char host[NI_MAXHOST], port[NI_MAXSERV];
+	int status, len = 0, n;
+
+	memset(oc, 0, sizeof(*oc));
+	oc->fd = -1;
+	oc->resolve.fd = -1;
+	oc->resolve.pid = -1;
+	oc->state = STATE_DONE;
+	oc->tls = tls;
+	oc->policy = policy;
+	oc->cachedir = cachedir;
+	oc->deadline = time(NULL) + OCSP_TIMEOUT;
+
+	/* libtls already threw out a server that stapled a revocation */
+	if (tls_peer_ocsp_response_status(tls) == TLS_OCSP_RESPONSE_SUCCESSFUL) {
+		finish(oc, tls_peer_ocsp_cert_status(tls), "stapled", NULL);
+		return;
+	}
+	if ((url = tls_peer_ocsp_url(tls)) == NULL) {
+		finish(oc, -1, NULL, "no responder in the certificate");
+		return;
+	}
+	if ((der = make_request(oc, &len)) == NULL) {
+		finish(oc, -1, NULL, "can't make a request");
+		return;
+	}
+	if ((status = cache_get(oc)) != -1) {
+		OPENSSL_free(der);
+		finish(oc, status, "cached", NULL);
+		return;
+	}
+	if (responder_parse(url, host, sizeof(host), port, sizeof(port),
+	    &path, &why) == -1) {
+		OPENSSL_free(der);
+		finish(oc, -1, NULL, why);
+		return;
+	}
+
+	if ((oc->buf = malloc(OCSP_MAX)) == NULL)
+		err(1, "malloc");
+	n = snprintf(oc->buf, OCSP_MAX, "POST %s HTTP/1.0\r\n"
+	    "Host: %s\r\n"
+	    "Content-Type: application/ocsp-request\r\n"
+	    "Content-Length: %d\r\n"
+	    "Connection: close\r\n\r\n", path, host, len);
+	if (n < 0 || n + len > OCSP_MAX) {
+		OPENSSL_free(der);
+		finish(oc, -1, NULL, "request too big");
+		return;
+	}
+	memcpy(oc->buf + n, der, len);
+	OPENSSL_free(der);
+	oc->len = n + len;
+	oc->off = 0;
+
+	/* we only learn who to ask from the handshake, so look them up now */
+	if (resolve_start(&oc->resolve, host, port) == 1) {
+		oc->fd = oc->resolve.fd;
+		oc->state = STATE_RESOLVING;
+		return;
+	}
+	responder_connect(oc);
+}
+
+/* What to poll for on oc->fd, 0 if we're done with it. */
+int
+ocspcheck_events(struct ocspcheck *oc)
+{
+	switch (oc->state) {
+	case STATE_RESOLVING:
+		return (POLLIN);
+	case STATE_CONNECTING:
+	case STATE_SENDING:
+		return (POLLOUT);
+	case STATE_RECEIVING:
+		return (POLLIN);
+	}
+	return (0);
+}
+
+/* We have all of the responder's answer, now what does it say? */
+static void
+answer(struct ocspcheck *oc)
+{
+	char *body;
+	size_t len;
+	int status;
+
+	oc->buf[oc->len] = '\0';
+	if (strncmp(oc->buf, "HTTP/1.", 7) != 0 ||
+	    strncmp(oc->buf + 8, " 200", 4) != 0) {
+		finish(oc, -1, NULL, "responder didn't say 200");
+		return;
+	}
+	if ((body = strstr(oc->buf, "\r\n\r\n")) == NULL) {
+		finish(oc, -1, NULL, "responder's answer is cut short");
+		return;
+	}
+	body += 4;
+	len = oc->buf + oc->len - body;
+	if ((status = process(oc, (unsigned char *)body, len)) == -1) {
+		finish(oc, -1, NULL, tls_error(oc->tls) != NULL ?
+		    tls_error(oc->tls) : "bad response");
+		return;
+	}
+	cache_put(oc, (unsigned char *)body, len);
+	finish(oc, status, "responder", NULL);
+}
+
+/* Do what we can without waiting, when poll says oc->fd is ready. */
+void
+ocspcheck_io(struct ocspcheck *oc)
+{
+	struct sockaddr_storage ss;
+	socklen_t sl;
+	ssize_t n;
+	int error;
+
+	if (oc->state == STATE_DONE)
+		return;
+	if (time(NULL) >= oc->deadline) {
+		finish(oc, -1, NULL, "responder timed out");
+		return;
+	}
+	switch (oc->state) {
+	case STATE_RESOLVING:
+		if (resolve_io(&oc->resolve) == 0)
+			responder_connect(oc);
+		return;
+	case STATE_CONNECTING:
+		/* connected if it has a peer, otherwise why not */
+		sl = sizeof(ss);
+		if (getpeername(oc->fd, (struct sockaddr *)&ss, &sl) == -1) {
+			sl = sizeof(error);
+			if (getsockopt(oc->fd, SOL_SOCKET, SO_ERROR, &error,
+			    &sl) == -1)
+				error = errno;
+			if (error != 0)
+				finish(oc, -1, NULL, strerror(error));
+			return;
+		}
+		oc->state = STATE_SENDING;
+		/* FALLTHROUGH */
+	case STATE_SENDING:
+		while (oc->off < oc->len) {
+			n = write(oc->fd, oc->buf + oc->off,
+			    oc->len - oc->off);
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				return;
+			if (n == -1) {
+				finish(oc, -1, NULL, strerror(errno));
+				return;
+			}
+			oc->off += n;
+		}
+		oc->state = STATE_RECEIVING;
+		oc->len = 0;
+		/* FALLTHROUGH */
+	case STATE_RECEIVING:
+		/* the responder hangs up when it's said everything */
+		for (;;) {
+			n = read(oc->fd, oc->buf + oc->len,
+			    OCSP_MAX - 1 - oc->len);
+			if (n == -1 && (errno == EAGAIN || errno == EINTR))
+				return;
+			if (n == -1) {
+				finish(oc, -1, NULL, strerror(errno));
+				return;
+			}
+			if (n == 0) {
+				answer(oc);
+				return;
+			}
+			oc->len += n;
+			if (oc->len == OCSP_MAX - 1) {
+				finish(oc, -1, NULL, "responder's answer too big");
+				return;
+			}
+		}
+	}
+}
+
+/* Wait for the verdict. 0 if we can believe the server, -1 if not. */
+int
+ocspcheck_wait(struct ocspcheck *oc)
+{
+	struct pollfd pfd;
+	time_t now;
+
+	while (oc->state != STATE_DONE) {
+		now = time(NULL);
+		pfd.fd = oc->fd;
+		pfd.events = ocspcheck_events(oc);
+		if (now < oc->deadline &&
+		    poll(&pfd, 1, (oc->deadline - now) * 1000) == -1 &&
+		    errno != EINTR)
+			err(1, "poll failed");
+		ocspcheck_io(oc);
+	}
+	return (oc->result);
+}
+
+void
+ocspcheck_free(struct ocspcheck *oc)
+{
+	if (oc->state == STATE_RESOLVING)
+		resolve_cancel(&oc->resolve);
+	else if (oc->fd != -1)
+		close(oc->fd);
+	oc->fd = -1;
+	free(oc->buf);
+	oc->buf = NULL;
+}
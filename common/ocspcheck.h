@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Checking that the server's certificate hasn't been revoked, by asking
+ * its CA's OCSP responder ourselves when the server didn't staple an
+ * answer, while the connection gets on with things.
+ */
+
+#define OCSP_FAIL_OPEN		0	/* no answer means carry on */
+#define OCSP_FAIL_CLOSED	1	/* no answer means hang up */
+
+#define OCSP_TIMEOUT		5	/* seconds to wait for the responder */
+
+#include "resolve.h"
+
+struct tls;
+
+struct ocspcheck {
+	int		 state;
+	int		 policy;	/* OCSP_FAIL_OPEN or OCSP_FAIL_CLOSED */
+	int		 result;	/* once done, 0 if good, -1 if not */
+	int		 fd;		/* to the lookup, then the responder */
+	struct resolve	 resolve;
+	struct tls	*tls;
+	const char	*cachedir;
+	char		 key[128];	/* issuer key hash and serial, in hex */
+	char		*buf;		/* the request, then the answer */
+	size_t		 len, off;
+	time_t		 deadline;
+};
+
+int	ocspcheck_policy(const char *);
+void	ocspcheck_start(struct ocspcheck *, struct tls *, int, const char *);
+int	ocspcheck_events(struct ocspcheck *);
+void	ocspcheck_io(struct ocspcheck *);
+int	ocspcheck_wait(struct ocspcheck *);
+void	ocspcheck_free(struct ocspcheck *);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Certificate pinning.
+ *
+ * Normally a client verifies the server's certificate chain up to a
+ * trusted root on every handshake. If we only ever talk to a handful
+ * of servers, we can instead say in advance exactly which certificates
+ * we will accept, turn off chain verification with
+ * tls_config_insecure_noverifycert(3), and after the handshake look the
+ * hash of the certificate we got up in the set. The server name is
+ * still checked by libtls as usual.
+ *
+ * The hashes are SHA256 of the certificate, so they are already as
+ * evenly spread as we could want - the table is indexed directly by
+ * the leading bits of the hash rather than hashing it again.
+ *
+ * Chain verification is also what would have refused a certificate
+ * outside its validity period, so pinset_check() does that itself from
+ * tls_peer_cert_notbefore(3) and tls_peer_cert_notafter(3). A pin
+ * therefore stops working when the certificate it pins expires, and the
+ * server needs a new certificate and the clients a new pin.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+
+#include "pinset.h"
+
+#define PIN_PREFIX	"SHA256:"
+#define PIN_MINSIZE	16
+
+void
+pinset_init(struct pinset *set)
+{
+	set->pins = NULL;
+	set->size = set->count = 0;
+}
+
+/* Is "hash" a well formed pin? */
+static int
+pin_valid(const char *hash)
+{
+	size_t i, plen = strlen(PIN_PREFIX);
+
+	if (strlen(hash) != PIN_HASHLEN || strncmp(hash, PIN_PREFIX, plen) != 0)
+		return (0);
+	for (i = plen; i < PIN_HASHLEN; i++)
+		if (!isxdigit((unsigned char)hash[i]))
+			return (0);
+	return (1);
+}
+
+/* Where to start looking for "hash" - the first 16 hex digits of it. */
+static size_t
+pin_slot(const struct pinset *set, const char *hash)
+{
+	const char *p = hash + strlen(PIN_PREFIX);
+	uint64_t v = 0;
+	int i, c;
+
+	for (i = 0; i < 16; i++) {
+		c = tolower((unsigned char)p[i]);
+		v = (v << 4) | (c <= '9' ? c - '0' : c - 'a' + 10);
+	}
+	return (v & (set->size - 1));
+}
+
+/* Returns the slot holding "hash", or the empty one it would go in */
+static size_t
+pin_find(const struct pinset *set, const char *hash)
+{
+	size_t i;
+
+	for (i = pin_slot(set, hash); set->pins[i][0] != '\0';
+	    i = (i + 1) & (set->size - 1))
+		if (strcasecmp(set->pins[i], hash) == 0)
+			break;
+	return (i);
+}
+
+/* Keep the table at most half full, so a miss is found quickly. */
+static int
+pinset_grow(struct pinset *set)
+{
+	struct pinset bigger;
+	size_t i;
+
+	bigger.size = set->size == 0 ? PIN_MINSIZE : set->size * 2;
+	bigger.count = set->count;
+	if ((bigger.pins = calloc(bigger.size, sizeof(*bigger.pins))) == NULL)
+		return (-1);
+	for (i = 0; i < set->size; i++)
+		if (set->pins[i][0] != '\0')
+			memcpy(bigger.pins[pin_find(&bigger, set->pins[i])],
+			    set->pins[i], sizeof(*set->pins));
+	free(set->pins);
+	*set = bigger;
+	return (0);
+}
+
+/* Add the pin "hash". Returns -1 if it is malformed or we ran out */
+int
+pinset_add(struct pinset *set, const char *hash)
+{
+	size_t i;
+
+	if (!pin_valid(hash)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((set->count + 1) * 2 > set->size && pinset_grow(set) == -1)
+		return (-1);
+	i = pin_find(set, hash);
+	if (set->pins[i][0] == '\0') {
+		memcpy(set->pins[i], hash, PIN_HASHLEN + 1);
+		set->count++;
+	}
+	return (0);
+}
+
+/*
+ * Load pins from "file", one per line. Blank lines and lines starting
+ * with '#' are ignored. Returns -1 if the file can't be read, or has
+ * anything in it that isn't a pin.
+ */
+int
+pinset_load(struct pinset *set, const char *file)
+{
+	char line[256], *p;
+	int lineno = 0, ret = 0;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		warn("%s", file);
+		return (-1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		p[strcspn(p, " \t")] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (pinset_add(set, p) == -1) {
+			warn("%s:%d", file, lineno);
+			ret = -1;
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		warn("%s", file);
+		ret = -1;
+	}
+	fclose(fp);
+	return (ret);
+}
+
+/*
+ * Check the certificate the peer on "ctx" gave us in its handshake
+ * against the set. Returns 0 if it is pinned and currently valid, -1
+ * (after saying why) if not.
+ */
+int
+pinset_check(const struct pinset *set, struct tls *ctx)
+{
+	const char *hash;
+	time_t now;
+
+	if ((hash = tls_peer_cert_hash(ctx)) == NULL) {
+		warnx("pinning: no peer certificate");
+		return (-1);
+	}
+	if (set->count == 0 || !pin_valid(hash) ||
+	    set->pins[pin_find(set, hash)][0] == '\0') {
+		warnx("pinning: certificate %s is not pinned", hash);
+		return (-1);
+	}
+	now = time(NULL);
+	if (now < tls_peer_cert_notbefore(ctx) ||
+	    now >= tls_peer_cert_notafter(ctx)) {
+		warnx("pinning: certificate %s is pinned, but not valid now",
+		    hash);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+pinset_free(struct pinset *set)
+{
+	free(set->pins);
+	pinset_init(set);
+}
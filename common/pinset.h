@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A set of pinned certificates, for clients that only ever talk to a
+ * few servers they know in advance. A pin is the hash of a server's
+ * certificate, in the "SHA256:..." form tls_peer_cert_hash(3) gives.
+ */
+
+#define PIN_HASHLEN	(sizeof("SHA256:") - 1 + 64)
+
+struct tls;
+
+struct pinset {
+	char	(*pins)[PIN_HASHLEN + 1];	/* open addressed, by hash */
+	size_t	  size;				/* a power of two */
+	size_t	  count;
+};
+
+void	pinset_init(struct pinset *);
+int	pinset_add(struct pinset *, const char *);
+int	pinset_load(struct pinset *, const char *);
+int	pinset_check(const struct pinset *, struct tls *);
+void	pinset_free(struct pinset *);
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Static tracepoints in the servers, for watching where the time in a
+ * connection goes with bpftrace or perf, without rebuilding anything.
+ * See ../trace for scripts that use them.
+ *
+ * Every probe has the same arguments:
+ *
+ *	arg0	the connection's file descriptor
+ *	arg1	bytes read by this event (the totals, for close)
+ *	arg2	bytes written by this event (the totals, for close)
+ *	arg3	negotiated TLS version, or NULL before the handshake
+ *	arg4	negotiated cipher, or NULL before the handshake
+ *
+ * A probe site is a single nop until a tracer attaches to it. Looking
+ * up the version and cipher costs more than that, so it is only done
+ * when a tracer has set the probe's semaphore. Tracers that don't set
+ * semaphores (perf) still see the probes, just with NULL for those.
+ *
+ * Where there is no <sys/sdt.h> (it comes with systemtap, on Linux)
+ * the tracepoints compile to nothing at all.
+ *
+ * A server started with -R also records every probe to a file, see
+ * ./recorder.c. Until then that costs a test of a global.
+ */
+
+#include "recorder.h"
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/*
+ * The semaphores are static so that every program including this can
+ * have its own, which is fine as long as only one file in a program
+ * has probes in it.
+ */
+#define PROBE_SEMAPHORE(name)						\
+	static volatile unsigned short tlstutorial_##name##_semaphore	\
+	    __attribute__((used, section(".probes")))
+
+PROBE_SEMAPHORE(accept);
+PROBE_SEMAPHORE(handshake_start);
+PROBE_SEMAPHORE(handshake_done);
+PROBE_SEMAPHORE(first_byte);
+PROBE_SEMAPHORE(read);
+PROBE_SEMAPHORE(write);
+PROBE_SEMAPHORE(close);
+
+#define PROBE(name, fd, nread, nwritten, ctx) do {			\
+	const char *probe_version = NULL, *probe_cipher = NULL;	\
+									\
+	if (__builtin_expect(tlstutorial_##name##_semaphore != 0, 0) &&	\
+	    (ctx) != NULL) {						\
+		probe_version = tls_conn_version(ctx);			\
+		probe_cipher = tls_conn_cipher(ctx);			\
+	}								\
+	STAP_PROBE5(tlstutorial, name, (int)(fd), (size_t)(nread),	\
+	    (size_t)(nwritten), probe_version, probe_cipher);		\
+	RECORD(name, fd, nread, nwritten, ctx);				\
+} while (0)
+
+#else
+
+#define PROBE(name, fd, nread, nwritten, ctx)				\
+	RECORD(name, fd, nread, nwritten, ctx)
+
+#endif
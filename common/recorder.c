@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Recording what the servers do, for replaying later.
+ *
+ * Every probe in ./probe.h also goes to the recorder once a server
+ * has called recorder_open(), which is all it takes to record one.
+ * Events are buffered, and written out when a connection closes or
+ * the buffer fills, with one write(2) to a file opened for appending.
+ * The ex1 server's children each have their own buffer, and writes
+ * that size to a local file don't get mixed up with each other, so
+ * the events for different connections may be out of order in the
+ * file, but those for any one connection aren't.
+ *
+ * A file that already has a recording in it gets added to, with the
+ * times relative to when it was started, so a server that takes over
+ * from another with -U can carry on with the same one.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+#define RECORD_BUF	(256 * RECORD_LEN)
+
+int recording = 0;
+static int rec_fd = -1;
+static uint64_t rec_start;
+static unsigned char rec_buf[RECORD_BUF];
+static size_t rec_len;
+static pid_t rec_pid;
+
+static uint64_t
+usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static void
+put_be(unsigned char *p, uint64_t v, int len)
+{
+	while (len-- > 0) {
+		p[len] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+static uint64_t
+get_be(const unsigned char *p, int len)
+{
+	uint64_t v = 0;
+
+	while (len-- > 0)
+		v = v << 8 | *p++;
+	return (v);
+}
+
+int
+recorder_open(const char *path)
+{
+	unsigned char hdr[RECORD_HDRLEN];
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1 ||
+	    fstat(fd, &sb) == -1) {
+		warn("%s", path);
+		goto fail;
+	}
+	if (sb.st_size == 0) {
+		rec_start = usec_now();
+		memcpy(hdr, RECORD_MAGIC, 8);
+		put_be(hdr + 8, rec_start, 8);
+		if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+			warn("%s", path);
+			goto fail;
+		}
+	} else {
+		if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    memcmp(hdr, RECORD_MAGIC, 8) != 0) {
+			warnx("%s: not a recording", path);
+			goto fail;
+		}
+		rec_start = get_be(hdr + 8, 8);
+	}
+	rec_fd = fd;
+	rec_len = 0;
+	recording = 1;
+	/* the ex1 server's children exit from all over the place */
+	atexit(recorder_flush);
+	return (0);
+ fail:
+	if (fd != -1)
+		close(fd);
+	return (-1);
+}
+
+void
+recorder_flush(void)
+{
+	if (rec_len > 0 && write(rec_fd, rec_buf, rec_len) == -1)
+		warn("recording");
+	rec_len = 0;
+}
+
+void
+recorder_probe(int type, int fd, size_t nread, size_t nwritten,
+    struct tls *ctx)
+{
+	unsigned char *p;
+	size_t size = 0;
+
+	/* a new connection, maybe in a new child */
+	if (type == RECORD_OPEN)
+		rec_pid = getpid();
+	else if (type == RECORD_FULL && tls_conn_session_resumed(ctx))
+		type = RECORD_RESUMED;
+	else if (type == RECORD_READ)
+		size = nread;
+	else if (type == RECORD_WRITE)
+		size = nwritten;
+
+	if (rec_len + RECORD_LEN > sizeof(rec_buf))
+		recorder_flush();
+	p = rec_buf + rec_len;
+	put_be(p, usec_now() - rec_start, 8);
+	put_be(p + 8, size, 4);
+	put_be(p + 12, rec_pid, 4);
+	put_be(p + 16, fd, 2);
+	p[18] = type;
+	p[19] = 0;
+	rec_len += RECORD_LEN;
+	if (type == RECORD_CLOSE)
+		recorder_flush();
+}
+
+void
+record_decode(const unsigned char *p, struct record *r)
+{
+	r->usec = get_be(p, 8);
+	r->size = get_be(p + 8, 4);
+	r->pid = get_be(p + 12, 4);
+	r->fd = get_be(p + 16, 2);
+	r->type = p[18];
+}
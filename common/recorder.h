@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A recording of the traffic a server sees - when each connection
+ * comes and goes, what kind of handshake it did, and how much each
+ * read and write moved, when - but none of the data. ../ex2/replay
+ * plays it back.
+ *
+ * The file is RECORD_MAGIC and the monotonic clock in microseconds
+ * when the recording started, then RECORD_LEN bytes for each event:
+ * microseconds since the start (64 bits), the size (32), the pid (32)
+ * and descriptor (16) of the connection, and the type (8), all big
+ * endian, and a byte of padding.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define RECORD_MAGIC	"TLSREC01"
+#define RECORD_HDRLEN	16
+#define RECORD_LEN	20
+
+#define RECORD_OPEN	1
+#define RECORD_FULL	2	/* the handshake finished */
+#define RECORD_RESUMED	3	/* the same, resuming a session */
+#define RECORD_READ	4	/* the server read "size" bytes */
+#define RECORD_WRITE	5	/* the server wrote "size" bytes */
+#define RECORD_CLOSE	6
+
+struct record {
+	uint64_t	usec;
+	uint32_t	size;
+	uint32_t	pid;
+	uint16_t	fd;
+	uint8_t		type;
+};
+
+struct tls;
+
+extern int recording;
+
+int	recorder_open(const char *);
+void	recorder_probe(int, int, size_t, size_t, struct tls *);
+void	recorder_flush(void);
+void	record_decode(const unsigned char *, struct record *);
+
+/*
+ * What the probes in ./probe.h record. The handshake is full or
+ * resumed depending on the connection, and the rest aren't recorded.
+ */
+#define RECORD_accept		RECORD_OPEN
+#define RECORD_handshake_done	RECORD_FULL
+#define RECORD_read		RECORD_READ
+#define RECORD_write		RECORD_WRITE
+#define RECORD_close		RECORD_CLOSE
+#define RECORD_handshake_start	0
+#define RECORD_first_byte	0
+
+#define RECORD(name, fd, nread, nwritten, ctx) do {			\
+	if (__builtin_expect(recording, 0) && RECORD_##name != 0)	\
+		recorder_probe(RECORD_##name, fd, nread, nwritten, ctx);\
+} while (0)
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Name lookups that don't hold everything else up.
+ *
+ * getaddrinfo(3) waits for the DNS to answer or give up, which can take
+ * seconds, and a program doing lots of things from one poll loop can't
+ * stop for that. resolve_start() forks a child to do the lookup, which
+ * writes back the first address it gets down a pipe and exits. The
+ * caller polls the other end of the pipe, and calls resolve_io() when
+ * it is readable. A host that is already an address is done on the
+ * spot, without a child.
+ *
+ * A process for each lookup isn't free, but it costs a lot less than
+ * waiting for the DNS, and it works everywhere - getaddrinfo_a(3) is
+ * only in glibc.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+/* what the child sends back, in one write, as it's under PIPE_BUF */
+struct answer {
+	int			 error;	/* from getaddrinfo */
+	int			 errnum; /* errno, for EAI_SYSTEM */
+	int			 family, socktype, protocol;
+	socklen_t		 addrlen;
+	struct sockaddr_storage	 addr;
+};
+
+/* Look up "host" and "port", and put the first address in "a". */
+static void
+lookup(const char *host, const char *port, int flags, struct answer *a)
+{
+	struct addrinfo hints, *res;
+
+	memset(a, 0, sizeof(*a));
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = flags;
+	if ((a->error = getaddrinfo(host, port, &hints, &res)) != 0) {
+		a->errnum = errno;
+		return;
+	}
+	a->family = res->ai_family;
+	a->socktype = res->ai_socktype;
+	a->protocol = res->ai_protocol;
+	a->addrlen = res->ai_addrlen;
+	memcpy(&a->addr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+}
+
+static void
+resolve_done(struct resolve *r, const struct answer *a)
+{
+	if (a->error == EAI_SYSTEM) {
+		r->why = strerror(a->errnum);
+		return;
+	}
+	if (a->error != 0) {
+		r->why = gai_strerror(a->error);
+		return;
+	}
+	r->why = NULL;
+	r->family = a->family;
+	r->socktype = a->socktype;
+	r->protocol = a->protocol;
+	r->addrlen = a->addrlen;
+	memcpy(&r->addr, &a->addr, sizeof(r->addr));
+}
+
+/*
+ * Start looking up "host" and "port", for a TCP connection. Returns 1
+ * if the answer is on its way, and r->fd should be polled for it, or 0
+ * if we already have it and "r" says how it went.
+ */
+int
+resolve_start(struct resolve *r, const char *host, const char *port)
+{
+	struct answer a;
+	int p[2];
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->pid = -1;
+
+	/* an address needs no asking, and a bad port won't get better */
+	lookup(host, port, AI_NUMERICHOST, &a);
+	if (a.error != EAI_NONAME) {
+		resolve_done(r, &a);
+		return (0);
+	}
+
+	if (pipe(p) == -1) {
+		r->why = strerror(errno);
+		return (0);
+	}
+	if ((r->pid = fork()) == -1) {
+		r->why = strerror(errno);
+		close(p[0]);
+		close(p[1]);
+		return (0);
+	}
+	if (r->pid == 0) {
+		close(p[0]);
+		lookup(host, port, 0, &a);
+		if (write(p[1], &a, sizeof(a)) != sizeof(a))
+			_exit(1);
+		_exit(0);
+	}
+	close(p[1]);
+	r->fd = p[0];
+	if (fcntl(r->fd, F_SETFL, O_NONBLOCK) == -1) {
+		r->why = strerror(errno);
+		resolve_cancel(r);
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * When r->fd is readable. Returns 1 if there's no answer yet, or 0 if
+ * the lookup is done, and "r" says how it went.
+ */
+int
+resolve_io(struct resolve *r)
+{
+	struct answer a;
+	ssize_t n;
+
+	if (r->fd == -1)
+		return (0);
+	n = read(r->fd, &a, sizeof(a));
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return (1);
+	if (n == sizeof(a))
+		resolve_done(r, &a);
+	else if (n == -1)
+		r->why = strerror(errno);
+	else
+		r->why = "lookup died";
+	resolve_cancel(r);
+	return (0);
+}
+
+/* Give up on the lookup if it's still going, and clean up after it. */
+void
+resolve_cancel(struct resolve *r)
+{
+	if (r->fd != -1)
+		close(r->fd);
+	r->fd = -1;
+	if (r->pid > 0) {
+		kill(r->pid, SIGKILL);
+		while (waitpid(r->pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+	r->pid = -1;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Looking a name up without waiting for it, in a child process. See
+ * ../common/resolve.c
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct resolve {
+	int			 fd;	/* poll for POLLIN, until -1 */
+	pid_t			 pid;
+	const char		*why;	/* once done, NULL if it worked */
+	int			 family, socktype, protocol;
+	socklen_t		 addrlen;
+	struct sockaddr_storage	 addr;
+};
+
+int	resolve_start(struct resolve *, const char *, const char *);
+int	resolve_io(struct resolve *);
+void	resolve_cancel(struct resolve *);
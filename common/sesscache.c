@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Persistent client side TLS session cache.
+ *
+ * The clients here run once per interaction, so without help every run
+ * does a full handshake. libtls can save the session it gets from the
+ * server to a file with tls_config_set_session_fd(3), and offer it for
+ * resumption the next time. We keep one such file per host, port and
+ * server name in a cache directory, so a client talking to different
+ * servers doesn't keep throwing its sessions away.
+ *
+ * libtls insists the session file be a regular file, owned by us and
+ * not readable by anyone else, since it holds the session secrets.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "sesscache.h"
+
+/* Turn what we got into something that is safe in a file name */
+static void
+sanitize(char *s)
+{
+	for (; *s != '\0'; s++) {
+		if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+		    (*s >= '0' && *s <= '9') || *s == '.' || *s == '-' ||
+		    *s == ',')
+			continue;
+		*s = '_';
+	}
+}
+
+/*
+ * Point "config" at the cache file for "host", "port" and "servername"
+ * in "dir", creating both if need be. Returns -1 on failure, in which
+ * case the caller can carry on, it just won't resume.
+ */
+int
+sesscache_setup(struct tls_config *config, const char *dir,
+    const char *host, const char *port, const char *servername)
+{
+	char key[NAME_MAX + 1], path[PATH_MAX];
+	int fd, n;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		warn("session cache %s", dir);
+		return (-1);
+	}
+	n = snprintf(key, sizeof(key), "%s,%s,%s", host, port,
+	    servername != NULL ? servername : "");
+	if (n < 0 || (size_t)n >= sizeof(key)) {
+		warnx("session cache key too long");
+		return (-1);
+	}
+	sanitize(key);
+	n = snprintf(path, sizeof(path), "%s/%s", dir, key);
+	if (n < 0 || (size_t)n >= sizeof(path)) {
+		warnx("session cache path too long");
+		return (-1);
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) {
+		warn("session cache %s", path);
+		return (-1);
+	}
+	if (tls_config_set_session_fd(config, fd) == -1) {
+		warnx("session cache %s: %s", path, tls_config_error(config));
+		close(fd);
+		return (-1);
+	}
+	/* libtls keeps using fd, it is closed when we exit */
+	return (0);
+}
+
+/*
+ * Say whether the handshake on "ctx" resumed a session, in a form
+ * that is easy for a script to count.
+ */
+void
+sesscache_report(struct tls *ctx)
+{
+	fprintf(stderr, "TLS session: %s\n",
+	    tls_conn_session_resumed(ctx) ? "resumed" : "full handshake");
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Named socket tuning profiles, and the code to apply them.
+ *
+ * - "default" is what you get from the kernel, with a sensible backlog.
+ * - "latency" turns off Nagle, and uses TCP Fast Open and deferred
+ *   accept so a client that talks first (such as a TLS client sending
+ *   its ClientHello) gets its first flight to the server with the SYN,
+ *   saving a round trip on every new connection.
+ * - "throughput" leaves Nagle alone and asks for big socket buffers
+ *   so a single connection can fill a long fat pipe.
+ * - "busypoll" is "latency", and has the kernel poll the network card
+ *   for a while when a read finds nothing, rather than wait for an
+ *   interrupt (SO_BUSY_POLL, Linux only). Sockets we accept inherit it
+ *   from the listening one. It needs the cpu to spare, see spin.c.
+ *
+ * Fast Open, deferred accept and busy polling are not available
+ * everywhere, so they are only used when the system headers know about
+ * them. Failing to set a tuning option is worth a warning, but never
+ * fatal.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sockopt.h"
+
+static const struct sockopt profiles[] = {
+	{ "default",	SOMAXCONN, 0, 0,   0, 0, 0, 0 },
+	{ "latency",	SOMAXCONN, 1, 256, 5, 0, 0, 0 },
+	{ "throughput",	SOMAXCONN, 0, 0,   5, 1024 * 1024, 1024 * 1024, 0 },
+	{ "busypoll",	SOMAXCONN, 1, 256, 5, 0, 0, 50 },
+};
+#define NPROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+const struct sockopt *
+sockopt_profile(const char *name)
+{
+	size_t i;
+
+	if (name == NULL)
+		return (&profiles[0]);
+	for (i = 0; i < NPROFILES; i++)
+		if (strcmp(profiles[i].name, name) == 0)
+			return (&profiles[i]);
+	return (NULL);
+}
+
+/* A list of the profile names, for usage messages */
+const char *
+sockopt_profiles(void)
+{
+	static char names[128];
+	size_t i, off = 0;
+
+	if (names[0] != '\0')
+		return (names);
+	for (i = 0; i < NPROFILES && off < sizeof(names); i++)
+		off += snprintf(names + off, sizeof(names) - off, "%s%s",
+		    i > 0 ? "|" : "", profiles[i].name);
+	return (names);
+}
+
+static void
+tune(int fd, int level, int opt, int val, const char *what)
+{
+	if (setsockopt(fd, level, opt, &val, sizeof(val)) == -1)
+		warn("setsockopt %s", what);
+}
+
+/* Options that apply to any stream socket, listening or not */
+static void
+tune_common(int fd, const struct sockopt *so)
+{
+	if (so->nodelay)
+		tune(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	/*
+	 * Buffer sizes have to be set before listen or connect, as they
+	 * determine the window scale we offer in the SYN.
+	 */
+	if (so->sndbuf > 0)
+		tune(fd, SOL_SOCKET, SO_SNDBUF, so->sndbuf, "SO_SNDBUF");
+	if (so->rcvbuf > 0)
+		tune(fd, SOL_SOCKET, SO_RCVBUF, so->rcvbuf, "SO_RCVBUF");
+#ifdef SO_BUSY_POLL
+	if (so->busypoll > 0)
+		tune(fd, SOL_SOCKET, SO_BUSY_POLL, so->busypoll,
+		    "SO_BUSY_POLL");
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	/* and keep polling even when the card has interrupts to give us */
+	if (so->busypoll > 0)
+		tune(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1,
+		    "SO_PREFER_BUSY_POLL");
+#endif
+}
+
+/*
+ * Bind "fd" to "sa" and listen on it, tuned according to "so".
+ * Returns -1 with errno set if we can't bind or listen.
+ */
+int
+sockopt_listen(int fd, const struct sockaddr *sa, socklen_t salen,
+    const struct sockopt *so)
+{
+	int one = 1;
+
+	/* This has to happen before bind to do any good */
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		return (-1);
+	tune_common(fd, so);
+
+	if (bind(fd, sa, salen) == -1)
+		return (-1);
+
+#ifdef TCP_FASTOPEN
+	if (so->fastopen > 0)
+		tune(fd, IPPROTO_TCP, TCP_FASTOPEN, so->fastopen,
+		    "TCP_FASTOPEN");
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	if (so->defer_accept > 0)
+		tune(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, so->defer_accept,
+		    "TCP_DEFER_ACCEPT");
+#endif
+
+	return (listen(fd, so->backlog));
+}
+
+/*
+ * Per connection tuning for a descriptor we got back from accept.
+ * Most systems copy these from the listen socket, but not all do.
+ */
+int
+sockopt_accepted(int fd, const struct sockopt *so)
+{
+	if (so->nodelay)
+		tune(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	return (0);
+}
+
+/*
+ * Close a connection we won't serve with a reset rather than a FIN.
+ * The client finds out straight away instead of after its handshake
+ * times out, and we don't keep the socket around in TIME_WAIT.
+ */
+int
+sockopt_reset(int fd)
+{
+	struct linger l;
+
+	l.l_onoff = 1;
+	l.l_linger = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)) == -1)
+		warn("setsockopt SO_LINGER");
+	return (close(fd));
+}
+
+/*
+ * Connect "fd" to "sa", tuned according to "so".
+ *
+ * If we have "data" to send first, and the profile asks for fast open,
+ * it is handed to sendto(MSG_FASTOPEN) so it rides in the SYN, and
+ * "*sent" says how much of it went. Without data, fast open is asked
+ * for with TCP_FASTOPEN_CONNECT, so the first write on the socket goes
+ * out with the SYN - that is how a TLS library's ClientHello gets
+ * there. Only ask for fast open if the client talks first, as no SYN
+ * is sent until it does.
+ */
+int
+sockopt_connect(int fd, const struct sockaddr *sa, socklen_t salen,
+    const struct sockopt *so, const void *data, size_t len, ssize_t *sent)
+{
+	*sent = 0;
+	tune_common(fd, so);
+
+	if (so->fastopen && data != NULL && len > 0) {
+#ifdef MSG_FASTOPEN
+		ssize_t n;
+
+		n = sendto(fd, data, len, MSG_FASTOPEN, sa, salen);
+		if (n >= 0) {
+			*sent = n;
+			return (0);
+		}
+		/* fast open is turned off, fall back to a normal connect */
+		if (errno != EOPNOTSUPP && errno != ENOPROTOOPT)
+			return (-1);
+#endif
+	} else if (so->fastopen) {
+#ifdef TCP_FASTOPEN_CONNECT
+		tune(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+		    "TCP_FASTOPEN_CONNECT");
+#endif
+	}
+
+	return (connect(fd, sa, salen));
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Socket tuning shared by the servers and clients in the exercises.
+ *
+ * Rather than every program hard coding its own listen backlog and
+ * socket options, they pick a named profile, and use sockopt_listen()
+ * and sockopt_connect() to set their sockets up with it.
+ */
+
+struct sockaddr;
+
+struct sockopt {
+	const char	*name;
+	int		 backlog;	/* listen(2) backlog */
+	int		 nodelay;	/* set TCP_NODELAY */
+	int		 fastopen;	/* TFO queue length on servers, on/off for clients */
+	int		 defer_accept;	/* seconds to wait for data before accept */
+	int		 sndbuf;	/* SO_SNDBUF, 0 for the kernel default */
+	int		 rcvbuf;	/* SO_RCVBUF, 0 for the kernel default */
+	int		 busypoll;	/* SO_BUSY_POLL microseconds, 0 for none */
+};
+
+const struct sockopt *sockopt_profile(const char *);
+const char	*sockopt_profiles(void);
+int		 sockopt_listen(int, const struct sockaddr *, socklen_t,
+		    const struct sockopt *);
+int		 sockopt_accepted(int, const struct sockopt *);
+int		 sockopt_reset(int);
+int		 sockopt_connect(int, const struct sockaddr *, socklen_t,
+		    const struct sockopt *, const void *, size_t, ssize_t *);
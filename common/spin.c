@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Busy polling.
+ *
+ * A process asleep in poll(2) has to be woken up and scheduled when
+ * something arrives, which costs several microseconds per message. If
+ * there's a cpu to spare, spin_poll() keeps asking with a zero timeout
+ * for up to "budget" microseconds first, and only sleeps once nothing
+ * has turned up for that long. Between tries it offers the cpu to
+ * anyone else who wants it, which costs next to nothing on a cpu of
+ * its own, and keeps it from starving whoever it's talking to on a
+ * shared one.
+ *
+ * It works best on a cpu nothing else uses (isolcpus=, or a cpuset),
+ * and spin_pin() puts us there. That's Linux only.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+
+#include "spin.h"
+
+/*
+ * poll(2), but spin for up to "budget" microseconds before blocking
+ * for what's left of "timeout" milliseconds (-1 for ever).
+ */
+int
+spin_poll(struct pollfd *fds, nfds_t nfds, int timeout, long budget)
+{
+	struct timespec start, now;
+	long long spun;
+	int n;
+
+	if (budget <= 0 || timeout == 0)
+		return (poll(fds, nfds, timeout));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		if ((n = poll(fds, nfds, 0)) != 0)
+			return (n);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		spun = (now.tv_sec - start.tv_sec) * 1000000LL +
+		    (now.tv_nsec - start.tv_nsec) / 1000;
+		if (spun >= budget)
+			break;
+		sched_yield();
+	}
+	if (timeout > 0) {
+		timeout -= spun / 1000;
+		if (timeout < 0)
+			timeout = 0;
+	}
+	return (poll(fds, nfds, timeout));
+}
+
+/* Run only on "cpu" from now on. */
+int
+spin_pin(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return (sched_setaffinity(0, sizeof(set), &set));
+#else
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
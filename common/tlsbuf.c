@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Ciphertext buffers for libtls.
+ *
+ * Given a socket, libtls does its own read(2) and write(2) for every
+ * record - a readable socket with four records waiting is four reads,
+ * and a reply of four records is four writes. Set up with
+ * tls_accept_cbs() or tls_connect_cbs() and these callbacks instead,
+ * libtls only ever reads and writes a pair of ring buffers, and the
+ * caller moves the bytes between them and the socket when it likes:
+ * tlsb_fill() does one readv(2) of as much as there's room for, and
+ * tlsb_flush() one writev(2) of everything libtls has written since.
+ *
+ * When the ring is empty, or full, the callbacks say TLS_WANT_POLLIN
+ * or TLS_WANT_POLLOUT, and libtls passes that on - so the caller's
+ * state machine works as it did with the socket, except that POLLIN
+ * now means "after a tlsb_fill()", and nothing has been sent until
+ * the next tlsb_flush().
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "tlsbuf.h"
+
+int
+tlsb_init(struct tlsbuf *b, int fd)
+{
+	return (tlsb_init_mem(b, fd, malloc(2 * TLSB_SIZE)));
+}
+
+/*
+ * tlsb_init(), with the 2 * TLSB_SIZE bytes at "mem" for the buffers,
+ * given back by tlsb_release() rather than freed. Fails if "mem" is
+ * NULL, so it can be handed an allocation without checking it first.
+ */
+int
+tlsb_init_mem(struct tlsbuf *b, int fd, unsigned char *mem)
+{
+	memset(b, 0, sizeof(*b));
+	if ((b->in.buf = mem) == NULL)
+		return (-1);
+	b->out.buf = b->in.buf + TLSB_SIZE;
+	b->fd = fd;
+	return (0);
+}
+
+void
+tlsb_free(struct tlsbuf *b)
+{
+	free(tlsb_release(b));
+}
+
+/* Done with the buffers, and hand them back to the caller. */
+unsigned char *
+tlsb_release(struct tlsbuf *b)
+{
+	unsigned char *mem = b->in.buf;
+
+	b->in.buf = b->out.buf = NULL;
+	return (mem);
+}
+
+/*
+ * The ring's data, or with "space" its free space, as one or two
+ * pieces depending on whether it wraps around the end. Returns how many.
+ */
+static int
+ring_iov(const struct tlsbuf_ring *r, int space, struct iovec iov[2])
+{
+	size_t start, len, first;
+
+	if (space) {
+		start = (r->off + r->len) % TLSB_SIZE;
+		len = TLSB_SIZE - r->len;
+	} else {
+		start = r->off;
+		len = r->len;
+	}
+	if (len == 0)
+		return (0);
+	first = TLSB_SIZE - start;
+	iov[0].iov_base = r->buf + start;
+	if (len <= first) {
+		iov[0].iov_len = len;
+		return (1);
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - first;
+	return (2);
+}
+
+static void
+ring_skip(struct tlsbuf_ring *r, size_t len)
+{
+	r->off = (r->off + len) % TLSB_SIZE;
+	r->len -= len;
+}
+
+static size_t
+ring_put(struct tlsbuf_ring *r, const unsigned char *p, size_t len)
+{
+	struct iovec iov[2];
+	size_t n, done = 0;
+	int cnt, i;
+
+	cnt = ring_iov(r, 1, iov);
+	for (i = 0; i < cnt && done < len; i++) {
+		n = len - done;
+		if (n > iov[i].iov_len)
+			n = iov[i].iov_len;
+		memcpy(iov[i].iov_base, p + done, n);
+		done += n;
+	}
+	r->len += done;
+	return (done);
+}
+
+static size_t
+ring_get(struct tlsbuf_ring *r, unsigned char *p, size_t len)
+{
+	struct iovec iov[2];
+	size_t n, done = 0;
+	int cnt, i;
+
+	cnt = ring_iov(r, 0, iov);
+	for (i = 0; i < cnt && done < len; i++) {
+		n = len - done;
+		if (n > iov[i].iov_len)
+			n = iov[i].iov_len;
+		memcpy(p + done, iov[i].iov_base, n);
+		done += n;
+	}
+	ring_skip(r, done);
+	return (done);
+}
+
+/* bytes we already read from the socket ourselves, for libtls to have first */
+size_t
+tlsb_put(struct tlsbuf *b, const void *p, size_t len)
+{
+	return (ring_put(&b->in, p, len));
+}
+
+/*
+ * One readv(2) into the free space of the input ring. Returns how much
+ * it read, 0 if there was nothing to read or no room, and -1 once the
+ * socket has no more for us, with b->error set if that's an error.
+ */
+int
+tlsb_fill(struct tlsbuf *b)
+{
+	struct iovec iov[2];
+	ssize_t r;
+	int cnt;
+
+	if (b->eof)
+		return (-1);
+	if ((cnt = ring_iov(&b->in, 1, iov)) == 0)
+		return (0);
+	r = readv(b->fd, iov, cnt);
+	b->reads++;
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return (0);
+	if (r <= 0) {
+		b->eof = 1;
+		if (r == -1)
+			b->error = errno;
+		return (-1);
+	}
+	b->in.len += r;
+	b->inbytes += r;
+	return (r > INT_MAX ? INT_MAX : (int)r);
+}
+
+/*
+ * One writev(2) of everything in the output ring. Returns 0 if that
+ * was all of it, 1 if some is left for when the socket is writable,
+ * and -1 with b->error set if the socket failed.
+ */
+int
+tlsb_flush(struct tlsbuf *b)
+{
+	struct iovec iov[2];
+	ssize_t w;
+	int cnt;
+
+	if (b->error)
+		return (-1);
+	if ((cnt = ring_iov(&b->out, 0, iov)) == 0)
+		return (0);
+	w = writev(b->fd, iov, cnt);
+	b->writes++;
+	if (w == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return (1);
+		b->error = errno;
+		return (-1);
+	}
+	ring_skip(&b->out, w);
+	b->outbytes += w;
+	return (b->out.len > 0);
+}
+
+ssize_t
+tlsb_read_cb(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct tlsbuf *b = arg;
+
+	if (b->in.len > 0) {
+		b->cbreads++;
+		return (ring_get(&b->in, buf, len));
+	}
+	if (!b->eof)
+		return (TLS_WANT_POLLIN);
+	if (b->error) {
+		errno = b->error;
+		return (-1);
+	}
+	return (0);
+}
+
+ssize_t
+tlsb_write_cb(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct tlsbuf *b = arg;
+	size_t n;
+
+	if (b->error) {
+		errno = b->error;
+		return (-1);
+	}
+	if ((n = ring_put(&b->out, buf, len)) == 0)
+		return (TLS_WANT_POLLOUT);
+	b->cbwrites++;
+	return (n);
+}
+
+void
+tlsb_report(const struct tlsbuf *b, const char *name)
+{
+	fprintf(stderr, "%s: read %llu bytes in %llu syscalls for %llu "
+	    "libtls reads, wrote %llu bytes in %llu syscalls for %llu "
+	    "libtls writes\n", name, (unsigned long long)b->inbytes,
+	    (unsigned long long)b->reads, (unsigned long long)b->cbreads,
+	    (unsigned long long)b->outbytes, (unsigned long long)b->writes,
+	    (unsigned long long)b->cbwrites);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Ciphertext buffers between libtls and a socket, for connections set
+ * up with tls_accept_cbs() or tls_connect_cbs().
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define TLSB_SIZE	(64 * 1024)	/* each way, a few full records */
+
+struct tls;
+
+struct tlsbuf_ring {
+	unsigned char	*buf;
+	size_t		 off, len;	/* what's buffered */
+};
+
+struct tlsbuf {
+	int			 fd;
+	int			 eof;		/* no more from the socket */
+	int			 error;		/* errno, if it failed */
+	struct tlsbuf_ring	 in, out;
+	uint64_t		 reads, writes;	/* syscalls */
+	uint64_t		 cbreads, cbwrites;	/* callbacks from libtls */
+	uint64_t		 inbytes, outbytes;
+};
+
+int	 tlsb_init(struct tlsbuf *, int);
+int	 tlsb_init_mem(struct tlsbuf *, int, unsigned char *);
+void	 tlsb_free(struct tlsbuf *);
+unsigned char	*tlsb_release(struct tlsbuf *);
+size_t	 tlsb_put(struct tlsbuf *, const void *, size_t);
+int	 tlsb_fill(struct tlsbuf *);
+int	 tlsb_flush(struct tlsbuf *);
+ssize_t	 tlsb_read_cb(struct tls *, void *, size_t, void *);
+ssize_t	 tlsb_write_cb(struct tls *, const void *, size_t, void *);
+void	 tlsb_report(const struct tlsbuf *, const char *);
+
+#define tlsb_readable(b)	((b)->in.len > 0 || (b)->eof)
+#define tlsb_writable(b)	((b)->out.len < TLSB_SIZE)
+#define tlsb_pending(b)		((b)->out.len > 0)
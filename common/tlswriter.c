@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Buffered TLS writes.
+ *
+ * Every tls_write() is at least one TLS record, with its own header,
+ * MAC and padding, and a write(2) to go with it. Programs like the ex2
+ * echo server that write whatever they have as soon as they have it
+ * end up sending a lot of records with a few bytes in each. Instead,
+ * the caller hands its data to a tlswriter, which holds on to it until
+ * it has a full record's worth, or the caller says to flush, or it's
+ * been waiting long enough - see tlsw_timeout().
+ *
+ * How big "full" is changes over the life of a connection. A new
+ * connection's congestion window is small, and a 16k record spread
+ * over a dozen TCP segments can't be decrypted until the last of them
+ * arrives, so we start with records that fit in one segment. Once
+ * we've sent TLSW_RAMP bytes the window has opened up, and we switch
+ * to the biggest records there are, which cost the least per byte.
+ * If the connection goes quiet for TLSW_IDLE ms, the window will have
+ * shrunk again, and so do we.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+
+#include "tlswriter.h"
+
+static long long
+ms_since(const struct timespec *then, const struct timespec *now)
+{
+	return ((now->tv_sec - then->tv_sec) * 1000LL +
+	    (now->tv_nsec - then->tv_nsec) / 1000000);
+}
+
+void
+tlsw_init(struct tlswriter *w, struct tls *tls)
+{
+	w->tls = tls;
+	w->off = w->len = w->inflight = 0;
+	w->recsize = TLSW_SMALL;
+	w->ramp = 0;
+	w->records = w->bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+	w->lastwrite = w->oldest = w->start;
+}
+
+/*
+ * Buffer as much of "cnt" iovecs as we have room for, and return how
+ * much that was. Nothing is written until tlsw_flush().
+ */
+size_t
+tlsw_writev(struct tlswriter *w, const struct iovec *iov, int cnt)
+{
+	size_t n, room, total = 0;
+	int i;
+
+	/*
+	 * a record tls_write wants us to try again with has to stay
+	 * where it is, otherwise we can move what's left to the front.
+	 */
+	if (w->inflight == 0 && w->off > 0) {
+		memmove(w->buf, w->buf + w->off, w->len);
+		w->off = 0;
+	}
+	for (i = 0; i < cnt; i++) {
+		room = sizeof(w->buf) - w->off - w->len;
+		if ((n = iov[i].iov_len) > room)
+			n = room;
+		if (n == 0)
+			break;
+		if (w->len == 0)
+			clock_gettime(CLOCK_MONOTONIC, &w->oldest);
+		memcpy(w->buf + w->off + w->len, iov[i].iov_base, n);
+		w->len += n;
+		total += n;
+	}
+	return (total);
+}
+
+/*
+ * Write out whole records, or everything we have if "all" is set.
+ * Returns 0 once that's done, TLS_WANT_POLLIN or TLS_WANT_POLLOUT if
+ * the socket has to be ready first, and -1 on error.
+ */
+int
+tlsw_flush(struct tlswriter *w, int all)
+{
+	struct timespec now;
+	size_t n;
+	ssize_t r;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (w->inflight == 0 && ms_since(&w->lastwrite, &now) > TLSW_IDLE) {
+		w->recsize = TLSW_SMALL;
+		w->ramp = 0;
+	}
+	for (;;) {
+		if ((n = w->inflight) == 0) {
+			n = w->len < w->recsize ? w->len : w->recsize;
+			if (n == 0 || (!all && n < w->recsize))
+				return (0);
+		}
+		r = tls_write(w->tls, w->buf + w->off, n);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT) {
+			w->inflight = n;
+			return (r);
+		}
+		if (r == -1)
+			return (-1);
+		w->inflight = 0;
+		w->off += r;
+		if ((w->len -= r) == 0)
+			w->off = 0;
+		w->records++;
+		w->bytes += r;
+		if ((w->ramp += r) >= TLSW_RAMP)
+			w->recsize = TLSW_MAX;
+		w->lastwrite = now;
+	}
+}
+
+/*
+ * How many ms until what's buffered has waited "delay" ms, for a
+ * poll(2) timeout. 0 means flush now, -1 that there's nothing to wait
+ * for.
+ */
+int
+tlsw_timeout(const struct tlswriter *w, int delay)
+{
+	struct timespec now;
+	long long left;
+
+	if (w->len == 0 || w->inflight != 0)
+		return (-1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = delay - ms_since(&w->oldest, &now);
+	return (left > 0 ? (int)left : 0);
+}
+
+void
+tlsw_report(const struct tlswriter *w, const char *name)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - w->start.tv_sec) +
+	    (now.tv_nsec - w->start.tv_nsec) / 1e9;
+	fprintf(stderr, "%s: %llu bytes in %llu records, %.0f bytes/record, "
+	    "%.0f records/s\n", name, (unsigned long long)w->bytes,
+	    (unsigned long long)w->records,
+	    w->records ? (double)w->bytes / w->records : 0.0,
+	    secs > 0 ? w->records / secs : 0.0);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A buffered TLS writer, that turns lots of small writes into a few
+ * full TLS records.
+ */
+
+#include <sys/uio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TLSW_MAX	16384		/* the biggest TLS record there is */
+#define TLSW_SMALL	1360		/* record that fits one TCP segment */
+#define TLSW_RAMP	(1024 * 1024)	/* send this much in small records */
+#define TLSW_IDLE	1000		/* ms idle before we start small again */
+
+struct tls;
+
+struct tlswriter {
+	struct tls	*tls;
+	unsigned char	 buf[TLSW_MAX];
+	size_t		 off, len;	/* what's buffered */
+	size_t		 inflight;	/* what tls_write said to try again */
+	size_t		 recsize;	/* how big we make records right now */
+	size_t		 ramp;		/* bytes since we started small */
+	struct timespec	 oldest;	/* when what's buffered first came */
+	struct timespec	 lastwrite;
+	struct timespec	 start;
+	uint64_t	 records, bytes;
+};
+
+void	 tlsw_init(struct tlswriter *, struct tls *);
+size_t	 tlsw_writev(struct tlswriter *, const struct iovec *, int);
+int	 tlsw_flush(struct tlswriter *, int);
+int	 tlsw_timeout(const struct tlswriter *, int);
+void	 tlsw_report(const struct tlswriter *, const char *);
@@ -31,39 +31,124 @@
 #include <string.h>
 #include <unistd.h>
 
-
+#include "message.h"
+#include "sockopt.h"
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s ipaddress portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-k requests] [-p %s] ipaddress "
+	    "portnumber\n", __progname, sockopt_profiles());
 	exit(1);
 }
 
+/* message_io functions for a plain socket */
+static ssize_t
+sd_read(void *arg, void *buf, size_t len)
+{
+	int sd = *(int *)arg;
+	ssize_t r;
+
+	do {
+		r = read(sd, buf, len);
+	} while (r == -1 && errno == EINTR);
+	return (r);
+}
+
+static ssize_t
+sd_write(void *arg, void *buf, size_t len)
+{
+	int sd = *(int *)arg;
+	ssize_t w;
+
+	do {
+		w = write(sd, buf, len);
+	} while (w == -1 && errno == EINTR);
+	return (w);
+}
+
+/*
+ * keep-alive mode - make "requests" requests of a server started with
+ * -k over the one connection, each one a length prefixed message
+ * answered by another.
+ */
+static void
+keepalive(int sd, unsigned long requests)
+{
+	char req[64], buffer[MESSAGE_MAX + 1];
+	unsigned long i;
+	size_t len;
+
+	for (i = 0; i < requests; i++) {
+		snprintf(req, sizeof(req), "request %lu", i);
+		if (message_send(sd_write, &sd, req, strlen(req)) == -1)
+			err(1, "write failed");
+		switch (message_recv(sd_read, &sd, buffer, sizeof(buffer) - 1,
+		    &len)) {
+		case -1:
+			err(1, "read failed");
+		case 0:
+			errx(1, "server hung up");
+		}
+		buffer[len] = '\0';
+		printf("Server sent:  %s", buffer);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in server_sa;
+	const struct sockopt *so;
+	struct sockopt sopt;
 	char buffer[80], *ep;
+	unsigned long requests = 0;
 	size_t maxread;
 	ssize_t r, rc;
 	u_short port;
 	u_long p;
-	int sd;
+	int ch, sd;
 
-	if (argc != 3)
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "k:p:")) != -1) {
+		switch (ch) {
+		case 'k':
+			errno = 0;
+			requests = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    requests == 0) {
+				fprintf(stderr, "%s - bad request count\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
 		usage();
 
-        p = strtoul(argv[2], &ep, 10);
-        if (*argv[2] == '\0' || *ep != '\0') {
+        p = strtoul(argv[1], &ep, 10);
+        if (*argv[1] == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[2]);
+		fprintf(stderr, "%s - not a number\n", argv[1]);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[2]);
+		fprintf(stderr, "%s - value out of range\n", argv[1]);
 		usage();
 	}
 	/* now safe to do this */
@@ -75,9 +160,9 @@ int main(int argc, char *argv[])
 	memset(&server_sa, 0, sizeof(server_sa));
 	server_sa.sin_family = AF_INET;
 	server_sa.sin_port = htons(port);
-	server_sa.sin_addr.s_addr = inet_addr(argv[1]);
+	server_sa.sin_addr.s_addr = inet_addr(argv[0]);
 	if (server_sa.sin_addr.s_addr == INADDR_NONE) {
-		fprintf(stderr, "Invalid IP address %s\n", argv[1]);
+		fprintf(stderr, "Invalid IP address %s\n", argv[0]);
 		usage();
 	}
 
@@ -85,11 +170,23 @@ int main(int argc, char *argv[])
 	if ((sd=socket(AF_INET,SOCK_STREAM,0)) == -1)
 		err(1, "socket failed");
 
-	/* connect the socket to the server described in "server_sa" */
-	if (connect(sd, (struct sockaddr *)&server_sa, sizeof(server_sa))
-	    == -1)
+	/*
+	 * connect the socket to the server described in "server_sa".
+	 * the server talks first, so fast open would only hold up our SYN
+	 * waiting for data we are never going to send.
+	 */
+	sopt = *so;
+	sopt.fastopen = 0;
+	if (sockopt_connect(sd, (struct sockaddr *)&server_sa,
+	    sizeof(server_sa), &sopt, NULL, 0, &r) == -1)
 		err(1, "connect failed");
 
+	if (requests > 0) {
+		keepalive(sd, requests);
+		close(sd);
+		return(0);
+	}
+
 	/*
 	 * finally, we are connected. find out what magnificent wisdom
 	 * our server is going to send to us - since we really don't know
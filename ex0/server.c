@@ -27,25 +27,99 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "handoff.h"
+#include "message.h"
+#include "sockopt.h"
+
+/* In keep-alive mode, how long a client may sit quiet before we hang up */
+#define IDLE_TIMEOUT	30
+
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-k] [-p %s] [-U path] portnumber\n",
+	    __progname, sockopt_profiles());
 	exit(1);
 }
 
+/*
+ * message_io functions for a plain socket. A read that times out
+ * (see SO_RCVTIMEO below) fails with EAGAIN, which we pass back as
+ * an error so an idle client gets hung up on.
+ */
+static ssize_t
+sd_read(void *arg, void *buf, size_t len)
+{
+	int sd = *(int *)arg;
+	ssize_t r;
+
+	do {
+		r = read(sd, buf, len);
+	} while (r == -1 && errno == EINTR);
+	return (r);
+}
+
+static ssize_t
+sd_write(void *arg, void *buf, size_t len)
+{
+	int sd = *(int *)arg;
+	ssize_t w;
+
+	do {
+		w = write(sd, buf, len);
+	} while (w == -1 && errno == EINTR);
+	return (w);
+}
+
+/*
+ * keep-alive mode - rather than saying our piece and hanging up, answer
+ * each length prefixed request from the client with our message, until
+ * it hangs up or goes idle.
+ */
+static void
+serve_requests(int sd, const char *msg)
+{
+	struct timeval tv = { IDLE_TIMEOUT, 0 };
+	char req[MESSAGE_MAX];
+	size_t len;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+		warn("setsockopt SO_RCVTIMEO");
+	while (message_recv(sd_read, &sd, req, sizeof(req), &len) == 1) {
+		if (message_send(sd_write, &sd, msg, strlen(msg)) == -1)
+			break;
+	}
+}
+
+/*
+ * Once we have handed our socket to a new server we're done accepting,
+ * but our children still have their clients - wait for them to finish.
+ * The SIGCHLD handler may reap some of them, so ECHILD is how we end.
+ */
+static void
+drain(void)
+{
+	printf("Handed off to a new server, waiting for clients to finish\n");
+	fflush(stdout);
+	while (waitpid(WAIT_ANY, NULL, 0) != -1 || errno == EINTR)
+		;
+	exit(0);
+}
+
 static void kidhandler(int signum) {
 	/* signal handler for SIGCHLD */
 	waitpid(WAIT_ANY, NULL, WNOHANG);
@@ -56,32 +130,66 @@ int main(int argc,  char *argv[])
 {
 	struct sockaddr_in sockname, client;
 	char buffer[80], *ep;
+	const char *upgrade = NULL;
+	struct handoff handoff;
+	int keepalive = 0, usd = -1;
 	struct sigaction sa;
 	unsigned int clientlen;
 	int sd;
 	u_short port;
+	const struct sockopt *so;
+	struct sockopt sopt;
 	pid_t pid;
 	u_long p;
+	int ch;
 
 	/*
-	 * first, figure out what port we will listen on - it should
-	 * be our first parameter.
+	 * -k turns on keep-alive mode, -p names the socket tuning
+	 * profile to use, see ../common/sockopt.c, and -U is where we
+	 * meet the server that replaces us, see ../common/handoff.c
 	 */
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "kp:U:")) != -1) {
+		switch (ch) {
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'U':
+			upgrade = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc != 2)
+	/*
+	 * now figure out what port we will listen on - it should
+	 * be our only parameter.
+	 */
+
+	if (argc != 1)
 		usage();
-		errno = 0;
-        p = strtoul(argv[1], &ep, 10);
-        if (*argv[1] == '\0' || *ep != '\0') {
+	errno = 0;
+        p = strtoul(argv[0], &ep, 10);
+        if (*argv[0] == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[1]);
+		fprintf(stderr, "%s - not a number\n", argv[0]);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[1]);
+		fprintf(stderr, "%s - value out of range\n", argv[0]);
 		usage();
 	}
 	/* now safe to do this */
@@ -92,19 +200,45 @@ int main(int argc,  char *argv[])
 	    "What is the air speed velocity of a coconut laden swallow?\n",
 	    sizeof(buffer));
 
-	memset(&sockname, 0, sizeof(sockname));
-	sockname.sin_family = AF_INET;
-	sockname.sin_port = htons(port);
-	sockname.sin_addr.s_addr = htonl(INADDR_ANY);
-	sd=socket(AF_INET,SOCK_STREAM,0);
-	if ( sd == -1)
-		err(1, "socket failed");
+	/*
+	 * we talk first, so the client never sends anything we could
+	 * defer the accept for, or that could come with its SYN. In
+	 * keep-alive mode the client does speak first, but we leave
+	 * these off to keep the two modes behaving the same.
+	 */
+	sopt = *so;
+	sopt.defer_accept = 0;
+	sopt.fastopen = 0;
 
-	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
-		err(1, "bind failed");
+	/*
+	 * if there's a server running with -U already, we take over its
+	 * listening socket, rather than making our own. We have no TLS
+	 * session ticket keys to pass on, so that's all there is to it.
+	 */
+	memset(&handoff, 0, sizeof(handoff));
+	if (upgrade != NULL && handoff_receive(&handoff, upgrade) == -1)
+		errx(1, "unable to take over from %s", upgrade);
+	if (handoff.nfds > 0) {
+		sd = handoff.fds[0];
+		while (handoff.nfds > 1)
+			close(handoff.fds[--handoff.nfds]);
+		/* tell the old server we have it from here */
+		handoff_ready(&handoff);
+	} else {
+		memset(&sockname, 0, sizeof(sockname));
+		sockname.sin_family = AF_INET;
+		sockname.sin_port = htons(port);
+		sockname.sin_addr.s_addr = htonl(INADDR_ANY);
+		sd=socket(AF_INET,SOCK_STREAM,0);
+		if ( sd == -1)
+			err(1, "socket failed");
 
-	if (listen(sd,3) == -1)
-		err(1, "listen failed");
+		if (sockopt_listen(sd, (struct sockaddr *) &sockname,
+		    sizeof(sockname), &sopt) == -1)
+			err(1, "bind/listen failed");
+	}
+	if (upgrade != NULL && (usd = handoff_listen(upgrade)) == -1)
+		errx(1, "unable to listen on %s", upgrade);
 
 	/*
 	 * we're now bound, and listening for connections on "sd" -
@@ -134,10 +268,37 @@ int main(int argc,  char *argv[])
 	printf("Server up and listening for connections on port %u\n", port);
 	for(;;) {
 		int clientsd;
+
+		/*
+		 * with -U, wait for either a client or a new server to
+		 * hand over to.
+		 */
+		if (usd != -1) {
+			struct pollfd pfd[2];
+
+			pfd[0].fd = sd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = usd;
+			pfd[1].events = POLLIN;
+			if (poll(pfd, 2, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "poll failed");
+			}
+			if ((pfd[1].revents & POLLIN) &&
+			    handoff_send(usd, &sd, 1, &handoff.keys) == 0) {
+				close(usd);
+				close(sd);
+				drain();
+			}
+			if (!(pfd[0].revents & POLLIN))
+				continue;
+		}
 		clientlen = sizeof(&client);
 		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
 		if (clientsd == -1)
 			err(1, "accept failed");
+		sockopt_accepted(clientsd, &sopt);
 		/*
 		 * We fork child to deal with each connection, this way more
 		 * than one client can connect to us and get served at any one
@@ -150,6 +311,14 @@ int main(int argc,  char *argv[])
 
 		if(pid == 0) {
 			ssize_t written, w;
+
+			if (usd != -1)
+				close(usd);
+			if (keepalive) {
+				serve_requests(clientsd, buffer);
+				close(clientsd);
+				exit(0);
+			}
 			/*
 			 * write the message to the client, being sure to
 			 * handle a short write, or being interrupted by
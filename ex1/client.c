@@ -14,7 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* client.c  - the "classic" example of a socket client */
+/* client.c  - the "classic" example of a socket client, over TLS */
 #include <arpa/inet.h>
 
 #include <netinet/in.h>
@@ -29,41 +29,149 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <tls.h>
 #include <unistd.h>
 
+#include "connpool.h"
+#include "message.h"
+#include "ocspcheck.h"
+#include "pinset.h"
+#include "sesscache.h"
+#include "sockopt.h"
 
+#define CA_FILE		"../CA/root.pem"
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s ipaddress portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-k requests] [-n servername] "
+	    "[-O open|closed] [-o ocspdir] [-P pinfile] [-p %s] "
+	    "[-s sessiondir] ipaddress portnumber\n", __progname,
+	    sockopt_profiles());
 	exit(1);
 }
 
+/*
+ * keep-alive mode - make "requests" requests of a server started with
+ * -k, each one a length prefixed message answered by another. The
+ * connection comes from our pool, so only the first request pays for
+ * a handshake.
+ */
+static void
+keepalive(struct connpool *pool, unsigned long requests)
+{
+	char req[64], buffer[MESSAGE_MAX + 1];
+	unsigned long i;
+	struct pconn *pc;
+	size_t len = 0;
+	int fresh, ret;
+
+	for (i = 0; i < requests; i++) {
+		snprintf(req, sizeof(req), "request %lu", i);
+		do {
+			if ((pc = connpool_get(pool)) == NULL)
+				exit(1);
+			fresh = (pc->requests == 0);
+			ret = -1;
+			if (message_send(connpool_write, pc, req,
+			    strlen(req)) == 0)
+				ret = message_recv(connpool_read, pc, buffer,
+				    sizeof(buffer) - 1, &len);
+			if (ret == 1)
+				pc->requests++;
+			connpool_put(pool, pc, ret == 1);
+			/*
+			 * the server may have given up on a connection
+			 * that sat in the pool, so try a new one.
+			 */
+			if (ret != 1 && fresh)
+				errx(1, "request failed");
+		} while (ret != 1);
+		buffer[len] = '\0';
+		printf("Server sent:  %s", buffer);
+	}
+	fprintf(stderr, "%lu requests over %lu connections\n", requests,
+	    pool->opened);
+}
+
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in server_sa;
+	const struct sockopt *so;
+	struct tls_config *tls_cfg;
+	struct connpool pool;
+	struct pinset pins;
+	struct pconn *pc;
 	char buffer[80], *ep;
+	const char *servername = "localhost", *sessiondir = NULL;
+	const char *pinfile = NULL, *ocspdir = NULL;
+	unsigned long requests = 0;
 	size_t maxread;
 	ssize_t r, rc;
 	u_short port;
 	u_long p;
-	int sd;
+	int ch, ocsp = -1;
 
-	if (argc != 3)
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "k:n:O:o:P:p:s:")) != -1) {
+		switch (ch) {
+		case 'k':
+			errno = 0;
+			requests = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    requests == 0) {
+				fprintf(stderr, "%s - bad request count\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'n':
+			servername = optarg;
+			break;
+		case 's':
+			sessiondir = optarg;
+			break;
+		case 'O':
+			if ((ocsp = ocspcheck_policy(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown OCSP policy\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'o':
+			ocspdir = optarg;
+			break;
+		case 'P':
+			pinfile = optarg;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2 || (ocspdir != NULL && ocsp == -1))
 		usage();
 
-        p = strtoul(argv[2], &ep, 10);
-        if (*argv[2] == '\0' || *ep != '\0') {
+        p = strtoul(argv[1], &ep, 10);
+        if (*argv[1] == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[2]);
+		fprintf(stderr, "%s - not a number\n", argv[1]);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[2]);
+		fprintf(stderr, "%s - value out of range\n", argv[1]);
 		usage();
 	}
 	/* now safe to do this */
@@ -75,20 +183,65 @@ int main(int argc, char *argv[])
 	memset(&server_sa, 0, sizeof(server_sa));
 	server_sa.sin_family = AF_INET;
 	server_sa.sin_port = htons(port);
-	server_sa.sin_addr.s_addr = inet_addr(argv[1]);
+	server_sa.sin_addr.s_addr = inet_addr(argv[0]);
 	if (server_sa.sin_addr.s_addr == INADDR_NONE) {
-		fprintf(stderr, "Invalid IP address %s\n", argv[1]);
+		fprintf(stderr, "Invalid IP address %s\n", argv[0]);
 		usage();
 	}
 
-	/* ok now get a socket. we don't care where... */
-	if ((sd=socket(AF_INET,SOCK_STREAM,0)) == -1)
-		err(1, "socket failed");
+	/*
+	 * set up our TLS client context, trusting the tutorial CA. If
+	 * we were given a session cache, sessions from earlier runs
+	 * get offered to the server for resumption.
+	 *
+	 * With a pin file, we skip verifying the server's chain against
+	 * the CA, and instead accept exactly the certificates pinned in
+	 * it, see ../common/pinset.c
+	 */
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	pinset_init(&pins);
+	if (pinfile != NULL) {
+		if (pinset_load(&pins, pinfile) == -1)
+			errx(1, "unable to load pins from %s", pinfile);
+		if (pins.count == 0)
+			errx(1, "no pins in %s", pinfile);
+		tls_config_insecure_noverifycert(tls_cfg);
+	} else if (tls_config_set_ca_file(tls_cfg, CA_FILE) == -1)
+		errx(1, "unable to set root CA file %s: %s", CA_FILE,
+		    tls_config_error(tls_cfg));
+	if (sessiondir != NULL)
+		sesscache_setup(tls_cfg, sessiondir, argv[0], argv[1],
+		    servername);
+
+	/*
+	 * connections to the server described in "server_sa" come from
+	 * our pool. the server talks first, but we send our ClientHello
+	 * before it can, so with fast open that goes out with our SYN.
+	 */
+	connpool_init(&pool, tls_cfg, (struct sockaddr *)&server_sa,
+	    sizeof(server_sa), servername, so);
+	if (pinfile != NULL)
+		pool.pins = &pins;
+	/*
+	 * with -O, the server's certificate is checked with the CA's
+	 * OCSP responder unless the server staples an answer, and we
+	 * don't believe what it says until that's done. "open" carries on
+	 * if we get no answer, "closed" doesn't. -o keeps the answers.
+	 */
+	pool.ocsp = ocsp;
+	pool.ocspdir = ocspdir;
+
+	if (requests > 0) {
+		keepalive(&pool, requests);
+		connpool_finish(&pool);
+		return(0);
+	}
 
-	/* connect the socket to the server described in "server_sa" */
-	if (connect(sd, (struct sockaddr *)&server_sa, sizeof(server_sa))
-	    == -1)
-		err(1, "connect failed");
+	if ((pc = connpool_get(&pool)) == NULL)
+		exit(1);
 
 	/*
 	 * finally, we are connected. find out what magnificent wisdom
@@ -100,19 +253,20 @@ int main(int argc, char *argv[])
 	 * is going to send us an entire message, then close the connection
 	 * to us, so that we see an end-of-file condition on the read.
 	 *
-	 * we also make sure we handle EINTR in case we got interrupted
-	 * by a signal.
+	 * tls_read may want to read or write on the socket before it
+	 * has anything for us, in which case connpool_read simply tries
+	 * again. It fails if the OCSP check does, and has said why.
 	 */
 	r = -1;
 	rc = 0;
 	maxread = sizeof(buffer) - 1; /* leave room for a 0 byte */
 	while ((r != 0) && rc < maxread) {
-		r = read(sd, buffer + rc, maxread - rc);
-		if (r == -1) {
-			if (errno != EINTR)
-				err(1, "read failed");
-		} else
-			rc += r;
+		r = connpool_read(pc, buffer + rc, maxread - rc);
+		if (r == -1 && tls_error(pc->tls) == NULL)
+			exit(1);	/* the OCSP check, which said why */
+		if (r == -1)
+			errx(1, "tls_read failed: %s", tls_error(pc->tls));
+		rc += r;
 	}
 	/*
 	 * we must make absolutely sure buffer has a terminating 0 byte
@@ -121,6 +275,7 @@ int main(int argc, char *argv[])
 	buffer[rc] = '\0';
 
 	printf("Server sent:  %s",buffer);
-	close(sd);
+	/* the server hung up on us, so this one can't go back in the pool */
+	connpool_put(&pool, pc, 0);
 	return(0);
 }
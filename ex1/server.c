@@ -14,7 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* server.c  - the "classic" example of a socket server */
+/* server.c  - the "classic" example of a socket server, over TLS */
 
 /*
  * compile with gcc -o server server.c
@@ -32,20 +32,163 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <tls.h>
 #include <unistd.h>
 
+#include "handoff.h"
+#include "message.h"
+#include "probe.h"
+#include "sockopt.h"
+
+#define CERT_FILE	"../CA/server.crt"
+#define KEY_FILE	"../CA/server.key"
+
+/*
+ * How long a client may resume a session for. The session ticket key
+ * is made when we set up our configuration, before we fork, so every
+ * child can decrypt the tickets any of the others handed out.
+ */
+#define SESSION_LIFETIME	(60 * 60)
+
+/* how long a client may sit quiet, in the handshake or between requests */
+#define IDLE_TIMEOUT	30
+
+struct conn {
+	int fd;
+	struct tls *tls;
+	size_t nread, nwritten;	/* for the close probe */
+};
+
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-k] [-p %s] [-R file] [-U path] "
+	    "portnumber\n",
+	    __progname, sockopt_profiles());
 	exit(1);
 }
 
+/*
+ * The child makes the client's socket non blocking, so libtls hands
+ * back TLS_WANT_POLLIN or TLS_WANT_POLLOUT rather than sitting in
+ * read(2) or write(2), and we wait here instead, giving up on a client
+ * that has been quiet for IDLE_TIMEOUT seconds. Returns -1 if it has.
+ */
+static int
+conn_wait(struct conn *conn, ssize_t want)
+{
+	struct pollfd pfd;
+
+	pfd.fd = conn->fd;
+	pfd.events = (want == TLS_WANT_POLLIN) ? POLLIN : POLLOUT;
+	if (poll(&pfd, 1, IDLE_TIMEOUT * 1000) <= 0)
+		return (-1);
+	return (0);
+}
+
+/* message_io functions for our TLS connection */
+static ssize_t
+conn_read(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+	ssize_t r;
+
+	for (;;) {
+		r = tls_read(conn->tls, buf, len);
+		if (r > 0) {
+			if (conn->nread == 0)
+				PROBE(first_byte, conn->fd, r, 0, conn->tls);
+			PROBE(read, conn->fd, r, 0, conn->tls);
+			conn->nread += r;
+		}
+		if (r != TLS_WANT_POLLIN && r != TLS_WANT_POLLOUT)
+			return (r);
+		if (conn_wait(conn, r) == -1)
+			return (-1);
+	}
+}
+
+static ssize_t
+conn_write(void *arg, void *buf, size_t len)
+{
+	struct conn *conn = arg;
+	ssize_t w;
+
+	while ((w = tls_write(conn->tls, buf, len)) == TLS_WANT_POLLIN ||
+	    w == TLS_WANT_POLLOUT) {
+		if (conn_wait(conn, w) == -1)
+			return (-1);
+	}
+	if (w > 0) {
+		PROBE(write, conn->fd, 0, w, conn->tls);
+		conn->nwritten += w;
+	}
+	return (w);
+}
+
+/*
+ * libtls would do the handshake for us on the first read or write, but
+ * doing it here lets the probes see where it starts and finishes. Like
+ * conn_read, we give up on a client that goes quiet part way through.
+ */
+static int
+conn_handshake(struct conn *conn)
+{
+	int r;
+
+	PROBE(handshake_start, conn->fd, 0, 0, NULL);
+	for (;;) {
+		r = tls_handshake(conn->tls);
+		if (r != TLS_WANT_POLLIN && r != TLS_WANT_POLLOUT)
+			break;
+		if (conn_wait(conn, r) == -1)
+			return (-1);
+	}
+	if (r == 0)
+		PROBE(handshake_done, conn->fd, 0, 0, conn->tls);
+	return (r);
+}
+
+/*
+ * keep-alive mode - rather than saying our piece and hanging up, answer
+ * each length prefixed request from the client with our message, until
+ * it hangs up or goes idle. What the client asks doesn't matter, we're
+ * only ever going to say one thing.
+ */
+static void
+serve_requests(struct conn *conn, const char *msg)
+{
+	char req[MESSAGE_MAX];
+	size_t len;
+
+	while (message_recv(conn_read, conn, req, sizeof(req), &len) == 1) {
+		if (message_send(conn_write, conn, msg, strlen(msg)) == -1)
+			break;
+	}
+}
+
+/*
+ * Once we have handed our socket to a new server we're done accepting,
+ * but our children still have their clients - wait for them to finish.
+ * The SIGCHLD handler may reap some of them, so ECHILD is how we end.
+ */
+static void
+drain(void)
+{
+	printf("Handed off to a new server, waiting for clients to finish\n");
+	fflush(stdout);
+	while (waitpid(WAIT_ANY, NULL, 0) != -1 || errno == EINTR)
+		;
+	exit(0);
+}
+
 static void kidhandler(int signum) {
 	/* signal handler for SIGCHLD */
 	waitpid(WAIT_ANY, NULL, WNOHANG);
@@ -55,33 +198,74 @@ static void kidhandler(int signum) {
 int main(int argc,  char *argv[])
 {
 	struct sockaddr_in sockname, client;
+	struct tls_config *tls_cfg;
+	struct tls *tls_ctx, *tls_cctx;
 	char buffer[80], *ep;
+	const char *upgrade = NULL;
+	struct handoff handoff;
+	int keepalive = 0, usd = -1;
 	struct sigaction sa;
 	int sd;
 	socklen_t clientlen;
 	u_short port;
+	const struct sockopt *so;
+	struct sockopt sopt;
 	pid_t pid;
 	u_long p;
+	int ch;
 
 	/*
-	 * first, figure out what port we will listen on - it should
-	 * be our first parameter.
+	 * -k turns on keep-alive mode, -p names the socket tuning
+	 * profile to use, see ../common/sockopt.c, -R records the
+	 * traffic to a file, see ../common/recorder.c, and -U is where
+	 * we meet the server that replaces us, see ../common/handoff.c
 	 */
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "kp:R:U:")) != -1) {
+		switch (ch) {
+		case 'k':
+			keepalive = 1;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'R':
+			if (recorder_open(optarg) == -1)
+				errx(1, "unable to record to %s", optarg);
+			break;
+		case 'U':
+			upgrade = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc != 2)
+	/*
+	 * now figure out what port we will listen on - it should
+	 * be our only parameter.
+	 */
+
+	if (argc != 1)
 		usage();
-		errno = 0;
-        p = strtoul(argv[1], &ep, 10);
-        if (*argv[1] == '\0' || *ep != '\0') {
+	errno = 0;
+        p = strtoul(argv[0], &ep, 10);
+        if (*argv[0] == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[1]);
+		fprintf(stderr, "%s - not a number\n", argv[0]);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[1]);
+		fprintf(stderr, "%s - value out of range\n", argv[0]);
 		usage();
 	}
 	/* now safe to do this */
@@ -92,19 +276,68 @@ int main(int argc,  char *argv[])
 	    "What is the air speed velocity of a coconut laden swallow?\n",
 	    sizeof(buffer));
 
-	memset(&sockname, 0, sizeof(sockname));
-	sockname.sin_family = AF_INET;
-	sockname.sin_port = htons(port);
-	sockname.sin_addr.s_addr = htonl(INADDR_ANY);
-	sd=socket(AF_INET,SOCK_STREAM,0);
-	if ( sd == -1)
-		err(1, "socket failed");
+	/*
+	 * we talk first, but the TLS client sends its ClientHello before
+	 * we can say anything, so deferred accept and fast open are fine.
+	 */
+	sopt = *so;
+
+	/*
+	 * if there's a server running with -U already, we take over its
+	 * listening socket, rather than making our own.
+	 */
+	memset(&handoff, 0, sizeof(handoff));
+	if (upgrade != NULL && handoff_receive(&handoff, upgrade) == -1)
+		errx(1, "unable to take over from %s", upgrade);
+	if (handoff.nfds > 0) {
+		sd = handoff.fds[0];
+		while (handoff.nfds > 1)
+			close(handoff.fds[--handoff.nfds]);
+	} else {
+		memset(&sockname, 0, sizeof(sockname));
+		sockname.sin_family = AF_INET;
+		sockname.sin_port = htons(port);
+		sockname.sin_addr.s_addr = htonl(INADDR_ANY);
+		sd=socket(AF_INET,SOCK_STREAM,0);
+		if ( sd == -1)
+			err(1, "socket failed");
+
+		if (sockopt_listen(sd, (struct sockaddr *) &sockname,
+		    sizeof(sockname), &sopt) == -1)
+			err(1, "bind/listen failed");
+	}
 
-	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
-		err(1, "bind failed");
+	/* set up our TLS server context, with our certificate and key */
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_keypair_file(tls_cfg, CERT_FILE, KEY_FILE) == -1)
+		errx(1, "unable to load keypair: %s",
+		    tls_config_error(tls_cfg));
+	if (tls_config_set_session_lifetime(tls_cfg, SESSION_LIFETIME) == -1)
+		errx(1, "unable to set session lifetime: %s",
+		    tls_config_error(tls_cfg));
+	/*
+	 * with -U we keep the ticket keys ourselves, so the server that
+	 * replaces us can have them, and add one of our own.
+	 */
+	if (upgrade != NULL) {
+		handoff_rekey(&handoff.keys);
+		if (handoff_configure(tls_cfg, &handoff.keys, NULL) == -1)
+			errx(1, "unable to set ticket keys: %s",
+			    tls_config_error(tls_cfg));
+	}
+	if ((tls_ctx = tls_server()) == NULL)
+		errx(1, "tls_server failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(tls_ctx));
 
-	if (listen(sd,3) == -1)
-		err(1, "listen failed");
+	/* tell the old server we have it from here */
+	if (handoff.nfds > 0)
+		handoff_ready(&handoff);
+	if (upgrade != NULL && (usd = handoff_listen(upgrade)) == -1)
+		errx(1, "unable to listen on %s", upgrade);
 
 	/*
 	 * we're now bound, and listening for connections on "sd" -
@@ -128,16 +361,51 @@ int main(int argc,  char *argv[])
         if (sigaction(SIGCHLD, &sa, NULL) == -1)
                 err(1, "sigaction failed");
 
+	/*
+	 * a client that hangs up early would otherwise kill the child
+	 * with SIGPIPE when it writes, and then its recorded events
+	 * never make it out of the buffer. Write errors are handled.
+	 */
+	if (recording)
+		signal(SIGPIPE, SIG_IGN);
+
 	/*
 	 * finally - the main loop.  accept connections and deal with 'em
 	 */
 	printf("Server up and listening for connections on port %u\n", port);
 	for(;;) {
 		int clientsd;
+
+		/*
+		 * with -U, wait for either a client or a new server to
+		 * hand over to.
+		 */
+		if (usd != -1) {
+			struct pollfd pfd[2];
+
+			pfd[0].fd = sd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = usd;
+			pfd[1].events = POLLIN;
+			if (poll(pfd, 2, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "poll failed");
+			}
+			if ((pfd[1].revents & POLLIN) &&
+			    handoff_send(usd, &sd, 1, &handoff.keys) == 0) {
+				close(usd);
+				close(sd);
+				drain();
+			}
+			if (!(pfd[0].revents & POLLIN))
+				continue;
+		}
 		clientlen = sizeof(&client);
 		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
 		if (clientsd == -1)
 			err(1, "accept failed");
+		sockopt_accepted(clientsd, &sopt);
 		/*
 		 * We fork child to deal with each connection, this way more
 		 * than one client can connect to us and get served at any one
@@ -149,24 +417,58 @@ int main(int argc,  char *argv[])
 		     err(1, "fork failed");
 
 		if(pid == 0) {
+			struct conn conn = { clientsd, NULL, 0, 0 };
 			ssize_t written, w;
+			int i;
+
+			/*
+			 * the accept probe fires in the child, so all of a
+			 * connection's probes come from the same process.
+			 */
+			PROBE(accept, clientsd, 0, 0, NULL);
+			if (usd != -1)
+				close(usd);
+			/* so an idle client can't keep us forever */
+			if (fcntl(clientsd, F_SETFL, O_NONBLOCK) == -1)
+				err(1, "fcntl failed");
+			if (tls_accept_socket(tls_ctx, &tls_cctx, clientsd) == -1)
+				errx(1, "tls_accept_socket failed: %s",
+				    tls_error(tls_ctx));
+			conn.tls = tls_cctx;
+			if (conn_handshake(&conn) == -1) {
+				warnx("tls_handshake failed: %s",
+				    tls_error(tls_cctx) != NULL ?
+				    tls_error(tls_cctx) : "timed out");
+				goto done;
+			}
+			if (keepalive) {
+				serve_requests(&conn, buffer);
+				goto done;
+			}
 			/*
 			 * write the message to the client, being sure to
-			 * handle a short write, or being interrupted by
-			 * a signal before we could write anything.
+			 * handle a short write. conn_write waits for the
+			 * socket when tls_write wants to read or write.
 			 */
 			w = 0;
 			written = 0;
 			while (written < strlen(buffer)) {
-				w = write(clientsd, buffer + written,
+				w = conn_write(&conn, buffer + written,
 				    strlen(buffer) - written);
-				if (w == -1) {
-					if (errno != EINTR)
-						err(1, "write failed");
-				}
-				else
-					written += w;
+				if (w == -1)
+					errx(1, "tls_write failed: %s",
+					    tls_error(tls_cctx));
+				written += w;
+			}
+ done:
+			PROBE(close, clientsd, conn.nread, conn.nwritten,
+			    tls_cctx);
+			while ((i = tls_close(tls_cctx)) == TLS_WANT_POLLIN ||
+			    i == TLS_WANT_POLLOUT) {
+				if (conn_wait(&conn, i) == -1)
+					break;
 			}
+			tls_free(tls_cctx);
 			close(clientsd);
 			exit(0);
 		}
@@ -15,8 +15,8 @@
  */
 
 /*
- * A relatively simple buffering echo client that uses poll(2),
- * for instructional purposes.
+ * A relatively simple buffering echo client that uses poll(2)
+ * and TLS, for instructional purposes.
  */
 
 #include <sys/types.h>
@@ -24,6 +24,7 @@
 #include <sys/wait.h>
 #include <netinet/in.h>
 
+#include <arpa/inet.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -34,17 +35,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <tls.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "ocspcheck.h"
+#include "sesscache.h"
+#include "sockopt.h"
+#include "spin.h"
 
 #define BUFLEN 4096
 
+#define CA_FILE		"../CA/root.pem"
+
 static int debug = 0;
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s host portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-l] [-b usec] [-C cpu] [-f line|length] "
+	    "[-n servername] [-O open|closed] [-o ocspdir] [-p %s] "
+	    "[-s sessiondir] host portnumber\n", __progname,
+	    sockopt_profiles());
 	exit(1);
 }
 
@@ -54,17 +67,26 @@ static void usage()
 
 struct server {
 	int state;
+	struct framer framer;	/* where the answer ends */
+	struct timespec sent;	/* when we sent what it answers */
 	unsigned char *readptr, *writeptr, *nextptr;
 	unsigned char buf[BUFLEN];
 };
 
 static struct server server;
+static struct tls *tls_ctx;
+static int framing = FRAME_LINE;
+static int timing = 0;
+static struct latency latency;
+static struct ocspcheck ocsp;
+static int checking = 0;	/* until we know what ocsp has to say */
 
 static void
 server_init(struct server *server)
 {
 	server->readptr = server->writeptr = server->nextptr = server->buf;
 	server->state = STATE_NONE;
+	framer_init(&server->framer, framing, sizeof(server->buf) - 1);
 }
 
 static ssize_t
@@ -76,6 +98,9 @@ server_consume(struct server *server, size_t len)
 		if (server->readptr == server->nextptr)
 			break;
 		server->readptr++;
+		if ((size_t)(server->readptr - server->buf) >=
+		    sizeof(server->buf))
+			server->readptr = server->buf;
 		n++;
 	}
 
@@ -131,9 +156,111 @@ server_put(struct server *server, const unsigned char *inbuf, size_t inlen)
         return ((ssize_t)n);
 }
 
+/* what's buffered, as one or two pieces. Returns how many */
+static int
+server_data(struct server *server, struct iovec data[2])
+{
+	unsigned char *end = server->buf + sizeof(server->buf);
+
+	data[0].iov_base = server->readptr;
+	if (server->readptr <= server->writeptr) {
+		data[0].iov_len = server->writeptr - server->readptr;
+		return (1);
+	}
+	data[0].iov_len = end - server->readptr;
+	data[1].iov_base = server->buf;
+	data[1].iov_len = server->writeptr - server->buf;
+	return (2);
+}
+
+static size_t
+server_room(struct server *server)
+{
+	struct iovec data[2];
+	size_t used = 0;
+	int i, n;
+
+	n = server_data(server, data);
+	for (i = 0; i < n; i++)
+		used += data[i].iov_len;
+	/* one byte less than its size, see server_put */
+	return (sizeof(server->buf) - 1 - used);
+}
+
+static void
+output(const struct iovec *iov, int cnt)
+{
+	const unsigned char *p;
+	size_t left;
+	ssize_t w;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		p = iov[i].iov_base;
+		for (left = iov[i].iov_len; left > 0; left -= w, p += w) {
+			if ((w = write(STDOUT_FILENO, p, left)) == -1) {
+				if (errno != EINTR)
+					err(1, "write failed");
+				w = 0;
+			}
+		}
+	}
+}
+
+/*
+ * Print the answer, if all of it is here, straight out of the buffer.
+ * Returns 1 if it was, 0 if we need more, and -1 if it's too big.
+ */
+static int
+server_answer(struct server *server)
+{
+	struct iovec data[2], nl = { "\n", 1 };
+	struct timespec now;
+	struct frame f;
+	size_t skip;
+	int i, ret;
+
+	ret = framer_next(&server->framer, data, server_data(server, data),
+	    &f);
+	if (ret != 1)
+		return (ret);
+	/* the server doesn't get believed until its certificate is */
+	if (checking) {
+		if (ocspcheck_wait(&ocsp) == -1)
+			exit(1);
+		ocspcheck_free(&ocsp);
+		checking = 0;
+	}
+	if (timing) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency_add(&latency,
+		    (now.tv_sec - server->sent.tv_sec) * 1000000000ULL +
+		    now.tv_nsec - server->sent.tv_nsec);
+	}
+	/* we print what a length prefixed message has after its length */
+	skip = framing == FRAME_LENGTH ? FRAME_HDRLEN : 0;
+	for (i = 0; i < f.iovcnt && skip > 0; i++) {
+		size_t n = f.iov[i].iov_len < skip ? f.iov[i].iov_len : skip;
+
+		f.iov[i].iov_base = (char *)f.iov[i].iov_base + n;
+		f.iov[i].iov_len -= n;
+		skip -= n;
+	}
+	output(f.iov, f.iovcnt);
+	if (framing == FRAME_LENGTH)
+		output(&nl, 1);
+
+	/* what server_get would have left, had we used it */
+	server->nextptr = server->writeptr;
+	server_consume(server, f.len);
+	return (1);
+}
+
 static void
 closeconn (struct pollfd *pfd)
 {
+	tls_close(tls_ctx);
+	tls_free(tls_ctx);
 	close(pfd->fd);
 	pfd->fd = -1;
 	pfd->revents = 0;
@@ -161,50 +288,60 @@ handle_server(struct pollfd *pfd, struct server *server)
 	if (pfd->revents & POLLHUP)
 		closeconn(pfd);
 	else if (pfd->revents & pfd->events) {
-		char buf[BUFLEN];
+		unsigned char buf[BUFLEN];
 		ssize_t len = 0;
 		if (server->state == STATE_READING) {
-			ssize_t w = 0;
-			ssize_t written = 0;
-			len = read(pfd->fd, buf, sizeof(buf));
+			int ret;
+
+			/*
+			 * the answer may come in pieces, so buffer it until
+			 * it's all here - the buffer has nothing else in it
+			 * while we read.
+			 */
+			len = tls_read(tls_ctx, buf, server_room(server));
 			if (len > 0) {
-				do {
-					w = write(STDOUT_FILENO, buf, len);
-					if (w == -1) {
-						if (errno != EINTR)
-							closeconn(pfd);
-					}
-					else
-						written += w;
-				} while (written < len);
-				if (buf[len - 1] == '\n') {
+				if (server_put(server, buf, len) != len)
+					errx(1, "can't buffer answer");
+				if ((ret = server_answer(server)) == -1)
+					errx(1, "answer too big");
+				if (ret == 1) {
 					server->state=STATE_NONE;
 					pfd->events = POLLHUP;
 				}
 			}
 			else if (len == 0)
 				closeconn(pfd);
-			else
+			else if (len == TLS_WANT_POLLIN)
 				pfd->events = POLLIN | POLLHUP;
+			else if (len == TLS_WANT_POLLOUT)
+				pfd->events = POLLOUT | POLLHUP;
+			else
+				errx(1, "tls_read failed: %s",
+				    tls_error(tls_ctx));
 		} else if (server->state == STATE_WRITING) {
 			ssize_t w = 0;
-			ssize_t written = 0;
-			do {
-				len = server_get(server, buf, sizeof(buf));
-				w = write(pfd->fd, buf, len);
-				if (w == -1) {
-					if (errno != EINTR)
-						closeconn(pfd);
-				}
-				else {
-					written += w;
-					server_consume(server, w);
-				}
-			} while (written < len);
-			if (pfd->fd > 0) {
-				server->state = STATE_READING;
-				pfd->events = POLLIN | POLLHUP;
+			/*
+			 * write out our line. If tls_write needs the
+			 * socket to be readable or writable first, leave
+			 * the rest buffered, and try again with the same
+			 * data when poll says so.
+			 */
+			while ((len = server_get(server, buf, sizeof(buf)))
+			    > 0) {
+				w = tls_write(tls_ctx, buf, len);
+				if (w == TLS_WANT_POLLIN) {
+					pfd->events = POLLIN | POLLHUP;
+					return;
+				} else if (w == TLS_WANT_POLLOUT) {
+					pfd->events = POLLOUT | POLLHUP;
+					return;
+				} else if (w == -1)
+					errx(1, "tls_write failed: %s",
+					    tls_error(tls_ctx));
+				server_consume(server, w);
 			}
+			server->state = STATE_READING;
+			pfd->events = POLLIN | POLLHUP;
 		}
 	}
 }
@@ -212,28 +349,150 @@ handle_server(struct pollfd *pfd, struct server *server)
 int main(int argc, char **argv) {
 
 	struct addrinfo hints, *res;
-	int serverfd, error;
-	struct pollfd pollfd;
+	const struct sockopt *so;
+	struct tls_config *tls_cfg;
+	const char *servername = NULL, *sessiondir = NULL, *ocspdir = NULL;
+	int ch, i, serverfd, error, policy = -1, cpu = -1;
+	struct pollfd pollfd[2];
+	ssize_t sent;
+	long l, spin = 0;
+	char *ep;
+
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "b:C:f:ln:O:o:p:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > 1000000) {
+				fprintf(stderr, "%s - bad spin budget\n",
+				    optarg);
+				usage();
+			}
+			spin = l;
+			break;
+		case 'C':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > 1023) {
+				fprintf(stderr, "%s - bad cpu\n", optarg);
+				usage();
+			}
+			cpu = l;
+			break;
+		case 'f':
+			if ((framing = framer_type(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown framing\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'l':
+			timing = 1;
+			break;
+		case 'n':
+			servername = optarg;
+			break;
+		case 'O':
+			if ((policy = ocspcheck_policy(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown OCSP policy\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'o':
+			ocspdir = optarg;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 's':
+			sessiondir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc != 3)
+	if (argc != 2 || (ocspdir != NULL && policy == -1))
 		usage();
+	/* unless told otherwise, we expect the server to be who we asked for */
+	if (servername == NULL)
+		servername = argv[0];
+	/* like the echo server, -b spins waiting for answers, -C pins us */
+	if (cpu != -1 && spin_pin(cpu) == -1)
+		err(1, "can't run on cpu %d", cpu);
 
 	bzero(&hints, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
-	if ((error = getaddrinfo(argv[1], argv[2], &hints, &res))) {
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
 		fprintf(stderr, "%s\n", gai_strerror(error));
 		usage();
 	}
 
+	/*
+	 * set up our TLS client context, trusting the tutorial CA. If
+	 * we were given a session cache, sessions from earlier runs
+	 * get offered to the server for resumption.
+	 */
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_ca_file(tls_cfg, CA_FILE) == -1)
+		errx(1, "unable to set root CA file %s: %s", CA_FILE,
+		    tls_config_error(tls_cfg));
+	if (sessiondir != NULL)
+		sesscache_setup(tls_cfg, sessiondir, argv[0], argv[1],
+		    servername);
+	if ((tls_ctx = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(tls_ctx));
+
 	if ((serverfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
 		err(1, "socket failed");
 
-	if (connect(serverfd, res->ai_addr, res->ai_addrlen) == -1)
+	/* with fast open, our ClientHello goes out with the SYN */
+	if (sockopt_connect(serverfd, res->ai_addr, res->ai_addrlen, so,
+	    NULL, 0, &sent) == -1)
 		err(1, "connect failed");
 
-	newconn(&pollfd, serverfd, 0);
+	/*
+	 * do the handshake while the socket is still blocking, so we
+	 * can say whether we resumed before anything else happens.
+	 */
+	if (tls_connect_socket(tls_ctx, serverfd, servername) == -1)
+		errx(1, "tls_connect_socket failed: %s", tls_error(tls_ctx));
+	do {
+		i = tls_handshake(tls_ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (i == -1)
+		errx(1, "TLS handshake failed: %s", tls_error(tls_ctx));
+	sesscache_report(tls_ctx);
+
+	/*
+	 * with -O, ask the CA's OCSP responder about the server's
+	 * certificate if it didn't staple an answer. That goes on
+	 * alongside our first line and the server's answer to it, which
+	 * we don't print until we know. -o keeps the answers.
+	 */
+	if (policy != -1) {
+		ocspcheck_start(&ocsp, tls_ctx, policy, ocspdir);
+		checking = 1;
+	}
+
+	newconn(&pollfd[0], serverfd, 0);
 	server_init(&server);
 
 	while(1) {
@@ -243,20 +502,51 @@ int main(int argc, char **argv) {
 			ssize_t len;
 
 			if ((len = getline(&line, &size, stdin)) != -1) {
-				if (server_put(&server, line, len) != len)
+				if (framing == FRAME_LENGTH) {
+					uint32_t hdr;
+
+					/* the newline is our framing, not theirs */
+					if (line[len - 1] == '\n')
+						len--;
+					hdr = htonl(len);
+					if (server_put(&server,
+					    (unsigned char *)&hdr, sizeof(hdr)) !=
+					    sizeof(hdr))
+						errx(1, "can't buffer line to server");
+				} else if (line[len - 1] != '\n') {
+					/* or we'd never know the answer ended */
+					line[len++] = '\n';
+				}
+				if (server_put(&server, (unsigned char *)line, len) != len)
 					errx(1, "can't buffer line to server");
+				clock_gettime(CLOCK_MONOTONIC, &server.sent);
 				server.state=STATE_WRITING;
-				pollfd.events = POLLOUT | POLLHUP;
+				pollfd[0].events = POLLOUT | POLLHUP;
 			}
 			free(line);
 			if (len == -1)
 				break;
 		}
-		if (poll(&pollfd, 1, -1) == -1)
+		pollfd[1].fd = checking ? ocsp.fd : -1;
+		pollfd[1].events = checking ? ocspcheck_events(&ocsp) : 0;
+		pollfd[1].revents = 0;
+		if (spin_poll(pollfd, 2, -1, spin) == -1)
 			err(1, "poll failed");
-		handle_server(&pollfd, &server);
+		if (pollfd[1].revents != 0)
+			ocspcheck_io(&ocsp);
+		handle_server(&pollfd[0], &server);
 	}
 
+	if (timing && latency.count > 0)
+		fprintf(stderr, "%llu messages, latency min %.1fus "
+		    "median %.1fus p99 %.1fus max %.1fus\n",
+		    (unsigned long long)latency.count, latency.min / 1000.0,
+		    latency_quantile(&latency, 0.5) / 1000.0,
+		    latency_quantile(&latency, 0.99) / 1000.0,
+		    latency.max / 1000.0);
+
+	tls_close(tls_ctx);
+	tls_free(tls_ctx);
 	freeaddrinfo(res);
 	return 0;
 }
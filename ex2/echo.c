@@ -15,8 +15,8 @@
  */
 
 /*
- * A relatively simple buffering echo server that uses poll(2),
- * for instructional purposes.
+ * A relatively simple buffering echo server that uses poll(2)
+ * and TLS, for instructional purposes.
  */
 
 #include <sys/types.h>
@@ -34,38 +34,94 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <tls.h>
 #include <unistd.h>
 
+#include "admit.h"
+#include "bufpool.h"
+#include "certmap.h"
+#include "clienthello.h"
+#include "fiber.h"
+#include "frame.h"
+#include "handoff.h"
+#include "probe.h"
+#include "spin.h"
+#include "tlsbuf.h"
+#include "tlswriter.h"
+#include "sockopt.h"
+
 #define MAX_CONNECTIONS 256
+#define MAX_FIBERS (128 * 1024)	/* with -F */
 #define BUFLEN 4096
 
+#define CERT_FILE	"../CA/server.crt"
+#define KEY_FILE	"../CA/server.key"
+#define SESSION_LIFETIME	(60 * 60)
+
 static int debug = 0;
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s host portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-BF] [-A rate] [-b usec] [-C cpu] "
+	    "[-c msec] [-f line|length] [-P count] [-p %s] [-R file] "
+	    "[-S certdir] [-U path] host portnumber\n", __progname,
+	    sockopt_profiles());
 	exit(1);
 }
 
 #define STATE_READING 0
 #define STATE_WRITING 1
+#define STATE_HELLO 2	/* reading the ClientHello, to pick a certificate */
+#define STATE_HANDSHAKE 3
 
 struct client {
 	int state;
+	int fd;
+	struct tls *tls;
+	unsigned char *hello;	/* the ClientHello, until libtls has it */
+	size_t hellolen, hellooff;
+	struct framer framer;	/* with -f, where messages end */
+	size_t ready;		/* bytes of complete messages buffered */
+	struct tlswriter *writer;	/* with -c, what we write through */
+	struct tlsbuf io;	/* with -B, what libtls reads and writes */
+	int want;		/* with -B, what libtls is waiting for */
+	int resuming;		/* with -A, the hello offered a session */
+	size_t nread, nwritten;	/* for the probes */
 	unsigned char *readptr, *writeptr, *nextptr;
 	unsigned char buf[BUFLEN];
 };
 
 static struct client clients[MAX_CONNECTIONS];
-static struct pollfd pollfds[MAX_CONNECTIONS];
+/* the listening socket, the clients, and with -U the handoff socket */
+#define HANDOFF_POLLFD MAX_CONNECTIONS
+static struct pollfd pollfds[MAX_CONNECTIONS + 1];
 static int throttle = 0;
+static const struct sockopt *so;
+static struct tls *tls_ctx;
+static struct certmap certmap;
+static int sni = 0;
+static int framing = -1;
+static int coalesce = -1;	/* -c, ms to hold a partial record */
+static int admission = 0;	/* -A */
+static int batch = 0;		/* -B */
+static struct admit admit;
+static int pooled = 0;		/* -P, buffers to keep */
+/* where the hello buffers, tlswriters and -B buffers come from */
+static struct bufpool hellopool, writerpool, iopool;
+
+#define POOL_REPORT	1000	/* with -P, report every this many */
 
 static void
 client_init(struct client *client)
 {
 	client->readptr = client->writeptr = client->nextptr = client->buf;
 	client->state = STATE_READING;
+	framer_init(&client->framer, framing, sizeof(client->buf) - 1);
+	client->ready = 0;
+	client->nread = client->nwritten = 0;
+	client->resuming = 0;
 }
 
 static ssize_t
@@ -77,6 +133,9 @@ client_consume(struct client *client, size_t len)
 		if (client->readptr == client->nextptr)
 			break;
 		client->readptr++;
+		if ((size_t)(client->readptr - client->buf) >=
+		    sizeof(client->buf))
+			client->readptr = client->buf;
 		n++;
 	}
 
@@ -132,13 +191,148 @@ client_put(struct client *client, const unsigned char *inbuf, size_t inlen)
         return ((ssize_t)n);
 }
 
+/*
+ * What's buffered, from "off" bytes in, as one or two pieces depending
+ * on whether it wraps around the end of the buffer. Returns how many.
+ */
+static int
+client_data(struct client *client, size_t off, struct iovec data[2])
+{
+	unsigned char *end = client->buf + sizeof(client->buf);
+	unsigned char *start = client->readptr + off;
+
+	if (start >= end)
+		start -= sizeof(client->buf);
+	if (start <= client->writeptr) {
+		data[0].iov_base = start;
+		data[0].iov_len = client->writeptr - start;
+		return (1);
+	}
+	data[0].iov_base = start;
+	data[0].iov_len = end - start;
+	data[1].iov_base = client->buf;
+	data[1].iov_len = client->writeptr - client->buf;
+	return (2);
+}
+
+/* take "len" bytes we dealt with without client_get() out of the buffer */
+static void
+client_skip(struct client *client, size_t len)
+{
+	client->nextptr = client->readptr + len;
+	if (client->nextptr >= client->buf + sizeof(client->buf))
+		client->nextptr -= sizeof(client->buf);
+	client_consume(client, len);
+}
+
+static size_t
+client_room(struct client *client)
+{
+	struct iovec data[2];
+	size_t used = 0;
+	int i, n;
+
+	n = client_data(client, 0, data);
+	for (i = 0; i < n; i++)
+		used += data[i].iov_len;
+	/* one byte less than its size, see client_put */
+	return (sizeof(client->buf) - 1 - used);
+}
+
+/*
+ * Count the complete messages that came in, after the ones we had.
+ * Returns -1 if one is too big for us to ever hold.
+ */
+static int
+client_frames(struct client *client)
+{
+	struct iovec data[2];
+	struct frame f;
+	int n, ret;
+
+	for (;;) {
+		n = client_data(client, client->ready, data);
+		if ((ret = framer_next(&client->framer, data, n, &f)) != 1)
+			return (ret);
+		client->ready += f.len;
+	}
+}
+
+/*
+ * With -P, say what the pools saved, every POOL_REPORT connections or
+ * when "now" says so.
+ */
+static void
+pools_report(int now)
+{
+	static unsigned long closed;
+
+	if (pooled == 0 || (++closed % POOL_REPORT != 0 && !now))
+		return;
+	bufpool_report(&hellopool, "hello buffers");
+	bufpool_report(&writerpool, "tlswriters");
+	bufpool_report(&iopool, "-B buffers");
+}
+
 static void
-closeconn (struct pollfd *pfd)
+closeconn (struct pollfd *pfd, struct client *client)
 {
+	/*
+	 * we don't wait around for the peer to see our close_notify,
+	 * a best effort is all anyone gets from a non blocking socket.
+	 */
+	PROBE(close, pfd->fd, client->nread, client->nwritten, client->tls);
+	/*
+	 * by the time a client that offered a session hangs up part way
+	 * through, we may well have signed for a full handshake anyway.
+	 */
+	if (admission && client->state == STATE_HANDSHAKE)
+		admit_handshake(&admit, client->resuming, 0);
+	if (client->tls != NULL) {
+		tls_close(client->tls);
+		tls_free(client->tls);
+		client->tls = NULL;
+	}
+	bufpool_put(&hellopool, client->hello);
+	client->hello = NULL;
+	if (client->writer != NULL) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "fd %d", pfd->fd);
+		tlsw_report(client->writer, name);
+		bufpool_put(&writerpool, client->writer);
+		client->writer = NULL;
+	}
+	if (batch) {
+		char name[32];
+
+		/* the close_notify is still in the buffer */
+		tlsb_flush(&client->io);
+		snprintf(name, sizeof(name), "fd %d", pfd->fd);
+		tlsb_report(&client->io, name);
+		bufpool_put(&iopool, tlsb_release(&client->io));
+	}
 	close(pfd->fd);
 	pfd->fd = -1;
 	pfd->revents = 0;
 	throttle = 0;
+	pools_report(0);
+}
+
+/* turn away a connection we haven't started a handshake on */
+static void
+shedconn(struct pollfd *pfd, struct client *client)
+{
+	PROBE(close, pfd->fd, client->nread, client->nwritten, NULL);
+	bufpool_put(&hellopool, client->hello);
+	client->hello = NULL;
+	if (batch)
+		bufpool_put(&iopool, tlsb_release(&client->io));
+	sockopt_reset(pfd->fd);
+	pfd->fd = -1;
+	pfd->revents = 0;
+	throttle = 0;
+	pools_report(0);
 }
 
 static void
@@ -154,121 +348,1011 @@ newconn(struct pollfd *pfd, int newfd) {
 	pfd->revents = 0;
 }
 
+/* tls_read, tls_write and tlsw_flush, keeping count for the probes */
+static ssize_t
+conn_read(struct client *client, void *buf, size_t len)
+{
+	ssize_t r;
+
+	if ((r = tls_read(client->tls, buf, len)) > 0) {
+		if (client->nread == 0)
+			PROBE(first_byte, client->fd, r, 0, client->tls);
+		PROBE(read, client->fd, r, 0, client->tls);
+		client->nread += r;
+	}
+	return (r);
+}
+
+static ssize_t
+conn_write(struct client *client, const void *buf, size_t len)
+{
+	ssize_t w;
+
+	if ((w = tls_write(client->tls, buf, len)) > 0) {
+		PROBE(write, client->fd, 0, w, client->tls);
+		client->nwritten += w;
+	}
+	return (w);
+}
+
+/* one write probe for however many records this writes */
+static int
+conn_flush(struct client *client, int all)
+{
+	uint64_t before = client->writer->bytes;
+	int ret;
+
+	ret = tlsw_flush(client->writer, all);
+	if (client->writer->bytes > before) {
+		PROBE(write, client->fd, 0, client->writer->bytes - before,
+		    client->tls);
+		client->nwritten += client->writer->bytes - before;
+	}
+	return (ret);
+}
+
+/*
+ * libtls would do the handshake for us on the first read, but doing it
+ * on its own lets the probes see when it finishes.
+ */
+static void
+handshake(struct pollfd *pfd, struct client *client)
+{
+	switch (tls_handshake(client->tls)) {
+	case 0:
+		PROBE(handshake_done, client->fd, 0, 0, client->tls);
+		if (admission)
+			admit_handshake(&admit, client->resuming,
+			    tls_conn_session_resumed(client->tls));
+		client->state = STATE_READING;
+		pfd->events = POLLIN | POLLHUP;
+		break;
+	case TLS_WANT_POLLIN:
+		pfd->events = POLLIN | POLLHUP;
+		break;
+	case TLS_WANT_POLLOUT:
+		pfd->events = POLLOUT | POLLHUP;
+		break;
+	default:
+		warnx("TLS handshake failed: %s", tls_error(client->tls));
+		closeconn(pfd, client);
+	}
+}
+
+/*
+ * libtls I/O callbacks for a connection we read the ClientHello from
+ * ourselves - libtls gets what we read first, then the socket.
+ */
+static ssize_t
+hello_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct client *client = arg;
+	ssize_t r;
+
+	if (client->hello != NULL) {
+		r = client->hellolen - client->hellooff;
+		if ((size_t)r > len)
+			r = len;
+		memcpy(buf, client->hello + client->hellooff, r);
+		client->hellooff += r;
+		if (client->hellooff == client->hellolen) {
+			bufpool_put(&hellopool, client->hello);
+			client->hello = NULL;
+		}
+		return (r);
+	}
+	if ((r = read(client->fd, buf, len)) == -1 &&
+	    (errno == EAGAIN || errno == EINTR))
+		return (TLS_WANT_POLLIN);
+	return (r);
+}
+
+static ssize_t
+hello_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct client *client = arg;
+	ssize_t w;
+
+	if ((w = write(client->fd, buf, len)) == -1 &&
+	    (errno == EAGAIN || errno == EINTR))
+		return (TLS_WANT_POLLOUT);
+	return (w);
+}
+
+/*
+ * Read until we have the whole first record from the client, then
+ * hand the connection to the context for the name it asked for - if
+ * with -A we decide to take it on at all.
+ */
+static void
+handle_hello(struct pollfd *pfd, struct client *client)
+{
+	char name[CLIENTHELLO_MAXNAME + 1];
+	struct tls *ctx = NULL;
+	ssize_t r;
+	int found;
+
+	r = read(pfd->fd, client->hello + client->hellolen,
+	    CLIENTHELLO_MAX - client->hellolen);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		closeconn(pfd, client);
+		return;
+	}
+	client->hellolen += r;
+	found = clienthello_servername(client->hello, client->hellolen, name,
+	    sizeof(name));
+	if (found == -1)
+		return;
+	client->resuming = clienthello_resuming(client->hello,
+	    client->hellolen) == 1;
+	if (admission && !admit_hello(&admit, client->resuming)) {
+		shedconn(pfd, client);
+		return;
+	}
+	if (found == 1 && sni)
+		ctx = certmap_lookup(&certmap, name);
+	if (ctx == NULL)
+		ctx = tls_ctx;
+	if (debug)
+		fprintf(stderr, "hello for \"%s\"%s\n", found ? name : "",
+		    ctx == tls_ctx ? ", using default certificate" : "");
+	if (batch) {
+		/* with -B, the hello is just the first thing in the buffer */
+		tlsb_put(&client->io, client->hello, client->hellolen);
+		bufpool_put(&hellopool, client->hello);
+		client->hello = NULL;
+		r = tls_accept_cbs(ctx, &client->tls, tlsb_read_cb,
+		    tlsb_write_cb, &client->io);
+	} else
+		r = tls_accept_cbs(ctx, &client->tls, hello_read, hello_write,
+		    client);
+	if (r == -1) {
+		warnx("tls_accept_cbs: %s", tls_error(ctx));
+		closeconn(pfd, client);
+		return;
+	}
+	PROBE(handshake_start, client->fd, 0, 0, NULL);
+	client->state = STATE_HANDSHAKE;
+
+	/*
+	 * The client is waiting for our answer to the hello we already
+	 * read, so poll won't wake us for it - start the handshake now.
+	 */
+	handshake(pfd, client);
+}
+
+static void
+read_client(struct pollfd *pfd, struct client *client)
+{
+	unsigned char buf[BUFLEN];
+	ssize_t len;
+
+	/*
+	 * the buffer is empty while we are reading, unless we are
+	 * framing and have part of a message.
+	 */
+	len = conn_read(client, buf, client_room(client));
+	if (len > 0) {
+		if (client_put(client, buf, len) != len) {
+			warnx("client buffer failed");
+			closeconn(pfd, client);
+		} else if (framing != -1 && client_frames(client) == -1) {
+			warnx("message too big");
+			closeconn(pfd, client);
+		} else if (framing == -1 || client->ready > 0) {
+			client->state=STATE_WRITING;
+			pfd->events = POLLOUT | POLLHUP;
+		}
+	}
+	else if (len == 0)
+		closeconn(pfd, client);
+	else if (len == TLS_WANT_POLLIN)
+		pfd->events = POLLIN | POLLHUP;
+	else if (len == TLS_WANT_POLLOUT)
+		pfd->events = POLLOUT | POLLHUP;
+	else {
+		warnx("tls_read failed: %s", tls_error(client->tls));
+		closeconn(pfd, client);
+	}
+}
+
+/*
+ * With -f, write out only the complete messages, straight from the
+ * buffer, and keep any part of the next one until the rest of it
+ * arrives. Messages that wrap around the end of the buffer get copied
+ * out in one piece, since two small writes can cost us a delayed ack.
+ */
+static void
+write_messages(struct pollfd *pfd, struct client *client)
+{
+	unsigned char buf[BUFLEN];
+	struct iovec data[2];
+	const void *p;
+	size_t len;
+	ssize_t w;
+
+	while (client->ready > 0) {
+		if (client_data(client, 0, data) == 2 &&
+		    data[0].iov_len < client->ready) {
+			len = client_get(client, buf, client->ready);
+			p = buf;
+		} else {
+			p = data[0].iov_base;
+			len = client->ready;
+		}
+		w = conn_write(client, p, len);
+		if (w == TLS_WANT_POLLIN) {
+			pfd->events = POLLIN | POLLHUP;
+			return;
+		} else if (w == TLS_WANT_POLLOUT) {
+			pfd->events = POLLOUT | POLLHUP;
+			return;
+		} else if (w == -1) {
+			warnx("tls_write failed: %s", tls_error(client->tls));
+			closeconn(pfd, client);
+			return;
+		}
+		client_skip(client, w);
+		client->ready -= w;
+	}
+	client->state = STATE_READING;
+	pfd->events = POLLIN | POLLHUP;
+	/*
+	 * libtls may have more of the last record than we had room
+	 * for, which poll can't tell us about - so look now.
+	 */
+	read_client(pfd, client);
+}
+
+/*
+ * With -c, everything goes back out through a tlswriter. We keep
+ * reading while there's input, hand the writer whatever is ready to
+ * echo, and it writes each record as it fills one. Once we run out of
+ * input, what's left goes when it has waited -c ms, so that replies to
+ * a client sending many small messages share records.
+ */
+static void
+echo_coalesced(struct pollfd *pfd, struct client *client)
+{
+	unsigned char buf[BUFLEN];
+	struct iovec data[2];
+	struct tlswriter *w;
+	size_t left, n;
+	ssize_t len;
+	int cnt, i, ret, events = POLLIN;
+
+	if ((w = client->writer) == NULL) {
+		if ((w = client->writer = bufpool_get(&writerpool)) == NULL) {
+			warn("malloc");
+			closeconn(pfd, client);
+			return;
+		}
+		tlsw_init(w, client->tls);
+	}
+	for (;;) {
+		cnt = client_data(client, 0, data);
+		for (i = 0, left = client->ready; i < cnt; i++) {
+			if (data[i].iov_len > left)
+				data[i].iov_len = left;
+			left -= data[i].iov_len;
+		}
+		if ((n = tlsw_writev(w, data, cnt)) > 0) {
+			client_skip(client, n);
+			client->ready -= n;
+		}
+		if ((ret = conn_flush(client, 0)) != 0)
+			break;
+		if (client->ready > 0)
+			continue;	/* the writer has room again */
+
+		len = conn_read(client, buf, client_room(client));
+		if (len > 0) {
+			if (client_put(client, buf, len) != len) {
+				warnx("client buffer failed");
+				closeconn(pfd, client);
+				return;
+			}
+			if (framing == -1)
+				client->ready += len;
+			else if (client_frames(client) == -1) {
+				warnx("message too big");
+				closeconn(pfd, client);
+				return;
+			}
+		} else if (len == TLS_WANT_POLLIN)
+			break;
+		else if (len == TLS_WANT_POLLOUT) {
+			events = POLLOUT;
+			break;
+		} else {
+			if (len == -1)
+				warnx("tls_read failed: %s",
+				    tls_error(client->tls));
+			closeconn(pfd, client);
+			return;
+		}
+	}
+	if (ret == 0 && tlsw_timeout(w, coalesce) == 0)
+		ret = conn_flush(client, 1);
+	if (ret == -1) {
+		warnx("tls_write failed: %s", tls_error(client->tls));
+		closeconn(pfd, client);
+		return;
+	}
+	/* no more reading until the writer can get rid of what it has */
+	if (ret == TLS_WANT_POLLOUT)
+		events = POLLOUT;
+	pfd->events = events | POLLHUP;
+}
+
 static void
 handle_client(struct pollfd *pfd, struct client *client)
 {
-	if ((pfd->revents & (POLLERR | POLLNVAL)))
+	if (pfd->revents & POLLNVAL)
 		errx(1, "bad fd %d", pfd->fd);
-	if (pfd->revents & POLLHUP)
-		closeconn(pfd);
+	/* a client going away badly shouldn't take the server with it */
+	if (pfd->revents & (POLLERR | POLLHUP))
+		closeconn(pfd, client);
 	else if (pfd->revents & pfd->events) {
-		char buf[BUFLEN];
+		unsigned char buf[BUFLEN];
 		ssize_t len = 0;
-		if (client->state == STATE_READING) {
-			len = read(pfd->fd, buf, sizeof(buf));
-			if (len > 0) {
-				if (client_put(client, buf, len)
-				    != len) {
-					warnx("client buffer failed");
-					closeconn(pfd);
-				} else {
-					client->state=STATE_WRITING;
+		if (client->state == STATE_HELLO)
+			handle_hello(pfd, client);
+		else if (client->state == STATE_HANDSHAKE)
+			handshake(pfd, client);
+		else if (coalesce != -1)
+			echo_coalesced(pfd, client);
+		else if (client->state == STATE_READING)
+			read_client(pfd, client);
+		else if (client->state == STATE_WRITING && framing != -1)
+			write_messages(pfd, client);
+		else if (client->state == STATE_WRITING) {
+			ssize_t w = 0;
+			/*
+			 * write out what we have buffered. If tls_write
+			 * needs the socket to be readable or writable
+			 * first, we leave the rest in the buffer, and try
+			 * again with the same data when poll says so.
+			 */
+			while ((len = client_get(client, buf, sizeof(buf)))
+			    > 0) {
+				w = conn_write(client, buf, len);
+				if (w == TLS_WANT_POLLIN) {
+					pfd->events = POLLIN | POLLHUP;
+					return;
+				} else if (w == TLS_WANT_POLLOUT) {
 					pfd->events = POLLOUT | POLLHUP;
+					return;
+				} else if (w == -1) {
+					warnx("tls_write failed: %s",
+					    tls_error(client->tls));
+					closeconn(pfd, client);
+					return;
 				}
+				client_consume(client, w);
 			}
-			else if (len == 0)
-				closeconn(pfd);
-			else
-				pfd->events = POLLIN | POLLHUP;
-		} else if (client->state == STATE_WRITING) {
-			ssize_t w = 0;
-			ssize_t written = 0;
+			client->state = STATE_READING;
+			pfd->events = POLLIN | POLLHUP;
+			/* see write_messages */
+			read_client(pfd, client);
+		}
+	}
+}
+
+/*
+ * With -B, send what libtls wrote with one writev, and poll for what
+ * the socket needs: to be read if there's room to read into, and to be
+ * written if there's something to write or libtls is waiting for room.
+ */
+static void
+batch_done(struct pollfd *pfd, struct client *client)
+{
+	struct tlsbuf *b = &client->io;
+
+	if (tlsb_flush(b) == -1) {
+		closeconn(pfd, client);
+		return;
+	}
+	pfd->events = POLLHUP;
+	if (!b->eof && b->in.len < TLSB_SIZE)
+		pfd->events |= POLLIN;
+	if (tlsb_pending(b) || (client->want & POLLOUT))
+		pfd->events |= POLLOUT;
+}
+
+/*
+ * With -B, libtls works on the client's buffers (../common/tlsbuf.c)
+ * rather than its socket. We read whatever the socket has with one
+ * readv, which may be several records, then run the state machine
+ * above for as long as what's buffered lets it get anywhere, and write
+ * what it produced with one writev in batch_done(). While we do, the
+ * state machine sees what libtls is waiting for in pfd->events as
+ * usual, which we keep in client->want while we're in poll.
+ */
+static void
+handle_batched(struct pollfd *pfd, struct client *client)
+{
+	struct tlsbuf *b = &client->io;
+	size_t inlen, outlen;
+	int revents, state;
+
+	if (pfd->fd == -1 || pfd->revents == 0)
+		return;
+	if (pfd->revents & POLLNVAL)
+		errx(1, "bad fd %d", pfd->fd);
+	if (client->state == STATE_HELLO) {
+		/* we read the hello ourselves, see handle_hello() */
+		handle_client(pfd, client);
+		if (pfd->fd == -1 || client->state == STATE_HELLO)
+			return;
+		client->want = pfd->events;
+	} else if (pfd->revents & (POLLIN | POLLHUP | POLLERR)) {
+		/* a hangup can come with the last of the data */
+		tlsb_fill(b);
+	}
+	if (pfd->revents & POLLOUT && tlsb_flush(b) == -1) {
+		closeconn(pfd, client);
+		return;
+	}
+
+	for (;;) {
+		revents = 0;
+		if ((client->want & POLLIN) && tlsb_readable(b))
+			revents |= POLLIN;
+		if ((client->want & POLLOUT) && tlsb_writable(b))
+			revents |= POLLOUT;
+		if (revents == 0)
+			break;
+		state = client->state;
+		inlen = b->in.len;
+		outlen = b->out.len;
+		pfd->events = client->want;
+		pfd->revents = revents;
+		handle_client(pfd, client);
+		if (pfd->fd == -1)
+			return;
+		client->want = pfd->events;
+		if (client->state == state && b->in.len == inlen &&
+		    b->out.len == outlen)
+			break;
+	}
+	batch_done(pfd, client);
+}
+
+/*
+ * With -F, each client gets a fiber (../common/fiber.c) rather than a
+ * slot in the poll loop, and echoing is a loop of reads and writes.
+ * Whenever libtls needs the socket, the fiber waits for it while the
+ * others run.
+ */
+static void
+echo_fiber(void *arg)
+{
+	unsigned char buf[BUFLEN];
+	struct tls *tls = NULL;
+	struct framer framer;
+	struct iovec data;
+	struct frame f;
+	size_t have = 0, ready, nread = 0, nwritten = 0;
+	ssize_t r;
+	int fd = (intptr_t)arg, ret;
+
+	if (tls_accept_socket(tls_ctx, &tls, fd) == -1) {
+		warnx("tls_accept_socket: %s", tls_error(tls_ctx));
+		goto done;
+	}
+	PROBE(handshake_start, fd, 0, 0, NULL);
+	if (fiber_tls_handshake(tls, fd, -1) == -1) {
+		warnx("TLS handshake failed: %s", tls_error(tls));
+		goto done;
+	}
+	PROBE(handshake_done, fd, 0, 0, tls);
+	framer_init(&framer, framing, sizeof(buf));
+
+	for (;;) {
+		r = fiber_tls_read(tls, fd, buf + have, sizeof(buf) - have,
+		    -1);
+		if (r == -1)
+			warnx("tls_read failed: %s", tls_error(tls));
+		if (r <= 0)
+			break;
+		if (nread == 0)
+			PROBE(first_byte, fd, r, 0, tls);
+		PROBE(read, fd, r, 0, tls);
+		nread += r;
+		have += r;
+
+		/* with -f, echo the complete messages, keep the rest */
+		ready = have;
+		if (framing != -1) {
+			ready = 0;
 			do {
-				len = client_get(client, buf, sizeof(buf));
-				w = write(pfd->fd, buf, len);
-				if (w == -1) {
-					if (errno != EINTR)
-						closeconn(pfd);
-				}
-				else {
-					written += w;
-					client_consume(client, w);
-				}
-			} while (written < len);
-			if (pfd->fd > 0) {
-				client->state = STATE_READING;
-				pfd->events = POLLIN | POLLHUP;
+				data.iov_base = buf + ready;
+				data.iov_len = have - ready;
+				if ((ret = framer_next(&framer, &data, 1,
+				    &f)) == 1)
+					ready += f.len;
+			} while (ret == 1);
+			if (ret == -1) {
+				warnx("message too big");
+				break;
+			}
+		}
+		if (ready == 0)
+			continue;
+		if (fiber_tls_write(tls, fd, buf, ready, -1) == -1) {
+			warnx("tls_write failed: %s", tls_error(tls));
+			break;
+		}
+		PROBE(write, fd, 0, ready, tls);
+		nwritten += ready;
+		memmove(buf, buf + ready, have - ready);
+		have -= ready;
+	}
+ done:
+	PROBE(close, fd, nread, nwritten, tls);
+	if (tls != NULL) {
+		tls_close(tls);
+		tls_free(tls);
+	}
+	close(fd);
+}
+
+/* what the -F accept and handoff fibers share */
+struct listener {
+	int			 fd;
+	int			 handoff;	/* with -U */
+	const struct handoff_keys *keys;
+	int			 closed;
+};
+
+static void
+accept_fiber(void *arg)
+{
+	struct listener *l = arg;
+	int fd, sflags;
+
+	for (;;) {
+		fiber_wait(l->fd, POLLIN, -1);
+		if (l->closed)
+			return;		/* handed off */
+		if ((fd = accept(l->fd, NULL, NULL)) == -1) {
+			/* out of descriptors, give some clients time to go */
+			if (errno == EMFILE || errno == ENFILE) {
+				warn("accept");
+				fiber_sleep(100);
 			}
+			continue;
+		}
+		PROBE(accept, fd, 0, 0, NULL);
+		sockopt_accepted(fd, so);
+		if ((sflags = fcntl(fd, F_GETFL)) < 0 ||
+		    fcntl(fd, F_SETFL, sflags | O_NONBLOCK) < 0)
+			err(1, "fcntl failed");
+		if (fiber_new(echo_fiber, (void *)(intptr_t)fd) == NULL) {
+			warn("fiber_new");
+			close(fd);
 		}
 	}
 }
 
+static void
+handoff_fiber(void *arg)
+{
+	struct listener *l = arg;
+
+	do {
+		fiber_wait(l->handoff, POLLIN, -1);
+	} while (handoff_send(l->handoff, &l->fd, 1, l->keys) == -1);
+	printf("Handed off to a new server, waiting for clients to finish\n");
+	fflush(stdout);
+	close(l->handoff);
+	/* which wakes the accept fiber, to see it's done */
+	close(l->fd);
+	l->closed = 1;
+}
+
 int main(int argc, char **argv) {
 
 	struct addrinfo hints, *res;
-	int i, listenfd, error;
+	struct tls_config *tls_cfg;
+	struct handoff handoff;
+	struct timespec polled;
+	const char *upgrade = NULL;
+	int ch, i, listenfd, error, timeout, t, fibers = 0, cpu = -1;
+	long l, spin = 0;
+	char *ep;
+
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "A:BFb:C:c:f:P:p:R:S:U:")) != -1) {
+		switch (ch) {
+		case 'A':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || l > 1000000) {
+				fprintf(stderr, "%s - bad rate\n", optarg);
+				usage();
+			}
+			admit_init(&admit, l);
+			admission = 1;
+			break;
+		case 'B':
+			batch = 1;
+			break;
+		case 'F':
+			fibers = 1;
+			break;
+		case 'b':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > 1000000) {
+				fprintf(stderr, "%s - bad spin budget\n",
+				    optarg);
+				usage();
+			}
+			spin = l;
+			break;
+		case 'C':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > 1023) {
+				fprintf(stderr, "%s - bad cpu\n", optarg);
+				usage();
+			}
+			cpu = l;
+			break;
+		case 'c':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > 1000) {
+				fprintf(stderr, "%s - bad delay\n", optarg);
+				usage();
+			}
+			coalesce = l;
+			break;
+		case 'f':
+			if ((framing = framer_type(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown framing\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'R':
+			if (recorder_open(optarg) == -1)
+				errx(1, "unable to record to %s", optarg);
+			break;
+		case 'S':
+			if (certmap_load(&certmap, optarg,
+			    SESSION_LIFETIME) == -1)
+				errx(1, "unable to load certificates from %s",
+				    optarg);
+			sni = 1;
+			break;
+		case 'P':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 0 || l > MAX_CONNECTIONS) {
+				fprintf(stderr, "%s - bad pool size\n",
+				    optarg);
+				usage();
+			}
+			pooled = l;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'U':
+			upgrade = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-	if (argc != 3)
+	if (argc != 2)
+		usage();
+	if (fibers && (coalesce != -1 || sni || admission || batch ||
+	    spin > 0 || pooled > 0)) {
+		fprintf(stderr, "-F doesn't do -A, -B, -b, -c, -P or -S\n");
+		usage();
+	}
+	/*
+	 * with -P, keep up to that many of each kind of per connection
+	 * buffer for the next connections, see ../common/bufpool.c
+	 */
+	if (bufpool_init(&hellopool, CLIENTHELLO_MAX, pooled) == -1 ||
+	    bufpool_init(&writerpool, sizeof(struct tlswriter), pooled) == -1 ||
+	    bufpool_init(&iopool, 2 * TLSB_SIZE, pooled) == -1)
+		err(1, "bufpool_init");
+	/* spinning looks like a busy server to admission control */
+	if (admission && spin > 0) {
+		fprintf(stderr, "-A doesn't do -b\n");
 		usage();
+	}
+	/*
+	 * with -b, spin on poll for that many microseconds before
+	 * sleeping in it, and with -C, do it on a cpu of our own. See
+	 * ../common/spin.c
+	 */
+	if (cpu != -1 && spin_pin(cpu) == -1)
+		err(1, "can't run on cpu %d", cpu);
 
 	bzero(&hints, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
-	if ((error = getaddrinfo(argv[1], argv[2], &hints, &res))) {
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
 		fprintf(stderr, "%s\n", gai_strerror(error));
 		usage();
 	}
 
-	for (i = 0; i < MAX_CONNECTIONS; i++)  {
+	for (i = 0; i < MAX_CONNECTIONS + 1; i++)  {
 		pollfds[i].fd = -1;
 		pollfds[i].events = POLLIN | POLLHUP;
 		pollfds[i].revents = 0;
 	}
 
-	if ((listenfd = socket(res->ai_family, res->ai_socktype,
-		    res->ai_protocol)) < 0)
-		err(1, "Couldn't get listen socket");
+	/*
+	 * with -U, take over the listening socket of the server that's
+	 * there already, if there is one. See ../common/handoff.c
+	 */
+	memset(&handoff, 0, sizeof(handoff));
+	if (upgrade != NULL && handoff_receive(&handoff, upgrade) == -1)
+		errx(1, "unable to take over from %s", upgrade);
+	if (handoff.nfds > 0) {
+		listenfd = handoff.fds[0];
+		while (handoff.nfds > 1)
+			close(handoff.fds[--handoff.nfds]);
+	} else {
+		if ((listenfd = socket(res->ai_family, res->ai_socktype,
+			    res->ai_protocol)) < 0)
+			err(1, "Couldn't get listen socket");
+
+		if (sockopt_listen(listenfd, res->ai_addr, res->ai_addrlen,
+		    so) == -1)
+			err(1, "bind/listen failed");
+	}
 
-	if (bind(listenfd, res->ai_addr, res->ai_addrlen) == -1)
-		err(1, "bind failed");
+	/*
+	 * set up our TLS server context, with our certificate and key.
+	 * With -S, this is only for clients asking for a name we have no
+	 * certificate for in the directory, see ../common/certmap.c
+	 */
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_keypair_file(tls_cfg, CERT_FILE, KEY_FILE) == -1)
+		errx(1, "unable to load keypair: %s",
+		    tls_config_error(tls_cfg));
+	if (tls_config_set_session_lifetime(tls_cfg, SESSION_LIFETIME) == -1)
+		errx(1, "unable to set session lifetime: %s",
+		    tls_config_error(tls_cfg));
+	/*
+	 * with -U we keep the ticket keys ourselves, so the server that
+	 * replaces us can have them, and add one of our own. Contexts
+	 * for the certificates from -S get them too.
+	 */
+	if (upgrade != NULL) {
+		handoff_rekey(&handoff.keys);
+		if (handoff_configure(tls_cfg, &handoff.keys, NULL) == -1)
+			errx(1, "unable to set ticket keys: %s",
+			    tls_config_error(tls_cfg));
+		certmap.keys = &handoff.keys;
+	}
+	if ((tls_ctx = tls_server()) == NULL)
+		errx(1, "tls_server failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(tls_ctx));
 
-	if (listen(listenfd, MAX_CONNECTIONS) == -1)
-		err(1, "listen failed");
+	/* tell the old server we have it from here */
+	if (handoff.nfds > 0)
+		handoff_ready(&handoff);
+	if (upgrade != NULL &&
+	    (pollfds[HANDOFF_POLLFD].fd = handoff_listen(upgrade)) == -1)
+		errx(1, "unable to listen on %s", upgrade);
 
-	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(int)) == -1)
-		err(1, "SO_REUSEADDR setsockopt failed");
+	/*
+	 * a client that goes away while we are writing to it should get
+	 * us an EPIPE, not kill us.
+	 */
+	signal(SIGPIPE, SIG_IGN);
 
 	newconn(&pollfds[0], listenfd);
 
+	if (fibers) {
+		struct listener l = { listenfd, pollfds[HANDOFF_POLLFD].fd,
+		    &handoff.keys, 0 };
+
+		if (fiber_init(FIBER_STACK, MAX_FIBERS) == -1)
+			err(1, "fiber_init");
+		if (fiber_new(accept_fiber, &l) == NULL ||
+		    (l.handoff != -1 && fiber_new(handoff_fiber, &l) == NULL))
+			err(1, "fiber_new");
+		fiber_loop();
+		freeaddrinfo(res);
+		return 0;
+	}
+
 	while(1) {
+		/* once we've handed off, we're done when our clients are */
+		if (pollfds[0].fd == -1) {
+			for (i = 1; i < MAX_CONNECTIONS; i++)
+				if (pollfds[i].fd != -1)
+					break;
+			if (i == MAX_CONNECTIONS)
+				break;
+		}
 		if (!throttle)
 			pollfds[0].events = POLLIN | POLLHUP;
 		else
 			pollfds[0].events = 0;
 
-		if (poll(pollfds, MAX_CONNECTIONS, -1) == -1)
+		/* wake up for the first partial record that's waited enough */
+		timeout = -1;
+		for (i = 1; coalesce != -1 && i < MAX_CONNECTIONS; i++) {
+			if (pollfds[i].fd == -1 || clients[i].writer == NULL)
+				continue;
+			t = tlsw_timeout(clients[i].writer, coalesce);
+			if (t != -1 && (timeout == -1 || t < timeout))
+				timeout = t;
+		}
+
+		if (spin_poll(pollfds, MAX_CONNECTIONS + 1, timeout, spin) == -1)
 			err(1, "poll failed");
+		if (admission)
+			clock_gettime(CLOCK_MONOTONIC, &polled);
+		if ((pollfds[HANDOFF_POLLFD].revents & POLLIN) &&
+		    handoff_send(pollfds[HANDOFF_POLLFD].fd, &listenfd, 1,
+		    &handoff.keys) == 0) {
+			printf("Handed off to a new server, "
+			    "waiting for clients to finish\n");
+			fflush(stdout);
+			close(pollfds[HANDOFF_POLLFD].fd);
+			pollfds[HANDOFF_POLLFD].fd = -1;
+			close(listenfd);
+			pollfds[0].fd = -1;
+			pollfds[0].revents = 0;
+		}
 		if (pollfds[0].revents) {
 			struct sockaddr csaddr;
 			socklen_t cssize;
 			int fd;
 
+			cssize = sizeof(csaddr);
 			fd = accept(pollfds[0].fd, &csaddr, &cssize);
+			if (fd >= 0) {
+				PROBE(accept, fd, 0, 0, NULL);
+				sockopt_accepted(fd, so);
+			}
 			throttle = 1;
 			for (i = 1; fd >= 0 && i < MAX_CONNECTIONS; i++)  {
+				if (pollfds[i].fd == -1 && (sni || admission)) {
+					/*
+					 * we don't know which certificate
+					 * to use, or whether the handshake
+					 * is worth doing, until we see the
+					 * hello.
+					 */
+					if ((clients[i].hello =
+					    bufpool_get(&hellopool)) == NULL) {
+						warn("malloc");
+						close(fd);
+						throttle = 0;
+						break;
+					}
+					if (batch && tlsb_init_mem(
+					    &clients[i].io, fd,
+					    bufpool_get(&iopool)) == -1) {
+						warn("malloc");
+						bufpool_put(&hellopool,
+						    clients[i].hello);
+						clients[i].hello = NULL;
+						close(fd);
+						throttle = 0;
+						break;
+					}
+					newconn(&pollfds[i], fd);
+					client_init(&clients[i]);
+					clients[i].state = STATE_HELLO;
+					clients[i].fd = fd;
+					clients[i].hellolen = 0;
+					clients[i].hellooff = 0;
+					throttle = 0;
+					break;
+				}
+				if (pollfds[i].fd == -1 && batch) {
+					if (tlsb_init_mem(&clients[i].io, fd,
+					    bufpool_get(&iopool)) == -1) {
+						warn("malloc");
+						close(fd);
+						throttle = 0;
+						break;
+					}
+					if (tls_accept_cbs(tls_ctx,
+					    &clients[i].tls, tlsb_read_cb,
+					    tlsb_write_cb, &clients[i].io) == -1) {
+						warnx("tls_accept_cbs: %s",
+						    tls_error(tls_ctx));
+						bufpool_put(&iopool,
+						    tlsb_release(&clients[i].io));
+						close(fd);
+						throttle = 0;
+						break;
+					}
+					clients[i].want = POLLIN | POLLHUP;
+				} else if (pollfds[i].fd == -1 &&
+				    tls_accept_socket(tls_ctx, &clients[i].tls,
+				    fd) == -1) {
+					warnx("tls_accept_socket: %s",
+					    tls_error(tls_ctx));
+					close(fd);
+					throttle = 0;
+					break;
+				}
 				if (pollfds[i].fd == -1) {
+					PROBE(handshake_start, fd, 0, 0, NULL);
 					newconn(&pollfds[i], fd);
 					client_init(&clients[i]);
+					clients[i].state = STATE_HANDSHAKE;
+					clients[i].fd = fd;
 					throttle = 0;
 					break;
 				}
 			}
+			if (fd >= 0 && throttle) {
+				/*
+				 * Nowhere to put it. With -A we keep
+				 * accepting, and say no straight away
+				 * rather than leave everyone after this
+				 * waiting in the listen queue.
+				 */
+				if (admission) {
+					admit_reject(&admit);
+					sockopt_reset(fd);
+					throttle = 0;
+				} else
+					close(fd);
+			}
+		}
+		for (i = 1; i < MAX_CONNECTIONS; i++) {
+			if (batch)
+				handle_batched(&pollfds[i], &clients[i]);
+			else
+				handle_client(&pollfds[i], &clients[i]);
+		}
+		for (i = 1; coalesce != -1 && i < MAX_CONNECTIONS; i++) {
+			if (pollfds[i].fd == -1 || clients[i].writer == NULL ||
+			    tlsw_timeout(clients[i].writer, coalesce) != 0)
+				continue;
+			if (batch) {
+				pollfds[i].events = clients[i].want;
+				echo_coalesced(&pollfds[i], &clients[i]);
+				if (pollfds[i].fd == -1)
+					continue;
+				clients[i].want = pollfds[i].events;
+				batch_done(&pollfds[i], &clients[i]);
+			} else
+				echo_coalesced(&pollfds[i], &clients[i]);
 		}
-		for (i = 1; i < MAX_CONNECTIONS; i++)
-			handle_client(&pollfds[i], &clients[i]);
+		if (admission)
+			admit_loop(&admit, &polled);
 	}
 
+	pools_report(1);
 	freeaddrinfo(res);
 	return 0;
 }
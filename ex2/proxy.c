@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A TLS terminating proxy, built like the echo server: one poll(2)
+ * loop, non blocking sockets, and a state machine for each client.
+ * Clients speak TLS to us, and we pass what they say on to a backend
+ * that doesn't, and what it says back to them.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "sockopt.h"
+
+#define MAX_CONNECTIONS 256
+#define POOL_MAX 32	/* idle backend connections we keep */
+#define BUFLEN 16384	/* each way, for each client */
+#define HANDSHAKE_TIMEOUT 10	/* seconds from accept to done handshaking */
+#define IDLE_TIMEOUT 60	/* seconds with nothing moving either way */
+
+#define CERT_FILE	"../CA/server.crt"
+#define KEY_FILE	"../CA/server.key"
+
+static int debug = 0;
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-f line|length] [-p %s] host portnumber "
+	    "backendhost backendport\n", __progname, sockopt_profiles());
+	exit(1);
+}
+
+#define STATE_HANDSHAKE 0
+#define STATE_PROXYING 1
+
+/* with -f, how many messages have gone by, and whether we're part way into one */
+struct counter {
+	unsigned long count;
+	size_t left;		/* of the message we're in */
+	size_t hdrlen;		/* of its length, with "-f length" */
+	unsigned char hdr[FRAME_HDRLEN];
+	int partial;
+};
+
+/* one direction: what we've read from one side and not yet written to the other */
+struct pipe {
+	unsigned char buf[BUFLEN];
+	size_t off, len;
+	int eof;		/* the side we read from is done */
+	int shut;		/* and we've told the other side so */
+	struct counter msgs;
+};
+
+struct proxy {
+	int state;
+	time_t last;		/* accepted, then last heard from */
+	struct tls *tls;
+	int connected;		/* to the backend */
+	struct pipe up;		/* client to backend */
+	struct pipe down;	/* backend to client */
+};
+
+/*
+ * pollfds has the listening socket, then each client, then the
+ * backend connection for each client, then the idle backend
+ * connections, which we watch so we notice when the backend hangs up.
+ */
+#define CLIENT(i)	(i)
+#define BACKEND(i)	(MAX_CONNECTIONS + (i))
+#define IDLE(i)		(2 * MAX_CONNECTIONS + (i))
+static struct pollfd pollfds[2 * MAX_CONNECTIONS + POOL_MAX];
+static struct proxy proxies[MAX_CONNECTIONS];
+static const struct sockopt *so;
+static struct tls *tls_ctx;
+static struct addrinfo *backend;
+static int framing = -1;
+static unsigned long opened, reused;
+
+static time_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
+
+static void
+nonblock(int fd)
+{
+	int sflags;
+
+	if ((sflags = fcntl(fd, F_GETFL)) < 0)
+		err(1, "fcntl failed");
+	sflags |= O_NONBLOCK;
+	if (fcntl(fd, F_SETFL, sflags) < 0)
+		err(1, "fcntl failed");
+}
+
+static void
+count_messages(struct counter *c, const unsigned char *p, size_t len)
+{
+	const unsigned char *nl;
+	size_t n;
+
+	if (framing == FRAME_LINE) {
+		while ((nl = frame_memchr(p, '\n', len)) != NULL) {
+			c->count++;
+			c->partial = 0;
+			len -= nl + 1 - p;
+			p = nl + 1;
+		}
+		if (len > 0)
+			c->partial = 1;
+		return;
+	}
+	while (len > 0) {
+		if (c->left == 0) {
+			c->hdr[c->hdrlen++] = *p++;
+			len--;
+			if (c->hdrlen < FRAME_HDRLEN)
+				continue;
+			c->left = (size_t)c->hdr[0] << 24 | c->hdr[1] << 16 |
+			    c->hdr[2] << 8 | c->hdr[3];
+			c->hdrlen = 0;
+		} else {
+			n = len < c->left ? len : c->left;
+			c->left -= n;
+			p += n;
+			len -= n;
+		}
+		if (c->left == 0 && c->hdrlen == 0)
+			c->count++;
+	}
+	c->partial = c->left > 0 || c->hdrlen > 0;
+}
+
+/* Where the next read into a pipe goes, or what it has to write. */
+static size_t
+pipe_room(struct pipe *p, unsigned char **start)
+{
+	size_t end = (p->off + p->len) % BUFLEN;
+
+	*start = p->buf + end;
+	if (p->len == BUFLEN)
+		return (0);
+	return (end >= p->off ? BUFLEN - end : p->off - end);
+}
+
+static int
+pipe_data(struct pipe *p, struct iovec iov[2])
+{
+	iov[0].iov_base = p->buf + p->off;
+	if (p->off + p->len <= BUFLEN) {
+		iov[0].iov_len = p->len;
+		return (1);
+	}
+	iov[0].iov_len = BUFLEN - p->off;
+	iov[1].iov_base = p->buf;
+	iov[1].iov_len = p->len - iov[0].iov_len;
+	return (2);
+}
+
+static void
+pipe_added(struct pipe *p, size_t n)
+{
+	unsigned char *start;
+
+	pipe_room(p, &start);
+	if (framing != -1)
+		count_messages(&p->msgs, start, n);
+	p->len += n;
+}
+
+static void
+pipe_removed(struct pipe *p, size_t n)
+{
+	p->off = (p->off + n) % BUFLEN;
+	p->len -= n;
+	if (p->len == 0)
+		p->off = 0;
+}
+
+/*
+ * Is the backend connection between requests? With -f, when every
+ * request we've sent it has had its answer, it can go back in the pool
+ * for the next client.
+ */
+static int
+quiet(struct proxy *p)
+{
+	return (framing != -1 && p->connected && !p->up.msgs.partial &&
+	    !p->down.msgs.partial && p->up.len == 0 && p->down.len == 0 &&
+	    !p->down.eof && p->up.msgs.count == p->down.msgs.count);
+}
+
+/* an idle backend connection from the pool, if there's one still up */
+static int
+pool_get(void)
+{
+	char c;
+	int i, fd;
+
+	for (i = POOL_MAX - 1; i >= 0; i--) {
+		if ((fd = pollfds[IDLE(i)].fd) == -1)
+			continue;
+		pollfds[IDLE(i)].fd = -1;
+		if (recv(fd, &c, 1, MSG_PEEK) == -1 && errno == EAGAIN) {
+			reused++;
+			return (fd);
+		}
+		close(fd);
+	}
+	return (-1);
+}
+
+static void
+pool_put(int fd)
+{
+	int i;
+
+	for (i = 0; i < POOL_MAX; i++) {
+		if (pollfds[IDLE(i)].fd == -1) {
+			pollfds[IDLE(i)].fd = fd;
+			pollfds[IDLE(i)].events = POLLIN;
+			pollfds[IDLE(i)].revents = 0;
+			return;
+		}
+	}
+	close(fd);
+}
+
+/* start connecting to the backend, or get a connection from the pool */
+static int
+backend_connect(struct proxy *p)
+{
+	ssize_t sent;
+	int fd;
+
+	if ((fd = pool_get()) != -1) {
+		p->connected = 1;
+		return (fd);
+	}
+	if ((fd = socket(backend->ai_family, backend->ai_socktype,
+	    backend->ai_protocol)) == -1) {
+		warn("socket");
+		return (-1);
+	}
+	nonblock(fd);
+	p->connected = 0;
+	if (sockopt_connect(fd, backend->ai_addr, backend->ai_addrlen, so,
+	    NULL, 0, &sent) == 0)
+		p->connected = 1;
+	else if (errno != EINPROGRESS) {
+		warn("connect to backend");
+		close(fd);
+		return (-1);
+	}
+	opened++;
+	return (fd);
+}
+
+static void
+finish(struct proxy *p, struct pollfd *cfd, struct pollfd *bfd, int recycle)
+{
+	if (p->tls != NULL) {
+		if (!p->down.shut)
+			tls_close(p->tls);
+		tls_free(p->tls);
+		p->tls = NULL;
+	}
+	close(cfd->fd);
+	cfd->fd = -1;
+	cfd->revents = 0;
+	if (bfd->fd != -1) {
+		if (recycle)
+			pool_put(bfd->fd);
+		else
+			close(bfd->fd);
+	}
+	bfd->fd = -1;
+	bfd->revents = 0;
+	if (debug)
+		fprintf(stderr, "backend connections: %lu opened, %lu reused\n",
+		    opened, reused);
+}
+
+/*
+ * Move what we can each way, until nothing moves, then work out
+ * what each socket has to wait for. Neither side gets more than
+ * BUFLEN bytes ahead of the other before we stop reading from it.
+ */
+static void
+proxy_run(struct proxy *p, struct pollfd *cfd, struct pollfd *bfd)
+{
+	struct iovec iov[2];
+	unsigned char *start;
+	int rwant, wwant, progress, error, cnt;
+	socklen_t len;
+	size_t room;
+	ssize_t n;
+
+	/* a reset from either side ends it */
+	if ((cfd->revents & POLLERR) ||
+	    (p->connected && (bfd->revents & POLLERR))) {
+		finish(p, cfd, bfd, 0);
+		return;
+	}
+	if (!p->connected && (bfd->revents & (POLLOUT | POLLERR | POLLHUP))) {
+		len = sizeof(error);
+		if (getsockopt(bfd->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) == -1) {
+			warn("getsockopt SO_ERROR");
+			finish(p, cfd, bfd, 0);
+			return;
+		}
+		if (error != 0) {
+			warnx("connect to backend: %s", strerror(error));
+			finish(p, cfd, bfd, 0);
+			return;
+		}
+		p->connected = 1;
+	}
+
+	if (p->state == STATE_HANDSHAKE) {
+		switch (tls_handshake(p->tls)) {
+		case 0:
+			p->state = STATE_PROXYING;
+			break;
+		case TLS_WANT_POLLIN:
+			cfd->events = POLLIN;
+			bfd->events = p->connected ? 0 : POLLOUT;
+			return;
+		case TLS_WANT_POLLOUT:
+			cfd->events = POLLOUT;
+			bfd->events = p->connected ? 0 : POLLOUT;
+			return;
+		default:
+			warnx("TLS handshake failed: %s", tls_error(p->tls));
+			finish(p, cfd, bfd, 0);
+			return;
+		}
+	}
+
+	do {
+		progress = 0;
+		rwant = wwant = 0;
+
+		/* from the client, straight into the pipe to the backend */
+		if (!p->up.eof && (room = pipe_room(&p->up, &start)) > 0) {
+			n = tls_read(p->tls, start, room);
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+				rwant = n == TLS_WANT_POLLIN ? POLLIN : POLLOUT;
+			else if (n == -1) {
+				warnx("tls_read failed: %s", tls_error(p->tls));
+				finish(p, cfd, bfd, 0);
+				return;
+			} else if (n == 0)
+				p->up.eof = 1;
+			else {
+				pipe_added(&p->up, n);
+				progress = 1;
+			}
+		}
+		if (p->connected && p->up.len > 0) {
+			cnt = pipe_data(&p->up, iov);
+			if ((n = writev(bfd->fd, iov, cnt)) > 0) {
+				pipe_removed(&p->up, n);
+				progress = 1;
+			} else if (errno != EAGAIN && errno != EINTR) {
+				warn("write to backend");
+				finish(p, cfd, bfd, 0);
+				return;
+			}
+		}
+
+		/* from the backend, and out to the client */
+		if (p->connected && !p->down.eof &&
+		    (room = pipe_room(&p->down, &start)) > 0) {
+			if ((n = read(bfd->fd, start, room)) > 0) {
+				pipe_added(&p->down, n);
+				progress = 1;
+			} else if (n == 0)
+				p->down.eof = 1;
+			else if (errno != EAGAIN && errno != EINTR) {
+				warn("read from backend");
+				finish(p, cfd, bfd, 0);
+				return;
+			}
+		}
+		if (p->down.len > 0) {
+			pipe_data(&p->down, iov);
+			n = tls_write(p->tls, iov[0].iov_base, iov[0].iov_len);
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+				wwant = n == TLS_WANT_POLLIN ? POLLIN : POLLOUT;
+			else if (n == -1) {
+				warnx("tls_write failed: %s",
+				    tls_error(p->tls));
+				finish(p, cfd, bfd, 0);
+				return;
+			} else {
+				pipe_removed(&p->down, n);
+				progress = 1;
+			}
+		}
+	} while (progress);
+
+	/*
+	 * Pass on a half close each way once the pipe is empty. The
+	 * client's close_notify becomes a shutdown of the backend
+	 * connection, and the backend's FIN a close_notify to the client,
+	 * which TLS 1.3 lets us send while still reading what the client
+	 * has to say. With -f, a client hanging up between requests leaves
+	 * the backend connection for the next one instead.
+	 */
+	if (p->up.eof && p->up.len == 0 && !p->up.shut) {
+		if (quiet(p)) {
+			finish(p, cfd, bfd, 1);
+			return;
+		}
+		if (framing == -1 || p->up.msgs.partial || p->down.eof) {
+			shutdown(bfd->fd, SHUT_WR);
+			p->up.shut = 1;
+		}
+	}
+	if (p->down.eof && p->down.len == 0 && !p->down.shut) {
+		n = tls_close(p->tls);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+			wwant = n == TLS_WANT_POLLIN ? POLLIN : POLLOUT;
+		else {
+			shutdown(cfd->fd, SHUT_WR);
+			p->down.shut = 1;
+		}
+	}
+	if (p->up.shut && p->down.shut) {
+		finish(p, cfd, bfd, 0);
+		return;
+	}
+
+	cfd->events = rwant | wwant;
+	bfd->events = 0;
+	if (!p->connected || p->up.len > 0)
+		bfd->events |= POLLOUT;
+	if (p->connected && !p->down.eof && p->down.len < BUFLEN)
+		bfd->events |= POLLIN;
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints, *res;
+	struct tls_config *tls_cfg;
+	int ch, i, listenfd, error;
+	time_t t;
+
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "f:p:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if ((framing = framer_type(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown framing\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 4)
+		usage();
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[2], argv[3], &hints, &backend))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+
+	for (i = 0; i < 2 * MAX_CONNECTIONS + POOL_MAX; i++)
+		pollfds[i].fd = -1;
+
+	if ((listenfd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) < 0)
+		err(1, "Couldn't get listen socket");
+	if (sockopt_listen(listenfd, res->ai_addr, res->ai_addrlen, so) == -1)
+		err(1, "bind/listen failed");
+	freeaddrinfo(res);
+
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_keypair_file(tls_cfg, CERT_FILE, KEY_FILE) == -1)
+		errx(1, "unable to load keypair: %s",
+		    tls_config_error(tls_cfg));
+	if ((tls_ctx = tls_server()) == NULL)
+		errx(1, "tls_server failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(tls_ctx));
+
+	signal(SIGPIPE, SIG_IGN);
+
+	nonblock(listenfd);
+	pollfds[0].fd = listenfd;
+	pollfds[0].events = POLLIN;
+
+	while(1) {
+		/* wake up now and then to hang up on the quiet ones */
+		if (poll(pollfds, 2 * MAX_CONNECTIONS + POOL_MAX, 1000) == -1)
+			err(1, "poll failed");
+		t = now();
+
+		/* an idle backend connection has nothing to say but goodbye */
+		for (i = 0; i < POOL_MAX; i++) {
+			if (pollfds[IDLE(i)].fd != -1 &&
+			    pollfds[IDLE(i)].revents) {
+				close(pollfds[IDLE(i)].fd);
+				pollfds[IDLE(i)].fd = -1;
+			}
+		}
+
+		if (pollfds[0].revents & POLLIN) {
+			struct proxy *p = NULL;
+			int fd, up;
+
+			if ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+				sockopt_accepted(fd, so);
+				nonblock(fd);
+				for (i = 1; i < MAX_CONNECTIONS; i++) {
+					if (pollfds[CLIENT(i)].fd == -1) {
+						p = &proxies[i];
+						break;
+					}
+				}
+			}
+			if (fd >= 0 && p == NULL)
+				close(fd);
+			else if (p != NULL) {
+				memset(p, 0, sizeof(*p));
+				p->last = t;
+				/*
+				 * get the backend connection going while
+				 * we do the handshake with the client.
+				 */
+				if ((up = backend_connect(p)) == -1)
+					close(fd);
+				else if (tls_accept_socket(tls_ctx, &p->tls,
+				    fd) == -1) {
+					warnx("tls_accept_socket: %s",
+					    tls_error(tls_ctx));
+					close(fd);
+					close(up);
+				} else {
+					pollfds[CLIENT(i)].fd = fd;
+					pollfds[CLIENT(i)].events = POLLIN;
+					pollfds[CLIENT(i)].revents = 0;
+					pollfds[BACKEND(i)].fd = up;
+					pollfds[BACKEND(i)].events = p->connected ?
+					    0 : POLLOUT;
+					pollfds[BACKEND(i)].revents = 0;
+				}
+			}
+		}
+
+		for (i = 1; i < MAX_CONNECTIONS; i++) {
+			if (pollfds[CLIENT(i)].fd == -1)
+				continue;
+			if (pollfds[CLIENT(i)].revents & POLLNVAL ||
+			    pollfds[BACKEND(i)].revents & POLLNVAL)
+				errx(1, "bad fd");
+			if (pollfds[CLIENT(i)].revents ||
+			    pollfds[BACKEND(i)].revents) {
+				proxy_run(&proxies[i], &pollfds[CLIENT(i)],
+				    &pollfds[BACKEND(i)]);
+				/* the handshake gets no more time for trying */
+				if (proxies[i].state == STATE_PROXYING)
+					proxies[i].last = t;
+				continue;
+			}
+			/*
+			 * otherwise they'd keep the slot forever, and with
+			 * all of them taken we'd accept no one else.
+			 */
+			if (t - proxies[i].last >=
+			    (proxies[i].state == STATE_HANDSHAKE ?
+			    HANDSHAKE_TIMEOUT : IDLE_TIMEOUT)) {
+				if (debug)
+					fprintf(stderr, "slot %d timed out\n",
+					    i);
+				finish(&proxies[i], &pollfds[CLIENT(i)],
+				    &pollfds[BACKEND(i)], 0);
+			}
+		}
+	}
+}
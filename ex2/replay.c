@@ -0,0 +1,626 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Plays back a recording of a server's traffic (../common/recorder.c)
+ * against any of the servers, so they can be measured with connections
+ * that come and go, send and think the way real ones did. Built like
+ * the client next door, but with a connection for every one in the
+ * recording, all in one poll loop.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "recorder.h"
+#include "sesscache.h"
+#include "sockopt.h"
+
+#define MAX_ACTIVE 1024		/* connections at once */
+#define CHUNK 16384
+
+#define CA_FILE		"../CA/root.pem"
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-f line|length] [-n servername] [-p %s] "
+	    "[-s sessiondir] [-t secs] [-x speed] file host portnumber\n",
+	    __progname, sockopt_profiles());
+	exit(1);
+}
+
+struct conn {
+	size_t first, nev, ev;	/* its events, and the next one */
+	int resume;		/* it resumed a session */
+	int handshook;
+	struct tls *tls;
+	uint64_t wake;		/* ns, when the next event is due */
+	uint64_t last;		/* ns, when the last one happened */
+	uint64_t lastusec;	/* and when it happened in the recording */
+	size_t msglen, msgoff;	/* what we're sending */
+	uint64_t expect, got;	/* bytes of answers */
+	uint64_t expectusec;	/* when the last answer ended */
+	uint64_t sent;		/* ns, when what they answer went */
+	uint64_t progress;	/* ns, when anything last moved */
+};
+
+static struct record *recs;
+static size_t nrecs;
+static struct conn *conns;
+static size_t nconns;
+
+static struct pollfd pollfds[MAX_ACTIVE];
+static size_t slots[MAX_ACTIVE];	/* which conn each pollfd is */
+static int active;
+
+static struct addrinfo *res;
+static const struct sockopt *so;
+static struct tls_config *cfg, *resume_cfg;
+static const char *servername;
+static int framing = -1;
+static double speed = 1.0;
+static uint64_t stall = 10 * 1000000000ULL;
+static uint64_t start;
+
+static struct {
+	unsigned long done, failed, stalled, hungup;
+	unsigned long full, resumed, asked;
+	unsigned long messages;
+	uint64_t sent, received;
+} stats;
+static struct latency answers, late;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* recorded microseconds to replayed nanoseconds */
+static uint64_t
+scaled(uint64_t usec)
+{
+	return ((uint64_t)(usec * 1000 / speed));
+}
+
+static int
+rec_cmp(const void *a, const void *b)
+{
+	size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
+	const struct record *ra = &recs[ia], *rb = &recs[ib];
+
+	if (ra->pid != rb->pid)
+		return (ra->pid < rb->pid ? -1 : 1);
+	if (ra->fd != rb->fd)
+		return (ra->fd < rb->fd ? -1 : 1);
+	if (ra->usec != rb->usec)
+		return (ra->usec < rb->usec ? -1 : 1);
+	/* the same microsecond - keep them in the order they were written */
+	return (ia < ib ? -1 : ia > ib);
+}
+
+static int
+conn_cmp(const void *a, const void *b)
+{
+	const struct conn *ca = a, *cb = b;
+	uint64_t ua = recs[ca->first].usec, ub = recs[cb->first].usec;
+
+	return (ua < ub ? -1 : ua > ub);
+}
+
+/*
+ * Read the recording, and sort it into connections. Those that were
+ * already open when it started don't count, and those still open when
+ * it ended close after their last event.
+ */
+static void
+load(const char *path)
+{
+	unsigned char hdr[RECORD_HDRLEN], buf[RECORD_LEN];
+	struct record *r, *sorted;
+	struct conn *c = NULL;
+	size_t i, n, *order;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr, RECORD_MAGIC, 8) != 0)
+		errx(1, "%s: not a recording", path);
+	for (n = 0; fread(buf, sizeof(buf), 1, f) == 1; nrecs++) {
+		if (nrecs == n) {
+			n = n ? n * 2 : 4096;
+			if ((recs = reallocarray(recs, n, sizeof(*recs))) ==
+			    NULL)
+				err(1, "reallocarray");
+		}
+		record_decode(buf, &recs[nrecs]);
+	}
+	fclose(f);
+
+	/* each connection's events together, in order */
+	if ((order = calloc(nrecs + 1, sizeof(*order))) == NULL ||
+	    (sorted = calloc(nrecs + 1, sizeof(*sorted))) == NULL ||
+	    (conns = calloc(nrecs + 1, sizeof(*conns))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nrecs; i++)
+		order[i] = i;
+	qsort(order, nrecs, sizeof(*order), rec_cmp);
+	for (i = n = 0; i < nrecs; i++) {
+		r = &recs[order[i]];
+		if (c != NULL && (r->pid != sorted[c->first].pid ||
+		    r->fd != sorted[c->first].fd || r->type == RECORD_OPEN))
+			c = NULL;
+		if (c == NULL && r->type != RECORD_OPEN)
+			continue;
+		if (c == NULL) {
+			c = &conns[nconns++];
+			c->first = n;
+		}
+		if (r->type == RECORD_RESUMED)
+			c->resume = 1;
+		sorted[n++] = *r;
+		c->nev++;
+		if (r->type == RECORD_CLOSE)
+			c = NULL;
+	}
+	free(order);
+	free(recs);
+	recs = sorted;
+	qsort(conns, nconns, sizeof(*conns), conn_cmp);
+}
+
+/* "len" bytes of a message that is "total" long, from "off" */
+static void
+message_bytes(unsigned char *buf, size_t off, size_t len, size_t total)
+{
+	size_t i;
+
+	memset(buf, 'x', len);
+	if (framing == FRAME_LENGTH) {
+		for (i = off; i < FRAME_HDRLEN && i < off + len; i++)
+			buf[i - off] = (total - FRAME_HDRLEN) >>
+			    (8 * (FRAME_HDRLEN - 1 - i));
+	} else if (framing == FRAME_LINE && off + len == total)
+		buf[len - 1] = '\n';
+}
+
+static void
+conn_start(struct conn *c)
+{
+	ssize_t sent;
+	int fd, i;
+
+	for (i = 0; i < MAX_ACTIVE && pollfds[i].fd != -1; i++)
+		;
+	c->progress = c->last = now_ns();
+	latency_add(&late, c->last - start - scaled(recs[c->first].usec));
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) == -1)
+		err(1, "socket");
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	if (sockopt_connect(fd, res->ai_addr, res->ai_addrlen, so, NULL, 0,
+	    &sent) == -1 && errno != EINPROGRESS) {
+		warn("connect");
+		close(fd);
+		stats.failed++;
+		return;
+	}
+	/* the handshake waits for the connect, like any other write */
+	if ((c->tls = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (c->resume)
+		stats.asked++;
+	if (tls_configure(c->tls, c->resume ? resume_cfg : cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(c->tls));
+	if (tls_connect_socket(c->tls, fd, servername) == -1)
+		errx(1, "tls_connect_socket failed: %s", tls_error(c->tls));
+	pollfds[i].fd = fd;
+	pollfds[i].events = POLLOUT;
+	pollfds[i].revents = 0;
+	slots[i] = c - conns;
+	active++;
+}
+
+static void
+conn_done(struct conn *c, struct pollfd *pfd, unsigned long *count)
+{
+	tls_close(c->tls);
+	tls_free(c->tls);
+	c->tls = NULL;
+	close(pfd->fd);
+	pfd->fd = -1;
+	pfd->revents = 0;
+	active--;
+	(*count)++;
+}
+
+static int
+want(ssize_t n)
+{
+	return (n == TLS_WANT_POLLIN ? POLLIN : POLLOUT);
+}
+
+/*
+ * Do as much of this connection's recording as we can right now. What
+ * the server read we send it, at the same time after the last thing
+ * that happened as in the recording, and what it wrote we wait for.
+ */
+static void
+conn_run(struct conn *c, struct pollfd *pfd)
+{
+	unsigned char buf[CHUNK];
+	struct record *e;
+	uint64_t now, due;
+	ssize_t n;
+	size_t len;
+
+	c->wake = 0;
+	if (!c->handshook) {
+		n = tls_handshake(c->tls);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) {
+			pfd->events = want(n);
+			return;
+		} else if (n == -1) {
+			warnx("TLS handshake failed: %s", tls_error(c->tls));
+			conn_done(c, pfd, &stats.failed);
+			return;
+		}
+		c->handshook = 1;
+		c->progress = c->last = now_ns();
+		if (tls_conn_session_resumed(c->tls))
+			stats.resumed++;
+		else
+			stats.full++;
+	}
+
+	for (;;) {
+		while (c->got < c->expect) {
+			n = tls_read(c->tls, buf, sizeof(buf));
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) {
+				pfd->events = want(n);
+				return;
+			} else if (n == 0) {
+				conn_done(c, pfd, &stats.hungup);
+				return;
+			} else if (n == -1) {
+				warnx("tls_read failed: %s", tls_error(c->tls));
+				conn_done(c, pfd, &stats.failed);
+				return;
+			}
+			c->got += n;
+			stats.received += n;
+			c->progress = now_ns();
+			if (c->got >= c->expect) {
+				if (c->sent != 0)
+					latency_add(&answers,
+					    c->progress - c->sent);
+				c->sent = 0;
+				c->last = c->progress;
+				c->lastusec = c->expectusec;
+			}
+		}
+		if (c->ev == c->nev) {
+			conn_done(c, pfd, &stats.done);
+			return;
+		}
+		e = &recs[c->first + c->ev];
+		switch (e->type) {
+		case RECORD_WRITE:
+			c->expect += e->size;
+			c->expectusec = e->usec;
+			c->ev++;
+			continue;
+		case RECORD_READ:
+		case RECORD_CLOSE:
+			break;
+		default:
+			c->lastusec = e->usec;
+			c->ev++;
+			continue;
+		}
+
+		now = now_ns();
+		if (c->msglen == 0) {
+			due = c->last;
+			if (e->usec > c->lastusec)
+				due += scaled(e->usec - c->lastusec);
+			if (due > now) {
+				/* nothing more from the server, we hope */
+				if (pfd->revents & (POLLERR | POLLHUP)) {
+					conn_done(c, pfd, &stats.hungup);
+					return;
+				}
+				c->wake = due;
+				pfd->events = 0;
+				return;
+			}
+			if (e->type == RECORD_CLOSE) {
+				conn_done(c, pfd, &stats.done);
+				return;
+			}
+			c->msglen = e->size;
+			if (framing == FRAME_LENGTH && c->msglen < FRAME_HDRLEN)
+				c->msglen = FRAME_HDRLEN;
+			else if (c->msglen == 0)
+				c->msglen = 1;
+			c->msgoff = 0;
+		}
+		while (c->msgoff < c->msglen) {
+			len = c->msglen - c->msgoff;
+			if (len > sizeof(buf))
+				len = sizeof(buf);
+			message_bytes(buf, c->msgoff, len, c->msglen);
+			n = tls_write(c->tls, buf, len);
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) {
+				pfd->events = want(n);
+				return;
+			} else if (n == -1) {
+				warnx("tls_write failed: %s",
+				    tls_error(c->tls));
+				conn_done(c, pfd, &stats.failed);
+				return;
+			}
+			c->msgoff += n;
+			stats.sent += n;
+			c->progress = now_ns();
+		}
+		stats.messages++;
+		c->msglen = 0;
+		c->sent = c->last = c->progress;
+		c->lastusec = e->usec;
+		c->ev++;
+	}
+}
+
+/*
+ * Get a session for the connections that resumed to offer, with a
+ * handshake before we start. It comes after the handshake, so wait a
+ * moment for the server to send it.
+ */
+static void
+prime(void)
+{
+	struct pollfd pfd;
+	struct tls *tls;
+	char buf[256];
+	ssize_t sent, n;
+	int fd;
+
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) == -1)
+		err(1, "socket");
+	if (sockopt_connect(fd, res->ai_addr, res->ai_addrlen, so, NULL, 0,
+	    &sent) == -1)
+		err(1, "connect failed");
+	if ((tls = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(tls, resume_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(tls));
+	if (tls_connect_socket(tls, fd, servername) == -1)
+		errx(1, "tls_connect_socket failed: %s", tls_error(tls));
+	do {
+		n = tls_handshake(tls);
+	} while (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT);
+	if (n == -1)
+		errx(1, "TLS handshake failed: %s", tls_error(tls));
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) == 1)
+		while (tls_read(tls, buf, sizeof(buf)) > 0)
+			;
+	tls_close(tls);
+	tls_free(tls);
+	close(fd);
+}
+
+int main(int argc, char **argv) {
+	const char *sessiondir = NULL;
+	char tmpl[] = "/tmp/replay.XXXXXX";
+	struct addrinfo hints;
+	uint64_t now, t, span;
+	size_t next = 0;
+	struct conn *c;
+	int ch, i, fd, error, timeout;
+	char *ep;
+	long l;
+
+	so = sockopt_profile(NULL);
+	while ((ch = getopt(argc, argv, "f:n:p:s:t:x:")) != -1) {
+		switch (ch) {
+		case 'f':
+			if ((framing = framer_type(optarg)) == -1) {
+				fprintf(stderr, "%s - unknown framing\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'n':
+			servername = optarg;
+			break;
+		case 'p':
+			if ((so = sockopt_profile(optarg)) == NULL) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 's':
+			sessiondir = optarg;
+			break;
+		case 't':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || l > 3600) {
+				fprintf(stderr, "%s - bad timeout\n", optarg);
+				usage();
+			}
+			stall = l * 1000000000ULL;
+			break;
+		case 'x':
+			speed = strtod(optarg, &ep);
+			if (*optarg == '\0' || *ep != '\0' || !(speed > 0)) {
+				fprintf(stderr, "%s - bad speed\n", optarg);
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 3)
+		usage();
+	if (servername == NULL)
+		servername = argv[1];
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[1], argv[2], &hints, &res))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+
+	load(argv[0]);
+	if (nconns == 0)
+		errx(1, "%s: no connections", argv[0]);
+
+	/*
+	 * one configuration for full handshakes, and one with a session
+	 * to offer for the connections that resumed. Without a session
+	 * cache directory, the session lives in a file nobody else sees.
+	 */
+	if (tls_init() == -1)
+		errx(1, "tls_init failed");
+	if ((cfg = tls_config_new()) == NULL ||
+	    (resume_cfg = tls_config_new()) == NULL)
+		errx(1, "tls_config_new failed");
+	if (tls_config_set_ca_file(cfg, CA_FILE) == -1 ||
+	    tls_config_set_ca_file(resume_cfg, CA_FILE) == -1)
+		errx(1, "unable to set root CA file %s: %s", CA_FILE,
+		    tls_config_error(cfg));
+	if (sessiondir != NULL) {
+		if (sesscache_setup(resume_cfg, sessiondir, argv[1], argv[2],
+		    servername) == -1)
+			exit(1);
+	} else {
+		if ((fd = mkstemp(tmpl)) == -1)
+			err(1, "mkstemp");
+		unlink(tmpl);
+		if (tls_config_set_session_fd(resume_cfg, fd) == -1)
+			errx(1, "tls_config_set_session_fd: %s",
+			    tls_config_error(resume_cfg));
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (c = conns; c < conns + nconns && !c->resume; c++)
+		;
+	if (c < conns + nconns)
+		prime();
+	for (i = 0; i < MAX_ACTIVE; i++)
+		pollfds[i].fd = -1;
+
+	start = now_ns();
+	for (;;) {
+		now = now_ns();
+		while (next < nconns && active < MAX_ACTIVE &&
+		    start + scaled(recs[conns[next].first].usec) <= now)
+			conn_start(&conns[next++]);
+
+		/*
+		 * run the connections poll woke up, or whose time has
+		 * come, and give up on those the server is ignoring.
+		 */
+		for (i = 0; i < MAX_ACTIVE; i++) {
+			if (pollfds[i].fd == -1)
+				continue;
+			c = &conns[slots[i]];
+			if (pollfds[i].revents ||
+			    (c->wake != 0 && c->wake <= now))
+				conn_run(c, &pollfds[i]);
+			else if (c->wake == 0 && c->progress + stall < now)
+				conn_done(c, &pollfds[i], &stats.stalled);
+		}
+		if (next == nconns && active == 0)
+			break;
+
+		timeout = -1;
+		t = UINT64_MAX;
+		if (next < nconns && active < MAX_ACTIVE)
+			t = start + scaled(recs[conns[next].first].usec);
+		for (i = 0; i < MAX_ACTIVE; i++) {
+			if (pollfds[i].fd == -1)
+				continue;
+			c = &conns[slots[i]];
+			if (c->wake != 0 && c->wake < t)
+				t = c->wake;
+			else if (c->wake == 0 && c->progress + stall < t)
+				t = c->progress + stall;
+		}
+		now = now_ns();
+		if (t != UINT64_MAX)
+			timeout = t > now ? (t - now + 999999) / 1000000 : 0;
+		if (poll(pollfds, MAX_ACTIVE, timeout) == -1)
+			err(1, "poll failed");
+	}
+
+	now = now_ns();
+	span = recs[conns[nconns - 1].first].usec - recs[conns[0].first].usec;
+	printf("connections %lu: %lu done, %lu failed, %lu hung up on, "
+	    "%lu stalled\n", (unsigned long)nconns, stats.done, stats.failed,
+	    stats.hungup, stats.stalled);
+	printf("handshakes: %lu full, %lu resumed (%lu tried)\n", stats.full,
+	    stats.resumed, stats.asked);
+	printf("messages %lu, %llu bytes sent, %llu received\n",
+	    stats.messages, (unsigned long long)stats.sent,
+	    (unsigned long long)stats.received);
+	if (answers.count > 0)
+		printf("answers: median %.1fus p99 %.1fus max %.1fus\n",
+		    latency_quantile(&answers, 0.5) / 1000.0,
+		    latency_quantile(&answers, 0.99) / 1000.0,
+		    answers.max / 1000.0);
+	printf("opened %.1fs of connections in %.1fs, up to %.1fms late "
+	    "(p99 %.1fms)\n", span / 1e6, (now - start) / 1e9,
+	    late.max / 1e6, latency_quantile(&late, 0.99) / 1e6);
+	return (stats.failed + stats.stalled > 0);
+}
@@ -0,0 +1,634 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the certificates on a lot of TLS servers at once.
+ *
+ * report_tls() in ex1 tells you all about one connection, after you've
+ * waited for it. Here we read "host:port" targets, keep up to "-n" of
+ * them handshaking at once from one poll loop, each with its own
+ * deadline, and write what report_tls would have said about each as
+ * JSON (one object per line) or CSV.
+ *
+ * Lots of servers share a certificate (a load balancer pool, a
+ * wildcard), so certificates are kept apart from targets: the first
+ * time we see a certificate hash we write a "cert" record with its
+ * details, and every target gets a "target" record that refers to its
+ * certificate by hash.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "resolve.h"
+
+#define DEFAULT_PORT	"443"
+#define DEFAULT_MAX	500	/* targets in flight */
+#define DEFAULT_TIMEOUT	10	/* seconds per target */
+#define EXPIRING	(30 * 24 * 60 * 60)	/* counted in the summary */
+#define SPARE_FDS	16	/* descriptors that aren't for targets */
+
+#define STATE_RESOLVING 0
+#define STATE_CONNECTING 1
+#define STATE_HANDSHAKE 2
+
+struct target {
+	char *name;		/* as we were given it */
+	char *host, *port;
+	int state;
+	struct resolve resolve;
+	struct tls *tls;
+	struct timespec start;	/* of the lookup, then of the connect */
+};
+
+static struct target *targets;
+static struct pollfd *pollfds;
+static int maxtargets = DEFAULT_MAX;
+static struct tls_config *tls_cfg;
+static int json = 1;
+
+static struct {
+	unsigned long targets, ok, failed, certs, expiring;
+} totals;
+
+/* the certificate hashes we have written out */
+static char **seen;
+static size_t nseen, seensize;
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-f json|csv] [-C cafile] [-n max] "
+	    "[-t seconds] [file]\n", __progname);
+	exit(1);
+}
+
+static long long
+ms_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - then->tv_sec) * 1000LL +
+	    (now.tv_nsec - then->tv_nsec) / 1000000);
+}
+
+static uint32_t
+fnv(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0')
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return (h);
+}
+
+/* Returns 1 if we've written "hash" out before, and remembers it if not. */
+static int
+seen_before(const char *hash)
+{
+	size_t i;
+
+	if (nseen * 2 >= seensize) {
+		char **old = seen;
+		size_t oldsize = seensize;
+
+		seensize = seensize ? seensize * 2 : 1024;
+		if ((seen = calloc(seensize, sizeof(*seen))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < oldsize; i++) {
+			size_t j;
+
+			if (old[i] == NULL)
+				continue;
+			for (j = fnv(old[i]) & (seensize - 1); seen[j] != NULL;
+			    j = (j + 1) & (seensize - 1))
+				;
+			seen[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = fnv(hash) & (seensize - 1); seen[i] != NULL;
+	    i = (i + 1) & (seensize - 1))
+		if (strcmp(seen[i], hash) == 0)
+			return (1);
+	if ((seen[i] = strdup(hash)) == NULL)
+		err(1, "strdup");
+	nseen++;
+	return (0);
+}
+
+/*
+ * Writing records. Fields always come in the same order, so a CSV
+ * record is just the values, and the header says what they are.
+ */
+static int nfields;
+
+static void
+record(const char *kind)
+{
+	if (json)
+		printf("{\"kind\":\"%s\"", kind);
+	else
+		printf("%s", kind);
+	nfields = 0;
+}
+
+static void
+field(const char *name, const char *val)
+{
+	const char *p;
+
+	if (json) {
+		printf(",\"%s\":", name);
+		if (val == NULL) {
+			printf("null");
+			return;
+		}
+		putchar('"');
+		for (p = val; *p != '\0'; p++) {
+			if (*p == '"' || *p == '\\')
+				printf("\\%c", *p);
+			else if ((unsigned char)*p < 0x20)
+				printf("\\u%04x", *p);
+			else
+				putchar(*p);
+		}
+		putchar('"');
+		return;
+	}
+	putchar(',');
+	if (val == NULL)
+		return;
+	if (strpbrk(val, ",\"\r\n") == NULL) {
+		fputs(val, stdout);
+		return;
+	}
+	putchar('"');
+	for (p = val; *p != '\0'; p++) {
+		if (*p == '"')
+			putchar('"');
+		putchar(*p);
+	}
+	putchar('"');
+}
+
+static void
+field_num(const char *name, long long val)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%lld", val);
+	if (json)
+		printf(",\"%s\":%s", name, buf);
+	else
+		field(name, buf);
+}
+
+static void
+field_time(const char *name, time_t t)
+{
+	char buf[32];
+	struct tm tm;
+
+	if (t == -1 || gmtime_r(&t, &tm) == NULL) {
+		field(name, NULL);
+		return;
+	}
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	field(name, buf);
+}
+
+static void
+endrecord(void)
+{
+	if (json)
+		putchar('}');
+	putchar('\n');
+}
+
+static void
+header(void)
+{
+	if (json)
+		return;
+	printf("# cert,hash,subject,issuer,notbefore,notafter,days_left,"
+	    "ocsp_url\n");
+	printf("# target,target,result,ms,version,cipher,hash,ocsp_staple\n");
+}
+
+/* The certificate "tls" has, the first time we see it. */
+static void
+report_cert(struct tls *tls, const char *hash)
+{
+	time_t notafter, now;
+
+	if (hash == NULL || seen_before(hash))
+		return;
+	totals.certs++;
+	notafter = tls_peer_cert_notafter(tls);
+	now = time(NULL);
+	if (notafter != -1 && notafter - now < EXPIRING)
+		totals.expiring++;
+	record("cert");
+	field("hash", hash);
+	field("subject", tls_peer_cert_subject(tls));
+	field("issuer", tls_peer_cert_issuer(tls));
+	field_time("notbefore", tls_peer_cert_notbefore(tls));
+	field_time("notafter", notafter);
+	if (notafter != -1)
+		field_num("days_left", (notafter - now) / (24 * 60 * 60));
+	else
+		field("days_left", NULL);
+	field("ocsp_url", tls_peer_ocsp_url(tls));
+	endrecord();
+}
+
+/* What the server stapled, as report_tls would put it. */
+static const char *
+staple(struct tls *tls, char *buf, size_t len)
+{
+	const char *result = tls_peer_ocsp_result(tls);
+
+	switch (tls_peer_ocsp_response_status(tls)) {
+	case -1:
+		return ("none");
+	case TLS_OCSP_RESPONSE_SUCCESSFUL:
+		return (result != NULL ? result : "");
+	default:
+		snprintf(buf, len, "failure - response_status %d (%s)",
+		    tls_peer_ocsp_response_status(tls),
+		    result != NULL ? result : "");
+		return (buf);
+	}
+}
+
+/* We're done with "t", one way or another: write it out, and free it. */
+static void
+finish(struct target *t, struct pollfd *pfd, const char *error)
+{
+	char buf[128];
+	const char *hash = NULL;
+
+	if (error == NULL) {
+		hash = tls_peer_cert_hash(t->tls);
+		report_cert(t->tls, hash);
+		totals.ok++;
+	} else
+		totals.failed++;
+	record("target");
+	field("target", t->name);
+	field("result", error != NULL ? error : "ok");
+	field_num("ms", ms_since(&t->start));
+	if (error == NULL) {
+		field("version", tls_conn_version(t->tls));
+		field("cipher", tls_conn_cipher(t->tls));
+		field("hash", hash);
+		field("ocsp_staple", staple(t->tls, buf, sizeof(buf)));
+	} else {
+		field("version", NULL);
+		field("cipher", NULL);
+		field("hash", NULL);
+		field("ocsp_staple", NULL);
+	}
+	endrecord();
+
+	if (t->tls != NULL) {
+		/* we don't wait to hear back from the server */
+		if (error == NULL)
+			tls_close(t->tls);
+		tls_free(t->tls);
+		t->tls = NULL;
+	}
+	if (t->state == STATE_RESOLVING)
+		resolve_cancel(&t->resolve);
+	else if (pfd->fd != -1)
+		close(pfd->fd);
+	pfd->fd = -1;
+	free(t->host);
+	free(t->name);
+	t->name = NULL;
+}
+
+/* Split "host:port", "host" or "[v6 address]:port" up. */
+static int
+parse_target(struct target *t, char *line)
+{
+	char *p;
+
+	line[strcspn(line, " \t\r\n#")] = '\0';
+	if (*line == '\0')
+		return (-1);
+	if ((t->name = strdup(line)) == NULL)
+		err(1, "strdup");
+	t->host = line;
+	t->port = DEFAULT_PORT;
+	if (*line == '[' && (p = strchr(line, ']')) != NULL) {
+		t->host = line + 1;
+		*p++ = '\0';
+		if (*p == ':')
+			t->port = p + 1;
+	} else if ((p = strrchr(line, ':')) != NULL) {
+		*p = '\0';
+		t->port = p + 1;
+	}
+	return (0);
+}
+
+/* The lookup for "t" is done, start connecting to what it found. */
+static void
+connect_target(struct target *t, struct pollfd *pfd)
+{
+	struct resolve *r = &t->resolve;
+	char buf[256];
+	int fd, flags;
+
+	pfd->fd = -1;
+	if (r->why != NULL) {
+		snprintf(buf, sizeof(buf), "resolve: %s", r->why);
+		finish(t, pfd, buf);
+		return;
+	}
+	/* its time starts running now */
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->state = STATE_CONNECTING;
+	/* only the first address - we're checking a name, not every host */
+	if ((fd = socket(r->family, r->socktype, r->protocol)) == -1) {
+		snprintf(buf, sizeof(buf), "socket: %s", strerror(errno));
+		finish(t, pfd, buf);
+		return;
+	}
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(1, "fcntl failed");
+	pfd->fd = fd;
+	pfd->events = POLLOUT;
+	pfd->revents = 0;
+	if (connect(fd, (struct sockaddr *)&r->addr, r->addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		snprintf(buf, sizeof(buf), "connect: %s", strerror(errno));
+		finish(t, pfd, buf);
+	}
+}
+
+/*
+ * Start on the target in "line". Names are looked up in a child (see
+ * ../common/resolve.c) so a slow one doesn't hold up the rest, and a
+ * target's -t seconds don't start until it has an address to connect
+ * to - a slow DNS server isn't a slow TLS server.
+ */
+static void
+start(struct target *t, struct pollfd *pfd, char *line)
+{
+	char *host;
+
+	if (parse_target(t, line) == -1)
+		return;
+	totals.targets++;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->tls = NULL;
+	t->state = STATE_RESOLVING;
+	if ((host = strdup(t->host)) == NULL)
+		err(1, "strdup");
+	t->host = host;
+
+	pfd->fd = -1;
+	pfd->revents = 0;
+	if (resolve_start(&t->resolve, t->host, t->port) == 1) {
+		pfd->fd = t->resolve.fd;
+		pfd->events = POLLIN;
+		return;
+	}
+	connect_target(t, pfd);
+}
+
+/* poll says "t" has something for us. */
+static void
+step(struct target *t, struct pollfd *pfd)
+{
+	char buf[512];
+	socklen_t len;
+	int error, r;
+
+	if (t->state == STATE_RESOLVING) {
+		if (resolve_io(&t->resolve) == 0)
+			connect_target(t, pfd);
+		return;
+	}
+	if (t->state == STATE_CONNECTING) {
+		len = sizeof(error);
+		if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) == -1)
+			error = errno;
+		if (error != 0) {
+			snprintf(buf, sizeof(buf), "connect: %s",
+			    strerror(error));
+			finish(t, pfd, buf);
+			return;
+		}
+		if ((t->tls = tls_client()) == NULL)
+			err(1, "tls_client");
+		if (tls_configure(t->tls, tls_cfg) == -1)
+			errx(1, "tls_configure: %s", tls_error(t->tls));
+		if (tls_connect_socket(t->tls, pfd->fd, t->host) == -1) {
+			snprintf(buf, sizeof(buf), "tls: %s",
+			    tls_error(t->tls));
+			finish(t, pfd, buf);
+			return;
+		}
+		t->state = STATE_HANDSHAKE;
+	}
+
+	r = tls_handshake(t->tls);
+	if (r == TLS_WANT_POLLIN)
+		pfd->events = POLLIN;
+	else if (r == TLS_WANT_POLLOUT)
+		pfd->events = POLLOUT;
+	else if (r == -1) {
+		snprintf(buf, sizeof(buf), "tls: %s", tls_error(t->tls));
+		finish(t, pfd, buf);
+	} else
+		finish(t, pfd, NULL);
+}
+
+/*
+ * Every target in flight has a descriptor, so raise our limit to fit
+ * as many as we were asked for if we can, and do fewer if we can't.
+ */
+static void
+fit_nofile(void)
+{
+	struct rlimit rl;
+	rlim_t want = (rlim_t)maxtargets + SPARE_FDS;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	if (rl.rlim_cur >= want)
+		return;
+	rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1 &&
+	    getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	if (rl.rlim_cur >= want)
+		return;
+	warnx("not enough descriptors for -n %d", maxtargets);
+	maxtargets = rl.rlim_cur > SPARE_FDS + 1 ? rl.rlim_cur - SPARE_FDS : 1;
+	warnx("doing %d targets at once", maxtargets);
+}
+
+int main(int argc, char **argv) {
+	FILE *in = stdin;
+	char *line = NULL, *ep;
+	size_t linesize = 0;
+	int ch, i, active, eof = 0, timeout = DEFAULT_TIMEOUT * 1000;
+	long long left, t;
+	const char *ca = NULL;
+	long l;
+
+	while ((ch = getopt(argc, argv, "C:f:n:t:")) != -1) {
+		switch (ch) {
+		case 'C':
+			ca = optarg;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				json = 1;
+			else if (strcmp(optarg, "csv") == 0)
+				json = 0;
+			else {
+				fprintf(stderr, "%s - unknown format\n",
+				    optarg);
+				usage();
+			}
+			break;
+		case 'n':
+		case 't':
+			errno = 0;
+			l = strtol(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno != 0 ||
+			    l < 1 || l > 100000) {
+				fprintf(stderr, "%s - bad number\n", optarg);
+				usage();
+			}
+			if (ch == 'n')
+				maxtargets = l;
+			else
+				timeout = l * 1000;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1 && (in = fopen(argv[0], "r")) == NULL)
+		err(1, "%s", argv[0]);
+	fit_nofile();
+
+	if ((targets = calloc(maxtargets, sizeof(*targets))) == NULL ||
+	    (pollfds = calloc(maxtargets, sizeof(*pollfds))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < maxtargets; i++)
+		pollfds[i].fd = -1;
+
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	/*
+	 * We're here to look at certificates, including the expired and
+	 * self signed ones, not to trust them - unless given a CA to
+	 * check them against.
+	 */
+	if (ca != NULL) {
+		if (tls_config_set_ca_file(tls_cfg, ca) == -1)
+			errx(1, "unable to set root CA file %s: %s", ca,
+			    tls_config_error(tls_cfg));
+	} else {
+		tls_config_insecure_noverifycert(tls_cfg);
+		tls_config_insecure_noverifyname(tls_cfg);
+	}
+	header();
+
+	for (;;) {
+		/* keep as many going as we're allowed */
+		active = 0;
+		for (i = 0; i < maxtargets; i++) {
+			while (targets[i].name == NULL && !eof) {
+				if (getline(&line, &linesize, in) == -1) {
+					eof = 1;
+					break;
+				}
+				start(&targets[i], &pollfds[i], line);
+			}
+			if (targets[i].name != NULL)
+				active++;
+		}
+		if (active == 0)
+			break;
+
+		/*
+		 * wake up in time for the first one to run out of time.
+		 * Lookups aren't timed, the resolver gives up on its own.
+		 */
+		left = -1;
+		for (i = 0; i < maxtargets; i++) {
+			if (targets[i].name == NULL ||
+			    targets[i].state == STATE_RESOLVING)
+				continue;
+			t = timeout - ms_since(&targets[i].start);
+			if (t < 0)
+				t = 0;
+			if (left == -1 || t < left)
+				left = t;
+		}
+		if (poll(pollfds, maxtargets, left) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+		for (i = 0; i < maxtargets; i++) {
+			if (targets[i].name == NULL)
+				continue;
+			if (pollfds[i].revents != 0)
+				step(&targets[i], &pollfds[i]);
+			else if (targets[i].state != STATE_RESOLVING &&
+			    ms_since(&targets[i].start) >= timeout)
+				finish(&targets[i], &pollfds[i], "timeout");
+		}
+	}
+	fflush(stdout);
+	fprintf(stderr, "%lu targets, %lu ok, %lu failed, %lu certificates, "
+	    "%lu expiring within %d days\n", totals.targets, totals.ok,
+	    totals.failed, totals.certs, totals.expiring,
+	    EXPIRING / (24 * 60 * 60));
+	return (totals.failed > 0);
+}
@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A TCP proxy that makes a connection over loopback behave like one
+ * over a real network - with latency, jitter, a limited bandwidth and
+ * small segments - so we can see what the round trips cost without
+ * root, netem or a second machine. Built the same way as the ex2 echo
+ * server: one poll loop, nonblocking sockets, no threads.
+ *
+ * Whatever we read from one side is cut into chunks of at most "mss"
+ * bytes, and each chunk is given the time it would arrive at the
+ * other end: once the link has finished sending what's ahead of it
+ * (at "rate" bits/s), plus the one way delay, plus or minus some
+ * jitter. TCP delivers in order, so a chunk is never due before the
+ * one in front of it. The loop sleeps until the next chunk is due,
+ * and writes it then. The first bytes from the client are held back
+ * an extra round trip, for the TCP handshake that the kernel has
+ * already done for us at loopback speed.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PAIRS	128
+#define BUFLEN		16384
+#define QUEUE_MAX	(4 * 1024 * 1024)	/* bytes in flight each way */
+
+struct impairment {
+	const char	*name;
+	double		 delay;		/* one way, ms */
+	double		 jitter;	/* up to this many ms either side */
+	double		 rate;		/* bits/s each way, 0 for no limit */
+	long		 mss;		/* biggest write, 0 for no limit */
+};
+
+static const struct impairment profiles[] = {
+	{ "none",		0,	0,	0,	0 },
+	{ "same-rack",		0.05,	0.01,	10e9,	0 },
+	{ "same-region",	1,	0.2,	1e9,	1448 },
+	{ "transcontinental",	75,	5,	100e6,	1448 },
+	{ "mobile",		40,	15,	10e6,	1200 },
+};
+
+/* what a chunk's journey costs, in ns */
+static uint64_t delay, jitter;
+/* and what each byte of it costs, in ps, since fast links are under a ns */
+static uint64_t psperbyte;
+static size_t mss;
+
+struct chunk {
+	struct chunk *next;
+	uint64_t due;		/* when it gets to the other end */
+	size_t len, off;
+	unsigned char data[];
+};
+
+/* one direction of a connection */
+struct pipe {
+	struct chunk *head, *tail;
+	size_t queued;
+	uint64_t linkfree;	/* when the link is done with what we have */
+	uint64_t linkps;	/* the ps left over past linkfree */
+	uint64_t lastdue;
+	int blocked;		/* the other end isn't taking any more */
+	int eof;		/* the sender is done */
+	int shut;		/* and we've passed that on */
+};
+
+struct pair {
+	int inuse;
+	int cfd, sfd;		/* client and server */
+	int connecting;
+	struct pipe up;		/* client to server */
+	struct pipe down;	/* server to client */
+};
+
+static struct pair pairs[MAX_PAIRS];
+/* the listening socket, then the client and server of each pair */
+static struct pollfd pollfds[1 + 2 * MAX_PAIRS];
+
+static void usage()
+{
+	extern char * __progname;
+	size_t i;
+
+	fprintf(stderr, "usage: %s [-b bits/s] [-d ms] [-j ms] [-m bytes] "
+	    "[-P profile] [-s seed] host portnumber serverhost serverport\n",
+	    __progname);
+	fprintf(stderr, "profiles:");
+	for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+		fprintf(stderr, " %s", profiles[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static double
+number(const char *s, int suffix)
+{
+	char *ep;
+	double d;
+
+	errno = 0;
+	d = strtod(s, &ep);
+	if (suffix && ep != s) {
+		switch (*ep) {
+		case 'k':
+			d *= 1e3;
+			ep++;
+			break;
+		case 'm':
+			d *= 1e6;
+			ep++;
+			break;
+		case 'g':
+			d *= 1e9;
+			ep++;
+			break;
+		}
+	}
+	if (*s == '\0' || *ep != '\0' || errno != 0 || d < 0) {
+		fprintf(stderr, "%s - bad number\n", s);
+		usage();
+	}
+	return (d);
+}
+
+static void
+nonblocking(int fd)
+{
+	int flags, one = 1;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		err(1, "fcntl failed");
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(1, "fcntl failed");
+	/* our chunks should go out when we write them, not when Nagle says */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+		warn("setsockopt TCP_NODELAY");
+}
+
+static void
+pipe_init(struct pipe *p, uint64_t t)
+{
+	p->head = p->tail = NULL;
+	p->queued = 0;
+	p->linkfree = p->lastdue = t;
+	p->linkps = 0;
+	p->blocked = p->eof = p->shut = 0;
+}
+
+static void
+pipe_free(struct pipe *p)
+{
+	struct chunk *c;
+
+	while ((c = p->head) != NULL) {
+		p->head = c->next;
+		free(c);
+	}
+	p->tail = NULL;
+}
+
+/* Queue "len" bytes that we got at "t", in chunks of at most mss. */
+static int
+pipe_put(struct pipe *p, const unsigned char *buf, size_t len, uint64_t t)
+{
+	struct chunk *c;
+	int64_t d;
+	size_t n;
+
+	while (len > 0) {
+		n = (mss > 0 && len > mss) ? mss : len;
+		if ((c = malloc(sizeof(*c) + n)) == NULL)
+			return (-1);
+		memcpy(c->data, buf, n);
+		c->len = n;
+		c->off = 0;
+		c->next = NULL;
+
+		/* it can't go until the link has sent what's ahead of it */
+		if (p->linkfree < t) {
+			p->linkfree = t;
+			p->linkps = 0;
+		}
+		p->linkps += n * psperbyte;
+		p->linkfree += p->linkps / 1000;
+		p->linkps %= 1000;
+		d = delay;
+		if (jitter > 0)
+			d += (int64_t)(random() % (2 * jitter + 1)) - jitter;
+		if (d < 0)
+			d = 0;
+		c->due = p->linkfree + d;
+		if (c->due < p->lastdue)
+			c->due = p->lastdue;
+		p->lastdue = c->due;
+
+		if (p->tail != NULL)
+			p->tail->next = c;
+		else
+			p->head = c;
+		p->tail = c;
+		p->queued += n;
+		buf += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/* Read what the sender has for us. */
+static int
+pipe_fill(struct pipe *p, int fd, uint64_t t)
+{
+	unsigned char buf[BUFLEN];
+	ssize_t r;
+
+	r = read(fd, buf, sizeof(buf));
+	if (r == -1)
+		return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+	if (r == 0) {
+		p->eof = 1;
+		return (0);
+	}
+	return (pipe_put(p, buf, r, t));
+}
+
+/* Write everything that's due by "t", and pass on EOF once it's all gone. */
+static int
+pipe_drain(struct pipe *p, int fd, uint64_t t)
+{
+	struct chunk *c;
+	ssize_t w;
+
+	p->blocked = 0;
+	while ((c = p->head) != NULL && c->due <= t) {
+		w = write(fd, c->data + c->off, c->len - c->off);
+		if (w == -1 && (errno == EAGAIN || errno == EINTR)) {
+			p->blocked = 1;
+			return (0);
+		}
+		if (w == -1)
+			return (-1);
+		c->off += w;
+		p->queued -= w;
+		if (c->off < c->len) {
+			p->blocked = 1;
+			return (0);
+		}
+		if ((p->head = c->next) == NULL)
+			p->tail = NULL;
+		free(c);
+	}
+	if (p->head == NULL && p->eof && !p->shut) {
+		shutdown(fd, SHUT_WR);
+		p->shut = 1;
+	}
+	return (0);
+}
+
+/* How long until the next chunk of "p" is due, if it's sooner than "next". */
+static void
+pipe_next(const struct pipe *p, uint64_t *next)
+{
+	if (p->head != NULL && !p->blocked && p->head->due < *next)
+		*next = p->head->due;
+}
+
+static void
+closepair(struct pair *pp)
+{
+	pipe_free(&pp->up);
+	pipe_free(&pp->down);
+	close(pp->cfd);
+	close(pp->sfd);
+	pp->inuse = 0;
+}
+
+static void
+newpair(int cfd, struct addrinfo *server)
+{
+	struct pair *pp = NULL;
+	uint64_t t;
+	int i, sfd;
+
+	for (i = 0; i < MAX_PAIRS; i++)
+		if (!pairs[i].inuse) {
+			pp = &pairs[i];
+			break;
+		}
+	if (pp == NULL) {
+		close(cfd);
+		return;
+	}
+	if ((sfd = socket(server->ai_family, server->ai_socktype,
+	    server->ai_protocol)) == -1) {
+		warn("socket");
+		close(cfd);
+		return;
+	}
+	nonblocking(cfd);
+	nonblocking(sfd);
+	if (connect(sfd, server->ai_addr, server->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		warn("connect");
+		close(cfd);
+		close(sfd);
+		return;
+	}
+	t = now();
+	pp->inuse = 1;
+	pp->cfd = cfd;
+	pp->sfd = sfd;
+	pp->connecting = 1;
+	pipe_init(&pp->up, t);
+	pipe_init(&pp->down, t);
+	/* the client's SYN and our SYN ACK */
+	pp->up.linkfree = t + 2 * delay;
+}
+
+/* Move whatever can be moved between the two ends of "pp". */
+static void
+service(struct pair *pp, struct pollfd *cpfd, struct pollfd *spfd)
+{
+	uint64_t t;
+	socklen_t len;
+	int error;
+
+	if (pp->connecting) {
+		if (spfd->revents == 0)
+			goto client;
+		len = sizeof(error);
+		if (getsockopt(pp->sfd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) == -1 || error != 0) {
+			warnx("connect to server: %s", strerror(error));
+			goto bad;
+		}
+		pp->connecting = 0;
+	}
+	t = now();
+	if ((spfd->revents & (POLLIN | POLLHUP | POLLERR)) &&
+	    pipe_fill(&pp->down, pp->sfd, t) == -1)
+		goto bad;
+	if (pipe_drain(&pp->up, pp->sfd, t) == -1)
+		goto bad;
+ client:
+	t = now();
+	if ((cpfd->revents & (POLLIN | POLLHUP | POLLERR)) &&
+	    pipe_fill(&pp->up, pp->cfd, t) == -1)
+		goto bad;
+	if (pipe_drain(&pp->down, pp->cfd, t) == -1)
+		goto bad;
+	if (pp->up.shut && pp->down.shut)
+		closepair(pp);
+	return;
+ bad:
+	closepair(pp);
+}
+
+int main(int argc, char **argv) {
+	struct addrinfo hints, *res, *server;
+	const struct impairment *imp = &profiles[0];
+	double d = -1, j = -1, rate = -1, m = -1;
+	struct timespec ts;
+	uint64_t t, next;
+	unsigned int seed = 1;
+	int ch, i, error, listenfd, full, one = 1;
+	size_t n;
+
+	while ((ch = getopt(argc, argv, "b:d:j:m:P:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			rate = number(optarg, 1);
+			break;
+		case 'd':
+			d = number(optarg, 0);
+			break;
+		case 'j':
+			j = number(optarg, 0);
+			break;
+		case 'm':
+			m = number(optarg, 0);
+			break;
+		case 'P':
+			for (n = 0; n < sizeof(profiles) / sizeof(profiles[0]);
+			    n++)
+				if (strcmp(optarg, profiles[n].name) == 0)
+					break;
+			if (n == sizeof(profiles) / sizeof(profiles[0])) {
+				fprintf(stderr, "%s - unknown profile\n",
+				    optarg);
+				usage();
+			}
+			imp = &profiles[n];
+			break;
+		case 's':
+			seed = number(optarg, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 4)
+		usage();
+
+	/* options override the profile */
+	if (d < 0)
+		d = imp->delay;
+	if (j < 0)
+		j = imp->jitter;
+	if (rate < 0)
+		rate = imp->rate;
+	if (m < 0)
+		m = imp->mss;
+	delay = d * 1e6;
+	jitter = j * 1e6;
+	psperbyte = rate > 0 ? 8e12 / rate + 0.5 : 0;
+	mss = m;
+	/* the same seed gets the same jitter, for runs we can compare */
+	srandom(seed);
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[2], argv[3], &hints, &server))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
+		fprintf(stderr, "%s\n", gai_strerror(error));
+		usage();
+	}
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket failed");
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one,
+	    sizeof(one)) == -1)
+		err(1, "setsockopt failed");
+	if (bind(listenfd, res->ai_addr, res->ai_addrlen) == -1)
+		err(1, "bind failed");
+	if (listen(listenfd, 128) == -1)
+		err(1, "listen failed");
+	freeaddrinfo(res);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Proxying %s:%s to %s:%s, %gms +-%gms each way, ", argv[0],
+	    argv[1], argv[2], argv[3], d, j);
+	if (rate > 0)
+		printf("%g Mbit/s, ", rate / 1e6);
+	else
+		printf("unlimited, ");
+	if (mss > 0)
+		printf("%zu byte segments\n", mss);
+	else
+		printf("any size segments\n");
+	fflush(stdout);
+
+	pollfds[0].fd = listenfd;
+	for (;;) {
+		t = now();
+		next = UINT64_MAX;
+		full = 1;
+		for (i = 0; i < MAX_PAIRS; i++) {
+			struct pair *pp = &pairs[i];
+			struct pollfd *cpfd = &pollfds[1 + 2 * i];
+			struct pollfd *spfd = &pollfds[2 + 2 * i];
+
+			cpfd->fd = spfd->fd = -1;
+			cpfd->events = spfd->events = 0;
+			cpfd->revents = spfd->revents = 0;
+			if (!pp->inuse) {
+				full = 0;
+				continue;
+			}
+			if (!pp->up.eof && pp->up.queued < QUEUE_MAX)
+				cpfd->events |= POLLIN;
+			if (pp->down.blocked)
+				cpfd->events |= POLLOUT;
+			if (pp->connecting)
+				spfd->events = POLLOUT;
+			else {
+				if (!pp->down.eof &&
+				    pp->down.queued < QUEUE_MAX)
+					spfd->events |= POLLIN;
+				if (pp->up.blocked)
+					spfd->events |= POLLOUT;
+				pipe_next(&pp->up, &next);
+			}
+			pipe_next(&pp->down, &next);
+			/* poll ignores negative descriptors */
+			if (cpfd->events)
+				cpfd->fd = pp->cfd;
+			if (spfd->events)
+				spfd->fd = pp->sfd;
+		}
+		pollfds[0].events = full ? 0 : POLLIN;
+		pollfds[0].revents = 0;
+
+		if (next != UINT64_MAX) {
+			next = next > t ? next - t : 0;
+			ts.tv_sec = next / 1000000000;
+			ts.tv_nsec = next % 1000000000;
+		}
+		if (ppoll(pollfds, 1 + 2 * MAX_PAIRS,
+		    next == UINT64_MAX ? NULL : &ts, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+
+		if (pollfds[0].revents & POLLIN) {
+			int fd;
+
+			if ((fd = accept(listenfd, NULL, NULL)) >= 0)
+				newpair(fd, server);
+		}
+		for (i = 0; i < MAX_PAIRS; i++)
+			if (pairs[i].inuse)
+				service(&pairs[i], &pollfds[1 + 2 * i],
+				    &pollfds[2 + 2 * i]);
+	}
+}